@@ -0,0 +1,831 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "../src/wgm.h"
+#include "../src/wgm_iface.h"
+#include "../src/wgm_peer.h"
+#include "../src/wgm_conf.h"
+#include "../src/wgm_json.h"
+#include "../src/wgm_exec.h"
+#include "../src/wgm_pool.h"
+
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+/*
+ * src/wgm.c built with -Dmain=wgm_main.
+ */
+int wgm_main(int argc, char *argv[]);
+
+static const size_t default_sizes[] = { 1000, 10000, 100000 };
+
+/*
+ * Number of operations per interface for the per-peer cases.
+ */
+#define BENCH_PEER_OPS	1000
+
+struct bench_result {
+	const char	*name;
+	size_t		nr_peers;
+	size_t		ops;
+	uint64_t	min_ns;
+	uint64_t	total_ns;
+	unsigned	runs;
+};
+
+struct bench {
+	struct wgm_ctx		ctx;
+	size_t			nr_ifaces;
+	unsigned		repeat;
+	size_t			nr_peers;
+	struct wgm_iface	*ifaces;
+	struct bench_result	*results;
+	size_t			nr_results;
+	uint64_t		rng;
+};
+
+static uint64_t now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+static uint64_t bench_rand(struct bench *b)
+{
+	/*
+	 * xorshift64; deterministic so runs are comparable.
+	 */
+	b->rng ^= b->rng << 13;
+	b->rng ^= b->rng >> 7;
+	b->rng ^= b->rng << 17;
+	return b->rng;
+}
+
+static void gen_key(struct bench *b, char *key)
+{
+	uint8_t raw[WGM_KEY_LEN];
+	uint64_t r;
+	size_t i;
+
+	for (i = 0; i < sizeof(raw); i += sizeof(r)) {
+		r = bench_rand(b);
+		memcpy(&raw[i], &r, sizeof(r));
+	}
+
+	wgm_key_to_base64(key, raw);
+}
+
+/*
+ * Peer @i of a synthetic interface. The mix follows what production
+ * interfaces look like: most peers have a single /32, some a /32 plus
+ * a /128, a few route a whole /24 through themselves, and a quarter
+ * egress through one of a handful of bind IPs.
+ */
+static int gen_peer(struct bench *b, struct wgm_peer *peer, size_t i)
+{
+	char ip[64];
+	int ret;
+	unsigned kind = bench_rand(b) % 10;
+
+	memset(peer, 0, sizeof(*peer));
+	gen_key(b, peer->public_key);
+
+	snprintf(ip, sizeof(ip), "10.%zu.%zu.%zu/32", (i >> 16) & 255, (i >> 8) & 255, i & 255);
+	ret = wgm_str_array_add(&peer->allowed_ips, ip);
+	if (!ret && kind >= 7 && kind < 9) {
+		snprintf(ip, sizeof(ip), "fd00::%zx/128", i);
+		ret = wgm_str_array_add(&peer->allowed_ips, ip);
+	}
+	if (!ret && kind == 9) {
+		snprintf(ip, sizeof(ip), "172.%zu.%zu.0/24", 16 + ((i >> 8) & 15), i & 255);
+		ret = wgm_str_array_add(&peer->allowed_ips, ip);
+	}
+
+	if (!ret && !(i % 4)) {
+		snprintf(peer->bind_ip, sizeof(peer->bind_ip), "198.51.100.%zu", i % 16 + 1);
+		snprintf(peer->bind_dev, sizeof(peer->bind_dev), "eth%zu", i % 2);
+	}
+
+	if (ret)
+		wgm_peer_free(peer);
+
+	return ret;
+}
+
+static int gen_iface(struct bench *b, struct wgm_iface *iface, size_t idx, size_t nr_peers)
+{
+	size_t i;
+	int ret;
+
+	memset(iface, 0, sizeof(*iface));
+	snprintf(iface->ifname, sizeof(iface->ifname), "wgb%u", (unsigned int)(idx % 100000));
+	iface->listen_port = 51820 + idx;
+	iface->mtu = 1420;
+	strncpyl(iface->private_key, "EDVfpFI5OcH2Jd0VtK9zlXPqhZaQ77NwnC4eHKHRaU8=", sizeof(iface->private_key));
+
+	ret = wgm_parse_csv(&iface->addresses, "10.0.0.1/8,fd00::1/64");
+	if (!ret)
+		ret = wgm_parse_csv(&iface->allowed_ips, "0.0.0.0/0,::/0");
+	if (ret)
+		goto out_err;
+
+	iface->peers.peers = calloc(nr_peers + 1, sizeof(*iface->peers.peers));
+	if (!iface->peers.peers) {
+		ret = -ENOMEM;
+		goto out_err;
+	}
+
+	for (i = 0; i < nr_peers; i++) {
+		ret = gen_peer(b, &iface->peers.peers[i], i);
+		if (ret)
+			goto out_err;
+		iface->peers.nr++;
+	}
+
+	return 0;
+
+out_err:
+	wgm_iface_free(iface);
+	return ret;
+}
+
+static void free_ifaces(struct bench *b)
+{
+	size_t i;
+
+	if (!b->ifaces)
+		return;
+
+	for (i = 0; i < b->nr_ifaces; i++)
+		wgm_iface_free(&b->ifaces[i]);
+
+	free(b->ifaces);
+	b->ifaces = NULL;
+}
+
+static int gen_ifaces(struct bench *b, size_t nr_peers)
+{
+	size_t i;
+	int ret;
+
+	free_ifaces(b);
+	b->nr_peers = nr_peers;
+	b->rng = 0x9e3779b97f4a7c15ull;
+	b->ifaces = calloc(b->nr_ifaces, sizeof(*b->ifaces));
+	if (!b->ifaces)
+		return -ENOMEM;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		ret = gen_iface(b, &b->ifaces[i], i, nr_peers);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int case_iface_save(struct bench *b, uint64_t *ns)
+{
+	uint64_t t = now_ns();
+	size_t i;
+	int ret;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		ret = wgm_iface_save(&b->ifaces[i], &b->ctx);
+		if (ret)
+			return ret;
+	}
+
+	*ns = now_ns() - t;
+	return 0;
+}
+
+static int __case_iface_load(struct bench *b, uint64_t *ns,
+			     int (*load)(struct wgm_iface *, struct wgm_ctx *, const char *))
+{
+	struct wgm_iface iface;
+	uint64_t t, sum = 0;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		memset(&iface, 0, sizeof(iface));
+		t = now_ns();
+		ret = load(&iface, &b->ctx, b->ifaces[i].ifname);
+		sum += now_ns() - t;
+		if (ret)
+			return ret;
+
+		if (iface.peers.nr != b->nr_peers) {
+			wgm_log_err("Error: bench: '%s' has %zu peers, expected %zu\n",
+				    iface.ifname, iface.peers.nr, b->nr_peers);
+			ret = -EINVAL;
+		}
+
+		wgm_iface_free(&iface);
+		if (ret)
+			return ret;
+	}
+
+	*ns = sum;
+	return 0;
+}
+
+static int case_iface_load(struct bench *b, uint64_t *ns)
+{
+	return __case_iface_load(b, ns, wgm_iface_load);
+}
+
+static int case_iface_load_json_c(struct bench *b, uint64_t *ns)
+{
+	return __case_iface_load(b, ns, wgm_iface_load_json_c);
+}
+
+static int case_conf_save(struct bench *b, uint64_t *ns)
+{
+	uint64_t t = now_ns();
+	size_t i;
+	int ret;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		ret = wgm_conf_save(&b->ifaces[i], &b->ctx);
+		if (ret)
+			return ret;
+	}
+
+	*ns = now_ns() - t;
+	return 0;
+}
+
+static int case_iface_add_peer(struct bench *b, uint64_t *ns)
+{
+	struct wgm_peer *peers;
+	uint64_t t, sum = 0;
+	size_t i, j;
+	int ret = 0;
+
+	peers = calloc(BENCH_PEER_OPS, sizeof(*peers));
+	if (!peers)
+		return -ENOMEM;
+
+	for (i = 0; i < b->nr_ifaces && !ret; i++) {
+		struct wgm_iface *iface = &b->ifaces[i];
+
+		for (j = 0; j < BENCH_PEER_OPS && !ret; j++)
+			ret = gen_peer(b, &peers[j], b->nr_peers + j);
+		if (ret)
+			break;
+
+		t = now_ns();
+		for (j = 0; j < BENCH_PEER_OPS && !ret; j++)
+			ret = wgm_iface_add_peer(iface, &peers[j], false);
+		sum += now_ns() - t;
+
+		/*
+		 * Drop the new peers again so every run starts from the
+		 * same interface.
+		 */
+		while (iface->peers.nr > b->nr_peers)
+			wgm_iface_del_peer(iface, iface->peers.nr - 1);
+
+		for (j = 0; j < BENCH_PEER_OPS; j++)
+			wgm_peer_free(&peers[j]);
+	}
+
+	free(peers);
+	*ns = sum;
+	return ret;
+}
+
+static int case_iface_get_peer_by_pubkey(struct bench *b, uint64_t *ns)
+{
+	struct wgm_peer *peer;
+	uint64_t t = now_ns();
+	size_t i, j, idx;
+	int ret;
+
+	for (i = 0; i < b->nr_ifaces; i++) {
+		const struct wgm_iface *iface = &b->ifaces[i];
+
+		for (j = 0; j < BENCH_PEER_OPS; j++) {
+			idx = (j * 7919) % iface->peers.nr;
+			ret = wgm_iface_get_peer_by_pubkey(iface, iface->peers.peers[idx].public_key, &peer);
+			if (ret)
+				return ret;
+		}
+	}
+
+	*ns = now_ns() - t;
+	return 0;
+}
+
+/*
+ * One --allowed-ips list with as many entries as the interface has
+ * peers.
+ */
+static int case_parse_csv(struct bench *b, uint64_t *ns)
+{
+	const struct wgm_iface *iface = &b->ifaces[0];
+	struct wgm_str_array arr;
+	size_t i, len = 0, off = 0;
+	char *csv;
+	uint64_t t;
+	int ret;
+
+	for (i = 0; i < iface->peers.nr; i++)
+		len += strlen(iface->peers.peers[i].allowed_ips.arr[0]) + 1;
+
+	csv = malloc(len + 1);
+	if (!csv)
+		return -ENOMEM;
+
+	csv[0] = '\0';
+	for (i = 0; i < iface->peers.nr; i++)
+		off += sprintf(csv + off, "%s%s", i ? "," : "", iface->peers.peers[i].allowed_ips.arr[0]);
+
+	t = now_ns();
+	ret = wgm_parse_csv(&arr, csv);
+	*ns = now_ns() - t;
+	free(csv);
+	if (ret)
+		return ret;
+
+	if (arr.nr != iface->peers.nr)
+		ret = -EINVAL;
+
+	wgm_str_array_free(&arr);
+	return ret;
+}
+
+/*
+ * Compare each rendered conf against a copy of itself, the common
+ * "nothing changed" case of wgm_conf_up().
+ */
+static int case_cmp_file_md5(struct bench *b, uint64_t *ns)
+{
+	char *conf, *copy;
+	uint64_t t, sum = 0;
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < b->nr_ifaces && !ret; i++) {
+		const char *dev = b->ifaces[i].ifname;
+
+		if (wgm_asprintf(&conf, "%s/wg_conf/%s.conf", b->ctx.data_dir, dev))
+			return -ENOMEM;
+		if (wgm_asprintf(&copy, "%s/%s.conf", b->ctx.wg_conf_path, dev)) {
+			free(conf);
+			return -ENOMEM;
+		}
+
+		if (wgm_copy_file(conf, copy, NULL) < 0)
+			ret = -EIO;
+
+		if (!ret) {
+			t = now_ns();
+			if (!wgm_cmp_file_md5(conf, copy))
+				ret = -EINVAL;
+			sum += now_ns() - t;
+		}
+
+		free(conf);
+		free(copy);
+	}
+
+	*ns = sum;
+	return ret;
+}
+
+static const struct {
+	const char	*name;
+	int		(*fn)(struct bench *b, uint64_t *ns);
+	size_t		ops_per_iface;
+	bool		first_iface_only;
+} cases[] = {
+	/*
+	 * Order matters: the load and md5 cases use the files written by
+	 * the save cases.
+	 */
+	{ "iface_save",			case_iface_save,		1,		false },
+	{ "iface_load",			case_iface_load,		1,		false },
+	{ "iface_load_json_c",		case_iface_load_json_c,		1,		false },
+	{ "conf_save",			case_conf_save,			1,		false },
+	{ "iface_add_peer",		case_iface_add_peer,		BENCH_PEER_OPS,	false },
+	{ "iface_get_peer_by_pubkey",	case_iface_get_peer_by_pubkey,	BENCH_PEER_OPS,	false },
+	{ "parse_csv",			case_parse_csv,			1,		true },
+	{ "cmp_file_md5",		case_cmp_file_md5,		1,		false },
+};
+
+static int add_result(struct bench *b, const struct bench_result *res)
+{
+	struct bench_result *new_results;
+
+	new_results = realloc(b->results, (b->nr_results + 1) * sizeof(*new_results));
+	if (!new_results)
+		return -ENOMEM;
+
+	b->results = new_results;
+	b->results[b->nr_results++] = *res;
+	return 0;
+}
+
+static int bench_size(struct bench *b, size_t nr_peers)
+{
+	struct bench_result res;
+	uint64_t ns;
+	size_t i;
+	unsigned r;
+	int ret;
+
+	ret = gen_ifaces(b, nr_peers);
+	if (ret) {
+		wgm_log_err("Error: bench: failed to generate interfaces: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(cases); i++) {
+		memset(&res, 0, sizeof(res));
+		res.name = cases[i].name;
+		res.nr_peers = nr_peers;
+		res.ops = cases[i].ops_per_iface * (cases[i].first_iface_only ? 1 : b->nr_ifaces);
+		res.min_ns = UINT64_MAX;
+
+		for (r = 0; r < b->repeat; r++) {
+			ret = cases[i].fn(b, &ns);
+			if (ret) {
+				wgm_log_err("Error: bench: %s at %zu peers failed: %s\n",
+					    res.name, nr_peers, strerror(-ret));
+				return ret;
+			}
+
+			if (ns < res.min_ns)
+				res.min_ns = ns;
+			res.total_ns += ns;
+			res.runs++;
+		}
+
+		ret = add_result(b, &res);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int write_results(struct wgm_jwriter *w, const void *data)
+{
+	const struct bench *b = data;
+	size_t i;
+
+	wgm_jw_obj_begin(w);
+	wgm_jw_key(w, "ifaces");
+	wgm_jw_int(w, b->nr_ifaces);
+	wgm_jw_key(w, "repeat");
+	wgm_jw_int(w, b->repeat);
+	wgm_jw_key(w, "results");
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < b->nr_results; i++) {
+		const struct bench_result *res = &b->results[i];
+
+		wgm_jw_obj_begin(w);
+		wgm_jw_key(w, "name");
+		wgm_jw_str(w, res->name);
+		wgm_jw_key(w, "peers");
+		wgm_jw_int(w, res->nr_peers);
+		wgm_jw_key(w, "ops");
+		wgm_jw_int(w, res->ops);
+		wgm_jw_key(w, "runs");
+		wgm_jw_int(w, res->runs);
+		wgm_jw_key(w, "min_ns");
+		wgm_jw_int(w, res->min_ns);
+		wgm_jw_key(w, "mean_ns");
+		wgm_jw_int(w, res->total_ns / res->runs);
+		wgm_jw_key(w, "ns_per_op");
+		wgm_jw_int(w, res->min_ns / res->ops);
+		wgm_jw_obj_end(w);
+	}
+	wgm_jw_arr_end(w);
+	return wgm_jw_obj_end(w);
+}
+
+static void show_usage(const char *app)
+{
+	printf("Usage: %s [-i <ifaces>] [-r <repeat>] [peers...]\n", app);
+	printf("       %s stress [procs] [adds]\n", app);
+	printf("       %s order\n\n", app);
+	printf("Times the store, render and lookup paths on <ifaces> synthetic\n");
+	printf("interfaces (default 2) of each peer count (default 1000 10000\n");
+	printf("100000), best of <repeat> runs (default 3), and prints JSON.\n");
+}
+
+/*
+ * Run a wgm command in-process with its output discarded. getopt
+ * permutes the argument vector, so it works on a copy.
+ */
+static int run_wgm(char *const args[])
+{
+	char *argv[32];
+	int argc = 0, fd, saved, ret;
+
+	while (args[argc] && argc < (int)ARRAY_SIZE(argv) - 1) {
+		argv[argc] = args[argc];
+		argc++;
+	}
+	argv[argc] = NULL;
+
+	fflush(stdout);
+	saved = dup(STDOUT_FILENO);
+	fd = open("/dev/null", O_WRONLY);
+	if (fd >= 0) {
+		dup2(fd, STDOUT_FILENO);
+		close(fd);
+	}
+
+	optind = 0;
+	ret = wgm_main(argc, argv);
+
+	fflush(stdout);
+	if (saved >= 0) {
+		dup2(saved, STDOUT_FILENO);
+		close(saved);
+	}
+
+	return ret;
+}
+
+static int add_iface(const char *dev)
+{
+	char *argv[] = {
+		"wgm", "iface", "add", "--dev", (char *)dev, "--listen-port", "443",
+		"--private-key", "EDVfpFI5OcH2Jd0VtK9zlXPqhZaQ77NwnC4eHKHRaU8=",
+		"--address", "10.0.0.1/8", "--mtu", "1420", "--allowed-ips", "0.0.0.0/0",
+		NULL
+	};
+
+	return run_wgm(argv);
+}
+
+static void stress_worker(const char *dev, size_t id, size_t nr_adds)
+{
+	char key[WGM_KEY_B64_LEN + 1], ips[32];
+	uint8_t raw[WGM_KEY_LEN];
+	char *argv[] = {
+		"wgm", "peer", "add", "--dev", (char *)dev, "--public-key", key,
+		"--allowed-ips", ips, NULL
+	};
+	size_t i;
+
+	/*
+	 * Canonical keys that are unique per worker and add.
+	 */
+	memset(raw, 0, sizeof(raw));
+	for (i = 0; i < nr_adds; i++) {
+		memcpy(&raw[0], &id, sizeof(id));
+		memcpy(&raw[sizeof(id)], &i, sizeof(i));
+		wgm_key_to_base64(key, raw);
+		snprintf(ips, sizeof(ips), "10.%zu.%zu.%zu/32", id & 255, (i >> 8) & 255, i & 255);
+		if (run_wgm(argv))
+			_exit(1);
+	}
+
+	_exit(0);
+}
+
+/*
+ * Run @nr_procs processes doing @nr_adds "peer add" each, either all on
+ * one interface (@shared) or each on its own, and check that no update
+ * got lost.
+ */
+static int bench_stress(struct wgm_ctx *ctx, size_t nr_procs, size_t nr_adds, bool shared)
+{
+	struct wgm_iface iface;
+	char dev[32];
+	size_t i, nr_ifaces = shared ? 1 : nr_procs;
+	int ret = 0, status;
+	pid_t pid;
+	uint64_t t;
+
+	for (i = 0; i < nr_ifaces; i++) {
+		snprintf(dev, sizeof(dev), "wgmst%zu%s", i, shared ? "s" : "p");
+		if (add_iface(dev))
+			return -EIO;
+	}
+
+	fflush(NULL);
+	t = now_ns();
+	for (i = 0; i < nr_procs; i++) {
+		pid = fork();
+		if (pid < 0)
+			return -errno;
+
+		if (!pid) {
+			snprintf(dev, sizeof(dev), "wgmst%zu%s", shared ? 0 : i, shared ? "s" : "p");
+			stress_worker(dev, i, nr_adds);
+		}
+	}
+
+	while (wait(&status) > 0) {
+		if (!WIFEXITED(status) || WEXITSTATUS(status))
+			ret = -EIO;
+	}
+	t = now_ns() - t;
+
+	if (ret) {
+		wgm_log_err("Error: bench_stress: a worker failed\n");
+		return ret;
+	}
+
+	for (i = 0; i < nr_ifaces; i++) {
+		size_t expected = shared ? nr_procs * nr_adds : nr_adds;
+
+		snprintf(dev, sizeof(dev), "wgmst%zu%s", i, shared ? "s" : "p");
+		memset(&iface, 0, sizeof(iface));
+		ret = wgm_iface_load(&iface, ctx, dev);
+		if (ret)
+			return ret;
+
+		if (iface.peers.nr != expected) {
+			wgm_log_err("Error: bench_stress: '%s' has %zu peers, expected %zu (lost updates)\n",
+				    dev, iface.peers.nr, expected);
+			ret = -EINVAL;
+		}
+
+		wgm_iface_free(&iface);
+		if (ret)
+			return ret;
+	}
+
+	printf("stress %-6s %3zu procs x %5zu adds %10.3f ms %10.1f ops/s\n",
+	       shared ? "1-dev" : "n-dev", nr_procs, nr_adds, t / 1e6,
+	       (nr_procs * nr_adds) / (t / 1e9));
+	return 0;
+}
+
+static int order_job(struct wgm_ctx *ctx, const struct wgm_pool_job *job, void *data)
+{
+	(void)ctx;
+	(void)job;
+	(void)data;
+	usleep(200000);
+	return 0;
+}
+
+/*
+ * Order the jobs of four interfaces that bind to eth0, one more that
+ * does and one that binds to it, like `iface up --all`, and check that
+ * the siblings on eth0 ran at the same time and the dependent one after
+ * the interface it binds to (before it with @reverse).
+ */
+static int bench_order(struct wgm_ctx *ctx, bool reverse)
+{
+	static const char *const names[] = { "wgo0", "wgo1", "wgo2", "wgo3", "wgop", "wgod" };
+	struct wgm_str_array binds[ARRAY_SIZE(names)];
+	struct wgm_pool_job jobs[ARRAY_SIZE(names)];
+	const struct wgm_pool_job *first, *then;
+	uint64_t last_start = 0, first_end = UINT64_MAX;
+	size_t i;
+	int ret = 0;
+
+	memset(binds, 0, sizeof(binds));
+	memset(jobs, 0, sizeof(jobs));
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		strncpyl(jobs[i].name, names[i], sizeof(jobs[i].name));
+		ret = wgm_str_array_add(&binds[i], strcmp(names[i], "wgod") ? "eth0" : "wgop");
+		if (ret)
+			goto out;
+	}
+
+	ret = wgm_iface_order_jobs(jobs, ARRAY_SIZE(names), binds, reverse);
+	if (ret)
+		goto out;
+
+	ret = wgm_pool_run(ctx, jobs, ARRAY_SIZE(names), ARRAY_SIZE(names), 0, order_job, NULL);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < 4; i++) {
+		if (jobs[i].start_ns > last_start)
+			last_start = jobs[i].start_ns;
+		if (jobs[i].end_ns < first_end)
+			first_end = jobs[i].end_ns;
+	}
+
+	if (last_start >= first_end) {
+		wgm_log_err("Error: bench_order: the interfaces sharing eth0 did not overlap\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	first = reverse ? &jobs[5] : &jobs[4];
+	then = reverse ? &jobs[4] : &jobs[5];
+	if (then->start_ns < first->end_ns) {
+		wgm_log_err("Error: bench_order: '%s' started before '%s' was done\n",
+			    then->name, first->name);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	printf("order %-4s siblings overlap %8.3f ms, %s after %s\n",
+	       reverse ? "down" : "up", (first_end - last_start) / 1e6,
+	       then->name, first->name);
+out:
+	for (i = 0; i < ARRAY_SIZE(names); i++) {
+		wgm_str_array_free(&binds[i]);
+		free(jobs[i].after);
+	}
+	return ret;
+}
+
+int main(int argc, char *argv[])
+{
+	char tmpl[] = "/tmp/wgm_bench.XXXXXX";
+	struct bench b;
+	int c, ret = 0;
+
+	memset(&b, 0, sizeof(b));
+	b.nr_ifaces = 2;
+	b.repeat = 3;
+
+	if (argc > 1 && (!strcmp(argv[1], "stress") || !strcmp(argv[1], "order"))) {
+		optind = 2;
+	} else {
+		while ((c = getopt(argc, argv, "i:r:h")) != -1) {
+			switch (c) {
+			case 'i':
+				b.nr_ifaces = strtoul(optarg, NULL, 10);
+				break;
+			case 'r':
+				b.repeat = strtoul(optarg, NULL, 10);
+				break;
+			default:
+				show_usage(argv[0]);
+				return c == 'h' ? 0 : 1;
+			}
+		}
+
+		if (!b.nr_ifaces || !b.repeat) {
+			show_usage(argv[0]);
+			return 1;
+		}
+	}
+
+	b.ctx.data_dir = mkdtemp(tmpl);
+	if (!b.ctx.data_dir) {
+		wgm_log_err("Error: failed to create temporary directory: %s\n", strerror(errno));
+		return 1;
+	}
+
+	if (wgm_asprintf(&b.ctx.wg_conf_path, "%s/etc", b.ctx.data_dir) ||
+	    mkdir_recursive(b.ctx.wg_conf_path, 0700))
+		return 1;
+
+	/*
+	 * The workers of the stress run execute wgm commands in-process,
+	 * which read their settings from the environment.
+	 */
+	setenv("WGM_DATA_DIR", b.ctx.data_dir, 1);
+	setenv("WGM_WG_CONF_PATH", b.ctx.wg_conf_path, 1);
+
+	if (argc > 1 && !strcmp(argv[1], "stress")) {
+		size_t nr_procs = argc > 2 ? strtoul(argv[2], NULL, 10) : 8;
+		size_t nr_adds = argc > 3 ? strtoul(argv[3], NULL, 10) : 50;
+
+		ret = bench_stress(&b.ctx, nr_procs, nr_adds, true);
+		if (!ret)
+			ret = bench_stress(&b.ctx, nr_procs, nr_adds, false);
+	} else if (argc > 1 && !strcmp(argv[1], "order")) {
+		ret = bench_order(&b.ctx, false);
+		if (!ret)
+			ret = bench_order(&b.ctx, true);
+	} else {
+		if (optind < argc) {
+			for (; optind < argc && !ret; optind++)
+				ret = bench_size(&b, strtoul(argv[optind], NULL, 10));
+		} else {
+			size_t i;
+
+			for (i = 0; i < ARRAY_SIZE(default_sizes) && !ret; i++)
+				ret = bench_size(&b, default_sizes[i]);
+		}
+
+		if (!ret)
+			wgm_jw_dump(write_results, &b, "benchmark results");
+	}
+
+	free_ifaces(&b);
+	free(b.results);
+	free(b.ctx.wg_conf_path);
+	{
+		const char *rm_argv[] = { "rm", "-rf", b.ctx.data_dir, NULL };
+		struct wgm_exec_cmd rm = { .argv = rm_argv, .name = "rm" };
+
+		if (wgm_exec_run(&b.ctx, &rm))
+			wgm_log_err("Warning: failed to remove '%s'\n", b.ctx.data_dir);
+		wgm_exec_cmd_free(&rm);
+	}
+
+	return ret ? 1 : 0;
+}
@@ -5,8 +5,14 @@
 
 #include <stdarg.h>
 #include <stdlib.h>
+#include <sys/ioctl.h>
+#include <sys/sendfile.h>
 #include <sys/stat.h>
+#include <linux/fs.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <time.h>
+#include <unistd.h>
 
 void wgm_log_err(const char *fmt, ...)
 {
@@ -190,31 +196,6 @@ int wgm_str_array_from_json(struct wgm_str_array *arr, const json_object *jobj)
 	return 0;
 }
 
-int wgm_str_array_to_json(json_object **jobj, const struct wgm_str_array *arr)
-{
-	json_object *jarr;
-	size_t i;
-
-	jarr = json_object_new_array();
-	if (!jarr)
-		return -ENOMEM;
-
-	for (i = 0; i < arr->nr; i++) {
-		json_object *jstr;
-
-		jstr = json_object_new_string(arr->arr[i]);
-		if (!jstr) {
-			json_object_put(jarr);
-			return -ENOMEM;
-		}
-
-		json_object_array_add(jarr, jstr);
-	}
-
-	*jobj = jarr;
-	return 0;
-}
-
 void wgm_str_array_free(struct wgm_str_array *arr)
 {
 	size_t i;
@@ -338,58 +319,239 @@ int wgm_get_realpath(const char *path, char **rp)
 	return 0;
 }
 
-ssize_t wgm_copy_file(const char *src, const char *dst)
+static bool copy_fallback(int err)
+{
+	return err == EXDEV || err == ENOSYS || err == EINVAL ||
+	       err == EOPNOTSUPP || err == EBADF;
+}
+
+/*
+ * Bounded, as offset + count must not overflow once the file position
+ * has moved.
+ */
+#define COPY_CHUNK	(1 << 30)
+
+/*
+ * Copy the whole of @sfd to the empty @dfd with the cheapest method the
+ * filesystems allow: a reflink, then copy_file_range() and sendfile(),
+ * which keep the data in the kernel, and only then read()/write().
+ */
+static ssize_t copy_fd(int dfd, int sfd, off_t size, const char **how)
 {
 	size_t total = 0;
-	FILE *sfp, *dfp;
-	int err;
+	char buf[65536];
+	ssize_t n, w, off;
+
+	if (!ioctl(dfd, FICLONE, sfd)) {
+		*how = "reflink";
+		return size;
+	}
+
+	*how = "copy_file_range";
+	while (1) {
+		n = copy_file_range(sfd, NULL, dfd, NULL, COPY_CHUNK, 0);
+		if (!n)
+			return total;
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (total || !copy_fallback(errno))
+			return -errno;
+		break;
+	}
+
+	*how = "sendfile";
+	while (1) {
+		n = sendfile(dfd, sfd, NULL, COPY_CHUNK);
+		if (!n)
+			return total;
+		if (n > 0) {
+			total += n;
+			continue;
+		}
+		if (errno == EINTR)
+			continue;
+		if (total || !copy_fallback(errno))
+			return -errno;
+		break;
+	}
+
+	*how = "read/write";
+	while (1) {
+		n = read(sfd, buf, sizeof(buf));
+		if (!n)
+			return total;
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
 
-	sfp = fopen(src, "rb");
-	if (!sfp) {
+		for (off = 0; off < n; off += w) {
+			w = write(dfd, buf + off, n - off);
+			if (w < 0) {
+				if (errno != EINTR)
+					return -errno;
+				w = 0;
+			}
+		}
+		total += n;
+	}
+}
+
+static void fsync_parent_dir(const char *path)
+{
+	const char *slash = strrchr(path, '/');
+	char *dir;
+	int fd;
+
+	if (!slash)
+		dir = strdup(".");
+	else if (slash == path)
+		dir = strdup("/");
+	else
+		dir = strndup(path, slash - path);
+	if (!dir)
+		return;
+
+	fd = open(dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (fd >= 0) {
+		fsync(fd);
+		close(fd);
+	}
+	free(dir);
+}
+
+/*
+ * Install @src as @dst atomically: the data goes to a private (0600)
+ * temporary file next to @dst, which is synced and renamed over it, so
+ * a reader such as wg-quick sees either the old file or the new one,
+ * never a partial one. @how, if set, gets the copy method used.
+ *
+ * Returns the number of bytes copied.
+ */
+ssize_t wgm_copy_file(const char *src, const char *dst, const char **how)
+{
+	const char *method = NULL;
+	int sfd, dfd = -1, err;
+	ssize_t total = 0;
+	char *tmp = NULL;
+	struct stat st;
+
+	sfd = open(src, O_RDONLY | O_CLOEXEC);
+	if (sfd < 0) {
 		err = -errno;
 		wgm_log_err("Failed to open source file '%s': %s\n", src, strerror(-err));
 		return err;
 	}
 
-	dfp = fopen(dst, "wb");
-	if (!dfp) {
+	if (fstat(sfd, &st)) {
 		err = -errno;
-		wgm_log_err("Failed to open destination file '%s': %s\n", dst, strerror(-err));
-		fclose(sfp);
-		return err;
+		wgm_log_err("Failed to stat source file '%s': %s\n", src, strerror(-err));
+		goto out;
 	}
 
-	while (1) {
-		char buf[4096];
-		size_t len;
+	err = wgm_asprintf(&tmp, "%s.XXXXXX", dst);
+	if (err)
+		goto out;
 
-		len = fread(buf, 1, sizeof(buf), sfp);
-		if (!len)
-			break;
+	dfd = mkostemp(tmp, O_CLOEXEC);
+	if (dfd < 0) {
+		err = -errno;
+		wgm_log_err("Failed to create temporary file '%s': %s\n", tmp, strerror(-err));
+		free(tmp);
+		tmp = NULL;
+		goto out;
+	}
 
-		if (fwrite(buf, 1, len, dfp) != len) {
-			err = -errno;
-			wgm_log_err("Failed to write to destination file '%s': %s\n", dst, strerror(-err));
-			fclose(sfp);
-			fclose(dfp);
-			remove(dst);
-			return err;
-		}
+	total = copy_fd(dfd, sfd, st.st_size, &method);
+	if (total < 0) {
+		err = total;
+		wgm_log_err("Failed to copy '%s' to '%s' (%s): %s\n", src, tmp, method, strerror(-err));
+		goto out;
+	}
 
-		total += len;
-		if (ferror(dfp)) {
-			err = -errno;
-			wgm_log_err("Failed to write to destination file '%s': %s\n", dst, strerror(-err));
-			fclose(sfp);
-			fclose(dfp);
-			remove(dst);
-			return err;
-		}
+	if (fsync(dfd) || close(dfd)) {
+		err = -errno;
+		dfd = -1;
+		wgm_log_err("Failed to write destination file '%s': %s\n", tmp, strerror(-err));
+		goto out;
+	}
+	dfd = -1;
+
+	if (rename(tmp, dst)) {
+		err = -errno;
+		wgm_log_err("Failed to rename '%s' to '%s': %s\n", tmp, dst, strerror(-err));
+		goto out;
 	}
 
-	fclose(sfp);
-	fclose(dfp);
-	return total;
+	fsync_parent_dir(dst);
+	free(tmp);
+	tmp = NULL;
+	if (how)
+		*how = method;
+	err = 0;
+
+out:
+	if (dfd >= 0)
+		close(dfd);
+	if (tmp) {
+		unlink(tmp);
+		free(tmp);
+	}
+	close(sfd);
+	return err ? err : total;
+}
+
+/*
+ * Snapshots share unchanged files with the data directory through
+ * hardlinks (see wgm_snapshot.c), so a file must get an inode of its
+ * own before it is written in place. One that is about to be truncated
+ * is only unlinked; with @keep, its contents are copied to the new
+ * inode first.
+ */
+int wgm_unshare_file(const char *path, bool keep)
+{
+	struct stat st;
+	ssize_t ret;
+
+	if (lstat(path, &st) || !S_ISREG(st.st_mode) || st.st_nlink < 2)
+		return 0;
+
+	if (!keep)
+		return unlink(path) ? -errno : 0;
+
+	ret = wgm_copy_file(path, path, NULL);
+	return ret < 0 ? ret : 0;
+}
+
+/*
+ * 64-bit FNV-1a, never zero so callers can use zero as "no hash".
+ */
+/*
+ * Monotonic time in nanoseconds, for measuring durations.
+ */
+uint64_t wgm_now_ns(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000ull + (uint64_t)ts.tv_nsec;
+}
+
+uint64_t wgm_hash_str(const char *str)
+{
+	uint64_t h = 0xcbf29ce484222325ull;
+
+	while (*str) {
+		h ^= (unsigned char)*str++;
+		h *= 0x100000001b3ull;
+	}
+
+	return h ? h : 1;
 }
 
 bool wgm_file_exists(const char *path)
@@ -423,3 +585,81 @@ out:
 
 	return ret;
 }
+
+static int b64_val(char c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A';
+	if (c >= 'a' && c <= 'z')
+		return c - 'a' + 26;
+	if (c >= '0' && c <= '9')
+		return c - '0' + 52;
+	if (c == '+')
+		return 62;
+	if (c == '/')
+		return 63;
+	return -1;
+}
+
+static const char b64_chars[] =
+	"ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+void wgm_key_to_base64(char b64[WGM_KEY_B64_LEN + 1], const uint8_t key[WGM_KEY_LEN])
+{
+	uint32_t acc;
+	size_t i, o = 0;
+
+	for (i = 0; i < WGM_KEY_LEN - 2; i += 3) {
+		acc = (uint32_t)key[i] << 16 | key[i + 1] << 8 | key[i + 2];
+		b64[o++] = b64_chars[acc >> 18];
+		b64[o++] = b64_chars[(acc >> 12) & 63];
+		b64[o++] = b64_chars[(acc >> 6) & 63];
+		b64[o++] = b64_chars[acc & 63];
+	}
+
+	acc = (uint32_t)key[i] << 10 | key[i + 1] << 2;
+	b64[o++] = b64_chars[acc >> 12];
+	b64[o++] = b64_chars[(acc >> 6) & 63];
+	b64[o++] = b64_chars[acc & 63];
+	b64[o++] = '=';
+	b64[o] = '\0';
+}
+
+/*
+ * Decode a WireGuard key: 32 bytes, base64 encoded as 43 characters
+ * and one '=' of padding.
+ */
+int wgm_key_from_base64(uint8_t key[WGM_KEY_LEN], const char *b64)
+{
+	uint32_t acc = 0;
+	size_t i, o = 0;
+	int v;
+
+	if (strlen(b64) != WGM_KEY_B64_LEN || b64[WGM_KEY_B64_LEN - 1] != '=')
+		return -EINVAL;
+
+	for (i = 0; i < WGM_KEY_B64_LEN - 1; i++) {
+		v = b64_val(b64[i]);
+		if (v < 0)
+			return -EINVAL;
+
+		acc = (acc << 6) | v;
+		if (i % 4 == 3) {
+			key[o++] = acc >> 16;
+			key[o++] = acc >> 8;
+			key[o++] = acc;
+			acc = 0;
+		}
+	}
+
+	/*
+	 * 43 = 10 * 4 + 3: the last 18 bits hold two bytes and two zero
+	 * bits.
+	 */
+	if (acc & 3)
+		return -EINVAL;
+
+	key[o++] = acc >> 10;
+	key[o++] = acc >> 2;
+	return 0;
+}
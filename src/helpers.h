@@ -21,6 +21,12 @@
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
 #endif
 
+/*
+ * WireGuard keys: 32 raw bytes, 44 characters in base64.
+ */
+#define WGM_KEY_LEN		32
+#define WGM_KEY_B64_LEN		44
+
 struct wgm_str_array {
 	char	**arr;
 	size_t	nr;
@@ -45,7 +51,6 @@ int wgm_create_getopt_long_args(struct option **long_opt_p, char **short_opt_p,
 void wgm_free_getopt_long_args(struct option *long_opt, char *short_opt);
 
 int wgm_str_array_from_json(struct wgm_str_array *arr, const json_object *jobj);
-int wgm_str_array_to_json(json_object **jobj, const struct wgm_str_array *arr);
 void wgm_str_array_free(struct wgm_str_array *arr);
 int wgm_str_array_copy(struct wgm_str_array *dst, const struct wgm_str_array *src);
 int wgm_str_array_add(struct wgm_str_array *arr, const char *str);
@@ -53,8 +58,13 @@ int wgm_str_array_del(struct wgm_str_array *arr, size_t idx);
 int wgm_str_array_move(struct wgm_str_array *dst, struct wgm_str_array *src);
 int wgm_asprintf(char **strp, const char *fmt, ...);
 int wgm_get_realpath(const char *path, char **rp);
-ssize_t wgm_copy_file(const char *src, const char *dst);
+ssize_t wgm_copy_file(const char *src, const char *dst, const char **how);
+int wgm_unshare_file(const char *path, bool keep);
+uint64_t wgm_hash_str(const char *str);
+uint64_t wgm_now_ns(void);
 bool wgm_file_exists(const char *path);
 bool wgm_cmp_file_md5(const char *f1, const char *f2);
+int wgm_key_from_base64(uint8_t key[WGM_KEY_LEN], const char *b64);
+void wgm_key_to_base64(char b64[WGM_KEY_B64_LEN + 1], const uint8_t key[WGM_KEY_LEN]);
 
 #endif /* #ifndef WGM__WG_HELPERS_H */
@@ -3,15 +3,32 @@
 #include "wgm.h"
 #include "wgm_peer.h"
 #include "wgm_iface.h"
+#include "wgm_trace.h"
+#include "wgm_metrics.h"
+#include "wgm_restore.h"
+#include "wgm_key.h"
+#include "wgm_export.h"
+#include "wgm_snapshot.h"
+#include "wgm_optimize.h"
+#include "wgm_conf.h"
 
 #include <stdlib.h>
+#include <limits.h>
 
 static void show_usage(const char *app)
 {
-	printf("Usage: %s [iface|peer] [OPTIONS]\n\n", app);
+	printf("Usage: %s [iface|peer|snapshot|restore|optimize|keygen|pubkey] [OPTIONS]\n\n", app);
 	printf("Commands:\n");
-	printf("  iface - Manage WireGuard interfaces\n");
-	printf("  peer  - Manage WireGuard peers\n");
+	printf("  iface   - Manage WireGuard interfaces\n");
+	printf("  peer    - Manage WireGuard peers\n");
+	printf("  snapshot - Save and roll back the stored configuration\n");
+	printf("  restore - Bring every stored interface up\n");
+	printf("  optimize - Put the busiest sources of an interface first in its rules\n");
+	printf("  keygen  - Generate key pairs\n");
+	printf("  pubkey  - Print the public keys of private keys read from stdin\n");
+	printf("\n");
+	printf("Global options:\n");
+	printf("  --timing[=table|json]  Print per-phase timings on stderr\n");
 }
 
 void show_usage_iface(const char *app, bool show_cmds)
@@ -19,7 +36,7 @@ void show_usage_iface(const char *app, bool show_cmds)
 	if (!app)
 		app = "wgm";
 
-	printf("Usage: %s iface [add|del|show|update|list|up|down] [OPTIONS]\n\n", app);
+	printf("Usage: %s iface [add|del|show|update|list|up|down|reload|rebalance] [OPTIONS]\n\n", app);
 	if (show_cmds) {
 		printf("Commands:\n");
 		printf("  add    - Add a new WireGuard interface\n");
@@ -29,6 +46,8 @@ void show_usage_iface(const char *app, bool show_cmds)
 		printf("  list   - List all WireGuard interfaces (no options required)\n");
 		printf("  up     - Start a WireGuard interface\n");
 		printf("  down   - Stop a WireGuard interface\n");
+		printf("  reload - Apply saved changes to a running interface\n");
+		printf("  rebalance - Change the number of peer shard files\n");
 		printf("\n");
 	}
 	printf("Options:\n");
@@ -40,6 +59,58 @@ void show_usage_iface(const char *app, bool show_cmds)
 	printf("  -i, --allowed-ips <ips>   Allowed IPs\n");
 	printf("  -h, --help                Show this help message\n");
 	printf("  -f, --force               Force operation\n");
+	printf("  -s, --shards <n>          Number of peer shard files (0: single file)\n");
+	printf("  -V, --if-version <n>      Only modify the interface if it is at version <n>\n");
+	printf("  -A, --all                 Every interface (up, down, show, update, reload)\n");
+	printf("  -j, --jobs <n>            Interfaces handled at once (default: CPUs)\n");
+	printf("  -F, --flowtable <on|off>  Offload established forwarded flows (add, update)\n");
+	printf("  -R, --filter-forward <on|off>  ACCEPT the peers' sources in FORWARD (add, update)\n");
+	printf("  -P, --plan                Show what would change, write nothing (add, update, rebalance)\n");
+	printf("\n");
+	printf("up, down, show, update and reload take a comma separated list of names\n");
+	printf("and glob patterns in --dev, e.g. --dev 'wg*,vpn0'.\n");
+	printf("\n");
+}
+
+void show_usage_restore(const char *app)
+{
+	if (!app)
+		app = "wgm";
+
+	printf("Usage: %s restore [OPTIONS]\n\n", app);
+	printf("Bring every stored interface up, e.g. after a reboot.\n\n");
+	printf("Options:\n");
+	printf("  -j, --jobs <n>  Interfaces loaded and brought up at once (default: CPUs)\n");
+	printf("  -h, --help      Show this help message\n");
+	printf("\n");
+}
+
+void show_usage_optimize(const char *app)
+{
+	if (!app)
+		app = "wgm";
+
+	printf("Usage: %s optimize [OPTIONS]\n\n", app);
+	printf("Reorder the firewall rules of a running interface by the packets\n");
+	printf("they counted, busiest first, and apply the new order atomically.\n\n");
+	printf("Options:\n");
+	printf("  -d, --dev <name>  Interface name\n");
+	printf("  -h, --help        Show this help message\n");
+	printf("\n");
+}
+
+void show_usage_keygen(const char *app)
+{
+	if (!app)
+		app = "wgm";
+
+	printf("Usage: %s keygen [OPTIONS]\n", app);
+	printf("       %s pubkey < private_keys\n\n", app);
+	printf("keygen prints one {\"private_key\", \"public_key\"} JSON object per line.\n");
+	printf("pubkey prints the public key of each private key read from stdin, one per line.\n\n");
+	printf("Options:\n");
+	printf("  -c, --count <n>  Number of key pairs (default: 1)\n");
+	printf("  -h, --help       Show this help message\n");
 	printf("\n");
 }
 
@@ -48,7 +119,7 @@ void show_usage_peer(const char *app, bool show_cmds)
 	if (!app)
 		app = "wgm";
 
-	printf("Usage: wgm peer [add|del|show|update|list] [OPTIONS]\n\n");
+	printf("Usage: wgm peer [add|del|show|update|list|export] [OPTIONS]\n\n");
 	if (show_cmds) {
 		printf("Commands:\n");
 		printf("  add    - Add a new peer to a WireGuard interface\n");
@@ -56,17 +127,63 @@ void show_usage_peer(const char *app, bool show_cmds)
 		printf("  show   - Show information about a peer in a WireGuard interface\n");
 		printf("  update - Update an existing peer in a WireGuard interface\n");
 		printf("  list   - List all peers in a WireGuard interface\n");
+		printf("  export - Write client configurations for the peers (see export --help)\n");
 		printf("\n");
 	}
 	printf("Options:\n");
-	printf("  -d, --dev         Interface name\n");
-	printf("  -p, --public-key  Public key of the peer\n");
-	printf("  -e, --endpoint    Endpoint of the peer\n");
-	printf("  -b, --bind-ip     Bind IP of the peer\n");
-	printf("  -a, --allowed-ips Allowed IPs of the peer\n");
-	printf("  -g, --bind-dev    Interface name to be bound for the peer\n");
-	printf("  -f, --force       Force the operation\n");
-	printf("  -h, --help        Show this help message\n");
+	printf("  -d, --dev          Interface name\n");
+	printf("  -p, --public-key   Public key of the peer\n");
+	printf("  -e, --endpoint     Endpoint of the peer\n");
+	printf("  -b, --bind-ip      Bind IP of the peer\n");
+	printf("  -a, --allowed-ips  Allowed IPs of the peer\n");
+	printf("  -g, --bind-dev     Interface name to be bound for the peer\n");
+	printf("  -f, --force        Force the operation\n");
+	printf("  -G, --generate-key Generate a key pair for the peer (add)\n");
+	printf("  -V, --if-version   Only modify the interface if it is at this version\n");
+	printf("  -P, --plan         Show what would change, write nothing (add, del, update)\n");
+	printf("  -h, --help         Show this help message\n");
+	printf("\n");
+}
+
+void show_usage_export(const char *app)
+{
+	if (!app)
+		app = "wgm";
+
+	printf("Usage: %s peer export --dev <name> --endpoint <host[:port]> [--all] [--keys-from <file>] [--output <dir>|--tar] [OPTIONS]\n\n", app);
+	printf("Write the client configuration of the peers of an interface.\n\n");
+	printf("Options:\n");
+	printf("  -d, --dev <name>         Interface name\n");
+	printf("  -A, --all                Every peer of the interface\n");
+	printf("  -k, --keys-from <file>   Private keys of the peers to export, one per line or\n");
+	printf("                           as printed by keygen ('-' for stdin)\n");
+	printf("  -e, --endpoint <addr>    Endpoint of the interface (default port: listen port)\n");
+	printf("  -n, --dns <servers>      DNS servers of the clients\n");
+	printf("  -K, --keepalive <secs>   Persistent keepalive interval of the clients\n");
+	printf("  -o, --output <dir>       Write <dir>/<public key>.conf for each peer\n");
+	printf("  -t, --tar                Write a tar archive to stdout\n");
+	printf("  -j, --jobs <n>           Rendering threads (default: CPUs)\n");
+	printf("  -h, --help               Show this help message\n");
+	printf("\n");
+}
+
+void show_usage_snapshot(const char *app, bool show_cmds)
+{
+	if (!app)
+		app = "wgm";
+
+	printf("Usage: %s snapshot [create|list|rollback|delete] [OPTIONS]\n\n", app);
+	if (show_cmds) {
+		printf("Commands:\n");
+		printf("  create   - Save the stores, generated configurations and fwmarks\n");
+		printf("  list     - List the snapshots\n");
+		printf("  rollback - Restore a snapshot and apply the interfaces that differ\n");
+		printf("  delete   - Delete a snapshot\n");
+		printf("\n");
+	}
+	printf("Options:\n");
+	printf("  -n, --name <name>  Snapshot name (create default: local time, YYYYmmdd-HHMMSS)\n");
+	printf("  -h, --help         Show this help message\n");
 	printf("\n");
 }
 
@@ -75,9 +192,59 @@ static void wgm_ctx_free(struct wgm_ctx *ctx)
 	free(ctx->data_dir);
 	free(ctx->wg_quick_path);
 	free(ctx->wg_conf_path);
+	free(ctx->wg_path);
+	wgm_trace_destroy(ctx->trace);
+	wgm_metrics_destroy(ctx->metrics);
+	wgm_conf_free_fwmarks(ctx);
 	memset(ctx, 0, sizeof(*ctx));
 }
 
+static int wgm_ctx_enable_trace(struct wgm_ctx *ctx, enum wgm_trace_fmt fmt)
+{
+	if (ctx->trace) {
+		ctx->trace->fmt = fmt;
+		return 0;
+	}
+
+	ctx->trace = wgm_trace_create(fmt);
+	return ctx->trace ? 0 : -ENOMEM;
+}
+
+/*
+ * --timing is accepted anywhere on the command line (before a "--") and
+ * removed from @argv, so the per-command option parsers never see it.
+ */
+static int wgm_ctx_parse_global_opts(int *argc, char *argv[], struct wgm_ctx *ctx)
+{
+	enum wgm_trace_fmt fmt;
+	int i, j, ret;
+
+	for (i = 1, j = 1; i < *argc; i++) {
+		const char *arg = argv[i];
+
+		if (!strcmp(arg, "--")) {
+			while (i < *argc)
+				argv[j++] = argv[i++];
+			break;
+		}
+
+		if (strcmp(arg, "--timing") && strncmp(arg, "--timing=", 9)) {
+			argv[j++] = argv[i];
+			continue;
+		}
+
+		ret = wgm_trace_opt_get_fmt(&fmt, arg[8] ? &arg[9] : "");
+		if (!ret)
+			ret = wgm_ctx_enable_trace(ctx, fmt);
+		if (ret)
+			return ret;
+	}
+
+	argv[j] = NULL;
+	*argc = j;
+	return 0;
+}
+
 static int wgm_ctx_init(struct wgm_ctx *ctx)
 {
 	const char *tmp;
@@ -117,6 +284,83 @@ static int wgm_ctx_init(struct wgm_ctx *ctx)
 	if (!ctx->wg_conf_path)
 		goto out_err;
 
+	tmp = getenv("WGM_WG_PATH");
+	if (!tmp)
+		tmp = "/usr/bin/wg";
+
+	ctx->wg_path = strdup(tmp);
+	if (!ctx->wg_path)
+		goto out_err;
+
+	tmp = getenv("WGM_LOCK_TIMEOUT");
+	if (tmp) {
+		char *endptr;
+		unsigned long t;
+
+		t = strtoul(tmp, &endptr, 10);
+		if (!*tmp || *endptr || t > UINT_MAX) {
+			wgm_log_err("Error: wgm_ctx_init: invalid WGM_LOCK_TIMEOUT: %s\n", tmp);
+			wgm_ctx_free(ctx);
+			return -EINVAL;
+		}
+
+		ctx->lock_timeout = t;
+	} else {
+		ctx->lock_timeout = 60;
+	}
+
+	tmp = getenv("WGM_EXEC_TIMEOUT");
+	if (tmp) {
+		char *endptr;
+		unsigned long t;
+
+		t = strtoul(tmp, &endptr, 10);
+		if (!*tmp || *endptr || t > UINT_MAX / 1000) {
+			wgm_log_err("Error: wgm_ctx_init: invalid WGM_EXEC_TIMEOUT: %s\n", tmp);
+			wgm_ctx_free(ctx);
+			return -EINVAL;
+		}
+
+		ctx->exec_timeout_ms = t * 1000;
+	} else {
+		ctx->exec_timeout_ms = 300 * 1000;
+	}
+
+	tmp = getenv("WGM_BRINGUP");
+	if (!tmp || !*tmp || !strcmp(tmp, "auto")) {
+		ctx->bringup = WGM_BRINGUP_AUTO;
+	} else if (!strcmp(tmp, "native")) {
+		ctx->bringup = WGM_BRINGUP_NATIVE;
+	} else if (!strcmp(tmp, "wg-quick")) {
+		ctx->bringup = WGM_BRINGUP_WG_QUICK;
+	} else {
+		wgm_log_err("Error: wgm_ctx_init: invalid WGM_BRINGUP: %s\n", tmp);
+		wgm_ctx_free(ctx);
+		return -EINVAL;
+	}
+
+	tmp = getenv("WGM_METRICS_FILE");
+	if (tmp && *tmp) {
+		ctx->metrics = wgm_metrics_create(tmp);
+		if (!ctx->metrics) {
+			wgm_ctx_free(ctx);
+			return -ENOMEM;
+		}
+	}
+
+	tmp = getenv("WGM_TRACE");
+	if (tmp && *tmp && strcmp(tmp, "0")) {
+		enum wgm_trace_fmt fmt;
+
+		ret = wgm_trace_opt_get_fmt(&fmt, tmp);
+		if (!ret)
+			ret = wgm_ctx_enable_trace(ctx, fmt);
+		if (ret) {
+			wgm_ctx_free(ctx);
+			return ret;
+		}
+	}
+
 	return 0;
 
 out_err:
@@ -125,8 +369,56 @@ out_err:
 	return -ENOMEM;
 }
 
+struct wgm_cmd {
+	const char	*name;
+	int		(*fn)(int argc, char *argv[], struct wgm_ctx *ctx);
+};
+
+static const struct wgm_cmd iface_cmds[] = {
+	{ "add",	wgm_iface_cmd_add },
+	{ "del",	wgm_iface_cmd_del },
+	{ "show",	wgm_iface_cmd_show },
+	{ "update",	wgm_iface_cmd_update },
+	{ "list",	wgm_iface_cmd_list },
+	{ "up",		wgm_iface_cmd_up },
+	{ "down",	wgm_iface_cmd_down },
+	{ "reload",	wgm_iface_cmd_reload },
+	{ "rebalance",	wgm_iface_cmd_rebalance },
+};
+
+static const struct wgm_cmd peer_cmds[] = {
+	{ "add",	wgm_peer_cmd_add },
+	{ "del",	wgm_peer_cmd_del },
+	{ "show",	wgm_peer_cmd_show },
+	{ "update",	wgm_peer_cmd_update },
+	{ "list",	wgm_peer_cmd_list },
+	{ "export",	wgm_peer_cmd_export },
+};
+
+static const struct wgm_cmd snapshot_cmds[] = {
+	{ "create",	wgm_snapshot_cmd_create },
+	{ "list",	wgm_snapshot_cmd_list },
+	{ "rollback",	wgm_snapshot_cmd_rollback },
+	{ "delete",	wgm_snapshot_cmd_delete },
+};
+
+static const struct wgm_cmd *wgm_find_cmd(const struct wgm_cmd *cmds, size_t nr,
+					  const char *name)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (!strcmp(cmds[i].name, name))
+			return &cmds[i];
+	}
+
+	return NULL;
+}
+
 static int wgm_ctx_run(int argc, char *argv[], struct wgm_ctx *ctx)
 {
+	const struct wgm_cmd *cmd;
+
 	if (argc < 2) {
 		fprintf(stderr, "Error: missing command\n");
 		return 1;
@@ -138,56 +430,76 @@ static int wgm_ctx_run(int argc, char *argv[], struct wgm_ctx *ctx)
 			return 1;
 		}
 
-		if (!strcmp(argv[2], "add"))
-			return wgm_iface_cmd_add(argc - 1, argv + 1, ctx);
-
-		if (!strcmp(argv[2], "del"))
-			return wgm_iface_cmd_del(argc - 1, argv + 1, ctx);
-
-		if (!strcmp(argv[2], "show"))
-			return wgm_iface_cmd_show(argc - 1, argv + 1, ctx);
-
-		if (!strcmp(argv[2], "update"))
-			return wgm_iface_cmd_update(argc - 1, argv + 1, ctx);
+		cmd = wgm_find_cmd(iface_cmds, ARRAY_SIZE(iface_cmds), argv[2]);
+		if (!cmd) {
+			fprintf(stderr, "Error: unknown command: %s\n\n", argv[2]);
+			show_usage_iface(argv[0], true);
+			return 1;
+		}
 
-		if (!strcmp(argv[2], "list"))
-			return wgm_iface_cmd_list(argc - 1, argv + 1, ctx);
+		ctx->cmd_group = "iface";
+		ctx->cmd_name = cmd->name;
+		return cmd->fn(argc - 1, argv + 1, ctx);
+	}
 
-		if (!strcmp(argv[2], "up"))
-			return wgm_iface_cmd_up(argc - 1, argv + 1, ctx);
+	if (strcmp(argv[1], "peer") == 0) {
+		if (argc < 3) {
+			show_usage_peer(argv[0], true);
+			return 1;
+		}
 
-		if (!strcmp(argv[2], "down"))
-			return wgm_iface_cmd_down(argc - 1, argv + 1, ctx);
+		cmd = wgm_find_cmd(peer_cmds, ARRAY_SIZE(peer_cmds), argv[2]);
+		if (!cmd) {
+			fprintf(stderr, "Error: unknown command: %s\n\n", argv[2]);
+			show_usage_peer(argv[0], true);
+			return 1;
+		}
 
-		fprintf(stderr, "Error: unknown command: %s\n\n", argv[2]);
-		show_usage_iface(argv[0], true);
-		return 1;
+		ctx->cmd_group = "peer";
+		ctx->cmd_name = cmd->name;
+		return cmd->fn(argc - 1, argv + 1, ctx);
 	}
 
-	if (strcmp(argv[1], "peer") == 0) {
+	if (strcmp(argv[1], "snapshot") == 0) {
 		if (argc < 3) {
-			show_usage_peer(argv[0], true);
+			show_usage_snapshot(argv[0], true);
 			return 1;
 		}
 
-		if (!strcmp(argv[2], "add"))
-			return wgm_peer_cmd_add(argc - 1, argv + 1, ctx);
+		cmd = wgm_find_cmd(snapshot_cmds, ARRAY_SIZE(snapshot_cmds), argv[2]);
+		if (!cmd) {
+			fprintf(stderr, "Error: unknown command: %s\n\n", argv[2]);
+			show_usage_snapshot(argv[0], true);
+			return 1;
+		}
 
-		if (!strcmp(argv[2], "del"))
-			return wgm_peer_cmd_del(argc - 1, argv + 1, ctx);
+		ctx->cmd_group = "snapshot";
+		ctx->cmd_name = cmd->name;
+		return cmd->fn(argc - 1, argv + 1, ctx);
+	}
 
-		if (!strcmp(argv[2], "show"))
-			return wgm_peer_cmd_show(argc - 1, argv + 1, ctx);
+	if (strcmp(argv[1], "restore") == 0) {
+		ctx->cmd_group = "restore";
+		ctx->cmd_name = NULL;
+		return wgm_cmd_restore(argc - 1, argv + 1, ctx);
+	}
 
-		if (!strcmp(argv[2], "update"))
-			return wgm_peer_cmd_update(argc - 1, argv + 1, ctx);
+	if (strcmp(argv[1], "optimize") == 0) {
+		ctx->cmd_group = "optimize";
+		ctx->cmd_name = NULL;
+		return wgm_cmd_optimize(argc - 1, argv + 1, ctx);
+	}
 
-		if (!strcmp(argv[2], "list"))
-			return wgm_peer_cmd_list(argc - 1, argv + 1, ctx);
+	if (strcmp(argv[1], "keygen") == 0) {
+		ctx->cmd_group = "keygen";
+		ctx->cmd_name = NULL;
+		return wgm_cmd_keygen(argc - 1, argv + 1, ctx);
+	}
 
-		fprintf(stderr, "Error: unknown command: %s\n\n", argv[2]);
-		show_usage_peer(argv[0], true);
-		return 1;
+	if (strcmp(argv[1], "pubkey") == 0) {
+		ctx->cmd_group = "pubkey";
+		ctx->cmd_name = NULL;
+		return wgm_cmd_pubkey(argc - 1, argv + 1, ctx);
 	}
 
 	fprintf(stderr, "Error: unknown command: %s\n\n", argv[1]);
@@ -209,7 +521,21 @@ int main(int argc, char *argv[])
 	if (ret)
 		return ret;
 
+	ret = wgm_ctx_parse_global_opts(&argc, argv, &ctx);
+	if (ret) {
+		wgm_ctx_free(&ctx);
+		return ret;
+	}
+
 	ret = wgm_ctx_run(argc, argv, &ctx);
+	if (ctx.trace)
+		wgm_trace_dump(ctx.trace);
+
+	wgm_metrics_flush(&ctx, ret);
+
 	wgm_ctx_free(&ctx);
+	if (ret == -ESTALE)
+		return WGM_EXIT_VERSION_MISMATCH;
+
 	return ret;
 }
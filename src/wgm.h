@@ -5,15 +5,83 @@
 #include "helpers.h"
 #include <json-c/json.h>
 
+struct wgm_trace;
+struct wgm_metrics;
+struct wgm_fwmark_cache;
+struct wgm_plan;
+
+/*
+ * How interfaces are brought up and down (WGM_BRINGUP).
+ */
+enum wgm_bringup {
+	WGM_BRINGUP_AUTO,
+	WGM_BRINGUP_NATIVE,
+	WGM_BRINGUP_WG_QUICK,
+};
+
 struct wgm_ctx {
 	char	*data_dir;
 	char	*wg_quick_path;
 	char	*wg_conf_path;
+	char	*wg_path;
+
+	/*
+	 * Seconds to wait for an interface lock (WGM_LOCK_TIMEOUT).
+	 */
+	unsigned int	lock_timeout;
+
+	/*
+	 * Milliseconds an external command may run (WGM_EXEC_TIMEOUT,
+	 * in seconds; 0: no limit).
+	 */
+	unsigned int	exec_timeout_ms;
+
+	/*
+	 * Netlink, wg-quick, or netlink falling back to wg-quick.
+	 */
+	enum wgm_bringup	bringup;
+
+	/*
+	 * Phase timings (--timing, WGM_TRACE); NULL when disabled.
+	 */
+	struct wgm_trace	*trace;
+
+	/*
+	 * Prometheus textfile metrics (WGM_METRICS_FILE); NULL when
+	 * disabled.
+	 */
+	struct wgm_metrics	*metrics;
+
+	/*
+	 * Fwmarks resolved in one pass (wgm restore); NULL otherwise.
+	 */
+	struct wgm_fwmark_cache	*fwmarks;
+
+	/*
+	 * Dry run (--plan): saving reports what it would write and apply
+	 * instead of writing; NULL otherwise.
+	 */
+	struct wgm_plan		*plan;
+
+	/*
+	 * The command being run ("iface", "up"), set by the dispatcher.
+	 */
+	const char		*cmd_group;
+	const char		*cmd_name;
 };
 
-#define WGM_JSON_FLAGS (JSON_C_TO_STRING_NOSLASHESCAPE | JSON_C_TO_STRING_SPACED | JSON_C_TO_STRING_PRETTY)
+/*
+ * Exit status of a command whose --if-version did not match. Commands
+ * report that case, and only that case, as -ESTALE.
+ */
+#define WGM_EXIT_VERSION_MISMATCH	3
 
 void show_usage_iface(const char *app, bool show_cmds);
 void show_usage_peer(const char *app, bool show_cmds);
+void show_usage_restore(const char *app);
+void show_usage_optimize(const char *app);
+void show_usage_keygen(const char *app);
+void show_usage_export(const char *app);
+void show_usage_snapshot(const char *app, bool show_cmds);
 
 #endif /* #ifndef WGM__WG_WGM_H */
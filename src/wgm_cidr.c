@@ -0,0 +1,463 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm_cidr.h"
+
+#include <arpa/inet.h>
+#include <stdlib.h>
+
+/*
+ * Aggregation works on a binary trie of the prefixes, the action of a
+ * source being the one of its longest matching prefix, like WireGuard
+ * picks the peer of a packet. The trie is rewritten into the smallest
+ * set of prefixes giving every address the same action, with ORTC
+ * (Draves et al., "Constructing Optimal IP Routing Tables"):
+ *
+ *   1. every node gets zero or two children; a new leaf takes the
+ *      action of its nearest ancestor with one (WGM_CIDR_NONE if none);
+ *   2. bottom-up, a leaf's candidate set is its action, an inner
+ *      node's the intersection of its children's, or their union if
+ *      that is empty;
+ *   3. top-down, a node needs a prefix only if the action covering it
+ *      from above is not in its set; it takes any action of the set.
+ *
+ * The prefixes may overlap, so they have to be matched longest first;
+ * wgm_cidr_aggregate() sorts them that way.
+ */
+#define ACTION_UNSET	INT64_MIN
+
+struct cidr_node {
+	int32_t		child[2];
+	uint32_t	nset;
+	int64_t		action;
+	int64_t		one;
+	int64_t		*set;
+};
+
+struct cidr_trie {
+	struct cidr_node	*nodes;
+	size_t			nr;
+	size_t			alloc;
+};
+
+int wgm_cidr_parse(const char *str, uint32_t *addr, uint8_t *len)
+{
+	char buf[INET_ADDRSTRLEN + 4], *slash, *end;
+	struct in_addr in;
+	unsigned long l = 32;
+
+	if (strlen(str) >= sizeof(buf))
+		return -EINVAL;
+
+	strcpy(buf, str);
+	slash = strchr(buf, '/');
+	if (slash) {
+		*slash++ = '\0';
+		l = strtoul(slash, &end, 10);
+		if (!*slash || *end || l > 32)
+			return -EINVAL;
+	}
+
+	if (inet_pton(AF_INET, buf, &in) != 1)
+		return -EINVAL;
+
+	*addr = ntohl(in.s_addr);
+	*len = l;
+	return 0;
+}
+
+void wgm_cidr_format(char buf[19], uint32_t addr, uint8_t len)
+{
+	struct in_addr in = { .s_addr = htonl(addr) };
+
+	inet_ntop(AF_INET, &in, buf, INET_ADDRSTRLEN);
+	if (len != 32)
+		sprintf(buf + strlen(buf), "/%u", len);
+}
+
+int wgm_cidr_array_add(struct wgm_cidr_array *a, uint32_t addr, uint8_t len, int64_t action)
+{
+	struct wgm_cidr *arr;
+
+	if (a->nr == a->alloc) {
+		size_t n = a->alloc ? a->alloc * 2 : 64;
+
+		arr = realloc(a->arr, n * sizeof(*arr));
+		if (!arr)
+			return -ENOMEM;
+
+		a->arr = arr;
+		a->alloc = n;
+	}
+
+	a->arr[a->nr].addr = len ? addr & (~0u << (32 - len)) : 0;
+	a->arr[a->nr].len = len;
+	a->arr[a->nr].action = action;
+	a->nr++;
+	return 0;
+}
+
+void wgm_cidr_array_free(struct wgm_cidr_array *a)
+{
+	free(a->arr);
+	memset(a, 0, sizeof(*a));
+}
+
+static int32_t trie_new(struct cidr_trie *t, int64_t action)
+{
+	struct cidr_node *nodes;
+
+	if (t->nr == t->alloc) {
+		size_t n = t->alloc ? t->alloc * 2 : 256;
+
+		nodes = realloc(t->nodes, n * sizeof(*nodes));
+		if (!nodes)
+			return -1;
+
+		t->nodes = nodes;
+		t->alloc = n;
+	}
+
+	memset(&t->nodes[t->nr], 0, sizeof(*t->nodes));
+	t->nodes[t->nr].child[0] = t->nodes[t->nr].child[1] = -1;
+	t->nodes[t->nr].action = action;
+	return t->nr++;
+}
+
+/*
+ * The first prefix wins when the same one is given twice, as with
+ * rules matched in order.
+ */
+static int trie_insert(struct cidr_trie *t, const struct wgm_cidr *c)
+{
+	int32_t n = 0, next;
+	uint8_t i;
+
+	for (i = 0; i < c->len; i++) {
+		unsigned bit = (c->addr >> (31 - i)) & 1;
+
+		next = t->nodes[n].child[bit];
+		if (next < 0) {
+			next = trie_new(t, ACTION_UNSET);
+			if (next < 0)
+				return -ENOMEM;
+			t->nodes[n].child[bit] = next;
+		}
+		n = next;
+	}
+
+	if (t->nodes[n].action == ACTION_UNSET)
+		t->nodes[n].action = c->action;
+	return 0;
+}
+
+static const int64_t *node_set(const struct cidr_node *n)
+{
+	return n->nset == 1 ? &n->one : n->set;
+}
+
+static int node_set_from(struct cidr_node *n, const int64_t *set, size_t nr)
+{
+	if (nr == 1) {
+		n->one = set[0];
+		n->nset = 1;
+		return 0;
+	}
+
+	n->set = malloc(nr * sizeof(*set));
+	if (!n->set)
+		return -ENOMEM;
+
+	memcpy(n->set, set, nr * sizeof(*set));
+	n->nset = nr;
+	return 0;
+}
+
+/*
+ * Merge the (sorted) candidate sets of both children into @n.
+ */
+static int node_merge_sets(struct cidr_node *n, const struct cidr_node *l,
+			   const struct cidr_node *r)
+{
+	const int64_t *a = node_set(l), *b = node_set(r);
+	size_t i = 0, j = 0, k = 0;
+	int64_t *out;
+	int ret;
+
+	out = malloc((l->nset + r->nset) * sizeof(*out));
+	if (!out)
+		return -ENOMEM;
+
+	while (i < l->nset && j < r->nset) {
+		if (a[i] < b[j]) {
+			i++;
+		} else if (a[i] > b[j]) {
+			j++;
+		} else {
+			out[k++] = a[i];
+			i++;
+			j++;
+		}
+	}
+
+	if (!k) {
+		i = j = 0;
+		while (i < l->nset || j < r->nset) {
+			if (j == r->nset || (i < l->nset && a[i] < b[j]))
+				out[k++] = a[i++];
+			else if (i == l->nset || b[j] < a[i])
+				out[k++] = b[j++];
+			else {
+				out[k++] = a[i];
+				i++;
+				j++;
+			}
+		}
+	}
+
+	ret = node_set_from(n, out, k);
+	free(out);
+	return ret;
+}
+
+/*
+ * Passes 1 and 2. Children are added while walking, which may move
+ * the nodes, so they are only referred to by index.
+ */
+static int trie_fill(struct cidr_trie *t, int32_t n, int64_t inherited)
+{
+	int64_t action = t->nodes[n].action;
+	int32_t c;
+	int i, ret;
+
+	if (action == ACTION_UNSET)
+		action = inherited;
+
+	if (t->nodes[n].child[0] < 0 && t->nodes[n].child[1] < 0)
+		return node_set_from(&t->nodes[n], &action, 1);
+
+	for (i = 0; i < 2; i++) {
+		c = t->nodes[n].child[i];
+		if (c < 0) {
+			c = trie_new(t, action);
+			if (c < 0)
+				return -ENOMEM;
+			t->nodes[n].child[i] = c;
+		}
+
+		ret = trie_fill(t, c, action);
+		if (ret)
+			return ret;
+	}
+
+	return node_merge_sets(&t->nodes[n], &t->nodes[t->nodes[n].child[0]],
+			       &t->nodes[t->nodes[n].child[1]]);
+}
+
+static bool set_has(const int64_t *set, size_t nr, int64_t action)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++) {
+		if (set[i] == action)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Pass 3.
+ */
+static int trie_select(const struct cidr_trie *t, int32_t n, uint32_t addr, uint8_t len,
+		       int64_t covering, struct wgm_cidr_array *out)
+{
+	const struct cidr_node *node = &t->nodes[n];
+	const int64_t *set = node_set(node);
+	int ret;
+
+	if (!set_has(set, node->nset, covering)) {
+		covering = set[0];
+		ret = wgm_cidr_array_add(out, addr, len, covering);
+		if (ret)
+			return ret;
+	}
+
+	if (node->child[0] < 0)
+		return 0;
+
+	ret = trie_select(t, node->child[0], addr, len + 1, covering, out);
+	if (!ret)
+		ret = trie_select(t, node->child[1], addr | (1u << (31 - len)), len + 1, covering, out);
+	return ret;
+}
+
+static int cmp_cidr(const void *a, const void *b)
+{
+	const struct wgm_cidr *x = a, *y = b;
+
+	if (x->len != y->len)
+		return y->len - x->len;
+
+	return (x->addr > y->addr) - (x->addr < y->addr);
+}
+
+/*
+ * Replace the prefixes of @a with the fewest that give every source
+ * the same action, longest first, so that matching them in order is
+ * a longest prefix match. Rules with WGM_CIDR_NONE may be needed to
+ * carve a hole in a shorter prefix.
+ */
+int wgm_cidr_aggregate(struct wgm_cidr_array *a)
+{
+	struct wgm_cidr_array out = { NULL, 0, 0 };
+	struct cidr_trie t = { NULL, 0, 0 };
+	size_t i;
+	int ret = 0;
+
+	if (!a->nr)
+		return 0;
+
+	if (trie_new(&t, ACTION_UNSET) < 0) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < a->nr && !ret; i++)
+		ret = trie_insert(&t, &a->arr[i]);
+	if (!ret)
+		ret = trie_fill(&t, 0, WGM_CIDR_NONE);
+	if (!ret)
+		ret = trie_select(&t, 0, 0, 0, WGM_CIDR_NONE, &out);
+	if (ret)
+		goto out;
+
+	if (out.nr)
+		qsort(out.arr, out.nr, sizeof(*out.arr), cmp_cidr);
+	wgm_cidr_array_free(a);
+	*a = out;
+	out.arr = NULL;
+
+out:
+	for (i = 0; i < t.nr; i++) {
+		if (t.nodes[i].nset > 1)
+			free(t.nodes[i].set);
+	}
+	free(t.nodes);
+	free(out.arr);
+	return ret;
+}
+
+static uint32_t cidr_mask(uint8_t len)
+{
+	return len ? ~0u << (32 - len) : 0;
+}
+
+/*
+ * The index of the prefix of @a (sorted longest first) that is exactly
+ * @addr/@len, or -1.
+ */
+static ssize_t cidr_find(const struct wgm_cidr_array *a, uint32_t addr, uint8_t len)
+{
+	struct wgm_cidr key = { .addr = addr & cidr_mask(len), .len = len };
+	const struct wgm_cidr *c;
+
+	c = bsearch(&key, a->arr, a->nr, sizeof(*a->arr), cmp_cidr);
+	return c ? c - a->arr : -1;
+}
+
+/*
+ * The index of the longest prefix of @a (sorted longest first) that
+ * contains @addr/@len, or -1.
+ */
+ssize_t wgm_cidr_lookup(const struct wgm_cidr_array *a, uint32_t addr, uint8_t len)
+{
+	ssize_t i;
+	int l;
+
+	for (l = len; l >= 0; l--) {
+		i = cidr_find(a, addr, l);
+		if (i >= 0)
+			return i;
+	}
+
+	return -1;
+}
+
+void wgm_cidr_sort(struct wgm_cidr_array *a)
+{
+	if (a->nr)
+		qsort(a->arr, a->nr, sizeof(*a->arr), cmp_cidr);
+}
+
+struct cidr_rank {
+	uint64_t	heat;
+	size_t		idx;
+};
+
+static int cmp_rank(const void *a, const void *b)
+{
+	const struct cidr_rank *x = a, *y = b;
+
+	if (x->heat != y->heat)
+		return x->heat < y->heat ? 1 : -1;
+
+	return (x->idx > y->idx) - (x->idx < y->idx);
+}
+
+/*
+ * Reorder the prefixes of @a, as left by wgm_cidr_aggregate(), hottest
+ * first. The heat of a prefix is the sum of the actions of the @heat
+ * prefixes it is the longest match of. Overlapping prefixes must stay
+ * longest first: every prefix is ranked with the hottest of itself and
+ * the prefixes containing it, which is never less than theirs, and
+ * ties keep the longest first order. Disjoint prefixes are free to move.
+ */
+int wgm_cidr_order(struct wgm_cidr_array *a, const struct wgm_cidr_array *heat)
+{
+	struct cidr_rank *ranks;
+	struct wgm_cidr *arr;
+	uint64_t *w;
+	size_t i;
+	ssize_t j;
+	int l;
+
+	if (!a->nr || !heat->nr)
+		return 0;
+
+	w = calloc(a->nr, sizeof(*w));
+	ranks = malloc(a->nr * sizeof(*ranks));
+	arr = malloc(a->nr * sizeof(*arr));
+	if (!w || !ranks || !arr) {
+		free(w);
+		free(ranks);
+		free(arr);
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < heat->nr; i++) {
+		j = wgm_cidr_lookup(a, heat->arr[i].addr, heat->arr[i].len);
+		if (j >= 0 && heat->arr[i].action > 0)
+			w[j] += (uint64_t)heat->arr[i].action;
+	}
+
+	for (i = 0; i < a->nr; i++) {
+		ranks[i].heat = w[i];
+		ranks[i].idx = i;
+		for (l = 0; l < a->arr[i].len; l++) {
+			j = cidr_find(a, a->arr[i].addr, l);
+			if (j >= 0 && w[j] > ranks[i].heat)
+				ranks[i].heat = w[j];
+		}
+	}
+
+	qsort(ranks, a->nr, sizeof(*ranks), cmp_rank);
+	for (i = 0; i < a->nr; i++)
+		arr[i] = a->arr[ranks[i].idx];
+
+	free(a->arr);
+	a->arr = arr;
+	a->alloc = a->nr;
+	free(ranks);
+	free(w);
+	return 0;
+}
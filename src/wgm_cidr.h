@@ -0,0 +1,35 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_CIDR_H
+#define WGM__WG_CIDR_H
+
+#include "helpers.h"
+
+/*
+ * An IPv4 source prefix and the action the firewall rules take for it.
+ * Actions are opaque to this file, except WGM_CIDR_NONE: no rule, the
+ * packet goes on to the end of the chain.
+ */
+#define WGM_CIDR_NONE	(-1)
+
+struct wgm_cidr {
+	uint32_t	addr;
+	uint8_t		len;
+	int64_t		action;
+};
+
+struct wgm_cidr_array {
+	struct wgm_cidr	*arr;
+	size_t		nr;
+	size_t		alloc;
+};
+
+int wgm_cidr_parse(const char *str, uint32_t *addr, uint8_t *len);
+void wgm_cidr_format(char buf[19], uint32_t addr, uint8_t len);
+int wgm_cidr_array_add(struct wgm_cidr_array *a, uint32_t addr, uint8_t len, int64_t action);
+void wgm_cidr_array_free(struct wgm_cidr_array *a);
+int wgm_cidr_aggregate(struct wgm_cidr_array *a);
+void wgm_cidr_sort(struct wgm_cidr_array *a);
+ssize_t wgm_cidr_lookup(const struct wgm_cidr_array *a, uint32_t addr, uint8_t len);
+int wgm_cidr_order(struct wgm_cidr_array *a, const struct wgm_cidr_array *heat);
+
+#endif /* #ifndef WGM__WG_CIDR_H */
@@ -2,12 +2,27 @@
 
 #include "wgm_conf.h"
 #include "md5.h"
+#include "wgm_trace.h"
+#include "wgm_metrics.h"
+#include "wgm_exec.h"
+#include "wgm_nl.h"
+#include "wgm_cidr.h"
 
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
+#include <strings.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <sys/file.h>
 
+/*
+ * The mark bits wgm owns: fwmarks are handed out from 37000 up to the
+ * mask, and the rules only ever set or match these bits, leaving the
+ * others to whatever else on the host marks packets.
+ */
+#define WGM_FWMARK_MASK		0xffffu
+
 static int get_fwmark_path(char **out, const char *src, const char *ip,
 			   struct wgm_ctx *ctx)
 {
@@ -34,358 +49,2441 @@ static int get_fwmark_path(char **out, const char *src, const char *ip,
 	return 0;
 }
 
-static int generate_fwmark_auto_increment(unsigned *mark, struct wgm_ctx *ctx)
+static int cmp_fwmark(const void *a, const void *b)
 {
-	unsigned tmp;
-	char *fpath;
-	FILE *fp;
+	const struct wgm_fwmark *x = a, *y = b;
 	int ret;
 
-	ret = wgm_asprintf(&fpath, "%s/fwmark.last", ctx->data_dir);
+	ret = strcmp(x->bind_ip, y->bind_ip);
 	if (ret)
 		return ret;
 
-	fp = fopen(fpath, "rb+");
-	if (!fp) {
-		fp = fopen(fpath, "wb");
-		if (!fp) {
-			ret = -errno;
-			wgm_log_err("Failed to create fwmark file '%s': %s\n", fpath, strerror(-ret));
-			return ret;
-		}
+	return strcmp(x->bind_dev, y->bind_dev);
+}
 
-		flock(fileno(fp), LOCK_EX);
-		fprintf(fp, "%u\n", 37000u);
-		fclose(fp);
-		*mark = 37000u;
-		return 0;
-	}
+static const struct wgm_fwmark *wgm_fwmark_cache_find(const struct wgm_fwmark_cache *c,
+						       const char *src, const char *ip)
+{
+	struct wgm_fwmark key;
 
-	flock(fileno(fp), LOCK_EX);
-	if (fscanf(fp, "%u\n", &tmp) != 1) {
-		wgm_log_err("Failed to read fwmark file '%s': Invalid unsigned integer format\n", fpath);
-		fclose(fp);
-		return -EINVAL;
-	}
-	rewind(fp);
-	fprintf(fp, "%u\n", tmp + 1);
-	fclose(fp);
-	*mark = tmp;
-	return 0;
+	if (!c || !c->nr)
+		return NULL;
+
+	strncpyl(key.bind_ip, src, sizeof(key.bind_ip));
+	strncpyl(key.bind_dev, ip, sizeof(key.bind_dev));
+	return bsearch(&key, c->marks, c->nr, sizeof(*c->marks), cmp_fwmark);
 }
 
-static int get_fwmark(unsigned *mark, const char *src, const char *ip,
-		      struct wgm_ctx *ctx)
+static int fwmark_cache_add(struct wgm_fwmark_cache *c, const char *bind_ip,
+			    const char *bind_dev)
 {
-	char *fpath;
-	FILE *fp;
-	int ret;
+	struct wgm_fwmark *marks;
 
-	ret = get_fwmark_path(&fpath, src, ip, ctx);
-	if (ret)
-		return ret;
+	if (c->nr == c->alloc) {
+		size_t n = c->alloc ? c->alloc * 2 : 16;
 
-	fp = fopen(fpath, "rb+");
-	if (!fp) {
-		unsigned tmp_mark = 0;
+		marks = realloc(c->marks, n * sizeof(*marks));
+		if (!marks)
+			return -ENOMEM;
 
-		fp = fopen(fpath, "wb");
-		if (!fp) {
-			ret = -errno;
-			wgm_log_err("Failed to create fwmark file '%s': %s\n", fpath, strerror(-ret));
-			goto out;
-		}
+		c->marks = marks;
+		c->alloc = n;
+	}
 
-		flock(fileno(fp), LOCK_EX);
-		ret = generate_fwmark_auto_increment(&tmp_mark, ctx);
-		if (ret)
-			goto out;
+	memset(&c->marks[c->nr], 0, sizeof(*c->marks));
+	strncpyl(c->marks[c->nr].bind_ip, bind_ip, sizeof(c->marks->bind_ip));
+	strncpyl(c->marks[c->nr].bind_dev, bind_dev, sizeof(c->marks->bind_dev));
+	c->nr++;
+	return 0;
+}
 
-		ret = 0;
-		*mark = tmp_mark;
-		fprintf(fp, "%u\n", tmp_mark);
-		goto out;
-	}
+static int read_fwmark_file(const char *path, unsigned *mark)
+{
+	FILE *fp;
+	int ret = 0;
 
-	flock(fileno(fp), LOCK_EX);
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -errno;
+
+	flock(fileno(fp), LOCK_SH);
 	if (fscanf(fp, "%u\n", mark) != 1) {
-		wgm_log_err("Failed to read fwmark file '%s': Invalid unsigned integer format\n", fpath);
+		wgm_log_err("Failed to read fwmark file '%s': Invalid unsigned integer format\n", path);
 		ret = -EINVAL;
 	}
 
-out:
 	fclose(fp);
-	if (ret)
-		remove(fpath);
-
-	free(fpath);
 	return ret;
 }
 
-static char *get_conf_path(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+/*
+ * Open fwmark.last and lock it, for handing out several marks in a row.
+ * A missing or empty file starts at 37000.
+ */
+static FILE *fwmark_last_open(struct wgm_ctx *ctx, unsigned *next, int *err)
 {
-	char *ret;
-	int err;
+	char *fpath;
+	FILE *fp;
+	int fd;
 
-	err = wgm_asprintf(&ret, "%s/wg_conf", ctx->data_dir);
-	if (err < 0)
+	*err = wgm_asprintf(&fpath, "%s/fwmark.last", ctx->data_dir);
+	if (*err)
 		return NULL;
 
-	err = mkdir_recursive(ret, 0700);
-	if (err) {
-		wgm_log_err("Failed to create directory '%s': %s\n", ret, strerror(-err));
-		free(ret);
+	fd = open(fpath, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	fp = fd >= 0 ? fdopen(fd, "rb+") : NULL;
+	if (!fp) {
+		*err = -errno;
+		wgm_log_err("Failed to open fwmark file '%s': %s\n", fpath, strerror(-*err));
+		if (fd >= 0)
+			close(fd);
+		free(fpath);
 		return NULL;
 	}
 
-	free(ret);
-	err = wgm_asprintf(&ret, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
-	if (err < 0)
-		return NULL;
+	flock(fileno(fp), LOCK_EX);
+	if (fscanf(fp, "%u\n", next) != 1) {
+		fseek(fp, 0, SEEK_END);
+		if (ftell(fp) > 0) {
+			wgm_log_err("Failed to read fwmark file '%s': Invalid unsigned integer format\n", fpath);
+			*err = -EINVAL;
+			fclose(fp);
+			free(fpath);
+			return NULL;
+		}
 
-	return ret;
+		*next = 37000u;
+	}
+
+	free(fpath);
+	return fp;
 }
 
-static int fprint_str_arr(FILE *h, const struct wgm_str_array *arr)
+/*
+ * The fwmark files are shared by every interface. Looking a mark up and
+ * creating it when missing spans fwmark.last and the mark's own file,
+ * so it is done under one lock, <data_dir>/fwmark.lock: concurrent wgm
+ * processes never hand out two marks for one pair, nor read a mark file
+ * that is still being written. It lives outside fwmark/, which a
+ * rollback swaps out. Returns the locked fd, to be closed.
+ */
+static int fwmark_lock(struct wgm_ctx *ctx)
 {
-	size_t i, n = arr->nr;
-	int ret = 0;
+	char *path;
+	int fd, ret;
 
-	for (i = 0; i < n; i++) {
-		ret += fprintf(h, "%s", arr->arr[i]);
-		if (i < n - 1)
-			ret += fprintf(h, ", ");
+	ret = wgm_asprintf(&path, "%s/fwmark.lock", ctx->data_dir);
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		ret = -errno;
+		wgm_log_err("Failed to lock '%s': %s\n", path, strerror(-ret));
+		if (fd >= 0)
+			close(fd);
+		free(path);
+		return ret;
 	}
 
-	return ret;
+	free(path);
+	return fd;
 }
 
-static int wgm_conf_write_iptables(FILE *h, const struct wgm_iface *iface,
-				   struct wgm_ctx *ctx)
+/*
+ * Create the mark file @path under a temporary name and rename it in
+ * place, so it is never seen empty.
+ */
+static int write_fwmark_file(const char *path, unsigned mark)
 {
-	size_t i, j;
+	char *tmp;
+	FILE *fp;
+	int ret;
 
-	fprintf(h, "\n");
+	ret = wgm_asprintf(&tmp, "%s.tmp", path);
+	if (ret)
+		return ret;
+
+	fp = fopen(tmp, "wb");
+	if (!fp) {
+		ret = -errno;
+		goto out;
+	}
 
-	fprintf(h, "PostUp   = (iptables -t nat -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t nat -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t nat -I POSTROUTING -j wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t nat -D POSTROUTING -j wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t nat -F wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t nat -X wgm_%s\n", iface->ifname);
+	fprintf(fp, "%u\n", mark);
+	if (fclose(fp) || rename(tmp, path))
+		ret = -errno;
 
-	fprintf(h, "\n");
+out:
+	if (ret) {
+		wgm_log_err("Failed to create fwmark file '%s': %s\n", path, strerror(-ret));
+		remove(tmp);
+	}
+	free(tmp);
+	return ret;
+}
 
-	fprintf(h, "PostUp   = (iptables -t filter -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t filter -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t filter -I FORWARD -j wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t filter -D FORWARD -j wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t filter -F wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t filter -X wgm_%s\n", iface->ifname);
+static int fwmark_check_free(unsigned mark)
+{
+	if (mark <= WGM_FWMARK_MASK)
+		return 0;
 
-	fprintf(h, "\n");
+	wgm_log_err("Error: No fwmark left, all of 37000 to %u are in use\n", WGM_FWMARK_MASK);
+	return -ENOSPC;
+}
 
-	fprintf(h, "PostUp   = (iptables -t mangle -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = (iptables -t mangle -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
-	fprintf(h, "PostUp   = iptables -t mangle -A PREROUTING -j wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t mangle -D PREROUTING -j wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t mangle -F wgm_%s\n", iface->ifname);
-	fprintf(h, "PostDown = iptables -t mangle -X wgm_%s\n", iface->ifname);
+static int get_fwmark(unsigned *mark, const char *src, const char *ip,
+		      struct wgm_ctx *ctx)
+{
+	const struct wgm_fwmark *cached;
+	int lock_fd, ret;
+	char *fpath;
+	FILE *last;
 
-	for (i = 0; i < iface->peers.nr; i++) {
-		const struct wgm_peer *peer = &iface->peers.peers[i];
+	cached = wgm_fwmark_cache_find(ctx->fwmarks, src, ip);
+	if (cached) {
+		*mark = cached->mark;
+		return 0;
+	}
 
-		if (peer->allowed_ips.nr)
-			fprintf(h, "\n### Start for peer %s\n", peer->public_key);
+	ret = get_fwmark_path(&fpath, src, ip, ctx);
+	if (ret)
+		return ret;
 
-		for (j = 0; j < peer->allowed_ips.nr; j++) {
-			const char *src = peer->allowed_ips.arr[j];
-			unsigned mark;
-			int ret;
-
-			fprintf(h, "PostUp   = iptables -t filter -A wgm_%s -s %s -j ACCEPT\n", iface->ifname, src);
-			if (peer->bind_ip[0]) {
-				ret = get_fwmark(&mark, peer->bind_ip, peer->bind_dev, ctx);
-				if (ret)
-					return ret;
-				fprintf(h, "PostUp   = iptables -t mangle -A wgm_%s -s %s -j MARK --set-mark %u\n", iface->ifname, src, mark);
-				fprintf(h, "PostUp   = iptables -t nat -A wgm_%s -s %s -j SNAT --to %s\n", iface->ifname, src, peer->bind_ip);
-				fprintf(h, "PostUp   = ip rule add fwmark %u lookup %u\n", mark, mark);
-				fprintf(h, "PostDown = ip rule del fwmark %u lookup %u\n", mark, mark);
-				fprintf(h, "PostUp   = ip route replace default dev %s table %u\n", peer->bind_dev, mark);
-			}
-		}
+	lock_fd = fwmark_lock(ctx);
+	if (lock_fd < 0) {
+		free(fpath);
+		return lock_fd;
+	}
 
-		/*
-		 * Repeat the loop for any client who doesn't have a bind IP.
-		 * MASQUERADE must be placed at the end, so the loop needs to
-		 * be repeated.
-		 */
-		for (j = 0; j < peer->allowed_ips.nr; j++) {
-			const char *src = peer->allowed_ips.arr[j];
+	ret = read_fwmark_file(fpath, mark);
+	if (ret != -ENOENT)
+		goto out;
 
-			if (!peer->bind_ip[0])
-				fprintf(h, "PostUp   = iptables -t nat -A wgm_%s -s %s -j MASQUERADE\n", iface->ifname, src);
-		}
+	last = fwmark_last_open(ctx, mark, &ret);
+	if (!last)
+		goto out;
 
-		if (peer->allowed_ips.nr)
-			fprintf(h, "### End for peer %s\n", peer->public_key);
+	ret = fwmark_check_free(*mark);
+	if (!ret)
+		ret = write_fwmark_file(fpath, *mark);
+	if (!ret) {
+		rewind(last);
+		fprintf(last, "%u\n", *mark + 1);
 	}
+	if (fclose(last) && !ret)
+		ret = -errno;
 
-	fprintf(h, "\n");
-	fprintf(h, "PostUp   = iptables -t nat -A wgm_%s -j RETURN\n", iface->ifname);
-	fprintf(h, "PostUp   = iptables -t filter -A wgm_%s -j RETURN\n", iface->ifname);
-	fprintf(h, "PostUp   = iptables -t mangle -A wgm_%s -j RETURN\n", iface->ifname);
-	return 0;
+out:
+	close(lock_fd);
+	free(fpath);
+	return ret;
 }
 
-static int wgm_conf_write(FILE *h, const struct wgm_iface *iface,
-			  struct wgm_ctx *ctx)
+/*
+ * Fill @c with the (bind IP, bind device) pairs used by @ifaces, sorted
+ * and without duplicates.
+ */
+static int fwmark_cache_collect(struct wgm_fwmark_cache *c,
+				const struct wgm_iface *const *ifaces, size_t nr)
 {
-	size_t i, n;
-	int ret;
+	size_t i, j, k;
+	int ret = 0;
 
-	fprintf(h, "[Interface]\n");
-	fprintf(h, "ListenPort = %hu\n", iface->listen_port);
-	fprintf(h, "PrivateKey = %s\n", iface->private_key);
-	n = iface->addresses.nr;
-	fprintf(h, "Address = ");
-	for (i = 0; i < n; i++) {
-		fprintf(h, "%s", iface->addresses.arr[i]);
-		if (i < n - 1)
-			fprintf(h, ",");
+	for (i = 0; i < nr && !ret; i++) {
+		for (j = 0; j < ifaces[i]->peers.nr && !ret; j++) {
+			const struct wgm_peer *peer = &ifaces[i]->peers.peers[j];
+
+			if (!peer->bind_ip[0] || !peer->allowed_ips.nr)
+				continue;
+
+			ret = fwmark_cache_add(c, peer->bind_ip, peer->bind_dev);
+		}
 	}
-	fprintf(h, "\n");
-	ret = wgm_conf_write_iptables(h, iface, ctx);
+
 	if (ret)
 		return ret;
 
-	n = iface->peers.nr;
-	for (i = 0; i < n; i++) {
-		const struct wgm_peer *peer = &iface->peers.peers[i];
+	if (c->nr)
+		qsort(c->marks, c->nr, sizeof(*c->marks), cmp_fwmark);
 
-		fprintf(h, "\n[Peer]\n");
-		fprintf(h, "PublicKey = %s\n", peer->public_key);
-		fprintf(h, "AllowedIPs = ");
-		fprint_str_arr(h, &peer->allowed_ips);
-		fprintf(h, "\n");
-		if (peer->endpoint[0])
-			fprintf(h, "Endpoint = %s\n", peer->endpoint);
-		if (peer->bind_ip[0])
-			fprintf(h, "# -- -- BindIP = %s\n", peer->bind_ip);
+	for (i = 0, k = 0; i < c->nr; i++) {
+		if (k && !cmp_fwmark(&c->marks[k - 1], &c->marks[i]))
+			continue;
+		c->marks[k++] = c->marks[i];
 	}
-
+	c->nr = k;
 	return 0;
 }
 
-int wgm_conf_restart_if_changed(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+/*
+ * Resolve the fwmark of every (bind IP, bind device) pair used by
+ * @ifaces in one pass and keep them in @ctx->fwmarks, so rendering the
+ * interfaces later does not touch the fwmark files at all. Marks that
+ * do not exist yet are allocated with the fwmark lock taken once,
+ * instead of once per mark.
+ */
+int wgm_conf_alloc_fwmarks(struct wgm_ctx *ctx, const struct wgm_iface *const *ifaces,
+			   size_t nr)
 {
-	char *path1, *path2;
-	int ret;
+	struct wgm_fwmark_cache *c;
+	int lock_fd = -1, ret;
+	FILE *last = NULL;
+	unsigned next = 0;
+	char *fpath;
+	size_t i;
 
-	ret = wgm_asprintf(&path1, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
-	if (ret)
-		return ret;
+	c = calloc(1, sizeof(*c));
+	if (!c) {
+		wgm_log_err("Error: wgm_conf_alloc_fwmarks: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
 
-	ret = wgm_asprintf(&path2, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
+	ret = fwmark_cache_collect(c, ifaces, nr);
 	if (ret) {
-		free(path1);
-		return ret;
+		wgm_log_err("Error: wgm_conf_alloc_fwmarks: Failed to allocate memory\n");
+		goto out;
 	}
 
-	if (!wgm_cmp_file_md5(path1, path2)) {
-		printf("Configuration file '%s' has changed, restarting...\n", path1);
-		ret = wgm_conf_down(iface, ctx);
+	for (i = 0; i < c->nr; i++) {
+		struct wgm_fwmark *m = &c->marks[i];
+
+		ret = get_fwmark_path(&fpath, m->bind_ip, m->bind_dev, ctx);
 		if (ret)
 			goto out;
 
-		ret = wgm_copy_file(path1, path2);
-		if (ret < 0) {
-			wgm_log_err("Failed to copy file '%s' to '%s'\n", path1, path2);
-			goto out;
+		if (lock_fd < 0) {
+			lock_fd = fwmark_lock(ctx);
+			if (lock_fd < 0) {
+				ret = lock_fd;
+				free(fpath);
+				goto out;
+			}
+		}
+
+		ret = read_fwmark_file(fpath, &m->mark);
+		if (ret != -ENOENT) {
+			free(fpath);
+			if (ret)
+				goto out;
+			continue;
+		}
+
+		ret = 0;
+		if (!last) {
+			last = fwmark_last_open(ctx, &next, &ret);
+			if (!last) {
+				free(fpath);
+				goto out;
+			}
 		}
 
-		ret = wgm_conf_up(iface, ctx);
+		m->mark = next;
+		ret = fwmark_check_free(m->mark);
+		if (!ret)
+			ret = write_fwmark_file(fpath, m->mark);
+		free(fpath);
+		if (ret)
+			goto out;
+		next++;
 	}
 
 out:
-	free(path1);
-	free(path2);
-	return ret;
-}
+	if (last) {
+		rewind(last);
+		fprintf(last, "%u\n", next);
+		fclose(last);
+	}
+	if (lock_fd >= 0)
+		close(lock_fd);
 
-int wgm_conf_save(const struct wgm_iface *iface, struct wgm_ctx *ctx)
-{
-	char *path = get_conf_path(iface, ctx);
-	FILE *fp;
-	int ret;
+	if (ret) {
+		free(c->marks);
+		free(c);
+		return ret;
+	}
 
-	if (!path)
-		return -ENOMEM;
+	wgm_conf_free_fwmarks(ctx);
+	ctx->fwmarks = c;
+	return 0;
+}
 
-	fp = fopen(path, "wb");
-	if (!fp) {
-		free(path);
-		return -ENOMEM;
-	}
+void wgm_conf_free_fwmarks(struct wgm_ctx *ctx)
+{
+	if (!ctx->fwmarks)
+		return;
 
-	ret = wgm_conf_write(fp, iface, ctx);
-	free(path);
-	fclose(fp);
-	return ret;
+	free(ctx->fwmarks->marks);
+	free(ctx->fwmarks);
+	ctx->fwmarks = NULL;
 }
 
-int wgm_conf_up(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+/*
+ * The fwmarks of @iface for a dry run, in @ctx->fwmarks like
+ * wgm_conf_alloc_fwmarks() but without touching the fwmark files: marks
+ * not allocated yet get the ones fwmark.last would hand out next.
+ */
+static int wgm_conf_plan_fwmarks(struct wgm_ctx *ctx, const struct wgm_iface *iface)
 {
-	const char *wqc = ctx->wg_quick_path;
-	char *path1, *path2, *cmd;
+	struct wgm_fwmark_cache *c;
+	unsigned next = 37000u;
+	char *fpath;
+	size_t i;
 	int ret;
 
-	ret = wgm_asprintf(&path1, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
+	c = calloc(1, sizeof(*c));
+	if (!c)
+		return -ENOMEM;
+
+	ret = fwmark_cache_collect(c, &iface, 1);
 	if (ret)
-		return ret;
+		goto out;
 
-	ret = wgm_asprintf(&path2, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
-	if (ret) {
-		free(path1);
-		return ret;
-	}
+	ret = wgm_asprintf(&fpath, "%s/fwmark.last", ctx->data_dir);
+	if (ret)
+		goto out;
 
-	if (!wgm_cmp_file_md5(path1, path2)) {
-		printf("Configuration file '%s' has changed, copying it to '%s'\n", path1, path2);
-		ret = wgm_copy_file(path1, path2);
-		if (ret < 0) {
-			wgm_log_err("Failed to copy file '%s' to '%s'\n", path1, path2);
-			free(path1);
-			free(path2);
-			return ret;
+	ret = read_fwmark_file(fpath, &next);
+	free(fpath);
+	if (ret == -ENOENT)
+		ret = 0;
+
+	for (i = 0; i < c->nr && !ret; i++) {
+		struct wgm_fwmark *m = &c->marks[i];
+
+		ret = wgm_asprintf(&fpath, "%s/fwmark/%s-%s.txt", ctx->data_dir,
+				   m->bind_ip, m->bind_dev);
+		if (ret)
+			break;
+
+		ret = read_fwmark_file(fpath, &m->mark);
+		free(fpath);
+		if (ret == -ENOENT) {
+			m->mark = next++;
+			ret = 0;
 		}
 	}
 
-	free(path1);
-	free(path2);
-	ret = wgm_asprintf(&cmd, "%s up '%s'", wqc, iface->ifname);
-	if (ret)
+out:
+	if (ret) {
+		free(c->marks);
+		free(c);
 		return ret;
+	}
 
-	printf("Executing: %s\n", cmd);
-	ret = system(cmd);
-	free(cmd);
-	return ret;
+	wgm_conf_free_fwmarks(ctx);
+	ctx->fwmarks = c;
+	return 0;
 }
 
-int wgm_conf_down(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+static char *get_conf_path(const struct wgm_iface *iface, struct wgm_ctx *ctx)
 {
-	const char *wqc = ctx->wg_quick_path;
-	char *cmd;
-	int ret;
-
-	ret = wgm_asprintf(&cmd, "%s down '%s'", wqc, iface->ifname);
-	if (ret)
-		return ret;
+	char *ret;
+	int err;
 
-	printf("Executing: %s\n", cmd);
-	ret = system(cmd);
-	free(cmd);
+	err = wgm_asprintf(&ret, "%s/wg_conf", ctx->data_dir);
+	if (err < 0)
+		return NULL;
+
+	err = mkdir_recursive(ret, 0700);
+	if (err) {
+		wgm_log_err("Failed to create directory '%s': %s\n", ret, strerror(-err));
+		free(ret);
+		return NULL;
+	}
+
+	free(ret);
+	err = wgm_asprintf(&ret, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
+	if (err < 0)
+		return NULL;
+
+	return ret;
+}
+
+static int fprint_str_arr(FILE *h, const struct wgm_str_array *arr)
+{
+	size_t i, n = arr->nr;
+	int ret = 0;
+
+	for (i = 0; i < n; i++) {
+		ret += fprintf(h, "%s", arr->arr[i]);
+		if (i < n - 1)
+			ret += fprintf(h, ", ");
+	}
+
+	return ret;
+}
+
+/*
+ * Policy routing rules are added with an explicit priority, so PostDown
+ * deletes exactly the rules PostUp added. Marks are shared by every
+ * interface with peers bound to the same (bind IP, bind device), and
+ * the kernel refuses a second identical rule, so every interface gets a
+ * priority of its own from [WGM_RULE_PRIO_BASE, +WGM_RULE_PRIO_SPAN):
+ * below the main table (32766), above the local one (0).
+ *
+ * Priorities are handed out in order from rule_prio.last, under the
+ * fwmark lock, and kept in rule_prio/<dev>.txt. They are never given to
+ * another interface, even once the interface is deleted, as it may
+ * still be running. Neither is part of a snapshot: a rollback must not
+ * hand out again a priority a running interface holds.
+ */
+#define WGM_RULE_PRIO_BASE	10000u
+#define WGM_RULE_PRIO_SPAN	20000u
+
+static int get_rule_prio(unsigned *prio, const char *ifname, struct wgm_ctx *ctx)
+{
+	char *dir = NULL, *path = NULL, *last = NULL;
+	int lock_fd = -1, ret;
+	unsigned next;
+
+	ret = wgm_asprintf(&dir, "%s/rule_prio", ctx->data_dir);
+	if (!ret)
+		ret = wgm_asprintf(&path, "%s/%s.txt", dir, ifname);
+	if (!ret)
+		ret = wgm_asprintf(&last, "%s/rule_prio.last", ctx->data_dir);
+	if (ret)
+		goto out;
+
+	/*
+	 * The files are renamed in place, so the common case of a
+	 * priority that exists needs no lock.
+	 */
+	ret = read_fwmark_file(path, prio);
+	if (ret != -ENOENT)
+		goto out;
+
+	if (!ctx->plan) {
+		ret = mkdir_recursive(dir, 0700);
+		if (ret) {
+			wgm_log_err("Failed to create directory '%s': %s\n", dir, strerror(-ret));
+			goto out;
+		}
+
+		lock_fd = fwmark_lock(ctx);
+		if (lock_fd < 0) {
+			ret = lock_fd;
+			goto out;
+		}
+
+		ret = read_fwmark_file(path, prio);
+		if (ret != -ENOENT)
+			goto out;
+	}
+
+	ret = read_fwmark_file(last, &next);
+	if (ret == -ENOENT) {
+		next = WGM_RULE_PRIO_BASE;
+		ret = 0;
+	}
+	if (ret)
+		goto out;
+
+	if (next < WGM_RULE_PRIO_BASE || next >= WGM_RULE_PRIO_BASE + WGM_RULE_PRIO_SPAN) {
+		wgm_log_err("Error: No rule priority left for '%s' in [%u, %u)\n", ifname,
+			    WGM_RULE_PRIO_BASE, WGM_RULE_PRIO_BASE + WGM_RULE_PRIO_SPAN);
+		ret = -ENOSPC;
+		goto out;
+	}
+
+	*prio = next;
+	if (ctx->plan)
+		goto out;
+
+	ret = write_fwmark_file(path, next);
+	if (!ret)
+		ret = write_fwmark_file(last, next + 1);
+
+out:
+	if (lock_fd >= 0)
+		close(lock_fd);
+	free(dir);
+	free(path);
+	free(last);
+	return ret;
+}
+
+struct wgm_route_mark {
+	unsigned	mark;
+	const char	*bind_dev;
+};
+
+static int cmp_route_mark(const void *a, const void *b)
+{
+	const struct wgm_route_mark *x = a, *y = b;
+
+	return (x->mark > y->mark) - (x->mark < y->mark);
+}
+
+/*
+ * One rule and one route per distinct mark of the interface, however
+ * many peers and allowed IPs use it: the rule list is walked for every
+ * routed packet. Returns the number of distinct marks, left at the
+ * start of @marks.
+ */
+static size_t wgm_conf_write_routing(FILE *h, struct wgm_route_mark *marks, size_t nr,
+				     unsigned prio)
+{
+	size_t i, k;
+
+	if (!nr)
+		return 0;
+
+	qsort(marks, nr, sizeof(*marks), cmp_route_mark);
+	for (i = 0, k = 0; i < nr; i++) {
+		if (k && marks[k - 1].mark == marks[i].mark)
+			continue;
+		marks[k++] = marks[i];
+	}
+
+	fprintf(h, "\n### Policy routing: %zu fwmarks, rule priority %u\n", k, prio);
+	for (i = 0; i < k; i++) {
+		unsigned mark = marks[i].mark;
+
+		fprintf(h, "PostUp   = (ip rule del fwmark %u/0x%x lookup %u priority %u || true) >> /dev/null 2>&1\n",
+			mark, WGM_FWMARK_MASK, mark, prio);
+		fprintf(h, "PostUp   = ip rule add fwmark %u/0x%x lookup %u priority %u\n", mark, WGM_FWMARK_MASK, mark, prio);
+		fprintf(h, "PostUp   = ip route replace default dev %s table %u\n", marks[i].bind_dev, mark);
+		fprintf(h, "PostDown = ip rule del fwmark %u/0x%x lookup %u priority %u\n", mark, WGM_FWMARK_MASK, mark, prio);
+	}
+
+	return k;
+}
+
+/*
+ * With --flowtable on, established flows forwarded through the
+ * interface are offloaded to an nftables flowtable over the interface
+ * and the devices its peers bind to: past their first packets, they
+ * are forwarded from the ingress hook and skip the iptables chains.
+ * Marks and SNAT keep working: a flow is only offloaded once it is
+ * established, on the route its mark chose and with its NAT set up in
+ * conntrack, which the fast path goes on applying.
+ *
+ * Every interface has its own inet wgm_<dev> table, as a device can
+ * only be in one flowtable of a table. The table is created in one
+ * nft transaction; where nft or flowtables are not available, it is
+ * not created and forwarding takes the regular path, PostUp only
+ * reports it.
+ */
+static void wgm_conf_write_flowtable(FILE *h, const struct wgm_iface *iface,
+				     const struct wgm_route_mark *marks, size_t nr)
+{
+	const char *dev = iface->ifname;
+	size_t i, j;
+
+	fprintf(h, "\n### Flowtable offload\n");
+	fprintf(h, "PostUp   = (nft delete table inet wgm_%s || true) >> /dev/null 2>&1\n", dev);
+	fprintf(h, "PostUp   = nft 'add table inet wgm_%s; add flowtable inet wgm_%s ft { hook ingress priority 0; devices = { \"%s\"", dev, dev, dev);
+	for (i = 0; i < nr; i++) {
+		for (j = 0; j < i; j++) {
+			if (!strcmp(marks[j].bind_dev, marks[i].bind_dev))
+				break;
+		}
+
+		if (j == i && strcmp(marks[i].bind_dev, dev))
+			fprintf(h, ", \"%s\"", marks[i].bind_dev);
+	}
+	fprintf(h, " }; }; add chain inet wgm_%s forward { type filter hook forward priority 0; policy accept; }; ", dev);
+	fprintf(h, "add rule inet wgm_%s forward iifname \"%s\" ct state established flow add @ft; ", dev, dev);
+	fprintf(h, "add rule inet wgm_%s forward oifname \"%s\" ct state established flow add @ft' ", dev, dev);
+	fprintf(h, "|| echo 'wgm: flowtable offload unavailable on %s, forwarding without it' >&2\n", dev);
+	fprintf(h, "PostDown = (nft delete table inet wgm_%s || true) >> /dev/null 2>&1\n", dev);
+}
+
+/*
+ * The per-source rules go through a compiler stage: the sources of each
+ * table are grouped by action (ACCEPT; MARK with the fwmark; SNAT to the
+ * bind IP, or MASQUERADE) and merged into the fewest prefixes that give
+ * every source the action of its longest matching allowed IP, see
+ * wgm_cidr_aggregate(). The prefixes are written longest first, but
+ * for MARK. Once `wgm optimize` has counted the hits of the peers, the
+ * filter and nat prefixes that do not overlap are written hottest
+ * first instead, see wgm_cidr_order().
+ */
+#define WGM_CONF_MASQUERADE	(-2)
+
+static void wgm_conf_write_peer_src(FILE *h, FILE *mangle_h, const struct wgm_iface *iface,
+				    const struct wgm_peer *peer, const char *src,
+				    unsigned mark)
+{
+	fprintf(h, "PostUp   = iptables -w -t filter -A wgm_%s -s %s -j ACCEPT\n", iface->ifname, src);
+	if (peer->bind_ip[0]) {
+		fprintf(mangle_h, "PostUp   = iptables -w -t mangle -A wgm_%s -s %s -j MARK --set-xmark %u/0x%x\n",
+			iface->ifname, src, mark, WGM_FWMARK_MASK);
+		fprintf(h, "PostUp   = iptables -w -t nat -A wgm_%s -s %s -j SNAT --to %s\n", iface->ifname, src, peer->bind_ip);
+	} else {
+		fprintf(h, "PostUp   = iptables -w -t nat -A wgm_%s -s %s -j MASQUERADE\n", iface->ifname, src);
+	}
+}
+
+static int wgm_conf_write_sources(FILE *h, const struct wgm_iface *iface,
+				  const char *table, struct wgm_cidr_array *srcs,
+				  const struct wgm_cidr_array *heat)
+{
+	size_t i, nr_in = 0;
+	char buf[19], ip[19];
+	int ret;
+
+	/*
+	 * Sources without a rule in this table do not count.
+	 */
+	for (i = 0; i < srcs->nr; i++)
+		nr_in += srcs->arr[i].action != WGM_CIDR_NONE;
+
+	ret = wgm_cidr_aggregate(srcs);
+	if (!ret && strcmp(table, "mangle"))
+		ret = wgm_cidr_order(srcs, heat);
+	if (ret) {
+		wgm_log_err("Error: wgm_conf_write_sources: Failed to allocate memory\n");
+		return ret;
+	}
+
+	fprintf(h, "\n### %s: %zu source rules, %zu after aggregation\n", table, nr_in, srcs->nr);
+
+	/*
+	 * MARK does not end the chain: the mark of the last matching rule
+	 * sticks, so there the prefixes go shortest first and a hole clears
+	 * the wgm bits again. Other bits of the mark are left alone.
+	 */
+	if (!strcmp(table, "mangle")) {
+		for (i = srcs->nr; i-- > 0;) {
+			const struct wgm_cidr *c = &srcs->arr[i];
+
+			wgm_cidr_format(buf, c->addr, c->len);
+			fprintf(h, "PostUp   = iptables -w -t mangle -A wgm_%s -s %s -j MARK --set-xmark %u/0x%x\n", iface->ifname, buf,
+				c->action == WGM_CIDR_NONE ? 0u : (unsigned)c->action, WGM_FWMARK_MASK);
+		}
+		return 0;
+	}
+
+	for (i = 0; i < srcs->nr; i++) {
+		const struct wgm_cidr *c = &srcs->arr[i];
+
+		wgm_cidr_format(buf, c->addr, c->len);
+		fprintf(h, "PostUp   = iptables -w -t %s -A wgm_%s -s %s -j ", table, iface->ifname, buf);
+		if (c->action == WGM_CIDR_NONE) {
+			fprintf(h, "RETURN\n");
+		} else if (!strcmp(table, "filter")) {
+			fprintf(h, "ACCEPT\n");
+		} else if (c->action == WGM_CONF_MASQUERADE) {
+			fprintf(h, "MASQUERADE\n");
+		} else {
+			wgm_cidr_format(ip, c->action, 32);
+			fprintf(h, "SNAT --to %s\n", ip);
+		}
+	}
+
+	return 0;
+}
+
+/*
+ * The mangle PREROUTING hook, and with --filter-forward on the filter
+ * FORWARD one, jump to one shared wgm-dispatch chain per table, which
+ * jumps to wgm_<dev> on `-i <dev>` (no interface name makes a wgm_<dev>
+ * chain of that name). A packet only walks the per-source rules of the
+ * interface it came in on, and traffic from elsewhere only the
+ * dispatcher. Every interface adds and removes its own dispatcher rule;
+ * the chain and its hook are created by whichever comes first and left
+ * in place. The hook is appended, so the rules already in it keep
+ * deciding first.
+ *
+ * Creating them is a check then an add, which interfaces brought up at
+ * the same time would race on and hook the chain twice, so it is done
+ * under flock(1) on WGM_DISPATCH_LOCK, whoever runs the hooks.
+ *
+ * nat POSTROUTING cannot match the input interface, so it keeps a jump
+ * per interface; nat chains only see the first packet of a connection.
+ */
+#define WGM_DISPATCH_LOCK	"/run/wgm-dispatch.lock"
+
+static void wgm_conf_write_dispatch(FILE *h, const char *ifname, const char *table,
+				    const char *hook)
+{
+	fprintf(h, "PostUp   = flock " WGM_DISPATCH_LOCK " sh -c '");
+	fprintf(h, "(iptables -w -t %s -N wgm-dispatch || true) >> /dev/null 2>&1; ", table);
+	fprintf(h, "iptables -w -t %s -C %s -j wgm-dispatch >> /dev/null 2>&1 || iptables -w -t %s -A %s -j wgm-dispatch'\n", table, hook, table, hook);
+	fprintf(h, "PostUp   = (iptables -w -t %s -D wgm-dispatch -i %s -j wgm_%s || true) >> /dev/null 2>&1\n", table, ifname, ifname);
+	fprintf(h, "PostUp   = iptables -w -t %s -A wgm-dispatch -i %s -j wgm_%s\n", table, ifname, ifname);
+	fprintf(h, "PostDown = iptables -w -t %s -D wgm-dispatch -i %s -j wgm_%s\n", table, ifname, ifname);
+}
+
+static int wgm_conf_write_iptables(FILE *h, const struct wgm_iface *iface,
+				   struct wgm_ctx *ctx)
+{
+	struct wgm_cidr_array filter = { NULL, 0, 0 }, mangle = { NULL, 0, 0 }, nat = { NULL, 0, 0 };
+	struct wgm_cidr_array heat = { NULL, 0, 0 };
+	struct wgm_route_mark *marks;
+	size_t i, j, nr_marks = 0, late_len = 0;
+	char *late_buf = NULL;
+	unsigned prio = 0;
+	bool connmark;
+	FILE *late;
+	int ret = 0;
+
+	/*
+	 * At most a mark per peer.
+	 */
+	marks = malloc((iface->peers.nr + 1) * sizeof(*marks));
+	if (!marks) {
+		wgm_log_err("Error: wgm_conf_write_iptables: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * The MARK rules of the sources written as is, which go after the
+	 * aggregated ones: in mangle, the last matching rule wins.
+	 */
+	late = open_memstream(&late_buf, &late_len);
+	if (!late) {
+		wgm_log_err("Error: wgm_conf_write_iptables: Failed to allocate memory\n");
+		free(marks);
+		return -ENOMEM;
+	}
+
+	fprintf(h, "\n");
+
+	fprintf(h, "PostUp   = (iptables -w -t nat -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	fprintf(h, "PostUp   = (iptables -w -t nat -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	fprintf(h, "PostUp   = (iptables -w -t nat -I POSTROUTING -j wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	fprintf(h, "PostDown = iptables -w -t nat -D POSTROUTING -j wgm_%s\n", iface->ifname);
+	fprintf(h, "PostDown = iptables -w -t nat -F wgm_%s\n", iface->ifname);
+	fprintf(h, "PostDown = iptables -w -t nat -X wgm_%s\n", iface->ifname);
+
+	fprintf(h, "\n");
+
+	fprintf(h, "PostUp   = (iptables -w -t filter -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	fprintf(h, "PostUp   = (iptables -w -t filter -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	/*
+	 * The filter chain ACCEPTs the sources of the peers, which would
+	 * override a FORWARD policy of DROP: it is only hooked on request.
+	 * Unhooked, it is built all the same and counts nothing.
+	 */
+	if (iface->filter_forward)
+		wgm_conf_write_dispatch(h, iface->ifname, "filter", "FORWARD");
+	fprintf(h, "PostDown = iptables -w -t filter -F wgm_%s\n", iface->ifname);
+	fprintf(h, "PostDown = iptables -w -t filter -X wgm_%s\n", iface->ifname);
+
+	fprintf(h, "\n");
+
+	fprintf(h, "PostUp   = (iptables -w -t mangle -F wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	fprintf(h, "PostUp   = (iptables -w -t mangle -N wgm_%s || true) >> /dev/null 2>&1\n", iface->ifname);
+	wgm_conf_write_dispatch(h, iface->ifname, "mangle", "PREROUTING");
+	fprintf(h, "PostDown = iptables -w -t mangle -F wgm_%s\n", iface->ifname);
+	fprintf(h, "PostDown = iptables -w -t mangle -X wgm_%s\n", iface->ifname);
+
+	/*
+	 * Only the first packets of a connection walk the MARK rules; the
+	 * mark they get is saved to the connection at the end of the chain
+	 * and restored for the rest of it. A connection keeps the mark, and
+	 * so the route, it started with, like it keeps its SNAT address.
+	 */
+	for (i = 0; i < iface->peers.nr; i++) {
+		if (iface->peers.peers[i].bind_ip[0] && iface->peers.peers[i].allowed_ips.nr)
+			break;
+	}
+
+	connmark = i < iface->peers.nr;
+	if (connmark) {
+		fprintf(h, "PostUp   = iptables -w -t mangle -A wgm_%s -m conntrack --ctstate ESTABLISHED,RELATED -j CONNMARK --restore-mark --nfmask 0x%x --ctmask 0x%x\n",
+			iface->ifname, WGM_FWMARK_MASK, WGM_FWMARK_MASK);
+		fprintf(h, "PostUp   = iptables -w -t mangle -A wgm_%s -m conntrack --ctstate ESTABLISHED,RELATED -j RETURN\n", iface->ifname);
+	}
+
+	for (i = 0; i < iface->peers.nr && !ret; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+		int64_t snat = WGM_CONF_MASQUERADE;
+		uint32_t addr;
+		uint8_t len;
+		unsigned mark = 0;
+
+		if (!peer->allowed_ips.nr)
+			continue;
+
+		if (peer->bind_ip[0]) {
+			wgm_trace_begin(ctx, "fwmark");
+			ret = get_fwmark(&mark, peer->bind_ip, peer->bind_dev, ctx);
+			wgm_trace_end(ctx);
+			if (ret)
+				goto out;
+
+			marks[nr_marks].mark = mark;
+			marks[nr_marks].bind_dev = peer->bind_dev;
+			nr_marks++;
+
+			snat = wgm_cidr_parse(peer->bind_ip, &addr, &len) ? WGM_CIDR_NONE : (int64_t)addr;
+		}
+
+		for (j = 0; j < peer->allowed_ips.nr && !ret; j++) {
+			const char *src = peer->allowed_ips.arr[j];
+
+			/*
+			 * What the rule compiler cannot represent (IPv6, names)
+			 * is written as is, with the peer.
+			 */
+			if (snat == WGM_CIDR_NONE || wgm_cidr_parse(src, &addr, &len)) {
+				wgm_conf_write_peer_src(h, late, iface, peer, src, mark);
+				continue;
+			}
+
+			ret = wgm_cidr_array_add(&filter, addr, len, 0);
+			if (!ret)
+				ret = wgm_cidr_array_add(&mangle, addr, len,
+							 peer->bind_ip[0] ? (int64_t)mark : WGM_CIDR_NONE);
+			if (!ret)
+				ret = wgm_cidr_array_add(&nat, addr, len, snat);
+			if (!ret && peer->hits)
+				ret = wgm_cidr_array_add(&heat, addr, len,
+							 (int64_t)(peer->hits / peer->allowed_ips.nr));
+		}
+	}
+
+	if (ret) {
+		wgm_log_err("Error: wgm_conf_write_iptables: Failed to allocate memory\n");
+		goto out;
+	}
+
+	wgm_trace_begin(ctx, "aggregate");
+	ret = wgm_conf_write_sources(h, iface, "filter", &filter, &heat);
+	if (!ret)
+		ret = wgm_conf_write_sources(h, iface, "mangle", &mangle, &heat);
+	if (!ret && fflush(late))
+		ret = -ENOMEM;
+	if (!ret)
+		fwrite(late_buf, 1, late_len, h);
+	if (!ret)
+		ret = wgm_conf_write_sources(h, iface, "nat", &nat, &heat);
+	wgm_trace_end(ctx);
+	if (ret)
+		goto out;
+
+	if (nr_marks) {
+		wgm_trace_begin(ctx, "rule_prio");
+		ret = get_rule_prio(&prio, iface->ifname, ctx);
+		wgm_trace_end(ctx);
+		if (ret)
+			goto out;
+	}
+
+	nr_marks = wgm_conf_write_routing(h, marks, nr_marks, prio);
+	if (iface->flowtable)
+		wgm_conf_write_flowtable(h, iface, marks, nr_marks);
+
+	fprintf(h, "\n");
+	fprintf(h, "PostUp   = iptables -w -t nat -A wgm_%s -j RETURN\n", iface->ifname);
+	fprintf(h, "PostUp   = iptables -w -t filter -A wgm_%s -j RETURN\n", iface->ifname);
+	if (connmark)
+		fprintf(h, "PostUp   = iptables -w -t mangle -A wgm_%s -j CONNMARK --save-mark --nfmask 0x%x --ctmask 0x%x\n",
+			iface->ifname, WGM_FWMARK_MASK, WGM_FWMARK_MASK);
+	fprintf(h, "PostUp   = iptables -w -t mangle -A wgm_%s -j RETURN\n", iface->ifname);
+out:
+	wgm_cidr_array_free(&filter);
+	wgm_cidr_array_free(&mangle);
+	wgm_cidr_array_free(&nat);
+	wgm_cidr_array_free(&heat);
+	fclose(late);
+	free(late_buf);
+	free(marks);
+	return ret;
+}
+
+/*
+ * The configuration is rendered in two parts: the one `wg` itself
+ * understands (private key, listen port and peers, what `wg-quick strip`
+ * leaves), and the network/firewall part only wg-quick acts on
+ * (addresses and the PostUp/PostDown hooks). The wg-quick file has
+ * both; the wg-only one is what a peer-only reload feeds to
+ * `wg syncconf`.
+ */
+static void wgm_conf_write_wg_iface(FILE *h, const struct wgm_iface *iface)
+{
+	fprintf(h, "[Interface]\n");
+	fprintf(h, "ListenPort = %hu\n", iface->listen_port);
+	fprintf(h, "PrivateKey = %s\n", iface->private_key);
+}
+
+static int wgm_conf_write_net(FILE *h, const struct wgm_iface *iface,
+			      struct wgm_ctx *ctx)
+{
+	size_t i, n;
+
+	n = iface->addresses.nr;
+	fprintf(h, "Address = ");
+	for (i = 0; i < n; i++) {
+		fprintf(h, "%s", iface->addresses.arr[i]);
+		if (i < n - 1)
+			fprintf(h, ",");
+	}
+	fprintf(h, "\n");
+	return wgm_conf_write_iptables(h, iface, ctx);
+}
+
+static void wgm_conf_write_peers(FILE *h, const struct wgm_iface *iface)
+{
+	size_t i, n;
+
+	n = iface->peers.nr;
+	for (i = 0; i < n; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+
+		fprintf(h, "\n[Peer]\n");
+		fprintf(h, "PublicKey = %s\n", peer->public_key);
+		fprintf(h, "AllowedIPs = ");
+		fprint_str_arr(h, &peer->allowed_ips);
+		fprintf(h, "\n");
+		if (peer->endpoint[0])
+			fprintf(h, "Endpoint = %s\n", peer->endpoint);
+		if (peer->bind_ip[0])
+			fprintf(h, "# -- -- BindIP = %s\n", peer->bind_ip);
+	}
+}
+
+static int wgm_conf_write(FILE *h, const struct wgm_iface *iface,
+			  struct wgm_ctx *ctx)
+{
+	int ret;
+
+	wgm_conf_write_wg_iface(h, iface);
+	ret = wgm_conf_write_net(h, iface, ctx);
+	if (ret)
+		return ret;
+
+	wgm_conf_write_peers(h, iface);
+	return 0;
+}
+
+static int wgm_conf_write_wg(FILE *h, const struct wgm_iface *iface)
+{
+	wgm_conf_write_wg_iface(h, iface);
+	wgm_conf_write_peers(h, iface);
+	return 0;
+}
+
+static bool wgm_conf_cmp_md5(const char *f1, const char *f2, struct wgm_ctx *ctx)
+{
+	bool ret;
+
+	wgm_trace_begin(ctx, "md5_cmp");
+	ret = wgm_cmp_file_md5(f1, f2);
+	wgm_trace_end(ctx);
+	return ret;
+}
+
+static ssize_t wgm_conf_copy_file(const char *src, const char *dst, struct wgm_ctx *ctx)
+{
+	uint64_t start = wgm_now_ns();
+	const char *how = NULL;
+	ssize_t ret;
+
+	wgm_trace_begin(ctx, "copy_file");
+	ret = wgm_copy_file(src, dst, &how);
+	wgm_trace_end(ctx);
+	if (ret >= 0)
+		printf("Installed '%s': %zd bytes in %.3f ms (%s)\n", dst, ret,
+		       (wgm_now_ns() - start) / 1e6, how);
+	return ret;
+}
+
+/*
+ * Run @argv through the executor, with @in (if any) on its stdin, and
+ * pass its output on once it has finished.
+ */
+static int wgm_conf_exec(const char * const *argv, const char *name, const char *in,
+			 struct wgm_ctx *ctx)
+{
+	struct wgm_exec_cmd cmd = {
+		.argv = argv,
+		.name = name,
+		.in = in,
+		.in_len = in ? strlen(in) : 0,
+	};
+	int ret;
+
+	fflush(stdout);
+	wgm_trace_begin(ctx, "exec");
+	ret = wgm_exec_run(ctx, &cmd);
+	wgm_trace_end(ctx);
+
+	if (cmd.out_len)
+		fwrite(cmd.out, 1, cmd.out_len, stdout);
+	fflush(stdout);
+	if (cmd.err_len)
+		fwrite(cmd.err, 1, cmd.err_len, stderr);
+
+	if (cmd.timed_out)
+		wgm_log_err("Error: '%s' was killed after %.3f s\n", argv[0], cmd.wall_ns / 1e9);
+	else if (ret > 0)
+		wgm_log_err("Error: '%s' exited with status %d after %.3f s\n", argv[0], ret, cmd.wall_ns / 1e9);
+
+	wgm_exec_cmd_free(&cmd);
+	return ret;
+}
+
+static int wgm_conf_wg_quick(const char *action, const struct wgm_iface *iface,
+			     struct wgm_ctx *ctx)
+{
+	const char *argv[] = { ctx->wg_quick_path, action, iface->ifname, NULL };
+
+	printf("Executing: %s %s %s\n", argv[0], argv[1], argv[2]);
+	return wgm_conf_exec(argv, "wg-quick", NULL, ctx);
+}
+
+/*
+ * A wg-quick configuration file split the way a reload applies it:
+ * @net has the interface settings wg-quick applies itself (addresses,
+ * MTU, listen port, ...), @fw the hooks, and @wg the private key and
+ * peers, which `wg syncconf` can apply to a running interface.
+ */
+struct wgm_conf_parts {
+	char			*net;
+	char			*fw;
+	char			*wg;
+	size_t			net_len;
+	size_t			fw_len;
+	size_t			wg_len;
+	struct wgm_str_array	fw_up;
+	struct wgm_str_array	fw_down;
+	struct wgm_str_array	routes;
+	bool			default_route;
+};
+
+static void wgm_conf_parts_free(struct wgm_conf_parts *p)
+{
+	free(p->net);
+	free(p->fw);
+	free(p->wg);
+	wgm_str_array_free(&p->fw_up);
+	wgm_str_array_free(&p->fw_down);
+	wgm_str_array_free(&p->routes);
+	memset(p, 0, sizeof(*p));
+}
+
+static char *trim(char *str)
+{
+	char *end;
+
+	while (isspace((unsigned char)*str))
+		str++;
+
+	end = str + strlen(str);
+	while (end > str && isspace((unsigned char)end[-1]))
+		*--end = '\0';
+
+	return str;
+}
+
+static int wgm_conf_parts_add_routes(struct wgm_conf_parts *p, const char *val)
+{
+	struct wgm_str_array ips;
+	size_t i;
+	int ret;
+
+	ret = wgm_parse_csv(&ips, val);
+	if (ret)
+		return ret;
+
+	for (i = 0; !ret && i < ips.nr; i++) {
+		const char *slash = strchr(ips.arr[i], '/');
+
+		if (slash && !strcmp(slash, "/0"))
+			p->default_route = true;
+		else if (ips.arr[i][0])
+			ret = wgm_str_array_add(&p->routes, ips.arr[i]);
+	}
+
+	wgm_str_array_free(&ips);
+	return ret;
+}
+
+static int wgm_conf_parse_fp(struct wgm_conf_parts *p, FILE *fp)
+{
+	enum { SEC_NONE, SEC_IFACE, SEC_PEER } sec = SEC_NONE;
+	char *line = NULL, *key, *val, *eq;
+	FILE *net = NULL, *fw = NULL, *wg = NULL;
+	size_t len = 0;
+	int ret = 0;
+
+	memset(p, 0, sizeof(*p));
+	net = open_memstream(&p->net, &p->net_len);
+	fw = open_memstream(&p->fw, &p->fw_len);
+	wg = open_memstream(&p->wg, &p->wg_len);
+	if (!net || !fw || !wg) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (getline(&line, &len, fp) > 0) {
+		key = trim(line);
+		if (!*key || *key == '#')
+			continue;
+
+		if (!strcasecmp(key, "[Interface]")) {
+			sec = SEC_IFACE;
+			continue;
+		}
+
+		if (!strcasecmp(key, "[Peer]")) {
+			sec = SEC_PEER;
+			fprintf(wg, "%s\n", key);
+			continue;
+		}
+
+		eq = strchr(key, '=');
+		if (!eq)
+			continue;
+
+		*eq = '\0';
+		key = trim(key);
+		val = trim(eq + 1);
+
+		if (sec == SEC_PEER) {
+			fprintf(wg, "%s=%s\n", key, val);
+			if (!strcasecmp(key, "AllowedIPs"))
+				ret = wgm_conf_parts_add_routes(p, val);
+		} else if (!strcasecmp(key, "PrivateKey")) {
+			fprintf(wg, "%s=%s\n", key, val);
+		} else if (!strcasecmp(key, "PreUp") || !strcasecmp(key, "PostUp")) {
+			fprintf(fw, "%s=%s\n", key, val);
+			ret = wgm_str_array_add(&p->fw_up, val);
+		} else if (!strcasecmp(key, "PreDown") || !strcasecmp(key, "PostDown")) {
+			fprintf(fw, "%s=%s\n", key, val);
+			ret = wgm_str_array_add(&p->fw_down, val);
+		} else {
+			fprintf(net, "%s=%s\n", key, val);
+		}
+
+		if (ret)
+			break;
+	}
+
+out:
+	if (net && fclose(net) && !ret)
+		ret = -ENOMEM;
+	if (fw && fclose(fw) && !ret)
+		ret = -ENOMEM;
+	if (wg && fclose(wg) && !ret)
+		ret = -ENOMEM;
+
+	free(line);
+	if (ret)
+		wgm_conf_parts_free(p);
+
+	return ret;
+}
+
+static int wgm_conf_parse_parts(struct wgm_conf_parts *p, const char *path)
+{
+	FILE *fp;
+	int ret;
+
+	memset(p, 0, sizeof(*p));
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -errno;
+
+	ret = wgm_conf_parse_fp(p, fp);
+	fclose(fp);
+	return ret;
+}
+
+static bool buf_eq(const char *a, size_t alen, const char *b, size_t blen)
+{
+	return alen == blen && (!alen || !memcmp(a, b, alen));
+}
+
+/*
+ * Classify the difference between the configuration applied (@old) and
+ * the new one as a mask of WGM_CONF_CHANGE_*. Anything wg-quick applies
+ * to the interface itself, or a change of default route, needs a
+ * restart; peers and firewall hooks can be applied in place.
+ */
+static unsigned wgm_conf_classify(const struct wgm_conf_parts *old,
+				  const struct wgm_conf_parts *new)
+{
+	unsigned mask = 0;
+
+	if (!buf_eq(old->net, old->net_len, new->net, new->net_len) ||
+	    old->default_route != new->default_route)
+		mask |= WGM_CONF_CHANGE_IFACE;
+
+	if (!buf_eq(old->fw, old->fw_len, new->fw, new->fw_len))
+		mask |= WGM_CONF_CHANGE_FIREWALL;
+
+	if (!buf_eq(old->wg, old->wg_len, new->wg, new->wg_len))
+		mask |= WGM_CONF_CHANGE_PEERS;
+
+	return mask;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char *const *)a, *(char *const *)b);
+}
+
+/*
+ * `wg syncconf` does not touch routes; add the ones wg-quick would have
+ * added for new allowed IPs (unless already routed through the
+ * interface) and drop the exact routes of removed ones.
+ */
+static void wgm_conf_script_routes(FILE *s, const char *ifname,
+				   struct wgm_str_array *old,
+				   struct wgm_str_array *new)
+{
+	size_t i = 0, j = 0;
+	int cmp;
+
+	qsort(old->arr, old->nr, sizeof(*old->arr), cmp_str);
+	qsort(new->arr, new->nr, sizeof(*new->arr), cmp_str);
+
+	while (i < old->nr || j < new->nr) {
+		if (i == old->nr)
+			cmp = 1;
+		else if (j == new->nr)
+			cmp = -1;
+		else
+			cmp = strcmp(old->arr[i], new->arr[j]);
+
+		if (cmp < 0) {
+			fprintf(s, "ip route del '%s' dev '%s' >/dev/null 2>&1\n",
+				old->arr[i], ifname);
+			i++;
+		} else if (cmp > 0) {
+			fprintf(s, "[ -n \"$(ip route show dev '%s' match '%s' 2>/dev/null)\" ] || ip route add '%s' dev '%s'\n",
+				ifname, new->arr[j], new->arr[j], ifname);
+			j++;
+		} else {
+			i++;
+			j++;
+		}
+	}
+}
+
+static bool str_array_eq(const struct wgm_str_array *a, const struct wgm_str_array *b)
+{
+	size_t i;
+
+	if (a->nr != b->nr)
+		return false;
+
+	for (i = 0; i < a->nr; i++) {
+		if (strcmp(a->arr[i], b->arr[i]))
+			return false;
+	}
+
+	return true;
+}
+
+static const char * const wgm_conf_tables[] = { "filter", "mangle", "nat" };
+
+/*
+ * Split the PostUp hooks of @p into the rules of the wgm_<dev> chain of
+ * each table of wgm_conf_tables, without their `iptables -w -t <table>`,
+ * and all the other hooks.
+ */
+static int wgm_conf_split_rules(const struct wgm_conf_parts *p, const char *ifname,
+				struct wgm_str_array *rules, struct wgm_str_array *other)
+{
+	char prefix[ARRAY_SIZE(wgm_conf_tables)][IFNAMSIZ + 32];
+	size_t i, t, plen[ARRAY_SIZE(wgm_conf_tables)], skip[ARRAY_SIZE(wgm_conf_tables)];
+	int ret = 0;
+
+	for (t = 0; t < ARRAY_SIZE(wgm_conf_tables); t++) {
+		snprintf(prefix[t], sizeof(prefix[t]), "iptables -w -t %s -A wgm_%s ", wgm_conf_tables[t], ifname);
+		plen[t] = strlen(prefix[t]);
+		skip[t] = strlen("iptables -w -t  ") + strlen(wgm_conf_tables[t]);
+	}
+
+	for (i = 0; i < p->fw_up.nr && !ret; i++) {
+		const char *line = p->fw_up.arr[i];
+
+		for (t = 0; t < ARRAY_SIZE(wgm_conf_tables); t++) {
+			if (!strncmp(line, prefix[t], plen[t]))
+				break;
+		}
+
+		if (t < ARRAY_SIZE(wgm_conf_tables))
+			ret = wgm_str_array_add(&rules[t], line + skip[t]);
+		else
+			ret = wgm_str_array_add(other, line);
+	}
+
+	return ret;
+}
+
+static bool str_array_same_set(struct wgm_str_array *a, struct wgm_str_array *b)
+{
+	if (a->nr != b->nr)
+		return false;
+
+	qsort(a->arr, a->nr, sizeof(*a->arr), cmp_str);
+	qsort(b->arr, b->nr, sizeof(*b->arr), cmp_str);
+	return str_array_eq(a, b);
+}
+
+/*
+ * A firewall change that only reorders the rules of the wgm_<dev>
+ * chains, like `wgm optimize` makes, is applied with iptables-restore:
+ * the new content of a chain is swapped in with its table in one
+ * commit, where the PostDown and PostUp hooks would leave the chains
+ * empty, then half filled, in between. Writes the restore input for
+ * the tables whose order changed to @s. Returns 1 for such a change, 0
+ * for any other.
+ */
+static int wgm_conf_script_reorder(FILE *s, const char *ifname,
+				   const struct wgm_conf_parts *old,
+				   const struct wgm_conf_parts *new)
+{
+	struct wgm_str_array old_rules[ARRAY_SIZE(wgm_conf_tables)];
+	struct wgm_str_array new_rules[ARRAY_SIZE(wgm_conf_tables)];
+	struct wgm_str_array old_other, new_other, sorted;
+	size_t i, t;
+	int ret;
+
+	memset(old_rules, 0, sizeof(old_rules));
+	memset(new_rules, 0, sizeof(new_rules));
+	memset(&old_other, 0, sizeof(old_other));
+	memset(&new_other, 0, sizeof(new_other));
+	memset(&sorted, 0, sizeof(sorted));
+
+	if (!str_array_eq(&old->fw_down, &new->fw_down))
+		return 0;
+
+	ret = wgm_conf_split_rules(old, ifname, old_rules, &old_other);
+	if (!ret)
+		ret = wgm_conf_split_rules(new, ifname, new_rules, &new_other);
+	if (ret)
+		goto out;
+
+	if (!str_array_eq(&old_other, &new_other))
+		goto out;
+
+	for (t = 0; t < ARRAY_SIZE(wgm_conf_tables); t++) {
+		if (str_array_eq(&old_rules[t], &new_rules[t])) {
+			wgm_str_array_free(&new_rules[t]);
+			continue;
+		}
+
+		/*
+		 * The new order is still needed; compare a sorted copy.
+		 */
+		wgm_str_array_free(&sorted);
+		ret = wgm_str_array_copy(&sorted, &new_rules[t]);
+		if (ret)
+			goto out;
+
+		if (!str_array_same_set(&old_rules[t], &sorted))
+			goto out;
+	}
+
+	fprintf(s, "set -e\niptables-restore -w --noflush <<'WGM_EOF'\n");
+	for (t = 0; t < ARRAY_SIZE(wgm_conf_tables); t++) {
+		if (!new_rules[t].nr)
+			continue;
+
+		fprintf(s, "*%s\n-F wgm_%s\n", wgm_conf_tables[t], ifname);
+		for (i = 0; i < new_rules[t].nr; i++)
+			fprintf(s, "%s\n", new_rules[t].arr[i]);
+		fprintf(s, "COMMIT\n");
+	}
+	fprintf(s, "WGM_EOF\n");
+	ret = 1;
+
+out:
+	for (t = 0; t < ARRAY_SIZE(wgm_conf_tables); t++) {
+		wgm_str_array_free(&old_rules[t]);
+		wgm_str_array_free(&new_rules[t]);
+	}
+	wgm_str_array_free(&old_other);
+	wgm_str_array_free(&new_other);
+	wgm_str_array_free(&sorted);
+	return ret;
+}
+
+/*
+ * Apply a peer and/or firewall change to a running interface without
+ * restarting it: the old PostDown hooks and the new PostUp hooks are
+ * run to rebuild the wgm_<dev> chains, then the peers are synced.
+ * Existing sessions and the addresses are left alone.
+ */
+static int wgm_conf_reload(const struct wgm_iface *iface, struct wgm_ctx *ctx,
+			   struct wgm_conf_parts *old, struct wgm_conf_parts *new,
+			   unsigned mask)
+{
+	static const char * const sh_argv[] = { "/bin/sh", "-s", NULL };
+	char *script = NULL, *wg_path;
+	bool reorder = false;
+	size_t len = 0, i;
+	FILE *s;
+	int ret;
+
+	ret = wgm_asprintf(&wg_path, "%s/wg_conf/%s.wg", ctx->data_dir, iface->ifname);
+	if (ret)
+		return ret;
+
+	s = open_memstream(&script, &len);
+	if (!s) {
+		free(wg_path);
+		return -ENOMEM;
+	}
+
+	if (mask & WGM_CONF_CHANGE_FIREWALL) {
+		ret = wgm_conf_script_reorder(s, iface->ifname, old, new);
+		if (ret < 0) {
+			fclose(s);
+			free(script);
+			free(wg_path);
+			return ret;
+		}
+		reorder = ret;
+	}
+
+	if ((mask & WGM_CONF_CHANGE_FIREWALL) && !reorder) {
+		for (i = 0; i < old->fw_down.nr; i++)
+			fprintf(s, "%s\n", old->fw_down.arr[i]);
+	}
+
+	fprintf(s, "set -e\n");
+	if ((mask & WGM_CONF_CHANGE_FIREWALL) && !reorder) {
+		for (i = 0; i < new->fw_up.nr; i++)
+			fprintf(s, "%s\n", new->fw_up.arr[i]);
+	}
+
+	if (mask & WGM_CONF_CHANGE_PEERS) {
+		fprintf(s, "'%s' syncconf '%s' '%s'\n", ctx->wg_path, iface->ifname, wg_path);
+		wgm_conf_script_routes(s, iface->ifname, &old->routes, &new->routes);
+	}
+
+	free(wg_path);
+	if (fclose(s)) {
+		free(script);
+		return -ENOMEM;
+	}
+
+	printf("Reloading %s%s%s of '%s' in place\n",
+	       (mask & WGM_CONF_CHANGE_PEERS) ? "peers" : "",
+	       (mask & WGM_CONF_CHANGE_PEERS) && (mask & WGM_CONF_CHANGE_FIREWALL) ? " and " : "",
+	       !(mask & WGM_CONF_CHANGE_FIREWALL) ? "" : reorder ? "firewall rule order" : "firewall rules",
+	       iface->ifname);
+
+	/*
+	 * The hooks are shell commands; the script goes to the shell on
+	 * stdin, which has no length limit unlike `sh -c`.
+	 */
+	ret = wgm_conf_exec(sh_argv, "sh", script, ctx);
+	free(script);
+	return ret;
+}
+
+/*
+ * Bring the running interface in line with its saved configuration.
+ * Only changes to the interface itself (address, MTU, listen port, ...)
+ * restart it; peer and firewall changes are applied in place, so peers
+ * do not all have to handshake again. An interface that is not running
+ * only gets its configuration installed.
+ */
+int wgm_conf_restart_if_changed(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	struct wgm_conf_parts old, new;
+	char *path1, *path2, *sys_path;
+	unsigned mask = WGM_CONF_CHANGE_IFACE;
+	bool running, parsed = false;
+	int ret;
+
+	ret = wgm_asprintf(&path1, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&path2, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
+	if (ret) {
+		free(path1);
+		return ret;
+	}
+
+	if (wgm_conf_cmp_md5(path1, path2, ctx))
+		goto out;
+
+	ret = wgm_asprintf(&sys_path, "/sys/class/net/%s", iface->ifname);
+	if (ret)
+		goto out;
+
+	running = wgm_file_exists(sys_path);
+	free(sys_path);
+	if (!running) {
+		printf("Interface '%s' is not running, installing '%s'\n", iface->ifname, path2);
+		ret = wgm_conf_copy_file(path1, path2, ctx);
+		goto out_copied;
+	}
+
+	/*
+	 * If either file cannot be parsed, fall back to a restart.
+	 */
+	wgm_trace_begin(ctx, "classify");
+	if (!wgm_conf_parse_parts(&old, path2)) {
+		if (!wgm_conf_parse_parts(&new, path1)) {
+			mask = wgm_conf_classify(&old, &new);
+			parsed = true;
+		} else {
+			wgm_conf_parts_free(&old);
+		}
+	}
+	wgm_trace_end(ctx);
+
+	if (parsed) {
+		if (mask && !(mask & WGM_CONF_CHANGE_IFACE)) {
+			uint64_t start = wgm_now_ns();
+
+			ret = wgm_conf_reload(iface, ctx, &old, &new, mask);
+			wgm_metrics_iface_apply(ctx, iface->ifname, wgm_now_ns() - start, !ret);
+		}
+		wgm_conf_parts_free(&new);
+		wgm_conf_parts_free(&old);
+	}
+
+	if (!(mask & WGM_CONF_CHANGE_IFACE)) {
+		if (ret) {
+			wgm_log_err("Error: wgm_conf_restart_if_changed: Failed to reload '%s' in place\n", iface->ifname);
+			goto out;
+		}
+
+		ret = wgm_conf_copy_file(path1, path2, ctx);
+		goto out_copied;
+	}
+
+	printf("Configuration file '%s' has changed, restarting...\n", path1);
+	ret = wgm_conf_down(iface, ctx);
+	if (ret)
+		goto out;
+
+	ret = wgm_conf_copy_file(path1, path2, ctx);
+	if (ret < 0) {
+		wgm_log_err("Failed to copy file '%s' to '%s'\n", path1, path2);
+		goto out;
+	}
+
+	ret = wgm_conf_up(iface, ctx);
+	goto out;
+
+out_copied:
+	if (ret < 0)
+		wgm_log_err("Failed to copy file '%s' to '%s'\n", path1, path2);
+	else
+		ret = 0;
+out:
+	free(path1);
+	free(path2);
+	return ret;
+}
+
+static int md5_path(const char *path, char md5sum[33])
+{
+	FILE *fp;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return -errno;
+
+	wgm_md5_file_hex(fp, md5sum);
+	fclose(fp);
+	return 0;
+}
+
+static bool str_array_has(const struct wgm_str_array *arr, const char *str)
+{
+	size_t i;
+
+	for (i = 0; i < arr->nr; i++) {
+		if (!strcmp(arr->arr[i], str))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * wg_conf/<dev>.digest records what the rendered files were made from:
+ * the interface version and the MD5 of both files, plus the devices
+ * its peers bind to. While the version and the files still match, the
+ * configuration does not need to be rendered again; see
+ * wgm_conf_check_digest().
+ */
+static int wgm_conf_write_digest(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	char conf_md5[33], wg_md5[33];
+	struct wgm_str_array devs;
+	char *conf, *wg, *path;
+	size_t i;
+	FILE *fp;
+	int ret;
+
+	memset(&devs, 0, sizeof(devs));
+	conf = wg = path = NULL;
+	ret = wgm_asprintf(&conf, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
+	if (!ret)
+		ret = wgm_asprintf(&wg, "%s/wg_conf/%s.wg", ctx->data_dir, iface->ifname);
+	if (!ret)
+		ret = wgm_asprintf(&path, "%s/wg_conf/%s.digest", ctx->data_dir, iface->ifname);
+	if (ret)
+		goto out;
+
+	ret = md5_path(conf, conf_md5);
+	if (!ret)
+		ret = md5_path(wg, wg_md5);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < iface->peers.nr && !ret; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+
+		if (!peer->bind_ip[0] || !peer->bind_dev[0] || str_array_has(&devs, peer->bind_dev))
+			continue;
+
+		ret = wgm_str_array_add(&devs, peer->bind_dev);
+	}
+
+	if (ret)
+		goto out;
+
+	ret = wgm_unshare_file(path, false);
+	if (ret)
+		goto out;
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		ret = -errno;
+		wgm_log_err("Failed to create file '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	fprintf(fp, "version %llu\n", (unsigned long long)iface->version);
+	fprintf(fp, "conf %s\n", conf_md5);
+	fprintf(fp, "wg %s\n", wg_md5);
+	for (i = 0; i < devs.nr; i++)
+		fprintf(fp, "bind_dev %s\n", devs.arr[i]);
+
+	if (fclose(fp))
+		ret = -errno;
+
+out:
+	wgm_str_array_free(&devs);
+	free(conf);
+	free(wg);
+	free(path);
+	return ret;
+}
+
+/*
+ * Return 0 if the rendered configuration of @ifname is still the one
+ * made from @version, filling @bind_devs from the digest. -ESTALE if
+ * it has to be rendered again.
+ */
+int wgm_conf_check_digest(struct wgm_ctx *ctx, const char *ifname, uint64_t version,
+			  struct wgm_str_array *bind_devs)
+{
+	char conf_md5[33], wg_md5[33], sum[33];
+	unsigned long long v;
+	char *path, *line = NULL;
+	size_t len = 0;
+	bool has_conf = false, has_wg = false, has_ver = false;
+	FILE *fp;
+	int ret;
+
+	ret = wgm_asprintf(&path, "%s/wg_conf/%s.digest", ctx->data_dir, ifname);
+	if (ret)
+		return ret;
+
+	fp = fopen(path, "rb");
+	free(path);
+	if (!fp)
+		return -ESTALE;
+
+	while (!ret && getline(&line, &len, fp) > 0) {
+		char *val = strchr(line, ' ');
+
+		if (!val)
+			continue;
+
+		*val++ = '\0';
+		val[strcspn(val, "\n")] = '\0';
+		if (!strcmp(line, "version")) {
+			has_ver = sscanf(val, "%llu", &v) == 1 && v == version;
+		} else if (!strcmp(line, "conf") && strlen(val) == 32) {
+			memcpy(conf_md5, val, sizeof(conf_md5));
+			has_conf = true;
+		} else if (!strcmp(line, "wg") && strlen(val) == 32) {
+			memcpy(wg_md5, val, sizeof(wg_md5));
+			has_wg = true;
+		} else if (!strcmp(line, "bind_dev") && !str_array_has(bind_devs, val)) {
+			ret = wgm_str_array_add(bind_devs, val);
+		}
+	}
+
+	free(line);
+	fclose(fp);
+	if (ret)
+		return ret;
+
+	if (!has_ver || !has_conf || !has_wg)
+		goto stale;
+
+	ret = wgm_asprintf(&path, "%s/wg_conf/%s.conf", ctx->data_dir, ifname);
+	if (ret)
+		return ret;
+
+	ret = md5_path(path, sum);
+	free(path);
+	if (ret || memcmp(sum, conf_md5, sizeof(sum)))
+		goto stale;
+
+	ret = wgm_asprintf(&path, "%s/wg_conf/%s.wg", ctx->data_dir, ifname);
+	if (ret)
+		return ret;
+
+	ret = md5_path(path, sum);
+	free(path);
+	if (ret || memcmp(sum, wg_md5, sizeof(sum)))
+		goto stale;
+
+	return 0;
+
+stale:
+	wgm_str_array_free(bind_devs);
+	return -ESTALE;
+}
+
+static int cmp_first_line(const char *a, const char *b)
+{
+	size_t alen = strcspn(a, "\n"), blen = strcspn(b, "\n");
+	int ret;
+
+	ret = memcmp(a, b, alen < blen ? alen : blen);
+	if (ret)
+		return ret;
+
+	return (alen > blen) - (alen < blen);
+}
+
+static int cmp_peer_section(const void *a, const void *b)
+{
+	const char *x = *(char *const *)a, *y = *(char *const *)b;
+	int ret;
+
+	ret = cmp_first_line(x, y);
+	return ret ? ret : strcmp(x, y);
+}
+
+/*
+ * Split the wg part of @p into its [Peer] sections, sorted by their
+ * first line, the public key.
+ */
+static int wgm_conf_split_peers(const struct wgm_conf_parts *p, struct wgm_str_array *peers)
+{
+	static const char sec[] = "[Peer]\n";
+	const char *s, *next;
+	char *str;
+	int ret;
+
+	s = p->wg ? strstr(p->wg, sec) : NULL;
+	while (s) {
+		s += strlen(sec);
+		next = strstr(s, sec);
+		str = strndup(s, next ? (size_t)(next - s) : strlen(s));
+		if (!str)
+			return -ENOMEM;
+
+		ret = wgm_str_array_add(peers, str);
+		free(str);
+		if (ret)
+			return ret;
+
+		s = next;
+	}
+
+	if (peers->nr)
+		qsort(peers->arr, peers->nr, sizeof(*peers->arr), cmp_peer_section);
+
+	return 0;
+}
+
+/*
+ * Count the peers added, removed and changed from @old to @new, both
+ * sorted by wgm_conf_split_peers().
+ */
+static void wgm_conf_diff_peers(const struct wgm_str_array *old, const struct wgm_str_array *new,
+				size_t *added, size_t *removed, size_t *changed)
+{
+	size_t i = 0, j = 0;
+	int c;
+
+	*added = *removed = *changed = 0;
+	while (i < old->nr || j < new->nr) {
+		if (i == old->nr)
+			c = 1;
+		else if (j == new->nr)
+			c = -1;
+		else
+			c = cmp_first_line(old->arr[i], new->arr[j]);
+
+		if (c < 0) {
+			(*removed)++;
+			i++;
+		} else if (c > 0) {
+			(*added)++;
+			j++;
+		} else {
+			if (strcmp(old->arr[i], new->arr[j]))
+				(*changed)++;
+			i++;
+			j++;
+		}
+	}
+}
+
+enum {
+	WGM_PLAN_IPTABLES,
+	WGM_PLAN_NFT,
+	WGM_PLAN_IP_RULE,
+	WGM_PLAN_NR,
+};
+
+static size_t count_str(const char *s, const char *needle)
+{
+	size_t n = 0;
+
+	while ((s = strstr(s, needle))) {
+		s += strlen(needle);
+		n++;
+	}
+
+	return n;
+}
+
+/*
+ * Add the rules the PostUp hook @hook installs to @n: iptables rules
+ * appended or inserted, nft rules, and policy routing rules.
+ */
+static void wgm_conf_count_hook(const char *hook, size_t n[WGM_PLAN_NR])
+{
+	const char *cmd = hook + (*hook == '(');
+
+	/*
+	 * The shared wgm-dispatch setup, see wgm_conf_write_dispatch().
+	 */
+	if (!strncmp(cmd, "flock ", 6) && strchr(cmd, '\'')) {
+		cmd = strchr(cmd, '\'') + 1;
+		cmd += *cmd == '(';
+	}
+
+	if (!strncmp(cmd, "iptables ", 9))
+		n[WGM_PLAN_IPTABLES] += count_str(cmd, " -A ") + count_str(cmd, " -I ");
+	else if (!strncmp(cmd, "nft ", 4))
+		n[WGM_PLAN_NFT] += count_str(cmd, "add rule ");
+	else if (!strncmp(cmd, "ip rule add ", 12))
+		n[WGM_PLAN_IP_RULE]++;
+}
+
+/*
+ * Count the rules of the PostUp hooks only in @new (@added) and only
+ * in @old (@removed), and all of those of @new (@total). A rule moved
+ * to another position counts as neither.
+ */
+static int wgm_conf_diff_hooks(const struct wgm_conf_parts *old, const struct wgm_conf_parts *new,
+			       size_t added[WGM_PLAN_NR], size_t removed[WGM_PLAN_NR],
+			       size_t total[WGM_PLAN_NR])
+{
+	struct wgm_str_array a, b;
+	size_t i = 0, j = 0;
+	int ret, c;
+
+	memset(&a, 0, sizeof(a));
+	memset(&b, 0, sizeof(b));
+	ret = wgm_str_array_copy(&a, &old->fw_up);
+	if (!ret)
+		ret = wgm_str_array_copy(&b, &new->fw_up);
+	if (ret)
+		goto out;
+
+	if (a.nr)
+		qsort(a.arr, a.nr, sizeof(*a.arr), cmp_str);
+	if (b.nr)
+		qsort(b.arr, b.nr, sizeof(*b.arr), cmp_str);
+
+	for (j = 0; j < b.nr; j++)
+		wgm_conf_count_hook(b.arr[j], total);
+
+	j = 0;
+	while (i < a.nr || j < b.nr) {
+		if (i == a.nr)
+			c = 1;
+		else if (j == b.nr)
+			c = -1;
+		else
+			c = strcmp(a.arr[i], b.arr[j]);
+
+		if (c < 0) {
+			wgm_conf_count_hook(a.arr[i++], removed);
+		} else if (c > 0) {
+			wgm_conf_count_hook(b.arr[j++], added);
+		} else {
+			i++;
+			j++;
+		}
+	}
+
+out:
+	wgm_str_array_free(&a);
+	wgm_str_array_free(&b);
+	return ret;
+}
+
+/*
+ * What wgm_conf_restart_if_changed() would do to apply @new over @old,
+ * the configuration installed in wg_conf_path.
+ */
+static int wgm_conf_plan_apply(const struct wgm_iface *iface, struct wgm_ctx *ctx,
+			       const struct wgm_conf_parts *old, const struct wgm_conf_parts *new,
+			       bool parsed)
+{
+	unsigned mask = WGM_CONF_CHANGE_IFACE;
+	char *sys_path, *script = NULL;
+	size_t len = 0;
+	bool running;
+	FILE *s;
+	int ret;
+
+	ret = wgm_asprintf(&sys_path, "/sys/class/net/%s", iface->ifname);
+	if (ret)
+		return ret;
+
+	running = wgm_file_exists(sys_path);
+	free(sys_path);
+	if (parsed)
+		mask = wgm_conf_classify(old, new);
+
+	printf("  apply:          ");
+	if (!running) {
+		printf("install only, '%s' is not running\n", iface->ifname);
+		return 0;
+	}
+
+	if (!mask) {
+		printf("nothing, the configuration applied is the same\n");
+		return 0;
+	}
+
+	if (mask & WGM_CONF_CHANGE_IFACE) {
+		printf("restart (down, then up), every peer handshakes again\n");
+		return 0;
+	}
+
+	if (mask & WGM_CONF_CHANGE_FIREWALL) {
+		s = open_memstream(&script, &len);
+		if (!s)
+			return -ENOMEM;
+
+		ret = wgm_conf_script_reorder(s, iface->ifname, old, new);
+		fclose(s);
+		free(script);
+		if (ret < 0)
+			return ret;
+	}
+
+	printf("in place, %s%s",
+	       (mask & WGM_CONF_CHANGE_PEERS) ? "peers synced" : "",
+	       (mask & WGM_CONF_CHANGE_PEERS) && (mask & WGM_CONF_CHANGE_FIREWALL) ? " and " : "");
+	if (!(mask & WGM_CONF_CHANGE_FIREWALL))
+		printf("\n");
+	else if (ret)
+		printf("firewall rule order swapped with iptables-restore\n");
+	else
+		printf("firewall rebuilt (%zu PostDown and %zu PostUp hooks)\n",
+		       old->fw_down.nr, new->fw_up.nr);
+
+	return 0;
+}
+
+/*
+ * wgm_conf_save() for a dry run: render the configuration of @iface
+ * into memory with the same writers and report what applying it would
+ * change against the one installed, and what saving would write.
+ */
+static int wgm_conf_plan(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	size_t added[WGM_PLAN_NR] = { 0 }, removed[WGM_PLAN_NR] = { 0 }, total[WGM_PLAN_NR] = { 0 };
+	size_t conf_len = 0, wg_len = 0, peers_add, peers_del, peers_mod;
+	struct wgm_str_array old_peers, new_peers;
+	struct wgm_conf_parts old, new;
+	char *conf = NULL, *wg = NULL, *path;
+	bool parsed;
+	FILE *fp;
+	int ret;
+
+	memset(&old, 0, sizeof(old));
+	memset(&new, 0, sizeof(new));
+	memset(&old_peers, 0, sizeof(old_peers));
+	memset(&new_peers, 0, sizeof(new_peers));
+
+	ret = wgm_conf_plan_fwmarks(ctx, iface);
+	if (ret)
+		return ret;
+
+	wgm_trace_begin(ctx, "render");
+	fp = open_memstream(&conf, &conf_len);
+	if (fp) {
+		ret = wgm_conf_write(fp, iface, ctx);
+		if (fclose(fp) && !ret)
+			ret = -ENOMEM;
+	}
+	wgm_trace_end(ctx);
+	wgm_conf_free_fwmarks(ctx);
+	if (!fp)
+		return -ENOMEM;
+	if (ret)
+		goto out;
+
+	fp = open_memstream(&wg, &wg_len);
+	if (!fp) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	ret = wgm_conf_write_wg(fp, iface);
+	if (fclose(fp) && !ret)
+		ret = -ENOMEM;
+	if (ret)
+		goto out;
+
+	fp = fmemopen(conf, conf_len, "rb");
+	if (!fp) {
+		ret = -errno;
+		goto out;
+	}
+
+	ret = wgm_conf_parse_fp(&new, fp);
+	fclose(fp);
+	if (ret)
+		goto out;
+
+	ret = wgm_asprintf(&path, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
+	if (ret)
+		goto out;
+
+	/*
+	 * Nothing installed yet compares as an empty configuration.
+	 */
+	ret = wgm_conf_parse_parts(&old, path);
+	parsed = !ret;
+	free(path);
+
+	ret = wgm_conf_split_peers(&old, &old_peers);
+	if (!ret)
+		ret = wgm_conf_split_peers(&new, &new_peers);
+	if (!ret)
+		ret = wgm_conf_diff_hooks(&old, &new, added, removed, total);
+	if (ret)
+		goto out;
+
+	wgm_conf_diff_peers(&old_peers, &new_peers, &peers_add, &peers_del, &peers_mod);
+
+	printf("Plan for '%s', version %llu -> %llu:\n", iface->ifname,
+	       (unsigned long long)iface->version - 1, (unsigned long long)iface->version);
+	printf("  peers:          +%zu -%zu ~%zu (%zu in total)\n", peers_add, peers_del, peers_mod, new_peers.nr);
+	printf("  iptables rules: +%zu -%zu (%zu in total)\n", added[WGM_PLAN_IPTABLES],
+	       removed[WGM_PLAN_IPTABLES], total[WGM_PLAN_IPTABLES]);
+	printf("  nft rules:      +%zu -%zu (%zu in total)\n", added[WGM_PLAN_NFT],
+	       removed[WGM_PLAN_NFT], total[WGM_PLAN_NFT]);
+	printf("  ip rules:       +%zu -%zu (%zu in total)\n", added[WGM_PLAN_IP_RULE],
+	       removed[WGM_PLAN_IP_RULE], total[WGM_PLAN_IP_RULE]);
+
+	ret = wgm_conf_plan_apply(iface, ctx, &old, &new, parsed);
+	if (ret)
+		goto out;
+
+	printf("  write:          %llu bytes (store %llu, .conf %zu, .wg %zu)\n",
+	       (unsigned long long)(ctx->plan->store_bytes + conf_len + wg_len),
+	       (unsigned long long)ctx->plan->store_bytes, conf_len, wg_len);
+	printf("Nothing was written.\n");
+	ctx->plan->store_bytes = 0;
+
+out:
+	wgm_str_array_free(&old_peers);
+	wgm_str_array_free(&new_peers);
+	wgm_conf_parts_free(&old);
+	wgm_conf_parts_free(&new);
+	free(conf);
+	free(wg);
+	return ret;
+}
+
+static int __wgm_conf_save(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	char *path = get_conf_path(iface, ctx);
+	FILE *fp;
+	int ret;
+
+	if (!path)
+		return -ENOMEM;
+
+	ret = wgm_unshare_file(path, false);
+	if (ret) {
+		free(path);
+		return ret;
+	}
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		free(path);
+		return -ENOMEM;
+	}
+
+	wgm_trace_begin(ctx, "render");
+	ret = wgm_conf_write(fp, iface, ctx);
+	wgm_trace_end(ctx);
+	wgm_trace_begin(ctx, "flush");
+	fclose(fp);
+	wgm_trace_end(ctx);
+	if (!ret)
+		wgm_metrics_iface_state(ctx, iface, path);
+
+	free(path);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&path, "%s/wg_conf/%s.wg", ctx->data_dir, iface->ifname);
+	if (ret)
+		return ret;
+
+	ret = wgm_unshare_file(path, false);
+	if (ret) {
+		free(path);
+		return ret;
+	}
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		ret = -errno;
+		wgm_log_err("Failed to create file '%s': %s\n", path, strerror(-ret));
+		free(path);
+		return ret;
+	}
+
+	wgm_trace_begin(ctx, "render_wg");
+	ret = wgm_conf_write_wg(fp, iface);
+	wgm_trace_end(ctx);
+	if (fclose(fp) && !ret)
+		ret = -errno;
+
+	free(path);
+	if (ret)
+		return ret;
+
+	return wgm_conf_write_digest(iface, ctx);
+}
+
+int wgm_conf_save(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	int ret;
+
+	if (ctx->plan) {
+		wgm_trace_begin(ctx, "plan");
+		ret = wgm_conf_plan(iface, ctx);
+		wgm_trace_end(ctx);
+		return ret;
+	}
+
+	wgm_trace_begin(ctx, "conf_save");
+	ret = __wgm_conf_save(iface, ctx);
+	wgm_trace_end(ctx);
+	return ret;
+}
+
+/*
+ * Run hooks (PostUp/PostDown lines) in one shell, stopping at the first
+ * one that fails, as wg-quick does.
+ */
+static int wgm_conf_run_hooks(const struct wgm_str_array *hooks, struct wgm_ctx *ctx)
+{
+	static const char * const sh_argv[] = { "/bin/sh", "-s", NULL };
+	char *script = NULL;
+	size_t len = 0, i;
+	FILE *s;
+	int ret;
+
+	if (!hooks->nr)
+		return 0;
+
+	s = open_memstream(&script, &len);
+	if (!s)
+		return -ENOMEM;
+
+	fprintf(s, "set -e\n");
+	for (i = 0; i < hooks->nr; i++)
+		fprintf(s, "%s\n", hooks->arr[i]);
+
+	if (fclose(s)) {
+		free(script);
+		return -ENOMEM;
+	}
+
+	ret = wgm_conf_exec(sh_argv, "sh", script, ctx);
+	free(script);
+	return ret;
+}
+
+/*
+ * Bring @iface up over netlink, then run the PostUp hooks of the
+ * installed configuration @path. On -EOPNOTSUPP nothing was changed and
+ * wg-quick may still do it.
+ */
+static int wgm_conf_native_up(const struct wgm_iface *iface, const char *path,
+			      struct wgm_ctx *ctx)
+{
+	struct wgm_conf_parts parts;
+	int ret;
+
+	ret = wgm_conf_parse_parts(&parts, path);
+	if (ret) {
+		wgm_log_err("Error: wgm_conf_up: Failed to read '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	if (parts.default_route) {
+		wgm_conf_parts_free(&parts);
+		return -EOPNOTSUPP;
+	}
+
+	wgm_trace_begin(ctx, "native_up");
+	ret = wgm_nl_up(iface, ctx);
+	if (!ret) {
+		printf("Interface '%s' is up, running %zu PostUp hooks\n", iface->ifname, parts.fw_up.nr);
+		ret = wgm_conf_run_hooks(&parts.fw_up, ctx);
+		if (ret)
+			wgm_nl_down(iface->ifname, ctx);
+	}
+	wgm_trace_end(ctx);
+
+	wgm_conf_parts_free(&parts);
+	return ret;
+}
+
+/*
+ * Bring @iface down over netlink, then run the PostDown hooks of its
+ * installed configuration. A configuration native_up() leaves to
+ * wg-quick returns -EOPNOTSUPP with nothing changed, so that wg-quick
+ * also takes it down and undoes its default route.
+ */
+static int wgm_conf_native_down(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	struct wgm_conf_parts parts;
+	char *path;
+	int ret;
+
+	ret = wgm_asprintf(&path, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
+	if (ret)
+		return ret;
+
+	ret = wgm_conf_parse_parts(&parts, path);
+	if (ret) {
+		wgm_log_err("Error: wgm_conf_down: Failed to read '%s': %s\n", path, strerror(-ret));
+		free(path);
+		return ret;
+	}
+
+	free(path);
+	if (parts.default_route) {
+		wgm_conf_parts_free(&parts);
+		return -EOPNOTSUPP;
+	}
+
+	wgm_trace_begin(ctx, "native_down");
+	ret = wgm_nl_down(iface->ifname, ctx);
+	if (!ret) {
+		printf("Interface '%s' is down, running %zu PostDown hooks\n", iface->ifname, parts.fw_down.nr);
+		ret = wgm_conf_run_hooks(&parts.fw_down, ctx);
+	}
+	wgm_trace_end(ctx);
+
+	wgm_conf_parts_free(&parts);
+	return ret;
+}
+
+/*
+ * Whether to go on with wg-quick after the native path returned @ret.
+ */
+static bool wgm_conf_need_wg_quick(int ret, const char *action,
+				   const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	if (ret != -EOPNOTSUPP)
+		return false;
+
+	if (ctx->bringup == WGM_BRINGUP_NATIVE) {
+		wgm_log_err("Error: wgm_conf_%s: '%s' cannot be brought %s without wg-quick\n", action, iface->ifname, action);
+		return false;
+	}
+
+	return true;
+}
+
+static int __wgm_conf_up(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	char *path1, *path2;
+	int ret;
+
+	ret = wgm_asprintf(&path1, "%s/wg_conf/%s.conf", ctx->data_dir, iface->ifname);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&path2, "%s/%s.conf", ctx->wg_conf_path, iface->ifname);
+	if (ret) {
+		free(path1);
+		return ret;
+	}
+
+	if (!wgm_conf_cmp_md5(path1, path2, ctx)) {
+		printf("Configuration file '%s' has changed, copying it to '%s'\n", path1, path2);
+		ret = wgm_conf_copy_file(path1, path2, ctx);
+		if (ret < 0) {
+			wgm_log_err("Failed to copy file '%s' to '%s'\n", path1, path2);
+			goto out;
+		}
+	}
+
+	/*
+	 * The installed file is what wg-quick would use, so an interface
+	 * brought up either way can be brought down the other way.
+	 */
+	if (ctx->bringup != WGM_BRINGUP_WG_QUICK) {
+		ret = wgm_conf_native_up(iface, path2, ctx);
+		if (!wgm_conf_need_wg_quick(ret, "up", iface, ctx))
+			goto out;
+	}
+
+	ret = wgm_conf_wg_quick("up", iface, ctx);
+out:
+	free(path1);
+	free(path2);
+	return ret;
+}
+
+int wgm_conf_up(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	uint64_t start = wgm_now_ns();
+	int ret;
+
+	wgm_trace_begin(ctx, "conf_up");
+	ret = __wgm_conf_up(iface, ctx);
+	wgm_trace_end(ctx);
+	wgm_metrics_iface_apply(ctx, iface->ifname, wgm_now_ns() - start, !ret);
+	return ret;
+}
+
+int wgm_conf_down(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	int ret = -EOPNOTSUPP;
+
+	wgm_trace_begin(ctx, "conf_down");
+	if (ctx->bringup != WGM_BRINGUP_WG_QUICK)
+		ret = wgm_conf_native_down(iface, ctx);
+	if (ctx->bringup == WGM_BRINGUP_WG_QUICK || wgm_conf_need_wg_quick(ret, "down", iface, ctx))
+		ret = wgm_conf_wg_quick("down", iface, ctx);
+	wgm_trace_end(ctx);
 	return ret;
 }
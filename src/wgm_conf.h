@@ -7,9 +7,45 @@
 #include "wgm_iface.h"
 #include "wgm_peer.h"
 
+/*
+ * What a configuration change touches; see wgm_conf_restart_if_changed().
+ */
+#define WGM_CONF_CHANGE_PEERS		(1u << 0)
+#define WGM_CONF_CHANGE_FIREWALL	(1u << 1)
+#define WGM_CONF_CHANGE_IFACE		(1u << 2)
+
+/*
+ * Fwmarks resolved up front by wgm_conf_alloc_fwmarks(), sorted by
+ * (bind_ip, bind_dev).
+ */
+struct wgm_fwmark {
+	char		bind_ip[16];
+	char		bind_dev[IFNAMSIZ];
+	unsigned	mark;
+};
+
+struct wgm_fwmark_cache {
+	struct wgm_fwmark	*marks;
+	size_t			nr;
+	size_t			alloc;
+};
+
+/*
+ * A dry run, see wgm_conf_save(): the bytes the store files of the
+ * interface would have taken so far.
+ */
+struct wgm_plan {
+	uint64_t	store_bytes;
+};
+
 int wgm_conf_save(const struct wgm_iface *iface, struct wgm_ctx *ctx);
 int wgm_conf_down(const struct wgm_iface *iface, struct wgm_ctx *ctx);
 int wgm_conf_up(const struct wgm_iface *iface, struct wgm_ctx *ctx);
 int wgm_conf_restart_if_changed(const struct wgm_iface *iface, struct wgm_ctx *ctx);
+int wgm_conf_check_digest(struct wgm_ctx *ctx, const char *ifname, uint64_t version,
+			  struct wgm_str_array *bind_devs);
+int wgm_conf_alloc_fwmarks(struct wgm_ctx *ctx, const struct wgm_iface *const *ifaces,
+			   size_t nr);
+void wgm_conf_free_fwmarks(struct wgm_ctx *ctx);
 
 #endif /* #ifndef WGM__WG_CONF_H */
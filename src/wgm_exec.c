@@ -0,0 +1,438 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_exec.h"
+#include "wgm_trace.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <spawn.h>
+#include <unistd.h>
+#include <sys/wait.h>
+
+extern char **environ;
+
+/*
+ * While a command has exited but not been reaped, or a descendant keeps
+ * its pipes open, check on it this often.
+ */
+#define WGM_EXEC_TICK_MS	10
+
+/*
+ * How long the pipes of a command that has exited are still read from;
+ * a daemon it started may hold them open indefinitely.
+ */
+#define WGM_EXEC_DRAIN_NS	(100 * 1000000ull)
+
+enum {
+	PIPE_IN,
+	PIPE_OUT,
+	PIPE_ERR,
+	NR_PIPES,
+};
+
+struct wgm_exec_slot {
+	pid_t		pid;
+	int		fd[NR_PIPES];
+	size_t		in_off;
+	uint64_t	start_ns;
+	uint64_t	exit_ns;
+	uint64_t	deadline_ns;
+	bool		started;
+	bool		exited;
+	bool		done;
+};
+
+static void close_fd(int *fd)
+{
+	if (*fd >= 0) {
+		close(*fd);
+		*fd = -1;
+	}
+}
+
+static int buf_append(char **buf, size_t *len, const char *data, size_t n)
+{
+	char *tmp;
+
+	if (*len + n > WGM_EXEC_MAX_OUTPUT)
+		n = WGM_EXEC_MAX_OUTPUT - *len;
+	if (!n)
+		return 0;
+
+	tmp = realloc(*buf, *len + n + 1);
+	if (!tmp)
+		return -ENOMEM;
+
+	memcpy(tmp + *len, data, n);
+	*len += n;
+	tmp[*len] = '\0';
+	*buf = tmp;
+	return 0;
+}
+
+static int wgm_exec_spawn(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmd,
+			  struct wgm_exec_slot *slot)
+{
+	int in[2] = { -1, -1 }, out[2] = { -1, -1 }, err[2] = { -1, -1 };
+	posix_spawn_file_actions_t fa;
+	posix_spawnattr_t attr;
+	unsigned int timeout;
+	sigset_t sigdef;
+	int ret;
+
+	if ((cmd->in && pipe2(in, O_CLOEXEC)) || pipe2(out, O_CLOEXEC) ||
+	    pipe2(err, O_CLOEXEC)) {
+		ret = -errno;
+		goto out_close;
+	}
+
+	posix_spawn_file_actions_init(&fa);
+	posix_spawnattr_init(&attr);
+	if (cmd->in)
+		posix_spawn_file_actions_adddup2(&fa, in[0], STDIN_FILENO);
+	else
+		posix_spawn_file_actions_addopen(&fa, STDIN_FILENO, "/dev/null", O_RDONLY, 0);
+	posix_spawn_file_actions_adddup2(&fa, out[1], STDOUT_FILENO);
+	posix_spawn_file_actions_adddup2(&fa, err[1], STDERR_FILENO);
+
+	/*
+	 * A process group of its own, so a timeout takes down whatever
+	 * the command started as well.
+	 */
+	posix_spawnattr_setpgroup(&attr, 0);
+	sigemptyset(&sigdef);
+	sigaddset(&sigdef, SIGPIPE);
+	posix_spawnattr_setsigdefault(&attr, &sigdef);
+	posix_spawnattr_setflags(&attr, POSIX_SPAWN_SETPGROUP | POSIX_SPAWN_SETSIGDEF);
+
+	slot->start_ns = wgm_now_ns();
+	ret = -posix_spawnp(&slot->pid, cmd->argv[0], &fa, &attr,
+			    (char * const *)cmd->argv, environ);
+	posix_spawnattr_destroy(&attr);
+	posix_spawn_file_actions_destroy(&fa);
+	if (ret)
+		goto out_close;
+
+	close_fd(&in[0]);
+	close_fd(&out[1]);
+	close_fd(&err[1]);
+	slot->fd[PIPE_IN] = in[1];
+	slot->fd[PIPE_OUT] = out[0];
+	slot->fd[PIPE_ERR] = err[0];
+	if (slot->fd[PIPE_IN] >= 0)
+		fcntl(slot->fd[PIPE_IN], F_SETFL, O_NONBLOCK);
+
+	timeout = cmd->timeout_ms ? cmd->timeout_ms : ctx->exec_timeout_ms;
+	slot->deadline_ns = timeout ? slot->start_ns + timeout * 1000000ull : 0;
+	return 0;
+
+out_close:
+	close_fd(&in[0]);
+	close_fd(&in[1]);
+	close_fd(&out[0]);
+	close_fd(&out[1]);
+	close_fd(&err[0]);
+	close_fd(&err[1]);
+	return ret;
+}
+
+static void wgm_exec_finish(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmd,
+			    struct wgm_exec_slot *slot)
+{
+	size_t i;
+
+	for (i = 0; i < NR_PIPES; i++)
+		close_fd(&slot->fd[i]);
+
+	cmd->wall_ns = wgm_now_ns() - slot->start_ns;
+	slot->done = true;
+	wgm_trace_add(ctx, cmd->name ? cmd->name : "exec", cmd->wall_ns);
+}
+
+static void wgm_exec_reap(struct wgm_exec_cmd *cmd, struct wgm_exec_slot *slot,
+			  bool block)
+{
+	int status;
+	pid_t pid;
+
+	do {
+		pid = waitpid(slot->pid, &status, block ? 0 : WNOHANG);
+	} while (pid < 0 && errno == EINTR);
+
+	if (pid < 0) {
+		cmd->exit_code = -errno;
+		slot->exited = true;
+		slot->exit_ns = wgm_now_ns();
+		return;
+	}
+
+	if (!pid)
+		return;
+
+	if (WIFEXITED(status))
+		cmd->exit_code = WEXITSTATUS(status);
+	else if (WIFSIGNALED(status))
+		cmd->exit_code = 128 + WTERMSIG(status);
+
+	slot->exited = true;
+	slot->exit_ns = wgm_now_ns();
+}
+
+/*
+ * Move data between the pipes of every running command. Returns 0 if
+ * nothing was ready within @timeout_ms.
+ */
+static int wgm_exec_io(struct wgm_exec_cmd *cmds, struct wgm_exec_slot *slots,
+		       size_t nr, int timeout_ms)
+{
+	struct pollfd *pfds;
+	size_t i, j, n = 0;
+	char buf[65536];
+	ssize_t len;
+	int ret;
+
+	pfds = calloc(nr * NR_PIPES, sizeof(*pfds));
+	if (!pfds)
+		return -ENOMEM;
+
+	for (i = 0; i < nr; i++) {
+		if (!slots[i].started || slots[i].done)
+			continue;
+
+		for (j = 0; j < NR_PIPES; j++) {
+			if (slots[i].fd[j] < 0)
+				continue;
+
+			pfds[n].fd = slots[i].fd[j];
+			pfds[n].events = j == PIPE_IN ? POLLOUT : POLLIN;
+			n++;
+		}
+	}
+
+	ret = poll(pfds, n, timeout_ms);
+	if (ret <= 0) {
+		free(pfds);
+		return ret < 0 && errno != EINTR ? -errno : 0;
+	}
+
+	for (i = 0; i < nr; i++) {
+		struct wgm_exec_slot *s = &slots[i];
+		struct wgm_exec_cmd *c = &cmds[i];
+
+		if (!s->started || s->done)
+			continue;
+
+		for (j = 0; j < n; j++) {
+			if (!pfds[j].revents)
+				continue;
+
+			if (pfds[j].fd == s->fd[PIPE_IN]) {
+				len = write(s->fd[PIPE_IN], c->in + s->in_off, c->in_len - s->in_off);
+				if (len > 0)
+					s->in_off += len;
+				if ((len < 0 && errno != EAGAIN) || s->in_off == c->in_len)
+					close_fd(&s->fd[PIPE_IN]);
+			} else if (pfds[j].fd == s->fd[PIPE_OUT] || pfds[j].fd == s->fd[PIPE_ERR]) {
+				bool is_out = pfds[j].fd == s->fd[PIPE_OUT];
+
+				len = read(pfds[j].fd, buf, sizeof(buf));
+				if (len > 0) {
+					if (is_out)
+						buf_append(&c->out, &c->out_len, buf, len);
+					else
+						buf_append(&c->err, &c->err_len, buf, len);
+				} else if (!len || errno != EAGAIN) {
+					close_fd(is_out ? &s->fd[PIPE_OUT] : &s->fd[PIPE_ERR]);
+				}
+			}
+		}
+	}
+
+	free(pfds);
+	return 1;
+}
+
+/*
+ * Run @cmds, at most @max_running (0: no limit) at a time, until all
+ * of them have finished. The results are stored in each command;
+ * see wgm_exec_result().
+ */
+int wgm_exec_run_many(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmds, size_t nr,
+		      unsigned int max_running)
+{
+	struct sigaction sa, old_sa;
+	struct wgm_exec_slot *slots;
+	size_t i, nr_done = 0, next = 0;
+	unsigned int running = 0;
+	uint64_t now, wait_ns;
+	int timeout_ms, ret;
+	bool tick;
+
+	if (!nr)
+		return 0;
+
+	slots = calloc(nr, sizeof(*slots));
+	if (!slots) {
+		wgm_log_err("Error: wgm_exec_run_many: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		memset(slots[i].fd, -1, sizeof(slots[i].fd));
+		cmds[i].exit_code = 0;
+		cmds[i].timed_out = false;
+	}
+
+	if (!max_running)
+		max_running = nr;
+
+	/*
+	 * A command that exits without reading all of its stdin must not
+	 * take us down with SIGPIPE.
+	 */
+	memset(&sa, 0, sizeof(sa));
+	sa.sa_handler = SIG_IGN;
+	sigaction(SIGPIPE, &sa, &old_sa);
+	ret = 0;
+
+	while (nr_done < nr) {
+		while (next < nr && running < max_running) {
+			struct wgm_exec_slot *s = &slots[next];
+			struct wgm_exec_cmd *c = &cmds[next++];
+
+			s->started = true;
+			ret = wgm_exec_spawn(ctx, c, s);
+			if (ret) {
+				wgm_log_err("Error: Failed to run '%s': %s\n", c->argv[0], strerror(-ret));
+				c->exit_code = ret;
+				s->start_ns = wgm_now_ns();
+				s->exited = true;
+				wgm_exec_finish(ctx, c, s);
+				nr_done++;
+				ret = 0;
+				continue;
+			}
+
+			running++;
+		}
+
+		if (!running)
+			continue;
+
+		/*
+		 * Wait for output, the next deadline, or a tick while some
+		 * command is past its pipes.
+		 */
+		now = wgm_now_ns();
+		wait_ns = 1000000000ull;
+		tick = false;
+		for (i = 0; i < nr; i++) {
+			struct wgm_exec_slot *s = &slots[i];
+
+			if (!s->started || s->done)
+				continue;
+
+			if (s->fd[PIPE_OUT] < 0 && s->fd[PIPE_ERR] < 0)
+				tick = true;
+			if (s->deadline_ns) {
+				uint64_t left = s->deadline_ns > now ? s->deadline_ns - now : 0;
+
+				if (left < wait_ns)
+					wait_ns = left;
+			}
+		}
+
+		timeout_ms = wait_ns / 1000000;
+		if (tick && timeout_ms > WGM_EXEC_TICK_MS)
+			timeout_ms = WGM_EXEC_TICK_MS;
+
+		ret = wgm_exec_io(cmds, slots, nr, timeout_ms);
+		if (ret < 0) {
+			wgm_log_err("Error: wgm_exec_run_many: poll failed: %s\n", strerror(-ret));
+			break;
+		}
+
+		now = wgm_now_ns();
+		for (i = 0; i < nr; i++) {
+			struct wgm_exec_slot *s = &slots[i];
+			struct wgm_exec_cmd *c = &cmds[i];
+
+			if (!s->started || s->done)
+				continue;
+
+			if (!s->exited)
+				wgm_exec_reap(c, s, false);
+
+			if (!s->exited && s->deadline_ns && now >= s->deadline_ns) {
+				kill(-s->pid, SIGKILL);
+				c->timed_out = true;
+				wgm_exec_reap(c, s, true);
+			}
+
+			/*
+			 * Output still buffered in the pipes is read before
+			 * the command counts as done.
+			 */
+			if (!s->exited)
+				continue;
+
+			if (!c->timed_out && (s->fd[PIPE_OUT] >= 0 || s->fd[PIPE_ERR] >= 0) &&
+			    now - s->exit_ns < WGM_EXEC_DRAIN_NS)
+				continue;
+
+			wgm_exec_finish(ctx, c, s);
+			nr_done++;
+			running--;
+		}
+	}
+
+	/*
+	 * Only after a poll() failure: do not leave anything behind.
+	 */
+	for (i = 0; i < nr; i++) {
+		if (slots[i].started && !slots[i].done) {
+			if (!slots[i].exited) {
+				kill(-slots[i].pid, SIGKILL);
+				wgm_exec_reap(&cmds[i], &slots[i], true);
+			}
+			wgm_exec_finish(ctx, &cmds[i], &slots[i]);
+		}
+	}
+
+	sigaction(SIGPIPE, &old_sa, NULL);
+	free(slots);
+	return ret < 0 ? ret : 0;
+}
+
+int wgm_exec_run(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmd)
+{
+	int ret;
+
+	ret = wgm_exec_run_many(ctx, cmd, 1, 1);
+	if (ret)
+		return ret;
+
+	return wgm_exec_result(cmd);
+}
+
+/*
+ * 0 if @cmd succeeded, -ETIMEDOUT if it was killed for running too
+ * long, -errno if it could not be run, its exit status otherwise.
+ */
+int wgm_exec_result(const struct wgm_exec_cmd *cmd)
+{
+	if (cmd->timed_out)
+		return -ETIMEDOUT;
+
+	return cmd->exit_code;
+}
+
+void wgm_exec_cmd_free(struct wgm_exec_cmd *cmd)
+{
+	free(cmd->out);
+	free(cmd->err);
+	cmd->out = cmd->err = NULL;
+	cmd->out_len = cmd->err_len = 0;
+}
@@ -0,0 +1,63 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_EXEC_H
+#define WGM__WG_EXEC_H
+
+#include "helpers.h"
+
+/*
+ * Run external tools (wg-quick, wg, the hook scripts) without a shell:
+ * every command is an explicit argv, started with posix_spawnp() (a
+ * vfork-style clone in glibc) in its own process group, with stdout and
+ * stderr captured. Several commands can run at once, each with its own
+ * timeout; a command that runs past it is killed with its whole process
+ * group.
+ */
+struct wgm_exec_cmd {
+	/*
+	 * NULL terminated; argv[0] is looked up in PATH unless it
+	 * contains a '/'.
+	 */
+	const char * const	*argv;
+
+	/*
+	 * Short name for the trace, e.g. "wg-quick"; a string literal.
+	 */
+	const char		*name;
+
+	/*
+	 * Optional data written to the command's stdin, which is
+	 * /dev/null otherwise.
+	 */
+	const char		*in;
+	size_t			in_len;
+
+	/*
+	 * Milliseconds, 0 for ctx->exec_timeout_ms.
+	 */
+	unsigned int		timeout_ms;
+
+	/*
+	 * Results. @exit_code is the exit status, 128 + the signal number
+	 * if the command was killed, or -errno if it could not be run.
+	 */
+	int			exit_code;
+	bool			timed_out;
+	uint64_t		wall_ns;
+	char			*out;
+	size_t			out_len;
+	char			*err;
+	size_t			err_len;
+};
+
+/*
+ * Captured output beyond this is dropped.
+ */
+#define WGM_EXEC_MAX_OUTPUT	(64u << 20)
+
+int wgm_exec_run(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmd);
+int wgm_exec_run_many(struct wgm_ctx *ctx, struct wgm_exec_cmd *cmds, size_t nr,
+		      unsigned int max_running);
+int wgm_exec_result(const struct wgm_exec_cmd *cmd);
+void wgm_exec_cmd_free(struct wgm_exec_cmd *cmd);
+
+#endif /* #ifndef WGM__WG_EXEC_H */
@@ -0,0 +1,854 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_export.h"
+#include "wgm_iface.h"
+#include "wgm_peer.h"
+#include "wgm_json.h"
+#include "wgm_key.h"
+#include "wgm_pool.h"
+
+#include <fcntl.h>
+#include <getopt.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <unistd.h>
+
+/*
+ * wgm peer export writes one client configuration per peer:
+ *
+ *   [Interface]                      [Peer]
+ *   PrivateKey = <--keys-from>       PublicKey = <interface key>
+ *   Address = <peer allowed IPs>     Endpoint = <--endpoint>
+ *   DNS = <--dns>                    AllowedIPs = <interface allowed IPs>
+ *                                    PersistentKeepalive = <--keepalive>
+ *
+ * wgm only stores the public key of a peer, so the private keys come
+ * from --keys-from (one per line, or the output of `wgm keygen`).
+ * Without it the PrivateKey line is left for the client to fill in.
+ *
+ * The peers are split into chunks that worker threads render and write
+ * on their own; in tar mode the chunks are written in order.
+ */
+struct wgm_export_arg {
+	char		ifname[IFNAMSIZ];
+	const char	*keys_from;
+	const char	*output;
+	char		endpoint[256];
+	char		dns[256];
+	uint16_t	keepalive;
+	unsigned int	jobs;
+	bool		all;
+	bool		tar;
+};
+
+static const struct wgm_opt options[] = {
+	#define EXPORT_ARG_DEV		(1ull << 0)
+	{ EXPORT_ARG_DEV,	"dev",		required_argument,	NULL,	'd' },
+
+	#define EXPORT_ARG_ALL		(1ull << 1)
+	{ EXPORT_ARG_ALL,	"all",		no_argument,		NULL,	'A' },
+
+	#define EXPORT_ARG_KEYS_FROM	(1ull << 2)
+	{ EXPORT_ARG_KEYS_FROM,	"keys-from",	required_argument,	NULL,	'k' },
+
+	#define EXPORT_ARG_ENDPOINT	(1ull << 3)
+	{ EXPORT_ARG_ENDPOINT,	"endpoint",	required_argument,	NULL,	'e' },
+
+	#define EXPORT_ARG_DNS		(1ull << 4)
+	{ EXPORT_ARG_DNS,	"dns",		required_argument,	NULL,	'n' },
+
+	#define EXPORT_ARG_KEEPALIVE	(1ull << 5)
+	{ EXPORT_ARG_KEEPALIVE,	"keepalive",	required_argument,	NULL,	'K' },
+
+	#define EXPORT_ARG_OUTPUT	(1ull << 6)
+	{ EXPORT_ARG_OUTPUT,	"output",	required_argument,	NULL,	'o' },
+
+	#define EXPORT_ARG_TAR		(1ull << 7)
+	{ EXPORT_ARG_TAR,	"tar",		no_argument,		NULL,	't' },
+
+	#define EXPORT_ARG_JOBS		(1ull << 8)
+	{ EXPORT_ARG_JOBS,	"jobs",		required_argument,	NULL,	'j' },
+
+	#define EXPORT_ARG_HELP		(1ull << 9)
+	{ EXPORT_ARG_HELP,	"help",		no_argument,		NULL,	'h' },
+};
+
+struct wgm_export_key {
+	uint8_t		pub[WGM_KEY_LEN];
+	uint8_t		priv[WGM_KEY_LEN];
+	bool		used;
+};
+
+struct wgm_export_ent {
+	const struct wgm_peer		*peer;
+	const struct wgm_export_key	*key;
+};
+
+/*
+ * Peers rendered per chunk; a chunk is also the unit of tar output.
+ */
+#define WGM_EXPORT_CHUNK	256
+
+struct wgm_export {
+	const struct wgm_export_arg	*arg;
+	const struct wgm_iface		*iface;
+	struct wgm_export_ent		*ents;
+	size_t				nr;
+	char				server_key[WGM_KEY_B64_LEN + 1];
+	char				endpoint[300];
+	int				dir_fd;
+	time_t				mtime;
+
+	pthread_mutex_t			lock;
+	pthread_cond_t			cond;
+	size_t				next;
+	size_t				written;
+	int				ret;
+};
+
+struct wgm_export_buf {
+	char		*buf;
+	size_t		len;
+	size_t		cap;
+};
+
+static int buf_reserve(struct wgm_export_buf *b, size_t len)
+{
+	size_t cap;
+	char *tmp;
+
+	if (b->len + len <= b->cap)
+		return 0;
+
+	cap = b->cap ? b->cap : 4096;
+	while (cap < b->len + len)
+		cap *= 2;
+
+	tmp = realloc(b->buf, cap);
+	if (!tmp)
+		return -ENOMEM;
+
+	b->buf = tmp;
+	b->cap = cap;
+	return 0;
+}
+
+__attribute__((__format__(printf, 2, 3)))
+static int buf_printf(struct wgm_export_buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	va_start(ap, fmt);
+	n = vsnprintf(NULL, 0, fmt, ap);
+	va_end(ap);
+	if (n < 0)
+		return -EINVAL;
+
+	if (buf_reserve(b, n + 1))
+		return -ENOMEM;
+
+	va_start(ap, fmt);
+	vsnprintf(b->buf + b->len, n + 1, fmt, ap);
+	va_end(ap);
+	b->len += n;
+	return 0;
+}
+
+static int buf_print_str_arr(struct wgm_export_buf *b, const struct wgm_str_array *arr)
+{
+	size_t i;
+	int ret = 0;
+
+	for (i = 0; i < arr->nr && !ret; i++)
+		ret = buf_printf(b, "%s%s", i ? ", " : "", arr->arr[i]);
+
+	return ret;
+}
+
+static void buf_wipe(struct wgm_export_buf *b)
+{
+	if (b->buf)
+		memset(b->buf, 0, b->cap);
+	free(b->buf);
+	memset(b, 0, sizeof(*b));
+}
+
+static int wgm_export_getopt(int argc, char *argv[], struct wgm_export_arg *arg)
+{
+	struct option *long_opt;
+	uint64_t out_args = 0;
+	char *short_opt;
+	char *endptr;
+	unsigned long n;
+	int c, ret;
+
+	ret = wgm_create_getopt_long_args(&long_opt, &short_opt, options,
+					  ARRAY_SIZE(options));
+	if (ret)
+		return ret;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_opt, long_opt, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			if (wgm_iface_opt_get_dev(arg->ifname, sizeof(arg->ifname), optarg)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			out_args |= EXPORT_ARG_DEV;
+			break;
+		case 'A':
+			arg->all = true;
+			out_args |= EXPORT_ARG_ALL;
+			break;
+		case 'k':
+			arg->keys_from = optarg;
+			out_args |= EXPORT_ARG_KEYS_FROM;
+			break;
+		case 'e':
+			if (!*optarg || strlen(optarg) >= sizeof(arg->endpoint)) {
+				wgm_log_err("Error: Invalid endpoint '%s'\n", optarg);
+				ret = -EINVAL;
+				goto out;
+			}
+			strncpyl(arg->endpoint, optarg, sizeof(arg->endpoint));
+			out_args |= EXPORT_ARG_ENDPOINT;
+			break;
+		case 'n':
+			if (strlen(optarg) >= sizeof(arg->dns)) {
+				wgm_log_err("Error: DNS servers are too long, max %zu characters\n",
+					    sizeof(arg->dns) - 1);
+				ret = -EINVAL;
+				goto out;
+			}
+			strncpyl(arg->dns, optarg, sizeof(arg->dns));
+			out_args |= EXPORT_ARG_DNS;
+			break;
+		case 'K':
+			n = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || n > 65535) {
+				wgm_log_err("Error: Invalid keepalive interval (0-65535)\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			arg->keepalive = n;
+			out_args |= EXPORT_ARG_KEEPALIVE;
+			break;
+		case 'o':
+			arg->output = optarg;
+			out_args |= EXPORT_ARG_OUTPUT;
+			break;
+		case 't':
+			arg->tar = true;
+			out_args |= EXPORT_ARG_TAR;
+			break;
+		case 'j':
+			n = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !n || n > 1024) {
+				wgm_log_err("Error: Invalid number of jobs (1-1024)\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			arg->jobs = n;
+			out_args |= EXPORT_ARG_JOBS;
+			break;
+		case 'h':
+			show_usage_export(NULL);
+			ret = -1;
+			goto out;
+		default:
+			wgm_log_err("Error: Invalid option '%c'\n", c);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (!(out_args & EXPORT_ARG_DEV)) {
+		wgm_log_err("Error: Option '--dev' is required\n\n");
+		ret = -EINVAL;
+	} else if (!(out_args & EXPORT_ARG_ENDPOINT)) {
+		wgm_log_err("Error: Option '--endpoint' is required\n\n");
+		ret = -EINVAL;
+	} else if (!(out_args & (EXPORT_ARG_ALL | EXPORT_ARG_KEYS_FROM))) {
+		wgm_log_err("Error: Option '--all' or '--keys-from' is required\n\n");
+		ret = -EINVAL;
+	} else if (!(out_args & EXPORT_ARG_OUTPUT) == !(out_args & EXPORT_ARG_TAR)) {
+		wgm_log_err("Error: Exactly one of '--output' and '--tar' is required\n\n");
+		ret = -EINVAL;
+	}
+
+	if (ret)
+		show_usage_export(NULL);
+
+out:
+	wgm_free_getopt_long_args(long_opt, short_opt);
+	return ret;
+}
+
+static int cmp_key(const void *a, const void *b)
+{
+	const struct wgm_export_key *x = a, *y = b;
+
+	return memcmp(x->pub, y->pub, sizeof(x->pub));
+}
+
+/*
+ * A line of --keys-from is either a base64 private key or a JSON object
+ * with a "private_key" member, as printed by `wgm keygen`.
+ */
+static int parse_key_line(uint8_t priv[WGM_KEY_LEN], const char *line, size_t len)
+{
+	char key[32], val[WGM_KEY_B64_LEN + 2] = "";
+	struct wgm_jparser p;
+	int ret;
+
+	if (*line != '{')
+		return wgm_key_from_base64(priv, line);
+
+	wgm_jp_init(&p, line, len);
+	ret = wgm_jp_obj_begin(&p);
+	while (!ret) {
+		ret = wgm_jp_obj_next(&p, key, sizeof(key));
+		if (ret <= 0)
+			break;
+
+		if (!strcmp(key, "private_key"))
+			ret = wgm_jp_str(&p, val, sizeof(val));
+		else
+			ret = wgm_jp_skip(&p);
+		if (ret > 0)
+			ret = 0;
+	}
+
+	if (!ret)
+		ret = wgm_key_from_base64(priv, val);
+
+	memset(val, 0, sizeof(val));
+	return ret;
+}
+
+static int wgm_export_read_keys(const char *path, struct wgm_export_key **keys_p,
+				size_t *nr_p)
+{
+	uint8_t (*priv)[WGM_KEY_LEN] = NULL, (*pub)[WGM_KEY_LEN] = NULL;
+	struct wgm_export_key *keys = NULL;
+	size_t len = 0, lineno = 0, nr = 0, alloc = 0, i, j;
+	char *line = NULL, *s;
+	ssize_t n;
+	FILE *fp;
+	void *tmp;
+	int ret = 0;
+
+	fp = strcmp(path, "-") ? fopen(path, "rb") : stdin;
+	if (!fp) {
+		ret = -errno;
+		wgm_log_err("Error: Failed to open '%s': %s\n", path, strerror(-ret));
+		return ret;
+	}
+
+	while ((n = getline(&line, &len, fp)) > 0) {
+		lineno++;
+		while (n && isspace((unsigned char)line[n - 1]))
+			line[--n] = '\0';
+
+		s = line;
+		while (isspace((unsigned char)*s))
+			s++;
+		if (!*s)
+			continue;
+
+		if (nr == alloc) {
+			alloc = alloc ? alloc * 2 : 256;
+			tmp = realloc(priv, alloc * sizeof(*priv));
+			if (!tmp) {
+				ret = -ENOMEM;
+				goto out;
+			}
+			priv = tmp;
+		}
+
+		if (parse_key_line(priv[nr], s, line + n - s)) {
+			wgm_log_err("Error: Invalid private key on line %zu of '%s'\n", lineno, path);
+			ret = -EINVAL;
+			goto out;
+		}
+		nr++;
+	}
+
+	if (ferror(fp)) {
+		wgm_log_err("Error: Failed to read '%s'\n", path);
+		ret = -EIO;
+		goto out;
+	}
+
+	pub = malloc((nr ? nr : 1) * sizeof(*pub));
+	keys = calloc(nr ? nr : 1, sizeof(*keys));
+	if (!pub || !keys) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	wgm_key_public_many(pub, (const uint8_t (*)[WGM_KEY_LEN])priv, nr);
+	for (i = 0; i < nr; i++) {
+		memcpy(keys[i].pub, pub[i], WGM_KEY_LEN);
+		memcpy(keys[i].priv, priv[i], WGM_KEY_LEN);
+	}
+
+	/*
+	 * Sorted by public key for the lookups, with duplicates dropped.
+	 */
+	qsort(keys, nr, sizeof(*keys), cmp_key);
+	for (i = j = 0; i < nr; i++) {
+		if (j && !cmp_key(&keys[j - 1], &keys[i]))
+			continue;
+		keys[j++] = keys[i];
+	}
+
+	memset(keys + j, 0, (nr - j) * sizeof(*keys));
+	*keys_p = keys;
+	*nr_p = j;
+	keys = NULL;
+
+out:
+	if (priv)
+		memset(priv, 0, alloc * sizeof(*priv));
+	if (line)
+		memset(line, 0, len);
+	free(keys);
+	free(priv);
+	free(pub);
+	free(line);
+	if (fp != stdin)
+		fclose(fp);
+	if (ret == -ENOMEM)
+		wgm_log_err("Error: wgm_export_read_keys: Failed to allocate memory\n");
+	return ret;
+}
+
+/*
+ * Client configurations are named after the public key of the peer,
+ * in the URL-safe base64 alphabet.
+ */
+static void conf_name(char *name, size_t len, const char *ifname, const char *pubkey)
+{
+	size_t i, off;
+
+	off = ifname ? (size_t)snprintf(name, len, "%s/", ifname) : 0;
+	for (i = 0; pubkey[i] && pubkey[i] != '=' && off + 6 < len; i++) {
+		char c = pubkey[i];
+
+		name[off++] = c == '/' ? '_' : c == '+' ? '-' : c;
+	}
+
+	snprintf(name + off, len - off, ".conf");
+}
+
+static int render_conf(struct wgm_export_buf *b, const struct wgm_export *e,
+		       const struct wgm_export_ent *ent)
+{
+	const struct wgm_export_arg *arg = e->arg;
+	const struct wgm_iface *iface = e->iface;
+	char b64[WGM_KEY_B64_LEN + 1];
+	int ret = 0;
+
+	ret |= buf_printf(b, "[Interface]\n");
+	if (ent->key) {
+		wgm_key_to_base64(b64, ent->key->priv);
+		ret |= buf_printf(b, "PrivateKey = %s\n", b64);
+		memset(b64, 0, sizeof(b64));
+	} else {
+		ret |= buf_printf(b, "# PrivateKey of %s, not known to wgm\n",
+				  ent->peer->public_key);
+	}
+
+	ret |= buf_printf(b, "Address = ");
+	ret |= buf_print_str_arr(b, &ent->peer->allowed_ips);
+	ret |= buf_printf(b, "\n");
+	if (arg->dns[0])
+		ret |= buf_printf(b, "DNS = %s\n", arg->dns);
+
+	ret |= buf_printf(b, "\n[Peer]\n");
+	ret |= buf_printf(b, "PublicKey = %s\n", e->server_key);
+	ret |= buf_printf(b, "Endpoint = %s\n", e->endpoint);
+	ret |= buf_printf(b, "AllowedIPs = ");
+	if (iface->allowed_ips.nr)
+		ret |= buf_print_str_arr(b, &iface->allowed_ips);
+	else
+		ret |= buf_printf(b, "0.0.0.0/0, ::/0");
+	ret |= buf_printf(b, "\n");
+	if (arg->keepalive)
+		ret |= buf_printf(b, "PersistentKeepalive = %hu\n", arg->keepalive);
+
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * One ustar member, padded to the 512-byte block size.
+ */
+static int tar_append(struct wgm_export_buf *b, const char *name, const char *data,
+		      size_t len, time_t mtime)
+{
+	unsigned char *hdr;
+	unsigned int sum = 0;
+	size_t pad, i;
+
+	pad = (512 - len % 512) % 512;
+	if (buf_reserve(b, 512 + len + pad))
+		return -ENOMEM;
+
+	hdr = (unsigned char *)b->buf + b->len;
+	memset(hdr, 0, 512);
+	snprintf((char *)hdr, 100, "%s", name);
+	memcpy(hdr + 100, "0000600", 8);
+	memcpy(hdr + 108, "0000000", 8);
+	memcpy(hdr + 116, "0000000", 8);
+	snprintf((char *)hdr + 124, 12, "%011zo", len);
+	snprintf((char *)hdr + 136, 12, "%011llo", (unsigned long long)mtime);
+	memset(hdr + 148, ' ', 8);
+	hdr[156] = '0';
+	memcpy(hdr + 257, "ustar", 6);
+	memcpy(hdr + 263, "00", 2);
+	for (i = 0; i < 512; i++)
+		sum += hdr[i];
+	snprintf((char *)hdr + 148, 8, "%06o", sum);
+
+	memcpy(b->buf + b->len + 512, data, len);
+	memset(b->buf + b->len + 512 + len, 0, pad);
+	b->len += 512 + len + pad;
+	return 0;
+}
+
+static int write_conf(int dir_fd, const char *name, const char *data, size_t len)
+{
+	ssize_t n;
+	int fd, ret = 0;
+
+	fd = openat(dir_fd, name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if (fd < 0)
+		return -errno;
+
+	while (len) {
+		n = write(fd, data, len);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			ret = -errno;
+			break;
+		}
+		data += n;
+		len -= n;
+	}
+
+	if (close(fd) && !ret)
+		ret = -errno;
+	return ret;
+}
+
+static void wgm_export_set_err(struct wgm_export *e, int ret)
+{
+	pthread_mutex_lock(&e->lock);
+	if (!e->ret)
+		e->ret = ret;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+}
+
+/*
+ * In tar mode a chunk is only written once the chunk before it is, so
+ * the archive lists the peers in interface order.
+ */
+static int wgm_export_write_tar(struct wgm_export *e, size_t start, size_t end,
+				const struct wgm_export_buf *out)
+{
+	int ret;
+
+	pthread_mutex_lock(&e->lock);
+	while (e->written != start && !e->ret)
+		pthread_cond_wait(&e->cond, &e->lock);
+
+	ret = e->ret;
+	if (!ret && fwrite(out->buf, 1, out->len, stdout) != out->len)
+		ret = -EIO;
+
+	e->written = end;
+	pthread_cond_broadcast(&e->cond);
+	pthread_mutex_unlock(&e->lock);
+	return ret;
+}
+
+static void *wgm_export_fn(void *data)
+{
+	struct wgm_export_buf conf = { 0 }, out = { 0 };
+	struct wgm_export *e = data;
+	size_t start, end, i;
+	char name[IFNAMSIZ + 64];
+	int ret = 0;
+
+	while (1) {
+		pthread_mutex_lock(&e->lock);
+		start = e->next;
+		e->next += WGM_EXPORT_CHUNK;
+		if (e->ret)
+			start = e->nr;
+		pthread_mutex_unlock(&e->lock);
+		if (start >= e->nr)
+			break;
+
+		end = start + WGM_EXPORT_CHUNK < e->nr ? start + WGM_EXPORT_CHUNK : e->nr;
+		out.len = 0;
+		for (i = start; i < end; i++) {
+			const struct wgm_export_ent *ent = &e->ents[i];
+
+			conf.len = 0;
+			ret = render_conf(&conf, e, ent);
+			if (ret)
+				break;
+
+			if (e->arg->tar) {
+				conf_name(name, sizeof(name), e->iface->ifname, ent->peer->public_key);
+				ret = tar_append(&out, name, conf.buf, conf.len, e->mtime);
+			} else {
+				conf_name(name, sizeof(name), NULL, ent->peer->public_key);
+				ret = write_conf(e->dir_fd, name, conf.buf, conf.len);
+				if (ret)
+					wgm_log_err("Error: Failed to write '%s/%s': %s\n",
+						    e->arg->output, name, strerror(-ret));
+			}
+			if (ret)
+				break;
+		}
+
+		if (!ret && e->arg->tar)
+			ret = wgm_export_write_tar(e, start, end, &out);
+
+		if (ret) {
+			wgm_export_set_err(e, ret);
+			break;
+		}
+	}
+
+	buf_wipe(&conf);
+	buf_wipe(&out);
+	return NULL;
+}
+
+static int wgm_export_run(struct wgm_export *e, unsigned int nr_threads)
+{
+	static const char tar_end[1024];
+	pthread_t *threads;
+	bool *started;
+	unsigned int i;
+	size_t nr_chunks;
+
+	nr_chunks = (e->nr + WGM_EXPORT_CHUNK - 1) / WGM_EXPORT_CHUNK;
+	if (nr_threads > nr_chunks)
+		nr_threads = nr_chunks ? nr_chunks : 1;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	started = calloc(nr_threads, sizeof(*started));
+	if (!threads || !started) {
+		free(threads);
+		free(started);
+		wgm_log_err("Error: wgm_export_run: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	/*
+	 * The calling thread is one of the workers, and takes over the
+	 * share of any thread that cannot be created.
+	 */
+	for (i = 1; i < nr_threads; i++) {
+		if (!pthread_create(&threads[i], NULL, wgm_export_fn, e))
+			started[i] = true;
+	}
+
+	wgm_export_fn(e);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	free(threads);
+	free(started);
+
+	if (!e->ret && e->arg->tar) {
+		if (fwrite(tar_end, 1, sizeof(tar_end), stdout) != sizeof(tar_end) ||
+		    fflush(stdout))
+			e->ret = -EIO;
+	}
+
+	if (e->ret == -EIO && e->arg->tar)
+		wgm_log_err("Error: Failed to write the tar stream\n");
+	else if (e->ret == -ENOMEM)
+		wgm_log_err("Error: wgm_export_run: Failed to allocate memory\n");
+
+	return e->ret;
+}
+
+/*
+ * --endpoint without a port gets the listen port of the interface.
+ */
+static void format_endpoint(char *dst, size_t len, const char *ep, uint16_t port)
+{
+	const char *colon = strchr(ep, ':');
+
+	if (ep[0] == '[') {
+		if (strstr(ep, "]:"))
+			snprintf(dst, len, "%s", ep);
+		else
+			snprintf(dst, len, "%s:%hu", ep, port);
+	} else if (!colon) {
+		snprintf(dst, len, "%s:%hu", ep, port);
+	} else if (strchr(colon + 1, ':')) {
+		snprintf(dst, len, "[%s]:%hu", ep, port);
+	} else {
+		snprintf(dst, len, "%s", ep);
+	}
+}
+
+static int wgm_export_select(struct wgm_export *e, struct wgm_export_key *keys,
+			     size_t nr_keys)
+{
+	const struct wgm_iface *iface = e->iface;
+	struct wgm_export_key want, *key;
+	size_t i;
+
+	e->ents = calloc(iface->peers.nr ? iface->peers.nr : 1, sizeof(*e->ents));
+	if (!e->ents) {
+		wgm_log_err("Error: wgm_export_select: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < iface->peers.nr; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+
+		key = NULL;
+		if (nr_keys && !wgm_key_from_base64(want.pub, peer->public_key))
+			key = bsearch(&want, keys, nr_keys, sizeof(*keys), cmp_key);
+
+		if (!key && !e->arg->all)
+			continue;
+
+		if (key)
+			key->used = true;
+
+		e->ents[e->nr].peer = peer;
+		e->ents[e->nr].key = key;
+		e->nr++;
+	}
+
+	for (i = 0; i < nr_keys; i++) {
+		char b64[WGM_KEY_B64_LEN + 1];
+
+		if (keys[i].used)
+			continue;
+
+		wgm_key_to_base64(b64, keys[i].pub);
+		wgm_log_err("Error: Interface '%s' has no peer with public key '%s'\n",
+			    iface->ifname, b64);
+		return -ENOENT;
+	}
+
+	return 0;
+}
+
+int wgm_peer_cmd_export(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_export_key *keys = NULL;
+	struct wgm_export_arg arg;
+	struct wgm_iface iface;
+	struct wgm_export e;
+	size_t nr_keys = 0;
+	int lock_fd = -1;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&iface, 0, sizeof(iface));
+	memset(&e, 0, sizeof(e));
+	e.dir_fd = -1;
+	pthread_mutex_init(&e.lock, NULL);
+	pthread_cond_init(&e.cond, NULL);
+
+	ret = wgm_export_getopt(argc, argv, &arg);
+	if (ret)
+		goto out;
+
+	if (arg.tar && isatty(STDOUT_FILENO)) {
+		wgm_log_err("Error: Refusing to write a tar stream to a terminal\n");
+		ret = -EINVAL;
+		goto out;
+	}
+
+	if (arg.keys_from) {
+		ret = wgm_export_read_keys(arg.keys_from, &keys, &nr_keys);
+		if (ret)
+			goto out;
+	}
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, false);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
+	ret = wgm_iface_load(&iface, ctx, arg.ifname);
+	wgm_iface_unlock(lock_fd);
+	lock_fd = -1;
+	if (ret) {
+		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		goto out;
+	}
+
+	ret = wgm_key_public_base64(e.server_key, iface.private_key);
+	if (ret) {
+		wgm_log_err("Error: Interface '%s' has an invalid private key\n", arg.ifname);
+		goto out;
+	}
+
+	e.arg = &arg;
+	e.iface = &iface;
+	e.mtime = time(NULL);
+	format_endpoint(e.endpoint, sizeof(e.endpoint), arg.endpoint, iface.listen_port);
+
+	ret = wgm_export_select(&e, keys, nr_keys);
+	if (ret)
+		goto out;
+
+	if (!arg.tar) {
+		ret = mkdir_recursive(arg.output, 0700);
+		if (ret < 0) {
+			wgm_log_err("Error: Failed to create directory '%s': %s\n", arg.output, strerror(-ret));
+			goto out;
+		}
+
+		e.dir_fd = open(arg.output, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+		if (e.dir_fd < 0) {
+			ret = -errno;
+			wgm_log_err("Error: Failed to open directory '%s': %s\n", arg.output, strerror(-ret));
+			goto out;
+		}
+	}
+
+	ret = wgm_export_run(&e, arg.jobs ? arg.jobs : wgm_pool_default_workers());
+	if (!ret)
+		fprintf(stderr, "exported %zu peers of '%s'\n", e.nr, arg.ifname);
+
+out:
+	if (e.dir_fd >= 0)
+		close(e.dir_fd);
+	if (keys)
+		memset(keys, 0, nr_keys * sizeof(*keys));
+	free(keys);
+	free(e.ents);
+	pthread_mutex_destroy(&e.lock);
+	pthread_cond_destroy(&e.cond);
+	wgm_iface_unlock(lock_fd);
+	wgm_iface_free(&iface);
+	return ret;
+}
@@ -0,0 +1,13 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_EXPORT_H
+#define WGM__WG_EXPORT_H
+
+#include "helpers.h"
+
+/*
+ * wgm peer export: render the client side configuration of the peers
+ * of an interface, into a directory or as a tar stream.
+ */
+int wgm_peer_cmd_export(int argc, char *argv[], struct wgm_ctx *ctx);
+
+#endif /* #ifndef WGM__WG_EXPORT_H */
@@ -3,9 +3,22 @@
 #include "wgm_iface.h"
 #include "wgm_peer.h"
 #include "wgm_conf.h"
+#include "wgm_json.h"
+#include "wgm_index.h"
+#include "wgm_trace.h"
+#include "wgm_metrics.h"
+#include "wgm_pool.h"
 
 #include <getopt.h>
+#include <fnmatch.h>
 #include <dirent.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/file.h>
+#include <pthread.h>
+#include <time.h>
 
 struct wgm_iface_arg {
 	bool			force;
@@ -15,6 +28,19 @@ struct wgm_iface_arg {
 	char			private_key[256];
 	struct wgm_str_array	addresses;
 	struct wgm_str_array	allowed_ips;
+	uint32_t		nr_shards;
+	uint64_t		if_version;
+	bool			flowtable;
+	bool			filter_forward;
+
+	/*
+	 * Every --dev item (names and glob patterns) in order; @ifname is
+	 * the first one. @multi is set when more than a single plain
+	 * name was given, or --all.
+	 */
+	struct wgm_str_array	devs;
+	bool			multi;
+	unsigned int		jobs;
 };
 
 static const struct wgm_opt options[] = {
@@ -42,6 +68,27 @@ static const struct wgm_opt options[] = {
 	#define IFACE_ARG_FORCE		(1ull << 7)
 	{ IFACE_ARG_FORCE,		"force",	no_argument,		NULL,	'f' },
 
+	#define IFACE_ARG_SHARDS	(1ull << 8)
+	{ IFACE_ARG_SHARDS,		"shards",	required_argument,	NULL,	's' },
+
+	#define IFACE_ARG_IF_VERSION	(1ull << 9)
+	{ IFACE_ARG_IF_VERSION,		"if-version",	required_argument,	NULL,	'V' },
+
+	#define IFACE_ARG_ALL		(1ull << 10)
+	{ IFACE_ARG_ALL,		"all",		no_argument,		NULL,	'A' },
+
+	#define IFACE_ARG_JOBS		(1ull << 11)
+	{ IFACE_ARG_JOBS,		"jobs",		required_argument,	NULL,	'j' },
+
+	#define IFACE_ARG_FLOWTABLE	(1ull << 12)
+	{ IFACE_ARG_FLOWTABLE,		"flowtable",	required_argument,	NULL,	'F' },
+
+	#define IFACE_ARG_PLAN		(1ull << 13)
+	{ IFACE_ARG_PLAN,		"plan",		no_argument,		NULL,	'P' },
+
+	#define IFACE_ARG_FILTER_FORWARD	(1ull << 14)
+	{ IFACE_ARG_FILTER_FORWARD,	"filter-forward", required_argument,	NULL,	'R' },
+
 	{ 0, NULL, 0, NULL, 0 }
 };
 
@@ -150,6 +197,148 @@ static int wgm_iface_opt_get_allowed_ips(struct wgm_str_array *allowed_ips, cons
 	return wgm_parse_csv(allowed_ips, ips);
 }
 
+static bool is_dev_glob(const char *dev)
+{
+	return !!strpbrk(dev, "*?[");
+}
+
+/*
+ * --dev takes a comma separated list of interface names and glob
+ * patterns, and may be repeated.
+ */
+static int wgm_iface_opt_add_devs(struct wgm_iface_arg *arg, const char *devs)
+{
+	struct wgm_str_array items;
+	const char *dev;
+	size_t i, j;
+	int ret;
+
+	ret = wgm_parse_csv(&items, devs);
+	if (ret)
+		return ret;
+
+	for (i = 0; i < items.nr; i++) {
+		dev = items.arr[i];
+		if (!is_dev_glob(dev)) {
+			ret = wgm_iface_opt_get_dev(arg->ifname, sizeof(arg->ifname), dev);
+			if (ret)
+				break;
+		} else {
+			for (j = 0; dev[j]; j++) {
+				if (!isalnum(dev[j]) && !strchr("-*?[]!", dev[j])) {
+					wgm_log_err("Error: Invalid interface pattern '%s'\n", dev);
+					ret = -EINVAL;
+					break;
+				}
+			}
+
+			if (ret)
+				break;
+
+			arg->multi = true;
+		}
+
+		ret = wgm_str_array_add(&arg->devs, dev);
+		if (ret)
+			break;
+	}
+
+	wgm_str_array_free(&items);
+	if (ret)
+		return ret;
+
+	if (arg->devs.nr > 1)
+		arg->multi = true;
+
+	/*
+	 * Commands taking a single interface use @ifname; keep it the
+	 * first name given.
+	 */
+	if (arg->devs.nr && !is_dev_glob(arg->devs.arr[0]))
+		strncpyl(arg->ifname, arg->devs.arr[0], sizeof(arg->ifname));
+
+	return 0;
+}
+
+static int wgm_iface_opt_get_jobs(unsigned int *jobs, const char *str)
+{
+	unsigned long n;
+	char *endptr;
+
+	n = strtoul(str, &endptr, 10);
+	if (!*str || *endptr || !n || n > 1024) {
+		wgm_log_err("Error: Invalid number of jobs (1-1024)\n");
+		return -EINVAL;
+	}
+
+	*jobs = n;
+	return 0;
+}
+
+static int wgm_iface_opt_get_shards(uint32_t *nr_shards, const char *shards)
+{
+	unsigned long n;
+	char *endptr;
+
+	n = strtoul(shards, &endptr, 10);
+	if (!*shards || *endptr) {
+		wgm_log_err("Error: Invalid shard count\n");
+		return -EINVAL;
+	}
+
+	if (n > WGM_MAX_SHARDS) {
+		wgm_log_err("Error: Shard count is too large, max %u\n", WGM_MAX_SHARDS);
+		return -EINVAL;
+	}
+
+	*nr_shards = n;
+	return 0;
+}
+
+static int wgm_iface_opt_get_on_off(bool *val, const char *name, const char *str)
+{
+	if (!strcmp(str, "on")) {
+		*val = true;
+	} else if (!strcmp(str, "off")) {
+		*val = false;
+	} else {
+		wgm_log_err("Error: Invalid %s mode '%s', must be 'on' or 'off'\n", name, str);
+		return -EINVAL;
+	}
+
+	return 0;
+}
+
+int wgm_iface_opt_get_version(uint64_t *version, const char *str)
+{
+	unsigned long long v;
+	char *endptr;
+
+	errno = 0;
+	v = strtoull(str, &endptr, 10);
+	if (!isdigit((unsigned char)*str) || *endptr || errno) {
+		wgm_log_err("Error: Invalid interface version '%s'\n", str);
+		return -EINVAL;
+	}
+
+	*version = v;
+	return 0;
+}
+
+/*
+ * Returns -ESTALE, which main() turns into WGM_EXIT_VERSION_MISMATCH,
+ * if @iface is not at @version.
+ */
+int wgm_iface_check_version(const struct wgm_iface *iface, uint64_t version)
+{
+	if (iface->version == version)
+		return 0;
+
+	wgm_log_err("Error: Interface '%s' is at version %llu, not %llu\n", iface->ifname,
+		    (unsigned long long)iface->version, (unsigned long long)version);
+	return -ESTALE;
+}
+
 static int wgm_iface_getopt(int argc, char *argv[], struct wgm_iface_arg *arg,
 			    uint64_t allowed_args, uint64_t required_args,
 			    uint64_t *out_args_p)
@@ -172,7 +361,7 @@ static int wgm_iface_getopt(int argc, char *argv[], struct wgm_iface_arg *arg,
 
 		switch (c) {
 		case 'd':
-			if (wgm_iface_opt_get_dev(arg->ifname, sizeof(arg->ifname), optarg))
+			if (wgm_iface_opt_add_devs(arg, optarg))
 				return -EINVAL;
 			out_args |= IFACE_ARG_DEV;
 			break;
@@ -210,6 +399,38 @@ static int wgm_iface_getopt(int argc, char *argv[], struct wgm_iface_arg *arg,
 			arg->force = true;
 			out_args |= IFACE_ARG_FORCE;
 			break;
+		case 's':
+			if (wgm_iface_opt_get_shards(&arg->nr_shards, optarg))
+				return -EINVAL;
+			out_args |= IFACE_ARG_SHARDS;
+			break;
+		case 'V':
+			if (wgm_iface_opt_get_version(&arg->if_version, optarg))
+				return -EINVAL;
+			out_args |= IFACE_ARG_IF_VERSION;
+			break;
+		case 'A':
+			arg->multi = true;
+			out_args |= IFACE_ARG_ALL;
+			break;
+		case 'j':
+			if (wgm_iface_opt_get_jobs(&arg->jobs, optarg))
+				return -EINVAL;
+			out_args |= IFACE_ARG_JOBS;
+			break;
+		case 'F':
+			if (wgm_iface_opt_get_on_off(&arg->flowtable, "flowtable", optarg))
+				return -EINVAL;
+			out_args |= IFACE_ARG_FLOWTABLE;
+			break;
+		case 'R':
+			if (wgm_iface_opt_get_on_off(&arg->filter_forward, "filter-forward", optarg))
+				return -EINVAL;
+			out_args |= IFACE_ARG_FILTER_FORWARD;
+			break;
+		case 'P':
+			out_args |= IFACE_ARG_PLAN;
+			break;
 		default:
 			wgm_log_err("Error: Invalid option '%c'\n", c);
 			ret = -EINVAL;
@@ -236,6 +457,16 @@ static int wgm_iface_getopt(int argc, char *argv[], struct wgm_iface_arg *arg,
 		}
 	}
 
+	/*
+	 * Only commands that accept --all run on several interfaces.
+	 */
+	if (arg->multi && !(allowed_args & IFACE_ARG_ALL)) {
+		wgm_log_err("Error: Option '--dev' takes a single interface name for this command\n\n");
+		wgm_iface_show_usage();
+		ret = -EINVAL;
+		goto out;
+	}
+
 	*out_args_p = out_args;
 out:
 	wgm_free_getopt_long_args(long_opt, short_opt);
@@ -253,35 +484,6 @@ static void wgm_peer_array_free(struct wgm_peer_array *peers)
 	memset(peers, 0, sizeof(*peers));
 }
 
-static int wgm_peer_array_to_json(json_object **jobj, const struct wgm_peer_array *peers)
-{
-	json_object *jarr;
-	size_t i;
-	int ret;
-
-	jarr = json_object_new_array();
-	if (!jarr) {
-		wgm_log_err("Error: wgm_peer_array_to_json: Failed to create JSON array\n");
-		return -ENOMEM;
-	}
-
-	for (i = 0; i < peers->nr; i++) {
-		json_object *jpeer;
-
-		ret = wgm_peer_to_json(&jpeer, &peers->peers[i]);
-		if (ret) {
-			wgm_log_err("Error: wgm_peer_array_to_json: Failed to convert peer data to JSON\n");
-			json_object_put(jarr);
-			return ret;
-		}
-
-		json_object_array_add(jarr, jpeer);
-	}
-
-	*jobj = jarr;
-	return 0;
-}
-
 static int wgm_peer_array_from_json(struct wgm_peer_array *peers, const json_object *jarr)
 {
 	size_t i, nr;
@@ -350,7 +552,10 @@ static char *wgm_iface_get_json_path(struct wgm_ctx *ctx, const char *devname)
 	if (ret)
 		return NULL;
 
-	ret = mkdir_recursive(path, 0700);
+	/*
+	 * A dry run creates nothing; a missing directory is no store.
+	 */
+	ret = ctx->plan ? 0 : mkdir_recursive(path, 0700);
 	if (ret) {
 		wgm_log_err("Error: wgm_iface_get_json_path: Failed to create directory '%s': %s\n", path, strerror(-ret));
 		free(path);
@@ -365,6 +570,115 @@ static char *wgm_iface_get_json_path(struct wgm_ctx *ctx, const char *devname)
 	return path;
 }
 
+static char *wgm_iface_get_shard_dir(struct wgm_ctx *ctx, const char *devname)
+{
+	char *path;
+
+	if (wgm_asprintf(&path, "%s/json/%s.shards", ctx->data_dir, devname))
+		return NULL;
+
+	return path;
+}
+
+/*
+ * Shard files are named after the shard count as well, so the files of
+ * a new layout never clobber the ones of the layout being replaced.
+ */
+static char *wgm_iface_get_shard_path(struct wgm_ctx *ctx, const char *devname,
+				      uint32_t nr_shards, uint32_t shard)
+{
+	char *path;
+
+	if (wgm_asprintf(&path, "%s/json/%s.shards/%u-%u.json", ctx->data_dir,
+			 devname, nr_shards, shard))
+		return NULL;
+
+	return path;
+}
+
+static uint32_t wgm_iface_peer_shard(const struct wgm_iface *iface, const char *pubkey)
+{
+	return (uint32_t)(wgm_hash_str(pubkey) % iface->nr_shards);
+}
+
+static bool wgm_iface_shard_is_dirty(const struct wgm_iface *iface, uint32_t shard)
+{
+	if (!iface->shard_track)
+		return true;
+
+	return !!(iface->shard_dirty[shard / 64] & (1ull << (shard % 64)));
+}
+
+void wgm_iface_mark_peer_dirty(struct wgm_iface *iface, const char *pubkey)
+{
+	uint32_t shard;
+
+	if (!iface->nr_shards)
+		return;
+
+	shard = wgm_iface_peer_shard(iface, pubkey);
+	iface->shard_dirty[shard / 64] |= 1ull << (shard % 64);
+}
+
+static void wgm_iface_remove_shards(struct wgm_ctx *ctx, const char *devname,
+				    uint32_t nr_shards)
+{
+	char *path;
+	uint32_t i;
+
+	for (i = 0; i < nr_shards; i++) {
+		path = wgm_iface_get_shard_path(ctx, devname, nr_shards, i);
+		if (!path)
+			continue;
+
+		wgm_index_remove(path);
+		unlink(path);
+		free(path);
+	}
+
+	/*
+	 * Only succeeds once no other layout is left in there.
+	 */
+	path = wgm_iface_get_shard_dir(ctx, devname);
+	if (path) {
+		rmdir(path);
+		free(path);
+	}
+}
+
+static uint64_t file_size(const char *path)
+{
+	struct stat st;
+
+	if (!path || stat(path, &st))
+		return 0;
+
+	return st.st_size;
+}
+
+/*
+ * Size on disk of the store of @iface: the interface file and, when
+ * sharded, the shards of its current layout.
+ */
+uint64_t wgm_iface_store_bytes(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	uint64_t bytes;
+	char *path;
+	uint32_t i;
+
+	path = wgm_iface_get_json_path(ctx, iface->ifname);
+	bytes = file_size(path);
+	free(path);
+
+	for (i = 0; i < iface->nr_shards; i++) {
+		path = wgm_iface_get_shard_path(ctx, iface->ifname, iface->nr_shards, i);
+		bytes += file_size(path);
+		free(path);
+	}
+
+	return bytes;
+}
+
 static const char *load_key_str(const json_object *jobj, const char *key)
 {
 	json_object *tmp;
@@ -539,10 +853,15 @@ int wgm_iface_add_peer(struct wgm_iface *iface, const struct wgm_peer *peer, boo
 		}
 
 		wgm_peer_free(&tmp);
+		wgm_iface_mark_peer_dirty(iface, peer->public_key);
 		return 0;
 	}
 
-	return __wgm_iface_append_peer(iface, peer);
+	ret = __wgm_iface_append_peer(iface, peer);
+	if (!ret)
+		wgm_iface_mark_peer_dirty(iface, peer->public_key);
+
+	return ret;
 }
 
 int wgm_iface_del_peer(struct wgm_iface *iface, size_t idx)
@@ -555,6 +874,7 @@ int wgm_iface_del_peer(struct wgm_iface *iface, size_t idx)
 		return -EINVAL;
 	}
 
+	wgm_iface_mark_peer_dirty(iface, iface->peers.peers[idx].public_key);
 	wgm_peer_free(&iface->peers.peers[idx]);
 
 	new_nr = iface->peers.nr - 1;
@@ -626,187 +946,1203 @@ void wgm_iface_free(struct wgm_iface *iface)
 	memset(iface, 0, sizeof(*iface));
 }
 
-int wgm_iface_load(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname)
+static int wgm_peer_array_from_jparser(struct wgm_peer_array *peers, struct wgm_jparser *p)
 {
-	char *path, *jstr;
-	json_object *jobj;
-	size_t len;
-	FILE *fp;
+	size_t cap = 0;
 	int ret;
 
-	path = wgm_iface_get_json_path(ctx, devname);
-	if (!path)
-		return -ENOMEM;
-
-	fp = fopen(path, "rb");
-	if (!fp) {
-		ret = -errno;
-		goto out_free_path;
-	}
+	memset(peers, 0, sizeof(*peers));
+	ret = wgm_jp_arr_begin(p);
+	if (ret)
+		return ret;
 
-	fseek(fp, 0, SEEK_END);
-	len = ftell(fp);
-	fseek(fp, 0, SEEK_SET);
+	while (1) {
+		ret = wgm_jp_arr_next(p);
+		if (ret < 0)
+			goto out_err;
+		if (!ret)
+			break;
 
-	if (!len) {
-		ret = -ENOENT;
-		goto out_free_fp;
-	}
+		if (peers->nr == cap) {
+			struct wgm_peer *new_peers;
+
+			cap = cap ? cap * 2 : 16;
+			new_peers = realloc(peers->peers, cap * sizeof(*new_peers));
+			if (!new_peers) {
+				wgm_log_err("Error: wgm_peer_array_from_jparser: Failed to allocate memory\n");
+				ret = -ENOMEM;
+				goto out_err;
+			}
+			peers->peers = new_peers;
+		}
 
-	jstr = malloc(len + 1);
-	if (!jstr) {
-		ret = -ENOMEM;
-		wgm_log_err("Error: wgm_iface_load: Failed to allocate memory\n");
-		goto out_free_fp;
-	}
+		ret = wgm_peer_from_jparser(&peers->peers[peers->nr], p);
+		if (ret) {
+			wgm_log_err("Error: wgm_peer_array_from_jparser: Failed to parse peer data\n");
+			goto out_err;
+		}
 
-	if (fread(jstr, 1, len, fp) != len) {
-		ret = -EIO;
-		wgm_log_err("Error: wgm_iface_load: Failed to read file '%s': %s\n", path, strerror(-ret));
-		goto out_free_jstr;
+		peers->nr++;
 	}
 
-	jstr[len] = '\0';
-	jobj = json_tokener_parse(jstr);
-	if (!jobj) {
-		ret = -EINVAL;
-		wgm_log_err("Error: wgm_iface_load: Failed to parse JSON data\n");
-		goto out_free_jstr;
-	}
+	return 0;
 
-	ret = wgm_iface_load_from_json(iface, jobj);
-	json_object_put(jobj);
-out_free_jstr:
-	free(jstr);
-out_free_fp:
-	fclose(fp);
-out_free_path:
-	free(path);
+out_err:
+	wgm_peer_array_free(peers);
 	return ret;
 }
 
-int wgm_iface_to_json(json_object **jobj, const struct wgm_iface *iface)
+/*
+ * With @meta_only, parsing stops at the 'peers' key, which the store
+ * writer always emits last, so the interface metadata can be read
+ * without walking the peer records.
+ */
+static int wgm_iface_load_from_jparser(struct wgm_iface *iface, struct wgm_jparser *p,
+				       bool meta_only)
 {
-	json_object *jarr;
+	enum {
+		SEEN_DEV		= (1u << 0),
+		SEEN_LISTEN_PORT	= (1u << 1),
+		SEEN_PRIVATE_KEY	= (1u << 2),
+		SEEN_ADDRESS		= (1u << 3),
+		SEEN_MTU		= (1u << 4),
+		SEEN_ALLOWED_IPS	= (1u << 5),
+		SEEN_PEERS		= (1u << 6),
+	};
+	static const struct {
+		unsigned	bit;
+		const char	*msg;
+	} required[] = {
+		{ SEEN_DEV,		"Missing 'dev' field (string)" },
+		{ SEEN_LISTEN_PORT,	"Missing 'listen-port' field (int)" },
+		{ SEEN_PRIVATE_KEY,	"Missing 'private-key' field (string)" },
+		{ SEEN_ADDRESS,		"Missing 'address' field (array of strings)" },
+		{ SEEN_MTU,		"Missing 'mtu' field (int)" },
+		{ SEEN_ALLOWED_IPS,	"Missing 'allowed-ips' field (array of strings)" },
+		{ SEEN_PEERS,		"Missing 'peers' field" },
+	};
+	unsigned seen = 0;
+	char key[32];
+	char stmp[256];
+	int64_t itmp;
+	size_t i;
 	int ret;
 
-	*jobj = json_object_new_object();
-	if (!*jobj) {
-		wgm_log_err("Error: wgm_iface_to_json: Failed to create JSON object\n");
-		return -ENOMEM;
-	}
-
-	json_object_object_add(*jobj, "dev", json_object_new_string(iface->ifname));
-	json_object_object_add(*jobj, "listen-port", json_object_new_int(iface->listen_port));
-	json_object_object_add(*jobj, "private-key", json_object_new_string(iface->private_key));
-	json_object_object_add(*jobj, "mtu", json_object_new_int(iface->mtu));
-
-	ret = wgm_str_array_to_json(&jarr, &iface->addresses);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_to_json: Failed to convert 'address' array to JSON\n");
-		json_object_put(*jobj);
+	ret = wgm_jp_obj_begin(p);
+	if (ret)
 		return ret;
-	}
-	json_object_object_add(*jobj, "address", jarr);
 
-	ret = wgm_str_array_to_json(&jarr, &iface->allowed_ips);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_to_json: Failed to convert 'allowed-ips' array to JSON\n");
-		json_object_put(*jobj);
-		return ret;
+	while (1) {
+		ret = wgm_jp_obj_next(p, key, sizeof(key));
+		if (ret < 0)
+			return ret;
+		if (!ret)
+			break;
+
+		if (!strcmp(key, "dev")) {
+			ret = wgm_jp_str(p, stmp, sizeof(stmp));
+			if (ret < 0)
+				return ret;
+			if (wgm_iface_opt_get_dev(iface->ifname, sizeof(iface->ifname), stmp))
+				return -EINVAL;
+			seen |= SEEN_DEV;
+		} else if (!strcmp(key, "listen-port") || !strcmp(key, "mtu")) {
+			bool is_port = key[0] == 'l';
+
+			ret = wgm_jp_int(p, &itmp);
+			if (ret)
+				return ret;
+			if (itmp < 0 || itmp > UINT16_MAX) {
+				wgm_log_err("Error: wgm_iface_load_from_jparser: Invalid '%s' value, must be in range [0, %u]\n", key, UINT16_MAX);
+				return -EINVAL;
+			}
+			if (is_port) {
+				iface->listen_port = (uint16_t)itmp;
+				seen |= SEEN_LISTEN_PORT;
+			} else {
+				iface->mtu = (uint16_t)itmp;
+				seen |= SEEN_MTU;
+			}
+		} else if (!strcmp(key, "private-key")) {
+			ret = wgm_jp_str(p, stmp, sizeof(stmp));
+			if (ret < 0)
+				return ret;
+			if (wgm_iface_opt_get_private_key(iface->private_key, sizeof(iface->private_key), stmp))
+				return -EINVAL;
+			seen |= SEEN_PRIVATE_KEY;
+		} else if (!strcmp(key, "address")) {
+			wgm_str_array_free(&iface->addresses);
+			ret = wgm_jp_str_array(p, &iface->addresses);
+			if (ret)
+				return ret;
+			seen |= SEEN_ADDRESS;
+		} else if (!strcmp(key, "allowed-ips")) {
+			wgm_str_array_free(&iface->allowed_ips);
+			ret = wgm_jp_str_array(p, &iface->allowed_ips);
+			if (ret)
+				return ret;
+			seen |= SEEN_ALLOWED_IPS;
+		} else if (!strcmp(key, "version")) {
+			ret = wgm_jp_int(p, &itmp);
+			if (ret)
+				return ret;
+			if (itmp < 0) {
+				wgm_log_err("Error: wgm_iface_load_from_jparser: Invalid 'version' value\n");
+				return -EINVAL;
+			}
+			iface->version = (uint64_t)itmp;
+		} else if (!strcmp(key, "shards")) {
+			ret = wgm_jp_int(p, &itmp);
+			if (ret)
+				return ret;
+			if (itmp < 0 || itmp > WGM_MAX_SHARDS) {
+				wgm_log_err("Error: wgm_iface_load_from_jparser: Invalid 'shards' value, must be in range [0, %u]\n", WGM_MAX_SHARDS);
+				return -EINVAL;
+			}
+			iface->nr_shards = (uint32_t)itmp;
+		} else if (!strcmp(key, "flowtable")) {
+			ret = wgm_jp_int(p, &itmp);
+			if (ret)
+				return ret;
+			iface->flowtable = !!itmp;
+		} else if (!strcmp(key, "filter-forward")) {
+			ret = wgm_jp_int(p, &itmp);
+			if (ret)
+				return ret;
+			iface->filter_forward = !!itmp;
+		} else if (!strcmp(key, "peers")) {
+			if (meta_only) {
+				seen |= SEEN_PEERS;
+				break;
+			}
+
+			wgm_peer_array_free(&iface->peers);
+			ret = wgm_peer_array_from_jparser(&iface->peers, p);
+			if (ret) {
+				wgm_log_err("Error: wgm_iface_load_from_jparser: Failed to parse 'peers' field\n");
+				return ret;
+			}
+			seen |= SEEN_PEERS;
+		} else {
+			ret = wgm_jp_skip(p);
+			if (ret)
+				return ret;
+		}
 	}
-	json_object_object_add(*jobj, "allowed-ips", jarr);
 
-	ret = wgm_peer_array_to_json(&jarr, &iface->peers);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_to_json: Failed to convert 'peers' array to JSON\n");
-		json_object_put(*jobj);
-		return ret;
+	for (i = 0; i < ARRAY_SIZE(required); i++) {
+		if (!(seen & required[i].bit)) {
+			wgm_log_err("Error: wgm_iface_load_from_jparser: %s\n", required[i].msg);
+			return -EINVAL;
+		}
 	}
-	json_object_object_add(*jobj, "peers", jarr);
 
-	return 0;
+	return meta_only ? 0 : wgm_jp_finish(p);
 }
 
-static char *wgm_iface_to_json_str(const struct wgm_iface *iface)
+/*
+ * Map the store file at @path and hand it to @parse, which parses it in
+ * place. An empty file is reported as -ENOENT.
+ */
+static int parse_store_file(const char *path, int (*parse)(struct wgm_jparser *, void *),
+			    void *data)
 {
-	json_object *jobj;
-	const char *tmp;
-	char *jstr;
+	struct wgm_jparser p;
+	struct stat st;
+	void *map;
+	int fd, ret;
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st)) {
+		ret = -errno;
+		wgm_log_err("Error: parse_store_file: Failed to stat file '%s': %s\n", path, strerror(-ret));
+		goto out_close;
+	}
+
+	if (!st.st_size) {
+		ret = -ENOENT;
+		goto out_close;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		ret = -errno;
+		wgm_log_err("Error: parse_store_file: Failed to map file '%s': %s\n", path, strerror(-ret));
+		goto out_close;
+	}
+
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+	wgm_jp_init(&p, map, st.st_size);
+	ret = parse(&p, data);
+	if (ret)
+		wgm_log_err("Error: parse_store_file: Failed to parse JSON data in '%s' at offset %zu\n", path, wgm_jp_offset(&p));
+
+	munmap(map, st.st_size);
+out_close:
+	close(fd);
+	return ret;
+}
+
+static int parse_iface(struct wgm_jparser *p, void *data)
+{
+	return wgm_iface_load_from_jparser(data, p, false);
+}
+
+static int parse_iface_meta(struct wgm_jparser *p, void *data)
+{
+	return wgm_iface_load_from_jparser(data, p, true);
+}
+
+static int parse_shard(struct wgm_jparser *p, void *data)
+{
+	int ret;
+
+	ret = wgm_peer_array_from_jparser(data, p);
+	if (ret)
+		return ret;
+
+	ret = wgm_jp_finish(p);
+	if (ret)
+		wgm_peer_array_free(data);
+
+	return ret;
+}
+
+struct shard_loader {
+	struct wgm_ctx		*ctx;
+	const char		*devname;
+	uint32_t		nr_shards;
+	uint32_t		first;
+	uint32_t		step;
+	struct wgm_peer_array	*shards;
+	pthread_t		thread;
+	bool			started;
+	int			ret;
+};
+
+static void *shard_loader_fn(void *data)
+{
+	struct shard_loader *l = data;
+	uint32_t i;
+	char *path;
+	int ret;
+
+	for (i = l->first; i < l->nr_shards; i += l->step) {
+		path = wgm_iface_get_shard_path(l->ctx, l->devname, l->nr_shards, i);
+		if (!path) {
+			l->ret = -ENOMEM;
+			break;
+		}
+
+		/*
+		 * A shard that has never had a peer has no file.
+		 */
+		ret = parse_store_file(path, parse_shard, &l->shards[i]);
+		free(path);
+		if (ret && ret != -ENOENT) {
+			l->ret = ret;
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/*
+ * Load the peers of a sharded interface. The shards are independent
+ * files, so they are parsed by up to one thread per online CPU and
+ * concatenated in shard order afterwards.
+ */
+static int wgm_iface_load_shards(struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	struct wgm_peer_array *shards;
+	struct shard_loader *loaders;
+	uint32_t i, nr_threads;
+	size_t nr_peers = 0;
+	long nr_cpus;
+	int ret = 0;
+
+	nr_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+	nr_threads = nr_cpus > 0 ? (uint32_t)nr_cpus : 1;
+	if (nr_threads > iface->nr_shards)
+		nr_threads = iface->nr_shards;
+
+	shards = calloc(iface->nr_shards, sizeof(*shards));
+	loaders = calloc(nr_threads, sizeof(*loaders));
+	if (!shards || !loaders) {
+		wgm_log_err("Error: wgm_iface_load_shards: Failed to allocate memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		loaders[i].ctx = ctx;
+		loaders[i].devname = iface->ifname;
+		loaders[i].nr_shards = iface->nr_shards;
+		loaders[i].first = i;
+		loaders[i].step = nr_threads;
+		loaders[i].shards = shards;
+	}
+
+	/*
+	 * The calling thread takes the first share itself. If a thread
+	 * cannot be created, its share is done inline as well.
+	 */
+	for (i = 1; i < nr_threads; i++) {
+		if (!pthread_create(&loaders[i].thread, NULL, shard_loader_fn, &loaders[i]))
+			loaders[i].started = true;
+		else
+			shard_loader_fn(&loaders[i]);
+	}
+
+	shard_loader_fn(&loaders[0]);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (loaders[i].started)
+			pthread_join(loaders[i].thread, NULL);
+	}
+
+	for (i = 0; i < nr_threads; i++) {
+		if (loaders[i].ret && !ret)
+			ret = loaders[i].ret;
+	}
+
+	if (ret)
+		goto out;
+
+	for (i = 0; i < iface->nr_shards; i++)
+		nr_peers += shards[i].nr;
+
+	wgm_peer_array_free(&iface->peers);
+	if (nr_peers) {
+		iface->peers.peers = malloc(nr_peers * sizeof(*iface->peers.peers));
+		if (!iface->peers.peers) {
+			wgm_log_err("Error: wgm_iface_load_shards: Failed to allocate memory\n");
+			ret = -ENOMEM;
+			goto out;
+		}
+	}
+
+	for (i = 0; i < iface->nr_shards; i++) {
+		if (!shards[i].nr)
+			continue;
+
+		memcpy(&iface->peers.peers[iface->peers.nr], shards[i].peers,
+		       shards[i].nr * sizeof(*shards[i].peers));
+		iface->peers.nr += shards[i].nr;
+		free(shards[i].peers);
+		memset(&shards[i], 0, sizeof(shards[i]));
+	}
+
+	iface->shard_track = true;
+	memset(iface->shard_dirty, 0, sizeof(iface->shard_dirty));
+
+out:
+	if (shards) {
+		for (i = 0; i < iface->nr_shards; i++)
+			wgm_peer_array_free(&shards[i]);
+	}
+	free(loaders);
+	free(shards);
+	return ret;
+}
+
+static int __wgm_iface_load(struct wgm_iface *iface, struct wgm_ctx *ctx,
+			    const char *devname, bool meta_only)
+{
+	char *path;
+	int ret;
+
+	path = wgm_iface_get_json_path(ctx, devname);
+	if (!path)
+		return -ENOMEM;
+
+	wgm_trace_begin(ctx, "parse");
+	ret = parse_store_file(path, meta_only ? parse_iface_meta : parse_iface, iface);
+	wgm_trace_end(ctx);
+	free(path);
+
+	if (!ret && !meta_only && iface->nr_shards) {
+		wgm_trace_begin(ctx, "load_shards");
+		ret = wgm_iface_load_shards(iface, ctx);
+		wgm_trace_end(ctx);
+	}
+
+	if (ret)
+		wgm_iface_free(iface);
+
+	return ret;
+}
+
+/*
+ * Map the store file and parse it in place, filling @iface directly.
+ * This is the default load path; wgm_iface_load_json_c() is kept for
+ * comparison in the benchmarks and only understands unsharded stores.
+ */
+int wgm_iface_load(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname)
+{
+	int ret;
+
+	wgm_trace_begin(ctx, "iface_load");
+	ret = __wgm_iface_load(iface, ctx, devname, false);
+	wgm_trace_end(ctx);
+	return ret;
+}
+
+/*
+ * Load only the interface metadata, leaving @iface->peers empty.
+ */
+int wgm_iface_load_meta(struct wgm_iface *iface, struct wgm_ctx *ctx,
+			const char *devname)
+{
+	int ret;
+
+	wgm_trace_begin(ctx, "iface_load_meta");
+	ret = __wgm_iface_load(iface, ctx, devname, true);
+	wgm_trace_end(ctx);
+	return ret;
+}
+
+int wgm_iface_load_json_c(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname)
+{
+	char *path, *jstr;
+	json_object *jobj;
+	size_t len;
+	FILE *fp;
+	int ret;
+
+	path = wgm_iface_get_json_path(ctx, devname);
+	if (!path)
+		return -ENOMEM;
+
+	fp = fopen(path, "rb");
+	if (!fp) {
+		ret = -errno;
+		goto out_free_path;
+	}
+
+	fseek(fp, 0, SEEK_END);
+	len = ftell(fp);
+	fseek(fp, 0, SEEK_SET);
+
+	if (!len) {
+		ret = -ENOENT;
+		goto out_free_fp;
+	}
+
+	jstr = malloc(len + 1);
+	if (!jstr) {
+		ret = -ENOMEM;
+		wgm_log_err("Error: wgm_iface_load_json_c: Failed to allocate memory\n");
+		goto out_free_fp;
+	}
+
+	if (fread(jstr, 1, len, fp) != len) {
+		ret = -EIO;
+		wgm_log_err("Error: wgm_iface_load_json_c: Failed to read file '%s': %s\n", path, strerror(-ret));
+		goto out_free_jstr;
+	}
+
+	jstr[len] = '\0';
+	jobj = json_tokener_parse(jstr);
+	if (!jobj) {
+		ret = -EINVAL;
+		wgm_log_err("Error: wgm_iface_load_json_c: Failed to parse JSON data\n");
+		goto out_free_jstr;
+	}
+
+	ret = wgm_iface_load_from_json(iface, jobj);
+	json_object_put(jobj);
+out_free_jstr:
+	free(jstr);
+out_free_fp:
+	fclose(fp);
+out_free_path:
+	free(path);
+	return ret;
+}
+
+/*
+ * When @ents is not NULL, it receives the byte range of every peer
+ * record in the output. Only meaningful in compact mode, where a record
+ * is preceded by nothing but the separating comma.
+ */
+static int wgm_peer_array_write_json(struct wgm_jwriter *w, const struct wgm_peer_array *peers,
+				     struct wgm_index_ent *ents)
+{
+	size_t i, off;
+
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < peers->nr; i++) {
+		off = wgm_jw_offset(w) + (i ? 1 : 0);
+		wgm_peer_write_json(w, &peers->peers[i]);
+		if (ents) {
+			ents[i].off = off;
+			ents[i].len = (uint32_t)(wgm_jw_offset(w) - off);
+		}
+	}
+
+	return wgm_jw_arr_end(w);
+}
+
+/*
+ * Every store starts with the version, padded with whitespace to a
+ * fixed width.
+ */
+#define WGM_STORE_VERSION_PREFIX	"{\"version\":"
+#define WGM_STORE_VERSION_WIDTH		20
+
+static int __wgm_iface_write_json(struct wgm_jwriter *w, const struct wgm_iface *iface,
+				  const struct wgm_peer_array *peers,
+				  struct wgm_index_ent *ents)
+{
+	wgm_jw_obj_begin(w);
+	wgm_jw_key(w, "version");
+	wgm_jw_int(w, (int64_t)iface->version);
+	if (!w->pretty) {
+		int len = snprintf(NULL, 0, "%llu", (unsigned long long)iface->version);
+
+		/*
+		 * Pad to a fixed width in the store so that
+		 * store_write_version() can bump it in place.
+		 */
+		while (len++ < WGM_STORE_VERSION_WIDTH)
+			wgm_jw_raw(w, " ", 1);
+	}
+	wgm_jw_key(w, "dev");
+	wgm_jw_str(w, iface->ifname);
+	wgm_jw_key(w, "listen-port");
+	wgm_jw_int(w, iface->listen_port);
+	wgm_jw_key(w, "private-key");
+	wgm_jw_str(w, iface->private_key);
+	wgm_jw_key(w, "mtu");
+	wgm_jw_int(w, iface->mtu);
+	wgm_jw_key(w, "address");
+	wgm_jw_str_array(w, &iface->addresses);
+	wgm_jw_key(w, "allowed-ips");
+	wgm_jw_str_array(w, &iface->allowed_ips);
+	if (iface->nr_shards) {
+		wgm_jw_key(w, "shards");
+		wgm_jw_int(w, iface->nr_shards);
+	}
+	if (iface->flowtable) {
+		wgm_jw_key(w, "flowtable");
+		wgm_jw_int(w, 1);
+	}
+	if (iface->filter_forward) {
+		wgm_jw_key(w, "filter-forward");
+		wgm_jw_int(w, 1);
+	}
+
+	/*
+	 * Must stay last, see wgm_iface_load_meta().
+	 */
+	wgm_jw_key(w, "peers");
+	wgm_peer_array_write_json(w, peers, ents);
+	return wgm_jw_obj_end(w);
+}
+
+int wgm_iface_write_json(struct wgm_jwriter *w, const struct wgm_iface *iface)
+{
+	return __wgm_iface_write_json(w, iface, &iface->peers, NULL);
+}
+
+int wgm_iface_del(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	char *path;
 	int ret;
 
-	ret = wgm_iface_to_json(&jobj, iface);
+	path = wgm_iface_get_json_path(ctx, iface->ifname);
+	if (!path)
+		return -ENOMEM;
+
+	wgm_index_remove(path);
+	ret = remove(path);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_to_json_str: Failed to convert interface data to JSON\n");
-		return NULL;
+		ret = -errno;
+		wgm_log_err("Error: wgm_iface_del: Failed to delete file '%s': %s\n", path, strerror(-ret));
+	}
+
+	if (!ret && iface->nr_shards)
+		wgm_iface_remove_shards(ctx, iface->ifname, iface->nr_shards);
+
+	if (!ret)
+		wgm_metrics_iface_del(ctx, iface->ifname);
+
+	free(path);
+	return ret;
+}
+
+/*
+ * Write a store file: the interface header with @peers when @iface is
+ * set, a bare array of @peers (a shard) otherwise. An index is built
+ * for the records unless @peers is empty.
+ */
+static int write_store_file(const char *path, const struct wgm_iface *iface,
+			    const struct wgm_peer_array *peers)
+{
+	struct wgm_index_ent *ents;
+	struct wgm_jwriter w;
+	FILE *fp;
+	int ret;
+
+	ents = malloc((peers->nr + 1) * sizeof(*ents));
+	if (!ents)
+		return -ENOMEM;
+
+	ret = wgm_unshare_file(path, false);
+	if (ret) {
+		wgm_log_err("Error: write_store_file: Failed to unshare file '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	fp = fopen(path, "wb");
+	if (!fp) {
+		ret = -errno;
+		wgm_log_err("Error: write_store_file: Failed to open file '%s': %s\n", path, strerror(-ret));
+		goto out;
+	}
+
+	/*
+	 * The store is written in compact form straight into the stdio
+	 * buffer; pretty printing is only for humans.
+	 */
+	wgm_jw_init(&w, fp, false);
+	if (iface)
+		__wgm_iface_write_json(&w, iface, peers, ents);
+	else
+		wgm_peer_array_write_json(&w, peers, ents);
+	wgm_jw_raw(&w, "\n", 1);
+	ret = wgm_jw_flush(&w);
+	wgm_jw_free(&w);
+	if (!ret && fflush(fp))
+		ret = -errno;
+
+	/*
+	 * The index is only a cache; if it cannot be written, make sure
+	 * no stale one is left behind and carry on.
+	 */
+	if (ret || !peers->nr || wgm_index_build(path, fileno(fp), peers, ents))
+		wgm_index_remove(path);
+
+	if (fclose(fp) && !ret)
+		ret = -errno;
+
+	if (ret)
+		wgm_log_err("Error: write_store_file: Failed to write file '%s': %s\n", path, strerror(-ret));
+out:
+	free(ents);
+	return ret;
+}
+
+/*
+ * write_store_file() for a dry run: render the store file into memory
+ * and only count its size.
+ */
+static int plan_store_file(struct wgm_plan *plan, const struct wgm_iface *iface,
+			   const struct wgm_peer_array *peers)
+{
+	struct wgm_jwriter w;
+	int ret;
+
+	wgm_jw_init(&w, NULL, false);
+	if (iface)
+		__wgm_iface_write_json(&w, iface, peers, NULL);
+	else
+		wgm_peer_array_write_json(&w, peers, NULL);
+	wgm_jw_raw(&w, "\n", 1);
+	ret = w.err;
+	if (!ret)
+		plan->store_bytes += w.len;
+
+	wgm_jw_free(&w);
+	return ret;
+}
+
+/*
+ * Write the shards of @iface that need it. The peers are bucketed by
+ * shard with a counting sort so every shard is a contiguous slice.
+ */
+static int wgm_iface_save_shards(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	struct wgm_peer_array shard;
+	struct wgm_peer *sorted;
+	uint32_t *peer_shard;
+	size_t *start, i;
+	uint32_t nr = iface->nr_shards, k;
+	char *path;
+	int ret;
+
+	path = wgm_iface_get_shard_dir(ctx, iface->ifname);
+	if (!path)
+		return -ENOMEM;
+
+	ret = ctx->plan ? 0 : mkdir_recursive(path, 0700);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_save_shards: Failed to create directory '%s': %s\n", path, strerror(-ret));
+		free(path);
+		return ret;
+	}
+	free(path);
+
+	start = calloc(nr + 1, sizeof(*start));
+	peer_shard = malloc((iface->peers.nr + 1) * sizeof(*peer_shard));
+	sorted = malloc((iface->peers.nr + 1) * sizeof(*sorted));
+	if (!start || !peer_shard || !sorted) {
+		wgm_log_err("Error: wgm_iface_save_shards: Failed to allocate memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	for (i = 0; i < iface->peers.nr; i++) {
+		peer_shard[i] = wgm_iface_peer_shard(iface, iface->peers.peers[i].public_key);
+		start[peer_shard[i] + 1]++;
+	}
+
+	for (k = 0; k < nr; k++)
+		start[k + 1] += start[k];
+
+	/*
+	 * Shallow copies; @sorted only borrows the peers of @iface.
+	 */
+	for (i = 0; i < iface->peers.nr; i++)
+		sorted[start[peer_shard[i]]++] = iface->peers.peers[i];
+
+	for (k = nr; k > 0; k--)
+		start[k] = start[k - 1];
+	start[0] = 0;
+
+	for (k = 0; k < nr; k++) {
+		if (!wgm_iface_shard_is_dirty(iface, k))
+			continue;
+
+		path = wgm_iface_get_shard_path(ctx, iface->ifname, nr, k);
+		if (!path) {
+			ret = -ENOMEM;
+			goto out;
+		}
+
+		shard.peers = &sorted[start[k]];
+		shard.nr = start[k + 1] - start[k];
+		if (ctx->plan)
+			ret = plan_store_file(ctx->plan, NULL, &shard);
+		else
+			ret = write_store_file(path, NULL, &shard);
+		free(path);
+		if (ret)
+			goto out;
+	}
+
+out:
+	free(sorted);
+	free(peer_shard);
+	free(start);
+	return ret;
+}
+
+/*
+ * An unsharded interface is a single store file. A sharded one writes
+ * its (dirty) shards first and the header last, so the header never
+ * names a shard layout that is not on disk yet.
+ */
+static int __wgm_iface_save(struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	static const struct wgm_peer_array no_peers;
+	char *path;
+	int ret;
+
+	if (iface->nr_shards) {
+		wgm_trace_begin(ctx, "write_shards");
+		ret = wgm_iface_save_shards(iface, ctx);
+		wgm_trace_end(ctx);
+		if (ret)
+			return ret;
+	}
+
+	path = wgm_iface_get_json_path(ctx, iface->ifname);
+	if (!path)
+		return -ENOMEM;
+
+	iface->version++;
+	wgm_trace_begin(ctx, "write_store");
+	if (ctx->plan)
+		ret = plan_store_file(ctx->plan, iface, iface->nr_shards ? &no_peers : &iface->peers);
+	else
+		ret = write_store_file(path, iface, iface->nr_shards ? &no_peers : &iface->peers);
+	wgm_trace_end(ctx);
+	free(path);
+	if (ret) {
+		iface->version--;
+		return ret;
+	}
+
+	return wgm_conf_save(iface, ctx);
+}
+
+int wgm_iface_save(struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	int ret;
+
+	wgm_trace_begin(ctx, "iface_save");
+	ret = __wgm_iface_save(iface, ctx);
+	wgm_trace_end(ctx);
+	return ret;
+}
+
+/*
+ * Overwrite the version at the start of the store file at @path. Fails
+ * with -ESTALE if the file does not start with a padded version, e.g.
+ * because it was written by an older wgm.
+ */
+static int store_write_version(const char *path, uint64_t version)
+{
+	static const size_t plen = sizeof(WGM_STORE_VERSION_PREFIX) - 1;
+	char buf[sizeof(WGM_STORE_VERSION_PREFIX) + WGM_STORE_VERSION_WIDTH];
+	ssize_t ret;
+	int fd, len;
+
+	ret = wgm_unshare_file(path, true);
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDWR | O_CLOEXEC);
+	if (fd < 0)
+		return -errno;
+
+	ret = pread(fd, buf, plen + WGM_STORE_VERSION_WIDTH + 1, 0);
+	if (ret != (ssize_t)(plen + WGM_STORE_VERSION_WIDTH + 1) ||
+	    memcmp(buf, WGM_STORE_VERSION_PREFIX, plen) ||
+	    buf[plen + WGM_STORE_VERSION_WIDTH] != ',') {
+		ret = ret < 0 ? -errno : -ESTALE;
+		goto out;
+	}
+
+	len = snprintf(buf, sizeof(buf), "%llu", (unsigned long long)version);
+	while (len < WGM_STORE_VERSION_WIDTH)
+		buf[len++] = ' ';
+
+	ret = pwrite(fd, buf, WGM_STORE_VERSION_WIDTH, plen);
+	if (ret < 0)
+		ret = -errno;
+	else
+		ret = ret == WGM_STORE_VERSION_WIDTH ? 0 : -EIO;
+out:
+	close(fd);
+	return (int)ret;
+}
+
+/*
+ * Set the version of the store of @devname to @version without touching
+ * the rest of it. A store without a padded version is rewritten.
+ */
+int wgm_iface_set_version(struct wgm_ctx *ctx, const char *devname, uint64_t version)
+{
+	struct wgm_iface iface;
+	char *path;
+	int ret;
+
+	path = wgm_iface_get_json_path(ctx, devname);
+	if (!path)
+		return -ENOMEM;
+
+	ret = store_write_version(path, version);
+	free(path);
+	if (ret != -ESTALE)
+		return ret;
+
+	memset(&iface, 0, sizeof(iface));
+	ret = wgm_iface_load(&iface, ctx, devname);
+	if (!ret) {
+		iface.version = version - 1;
+		ret = wgm_iface_save(&iface, ctx);
+	}
+
+	wgm_iface_free(&iface);
+	return ret;
+}
+
+/*
+ * Path of the store file that holds the record of @pubkey: the shard
+ * it hashes to, or the interface file itself when not sharded.
+ */
+static char *wgm_iface_get_peer_store_path(const struct wgm_iface *iface,
+					   struct wgm_ctx *ctx, const char *pubkey)
+{
+	if (!iface->nr_shards)
+		return wgm_iface_get_json_path(ctx, iface->ifname);
+
+	return wgm_iface_get_shard_path(ctx, iface->ifname, iface->nr_shards,
+					wgm_iface_peer_shard(iface, pubkey));
+}
+
+/*
+ * wgm_iface_save_peer() for a dry run: count the record and the version
+ * it would rewrite in place, or fall back to a whole save like it.
+ */
+static int wgm_iface_plan_peer(struct wgm_iface *iface, const struct wgm_peer *peer,
+			       struct wgm_ctx *ctx)
+{
+	struct wgm_index_loc loc;
+	struct wgm_jwriter w;
+	struct wgm_peer old;
+	char *path;
+	int ret;
+
+	path = wgm_iface_get_peer_store_path(iface, ctx, peer->public_key);
+	if (!path)
+		return -ENOMEM;
+
+	memset(&old, 0, sizeof(old));
+	ret = wgm_index_find_peer(path, peer->public_key, &old, &loc);
+	free(path);
+	if (!ret) {
+		wgm_peer_free(&old);
+		wgm_jw_init(&w, NULL, false);
+		wgm_peer_write_json(&w, peer);
+		ret = w.err ? w.err : w.len > loc.cap ? -ENOSPC : 0;
+		wgm_jw_free(&w);
+	}
+
+	if (ret)
+		return wgm_iface_save(iface, ctx);
+
+	ctx->plan->store_bytes += loc.cap + WGM_STORE_VERSION_WIDTH;
+	iface->version++;
+	return wgm_conf_save(iface, ctx);
+}
+
+/*
+ * Persist a change to a single peer of @iface (which must already be
+ * applied to @iface and, when sharded, marked with
+ * wgm_iface_mark_peer_dirty()). The record is rewritten in place
+ * through the index when the new one fits; otherwise the store (or
+ * just the peer's shard) is rewritten.
+ */
+int wgm_iface_save_peer(struct wgm_iface *iface, const struct wgm_peer *peer,
+			struct wgm_ctx *ctx)
+{
+	struct wgm_index_loc loc;
+	struct wgm_peer old;
+	char *path;
+	int ret;
+
+	if (ctx->plan)
+		return wgm_iface_plan_peer(iface, peer, ctx);
+
+	path = wgm_iface_get_peer_store_path(iface, ctx, peer->public_key);
+	if (!path)
+		return -ENOMEM;
+
+	memset(&old, 0, sizeof(old));
+	wgm_trace_begin(ctx, "index_rewrite");
+	ret = wgm_index_find_peer(path, peer->public_key, &old, &loc);
+	if (!ret) {
+		wgm_peer_free(&old);
+		ret = wgm_index_rewrite_peer(path, &loc, peer);
+	}
+	wgm_trace_end(ctx);
+
+	free(path);
+	if (ret)
+		return wgm_iface_save(iface, ctx);
+
+	/*
+	 * The record is in place; bump the version in the interface file
+	 * as well, and re-stamp the index if it covers the same file.
+	 */
+	path = wgm_iface_get_json_path(ctx, iface->ifname);
+	if (!path)
+		return -ENOMEM;
+
+	ret = store_write_version(path, iface->version + 1);
+	if (!ret && !iface->nr_shards && wgm_index_sync_store(path))
+		wgm_index_remove(path);
+
+	free(path);
+	if (ret)
+		return wgm_iface_save(iface, ctx);
+
+	iface->version++;
+	return wgm_conf_save(iface, ctx);
+}
+
+/*
+ * Load a single peer of interface @devname. With a valid index this
+ * reads only that peer's record; otherwise the whole interface (or
+ * just the peer's shard) is loaded and the peer copied out of it.
+ */
+int wgm_iface_load_peer(struct wgm_ctx *ctx, const char *devname, const char *pubkey,
+			struct wgm_peer *peer)
+{
+	struct wgm_index_loc loc;
+	struct wgm_iface iface;
+	struct wgm_peer *peer_p;
+	char *path;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	ret = wgm_iface_load_meta(&iface, ctx, devname);
+	if (ret)
+		return ret;
+
+	path = wgm_iface_get_peer_store_path(&iface, ctx, pubkey);
+	if (!path) {
+		ret = -ENOMEM;
+		goto out;
 	}
 
-	tmp = json_object_to_json_string_ext(jobj, WGM_JSON_FLAGS);
-	if (!tmp) {
-		wgm_log_err("Error: wgm_iface_to_json_str: Failed to convert JSON object to string\n");
-		json_object_put(jobj);
-		return NULL;
-	}
+	ret = wgm_index_find_peer(path, pubkey, peer, &loc);
+	if (ret == -ESTALE) {
+		if (iface.nr_shards) {
+			ret = parse_store_file(path, parse_shard, &iface.peers);
+			if (ret == -ENOENT)
+				ret = 0;
+		} else {
+			ret = wgm_iface_load(&iface, ctx, devname);
+		}
 
-	jstr = strdup(tmp);
-	json_object_put(jobj);
-	if (!jstr)
-		wgm_log_err("Error: wgm_iface_to_json_str: Failed to allocate memory\n");
+		if (!ret) {
+			ret = wgm_iface_get_peer_by_pubkey(&iface, pubkey, &peer_p);
+			if (!ret)
+				wgm_peer_move(peer, peer_p);
+		}
+	} else if (ret == -ENOENT) {
+		wgm_log_err("Error: wgm_iface_load_peer: Peer with public key '%s' not found\n", pubkey);
+	}
 
-	return jstr;
+	free(path);
+out:
+	wgm_iface_free(&iface);
+	return ret;
 }
 
-int wgm_iface_del(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+/*
+ * Move @iface to @nr_shards shards (zero meaning a single store file)
+ * and save it. The files of the old layout are removed only once the
+ * new header is in place.
+ */
+static int wgm_iface_set_shards(struct wgm_iface *iface, uint32_t nr_shards,
+				struct wgm_ctx *ctx)
 {
-	char *path;
+	uint32_t old_nr = iface->nr_shards;
 	int ret;
 
-	path = wgm_iface_get_json_path(ctx, iface->ifname);
-	if (!path)
-		return -ENOMEM;
-
-	ret = remove(path);
+	iface->nr_shards = nr_shards;
+	iface->shard_track = false;
+	ret = wgm_iface_save(iface, ctx);
 	if (ret) {
-		ret = -errno;
-		wgm_log_err("Error: wgm_iface_del: Failed to delete file '%s': %s\n", path, strerror(-ret));
+		iface->nr_shards = old_nr;
+		return ret;
 	}
 
-	free(path);
-	return ret;
+	iface->shard_track = !!nr_shards;
+	memset(iface->shard_dirty, 0, sizeof(iface->shard_dirty));
+	if (old_nr && old_nr != nr_shards && !ctx->plan)
+		wgm_iface_remove_shards(ctx, iface->ifname, old_nr);
+
+	return 0;
 }
 
-int wgm_iface_save(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+/*
+ * Take the advisory lock of interface @devname, shared for readers and
+ * exclusive for anything that saves. The lock lives in its own file so
+ * that it survives the store files being replaced or removed, and it is
+ * dropped by the kernel if the process dies. Returns the locked fd, to
+ * be released with wgm_iface_unlock(), or -ETIMEDOUT if the lock is not
+ * available within ctx->lock_timeout seconds.
+ */
+int wgm_iface_lock(struct wgm_ctx *ctx, const char *devname, bool exclusive)
 {
-	char *path, *jstr;
-	FILE *fp;
+	struct timespec deadline, now, delay = { 0, 1000000 };
+	int fd, ret, op = exclusive ? LOCK_EX : LOCK_SH;
+	char *path;
 
-	path = wgm_iface_get_json_path(ctx, iface->ifname);
-	if (!path)
-		return -ENOMEM;
+	/*
+	 * A dry run only reads, and creates nothing: it shares the lock
+	 * file if there is one, and an interface no command ever locked
+	 * has no writer to wait for. The data directory then stands in
+	 * for the fd, unlocked.
+	 */
+	if (ctx->plan) {
+		ret = wgm_asprintf(&path, "%s/lock/%s.lock", ctx->data_dir, devname);
+		if (ret)
+			return ret;
 
-	fp = fopen(path, "wb");
-	if (!fp) {
-		int ret = -errno;
-		wgm_log_err("Error: wgm_iface_save: Failed to open file '%s': %s\n", path, strerror(-ret));
+		op = LOCK_SH;
+		fd = open(path, O_RDONLY | O_CLOEXEC);
+		if (fd < 0 && errno == ENOENT) {
+			free(path);
+			fd = open(ctx->data_dir, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+			return fd < 0 ? -errno : fd;
+		}
+	} else {
+		ret = wgm_asprintf(&path, "%s/lock", ctx->data_dir);
+		if (ret)
+			return ret;
+
+		ret = mkdir_recursive(path, 0700);
 		free(path);
-		return ret;
+		if (ret)
+			return ret;
+
+		ret = wgm_asprintf(&path, "%s/lock/%s.lock", ctx->data_dir, devname);
+		if (ret)
+			return ret;
+
+		fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
 	}
 
-	jstr = wgm_iface_to_json_str(iface);
-	if (!jstr) {
-		wgm_log_err("Error: wgm_iface_save: Failed to convert interface data to JSON\n");
-		fclose(fp);
+	if (fd < 0) {
+		ret = -errno;
+		wgm_log_err("Error: wgm_iface_lock: Failed to open lock file '%s': %s\n", path, strerror(-ret));
 		free(path);
-		return -ENOMEM;
+		return ret;
 	}
+	free(path);
 
-	fputs(jstr, fp);
-	fputc('\n', fp);
+	clock_gettime(CLOCK_MONOTONIC, &deadline);
+	deadline.tv_sec += ctx->lock_timeout;
 
-	free(jstr);
-	fclose(fp);
-	free(path);
-	return wgm_conf_save(iface, ctx);
+	/*
+	 * flock() has no timeout of its own, so poll with a backoff capped
+	 * at 16ms; a waiter notices a released lock quickly without
+	 * spinning while a large interface is being saved.
+	 */
+	wgm_trace_begin(ctx, "lock_wait");
+	while (flock(fd, op | LOCK_NB)) {
+		if (errno != EWOULDBLOCK && errno != EINTR) {
+			ret = -errno;
+			wgm_trace_end(ctx);
+			wgm_log_err("Error: wgm_iface_lock: Failed to lock interface '%s': %s\n", devname, strerror(-ret));
+			close(fd);
+			return ret;
+		}
+
+		clock_gettime(CLOCK_MONOTONIC, &now);
+		if (now.tv_sec > deadline.tv_sec ||
+		    (now.tv_sec == deadline.tv_sec && now.tv_nsec >= deadline.tv_nsec)) {
+			wgm_trace_end(ctx);
+			wgm_log_err("Error: wgm_iface_lock: Timed out waiting for the lock of interface '%s'\n", devname);
+			close(fd);
+			return -ETIMEDOUT;
+		}
+
+		nanosleep(&delay, NULL);
+		if (delay.tv_nsec < 16000000)
+			delay.tv_nsec *= 2;
+	}
+	wgm_trace_end(ctx);
+
+	return fd;
+}
+
+void wgm_iface_unlock(int fd)
+{
+	if (fd >= 0)
+		close(fd);
 }
 
 static void move_arg_to_iface(struct wgm_iface *iface, struct wgm_iface_arg *arg, uint64_t args)
@@ -828,12 +2164,19 @@ static void move_arg_to_iface(struct wgm_iface *iface, struct wgm_iface_arg *arg
 
 	if (args & IFACE_ARG_ALLOWED_IPS)
 		wgm_str_array_move(&iface->allowed_ips, &arg->allowed_ips);
+
+	if (args & IFACE_ARG_FLOWTABLE)
+		iface->flowtable = arg->flowtable;
+
+	if (args & IFACE_ARG_FILTER_FORWARD)
+		iface->filter_forward = arg->filter_forward;
 }
 
 static void wgm_iface_free_arg(struct wgm_iface_arg *arg)
 {
 	wgm_str_array_free(&arg->addresses);
 	wgm_str_array_free(&arg->allowed_ips);
+	wgm_str_array_free(&arg->devs);
 	memset(arg, 0, sizeof(*arg));
 }
 
@@ -843,27 +2186,425 @@ static int apply_iface(struct wgm_iface *iface, struct wgm_iface_arg *arg,
 	int ret;
 
 	move_arg_to_iface(iface, arg, out_args);
-	ret = wgm_iface_save(iface, ctx);
+	if (out_args & IFACE_ARG_SHARDS)
+		ret = wgm_iface_set_shards(iface, arg->nr_shards, ctx);
+	else
+		ret = wgm_iface_save(iface, ctx);
 	if (ret) {
 		wgm_log_err("Error: apply_iface: Failed to save interface data: %s\n", strerror(-ret));
 		return ret;
 	}
 
-	return 0;
-}
+	return 0;
+}
+
+static int write_iface(struct wgm_jwriter *w, const void *data)
+{
+	return wgm_iface_write_json(w, data);
+}
+
+static int write_iface_array(struct wgm_jwriter *w, const void *data)
+{
+	return wgm_iface_array_write_json(w, data);
+}
+
+static int write_peer_array(struct wgm_jwriter *w, const void *data)
+{
+	return wgm_peer_array_write_json(w, data, NULL);
+}
+
+void wgm_iface_dump_json(const struct wgm_iface *iface)
+{
+	wgm_jw_dump(write_iface, iface, "interface");
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(const char **)a, *(const char **)b);
+}
+
+/*
+ * Collect the names of all stored interfaces, sorted.
+ */
+int wgm_iface_list_names(struct wgm_ctx *ctx, struct wgm_str_array *names)
+{
+	struct dirent *ent;
+	char *dir_path;
+	DIR *dir;
+	int ret;
+
+	ret = wgm_asprintf(&dir_path, "%s/json", ctx->data_dir);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_list_names: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	dir = opendir(dir_path);
+	free(dir_path);
+	if (!dir) {
+		ret = -errno;
+		wgm_log_err("Error: wgm_iface_list_names: Failed to open directory '%s': %s\n", ctx->data_dir, strerror(-ret));
+		return ret;
+	}
+
+	ret = 0;
+	while (1) {
+		size_t len;
+		char *name;
+
+		ent = readdir(dir);
+		if (!ent)
+			break;
+
+		if (ent->d_type != DT_REG)
+			continue;
+
+		name = ent->d_name;
+
+		/*
+		 * Ensure the file ends with '.json'.
+		 */
+		len = strlen(name);
+		if (len < 5 || strcmp(name + len - 5, ".json"))
+			continue;
+
+		/*
+		 * Remove the '.json' extension.
+		 */
+		name[len - 5] = '\0';
+
+		ret = wgm_str_array_add(names, name);
+		if (ret)
+			break;
+	}
+
+	closedir(dir);
+	if (ret) {
+		wgm_str_array_free(names);
+		return ret;
+	}
+
+	if (names->nr)
+		qsort(names->arr, names->nr, sizeof(*names->arr), cmp_str);
+
+	return 0;
+}
+
+static bool str_array_has(const struct wgm_str_array *arr, const char *str)
+{
+	size_t i;
+
+	for (i = 0; i < arr->nr; i++) {
+		if (!strcmp(arr->arr[i], str))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Expand --all and the --dev names and patterns into the interfaces to
+ * run on. Plain names are kept even if they are not stored, so the job
+ * reports the error; a pattern that matches nothing is an error.
+ */
+static int wgm_iface_resolve_devs(struct wgm_ctx *ctx, const struct wgm_iface_arg *arg,
+				  uint64_t out_args, struct wgm_str_array *devs)
+{
+	struct wgm_str_array names;
+	const char *dev;
+	bool matched;
+	size_t i, j;
+	int ret;
+
+	memset(&names, 0, sizeof(names));
+	if ((out_args & IFACE_ARG_ALL) || arg->devs.nr > 1 || (arg->devs.nr && is_dev_glob(arg->devs.arr[0]))) {
+		ret = wgm_iface_list_names(ctx, &names);
+		if (ret)
+			return ret;
+	}
+
+	if (out_args & IFACE_ARG_ALL) {
+		wgm_str_array_move(devs, &names);
+		return 0;
+	}
+
+	ret = 0;
+	for (i = 0; i < arg->devs.nr; i++) {
+		dev = arg->devs.arr[i];
+		if (!is_dev_glob(dev)) {
+			if (!str_array_has(devs, dev))
+				ret = wgm_str_array_add(devs, dev);
+			if (ret)
+				break;
+			continue;
+		}
+
+		matched = false;
+		for (j = 0; j < names.nr; j++) {
+			if (fnmatch(dev, names.arr[j], 0))
+				continue;
+
+			matched = true;
+			if (str_array_has(devs, names.arr[j]))
+				continue;
+
+			ret = wgm_str_array_add(devs, names.arr[j]);
+			if (ret)
+				break;
+		}
+
+		if (ret)
+			break;
+
+		if (!matched) {
+			wgm_log_err("Error: No interface matches '%s'\n", dev);
+			ret = -ENOENT;
+			break;
+		}
+	}
+
+	wgm_str_array_free(&names);
+	if (ret)
+		wgm_str_array_free(devs);
+
+	return ret;
+}
+
+/*
+ * Whether job @from already waits, directly or not, for job @to.
+ */
+static bool job_waits_for(const struct wgm_pool_job *jobs, size_t nr, size_t from,
+			  size_t to, bool *seen)
+{
+	size_t i;
+
+	if (from == to)
+		return true;
+
+	if (seen[from])
+		return false;
+
+	seen[from] = true;
+	for (i = 0; i < jobs[from].nr_after; i++) {
+		if (job_waits_for(jobs, nr, jobs[from].after[i], to, seen))
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * An interface whose peers bind to another interface of the run needs
+ * that one up first, for the device to exist, and down last. Order each
+ * job after the jobs of the interfaces it binds to, or with @reverse
+ * (down) before them. Interfaces that only share a bind device such as
+ * eth0 run concurrently: each installs its ip rules at a priority of its
+ * own and `ip route replace` is idempotent. A binding that would close
+ * a cycle is not ordered. @binds[i] are the bind devices of the peers
+ * of job i.
+ */
+int wgm_iface_order_jobs(struct wgm_pool_job *jobs, size_t nr,
+			 const struct wgm_str_array *binds, bool reverse)
+{
+	size_t i, j, first, then;
+	bool *seen;
+	int ret = 0;
+
+	seen = calloc(nr + 1, sizeof(*seen));
+	if (!seen) {
+		wgm_log_err("Error: wgm_iface_order_jobs: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr && !ret; i++) {
+		for (j = 0; j < nr && !ret; j++) {
+			if (i == j || !str_array_has(&binds[i], jobs[j].name))
+				continue;
+
+			first = reverse ? i : j;
+			then = reverse ? j : i;
+			memset(seen, 0, nr * sizeof(*seen));
+			if (job_waits_for(jobs, nr, first, then, seen))
+				continue;
+
+			ret = wgm_pool_job_after(&jobs[then], first);
+		}
+	}
+
+	if (ret)
+		wgm_log_err("Error: wgm_iface_order_jobs: Failed to allocate memory\n");
+
+	free(seen);
+	return ret;
+}
+
+static int wgm_iface_order_by_bind_dev(struct wgm_ctx *ctx, struct wgm_pool_job *jobs,
+				       size_t nr, bool reverse)
+{
+	struct wgm_str_array *binds;
+	struct wgm_iface iface;
+	int lock_fd, ret = 0;
+	size_t i, j;
+
+	binds = calloc(nr, sizeof(*binds));
+	if (!binds) {
+		wgm_log_err("Error: wgm_iface_order_by_bind_dev: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < nr; i++) {
+		/*
+		 * An interface that cannot be loaded has nothing to order;
+		 * its own job reports the error.
+		 */
+		memset(&iface, 0, sizeof(iface));
+		lock_fd = wgm_iface_lock(ctx, jobs[i].name, false);
+		if (lock_fd < 0)
+			continue;
+
+		if (!wgm_iface_load(&iface, ctx, jobs[i].name)) {
+			for (j = 0; j < iface.peers.nr && !ret; j++) {
+				const struct wgm_peer *peer = &iface.peers.peers[j];
+
+				if (!*peer->bind_ip || !*peer->bind_dev)
+					continue;
+				if (str_array_has(&binds[i], peer->bind_dev))
+					continue;
+
+				ret = wgm_str_array_add(&binds[i], peer->bind_dev);
+			}
+		}
+
+		wgm_iface_unlock(lock_fd);
+		wgm_iface_free(&iface);
+		if (ret)
+			break;
+	}
+
+	if (!ret)
+		ret = wgm_iface_order_jobs(jobs, nr, binds, reverse);
+
+	for (i = 0; i < nr; i++)
+		wgm_str_array_free(&binds[i]);
+
+	free(binds);
+	return ret;
+}
+
+typedef int (*wgm_iface_dev_fn_t)(struct wgm_ctx *ctx, const char *ifname,
+				  struct wgm_iface_arg *arg, uint64_t out_args);
+
+struct wgm_iface_for_each_data {
+	wgm_iface_dev_fn_t	fn;
+	struct wgm_iface_arg	*arg;
+	uint64_t		out_args;
+};
+
+static int wgm_iface_for_each_job(struct wgm_ctx *ctx, const struct wgm_pool_job *job,
+				  void *data)
+{
+	struct wgm_iface_for_each_data *d = data;
+
+	return d->fn(ctx, job->name, d->arg, d->out_args);
+}
+
+/*
+ * Order the jobs by bind device; @reverse is for taking interfaces down.
+ */
+#define WGM_IFACE_EACH_BIND_ORDER	(1u << 0)
+#define WGM_IFACE_EACH_REVERSE		(1u << 1)
+
+/*
+ * Print the output of every interface as one JSON array.
+ */
+#define WGM_IFACE_EACH_JSON		(1u << 2)
+
+/*
+ * Run @fn for the interface given with --dev, or, with a list, patterns
+ * or --all, for every matching interface on a pool of workers (--jobs,
+ * default: one per CPU). A single --dev name runs in this process,
+ * exactly as before.
+ */
+static int wgm_iface_for_each(struct wgm_ctx *ctx, struct wgm_iface_arg *arg,
+			      uint64_t out_args, wgm_iface_dev_fn_t fn, unsigned int flags)
+{
+	struct wgm_iface_for_each_data data = {
+		.fn = fn,
+		.arg = arg,
+		.out_args = out_args,
+	};
+	struct wgm_str_array devs;
+	struct wgm_pool_job *jobs;
+	unsigned int nr_workers;
+	size_t i;
+	int ret;
+
+	if (!(out_args & (IFACE_ARG_DEV | IFACE_ARG_ALL))) {
+		wgm_log_err("Error: Option '--dev' or '--all' is required\n\n");
+		wgm_iface_show_usage();
+		return -EINVAL;
+	}
+
+	if ((out_args & IFACE_ARG_DEV) && (out_args & IFACE_ARG_ALL)) {
+		wgm_log_err("Error: Options '--dev' and '--all' are mutually exclusive\n");
+		return -EINVAL;
+	}
+
+	if (!arg->multi)
+		return fn(ctx, arg->ifname, arg, out_args);
+
+	/*
+	 * A version belongs to one interface.
+	 */
+	if (out_args & IFACE_ARG_IF_VERSION) {
+		wgm_log_err("Error: Option '--if-version' takes a single interface\n");
+		return -EINVAL;
+	}
+
+	/*
+	 * The plan is printed instead of the JSON the workers merge.
+	 */
+	if (out_args & IFACE_ARG_PLAN) {
+		wgm_log_err("Error: Option '--plan' takes a single interface\n");
+		return -EINVAL;
+	}
+
+	memset(&devs, 0, sizeof(devs));
+	ret = wgm_iface_resolve_devs(ctx, arg, out_args, &devs);
+	if (ret)
+		return ret;
+
+	if (!devs.nr) {
+		if (flags & WGM_IFACE_EACH_JSON)
+			printf("[]\n");
+		return 0;
+	}
+
+	jobs = calloc(devs.nr, sizeof(*jobs));
+	if (!jobs) {
+		wgm_log_err("Error: wgm_iface_for_each: Failed to allocate memory\n");
+		wgm_str_array_free(&devs);
+		return -ENOMEM;
+	}
 
-void wgm_iface_dump_json(const struct wgm_iface *iface)
-{
-	char *jstr;
+	for (i = 0; i < devs.nr; i++)
+		strncpyl(jobs[i].name, devs.arr[i], sizeof(jobs[i].name));
 
-	jstr = wgm_iface_to_json_str(iface);
-	if (!jstr) {
-		wgm_log_err("Error: wgm_iface_dump_json: Failed to convert interface data to JSON\n");
-		return;
+	if (flags & WGM_IFACE_EACH_BIND_ORDER) {
+		ret = wgm_iface_order_by_bind_dev(ctx, jobs, devs.nr,
+						  !!(flags & WGM_IFACE_EACH_REVERSE));
+		if (ret)
+			goto out;
 	}
 
-	printf("%s\n", jstr);
-	free(jstr);
+	nr_workers = arg->jobs ? arg->jobs : wgm_pool_default_workers();
+	ret = wgm_pool_run(ctx, jobs, devs.nr, nr_workers,
+			   (flags & WGM_IFACE_EACH_JSON) ? WGM_POOL_JSON_ARRAY : WGM_POOL_SUMMARY,
+			   wgm_iface_for_each_job, &data);
+out:
+	wgm_pool_free_jobs(jobs, devs.nr);
+	wgm_str_array_free(&devs);
+	return ret;
 }
 
 int wgm_iface_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
@@ -871,11 +2612,16 @@ int wgm_iface_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 	static const uint64_t req_args = IFACE_ARG_DEV | IFACE_ARG_LISTEN_PORT |
 					  IFACE_ARG_PRIVATE_KEY | IFACE_ARG_ADDRESS |
 					  IFACE_ARG_MTU | IFACE_ARG_ALLOWED_IPS;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP | IFACE_ARG_FORCE;
+	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP | IFACE_ARG_FORCE |
+					      IFACE_ARG_SHARDS | IFACE_ARG_IF_VERSION |
+					      IFACE_ARG_FLOWTABLE | IFACE_ARG_PLAN |
+					      IFACE_ARG_FILTER_FORWARD;
 
+	struct wgm_plan plan = { 0 };
 	struct wgm_iface_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -885,6 +2631,15 @@ int wgm_iface_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		return ret;
 
+	if (out_args & IFACE_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (!ret) {
 		if (!arg.force) {
@@ -899,111 +2654,243 @@ int wgm_iface_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 		}
 	}
 
+	/*
+	 * An interface that does not exist yet is at version 0.
+	 */
+	if (out_args & IFACE_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
 	ret = apply_iface(&iface, &arg, out_args, ctx);
-	wgm_iface_dump_json(&iface);
+	if (!ctx->plan)
+		wgm_iface_dump_json(&iface);
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
 	wgm_iface_free_arg(&arg);
 	return ret;
 }
 
+static int wgm_iface_up_dev(struct wgm_ctx *ctx, const char *ifname,
+			    struct wgm_iface_arg *arg, uint64_t out_args)
+{
+	struct wgm_iface iface;
+	int lock_fd;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	lock_fd = wgm_iface_lock(ctx, ifname, true);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load(&iface, ctx, ifname);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_cmd_up: Failed to load interface '%s': %s\n", ifname, strerror(-ret));
+		goto out;
+	}
+
+	ret = wgm_conf_save(&iface, ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_cmd_up: Failed to save configuration: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	ret = wgm_conf_up(&iface, ctx);
+
+out:
+	wgm_iface_unlock(lock_fd);
+	wgm_iface_free(&iface);
+	return ret;
+}
+
 int wgm_iface_cmd_up(int argc, char *argv[], struct wgm_ctx *ctx)
 {
-	static const uint64_t req_args = IFACE_ARG_DEV;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP;
+	static const uint64_t allowed_args = IFACE_ARG_DEV | IFACE_ARG_HELP |
+					      IFACE_ARG_ALL | IFACE_ARG_JOBS;
 
 	struct wgm_iface_arg arg;
-	struct wgm_iface iface;
 	uint64_t out_args = 0;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
-	memset(&iface, 0, sizeof(iface));
 
-	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, req_args, &out_args);
+	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, 0, &out_args);
 	if (ret)
 		return ret;
 
-	ret = wgm_iface_load(&iface, ctx, arg.ifname);
+	ret = wgm_iface_for_each(ctx, &arg, out_args, wgm_iface_up_dev,
+				 WGM_IFACE_EACH_BIND_ORDER);
+	wgm_iface_free_arg(&arg);
+	return ret;
+}
+
+static int wgm_iface_reload_dev(struct wgm_ctx *ctx, const char *ifname,
+				struct wgm_iface_arg *arg, uint64_t out_args)
+{
+	struct wgm_iface iface;
+	int lock_fd;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	lock_fd = wgm_iface_lock(ctx, ifname, true);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load(&iface, ctx, ifname);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_up: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		wgm_log_err("Error: wgm_iface_cmd_reload: Failed to load interface '%s': %s\n", ifname, strerror(-ret));
 		goto out;
 	}
 
-	ret = wgm_iface_save(&iface, ctx);
+	ret = wgm_conf_save(&iface, ctx);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_up: Failed to save interface data: %s\n", strerror(-ret));
+		wgm_log_err("Error: wgm_iface_cmd_reload: Failed to save configuration: %s\n", strerror(-ret));
 		goto out;
 	}
 
-	ret = wgm_conf_up(&iface, ctx);
+	ret = wgm_conf_restart_if_changed(&iface, ctx);
 
 out:
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
-	wgm_iface_free_arg(&arg);
 	return ret;
 }
 
-int wgm_iface_cmd_down(int argc, char *argv[], struct wgm_ctx *ctx)
+int wgm_iface_cmd_reload(int argc, char *argv[], struct wgm_ctx *ctx)
 {
-	static const uint64_t req_args = IFACE_ARG_DEV;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP;
+	static const uint64_t allowed_args = IFACE_ARG_DEV | IFACE_ARG_HELP |
+					      IFACE_ARG_ALL | IFACE_ARG_JOBS;
 
 	struct wgm_iface_arg arg;
-	struct wgm_iface iface;
 	uint64_t out_args = 0;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
-	memset(&iface, 0, sizeof(iface));
 
-	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, req_args, &out_args);
+	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, 0, &out_args);
 	if (ret)
 		return ret;
 
-	ret = wgm_iface_load(&iface, ctx, arg.ifname);
+	ret = wgm_iface_for_each(ctx, &arg, out_args, wgm_iface_reload_dev,
+				 WGM_IFACE_EACH_BIND_ORDER);
+	wgm_iface_free_arg(&arg);
+	return ret;
+}
+
+static int wgm_iface_down_dev(struct wgm_ctx *ctx, const char *ifname,
+			      struct wgm_iface_arg *arg, uint64_t out_args)
+{
+	struct wgm_iface iface;
+	int lock_fd;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	lock_fd = wgm_iface_lock(ctx, ifname, true);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load(&iface, ctx, ifname);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_down: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		wgm_log_err("Error: wgm_iface_cmd_down: Failed to load interface '%s': %s\n", ifname, strerror(-ret));
 		goto out;
 	}
 
 	ret = wgm_conf_down(&iface, ctx);
 
 out:
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
-	wgm_iface_free_arg(&arg);
 	return ret;
 }
 
-int wgm_iface_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx)
+int wgm_iface_cmd_down(int argc, char *argv[], struct wgm_ctx *ctx)
 {
-	static const uint64_t req_args = IFACE_ARG_DEV;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_LISTEN_PORT |
-					      IFACE_ARG_PRIVATE_KEY | IFACE_ARG_ADDRESS |
-					      IFACE_ARG_MTU | IFACE_ARG_ALLOWED_IPS |
-					      IFACE_ARG_HELP | IFACE_ARG_FORCE;
+	static const uint64_t allowed_args = IFACE_ARG_DEV | IFACE_ARG_HELP |
+					      IFACE_ARG_ALL | IFACE_ARG_JOBS;
 
 	struct wgm_iface_arg arg;
-	struct wgm_iface iface;
 	uint64_t out_args = 0;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
-	memset(&iface, 0, sizeof(iface));
-	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, req_args, &out_args);
+
+	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, 0, &out_args);
 	if (ret)
 		return ret;
 
-	ret = wgm_iface_load(&iface, ctx, arg.ifname);
+	ret = wgm_iface_for_each(ctx, &arg, out_args, wgm_iface_down_dev,
+				 WGM_IFACE_EACH_BIND_ORDER | WGM_IFACE_EACH_REVERSE);
+	wgm_iface_free_arg(&arg);
+	return ret;
+}
+
+static int wgm_iface_update_dev(struct wgm_ctx *ctx, const char *ifname,
+				struct wgm_iface_arg *arg, uint64_t out_args)
+{
+	struct wgm_plan plan = { 0 };
+	struct wgm_iface iface;
+	int lock_fd;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	if (out_args & IFACE_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
+	ret = wgm_iface_load(&iface, ctx, ifname);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_update: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		wgm_log_err("Error: wgm_iface_cmd_update: Failed to load interface '%s': %s\n", ifname, strerror(-ret));
 		goto out;
 	}
 
-	ret = apply_iface(&iface, &arg, out_args, ctx);
-	wgm_iface_dump_json(&iface);
+	if (out_args & IFACE_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg->if_version);
+		if (ret)
+			goto out;
+	}
+
+	/*
+	 * The name is the one being updated, never a pattern.
+	 */
+	ret = apply_iface(&iface, arg, out_args & ~IFACE_ARG_DEV, ctx);
+	if (!ctx->plan)
+		wgm_iface_dump_json(&iface);
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
+	return ret;
+}
+
+int wgm_iface_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	static const uint64_t allowed_args = IFACE_ARG_DEV | IFACE_ARG_LISTEN_PORT |
+					      IFACE_ARG_PRIVATE_KEY | IFACE_ARG_ADDRESS |
+					      IFACE_ARG_MTU | IFACE_ARG_ALLOWED_IPS |
+					      IFACE_ARG_HELP | IFACE_ARG_FORCE |
+					      IFACE_ARG_IF_VERSION | IFACE_ARG_ALL |
+					      IFACE_ARG_JOBS | IFACE_ARG_FLOWTABLE |
+					      IFACE_ARG_PLAN | IFACE_ARG_FILTER_FORWARD;
+
+	struct wgm_iface_arg arg;
+	uint64_t out_args = 0;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, 0, &out_args);
+	if (ret)
+		return ret;
+
+	ret = wgm_iface_for_each(ctx, &arg, out_args, wgm_iface_update_dev,
+				 WGM_IFACE_EACH_JSON);
 	wgm_iface_free_arg(&arg);
 	return ret;
 }
@@ -1011,11 +2898,13 @@ out:
 int wgm_iface_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 {
 	static const uint64_t req_args = IFACE_ARG_DEV;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP | IFACE_ARG_FORCE;
+	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP | IFACE_ARG_FORCE |
+					      IFACE_ARG_IF_VERSION;
 
 	struct wgm_iface_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -1025,6 +2914,12 @@ int wgm_iface_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		return ret;
 
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
 		if (arg.force)
@@ -1034,21 +2929,78 @@ int wgm_iface_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 		goto out;
 	}
 
+	if (out_args & IFACE_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
 	ret = wgm_iface_del(&iface, ctx);
 out:
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
 	wgm_iface_free_arg(&arg);
 	return ret;
 }
 
+static int wgm_iface_show_dev(struct wgm_ctx *ctx, const char *ifname,
+			      struct wgm_iface_arg *arg, uint64_t out_args)
+{
+	struct wgm_iface iface;
+	int lock_fd;
+	int ret;
+
+	memset(&iface, 0, sizeof(iface));
+	lock_fd = wgm_iface_lock(ctx, ifname, false);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load(&iface, ctx, ifname);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_cmd_show: Failed to load interface '%s': %s\n", ifname, strerror(-ret));
+		goto out;
+	}
+
+	wgm_iface_dump_json(&iface);
+	ret = 0;
+out:
+	wgm_iface_unlock(lock_fd);
+	wgm_iface_free(&iface);
+	return ret;
+}
+
 int wgm_iface_cmd_show(int argc, char *argv[], struct wgm_ctx *ctx)
 {
-	static const uint64_t req_args = IFACE_ARG_DEV;
-	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP;
+	static const uint64_t allowed_args = IFACE_ARG_DEV | IFACE_ARG_HELP |
+					      IFACE_ARG_ALL | IFACE_ARG_JOBS;
+
+	struct wgm_iface_arg arg;
+	uint64_t out_args = 0;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+
+	ret = wgm_iface_getopt(argc, argv, &arg, allowed_args, 0, &out_args);
+	if (ret)
+		return ret;
+
+	ret = wgm_iface_for_each(ctx, &arg, out_args, wgm_iface_show_dev,
+				 WGM_IFACE_EACH_JSON);
+	wgm_iface_free_arg(&arg);
+	return ret;
+}
+
+int wgm_iface_cmd_rebalance(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	static const uint64_t req_args = IFACE_ARG_DEV | IFACE_ARG_SHARDS;
+	static const uint64_t allowed_args = req_args | IFACE_ARG_HELP | IFACE_ARG_IF_VERSION |
+					      IFACE_ARG_PLAN;
 
+	struct wgm_plan plan = { 0 };
 	struct wgm_iface_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -1058,15 +3010,39 @@ int wgm_iface_cmd_show(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		return ret;
 
+	if (out_args & IFACE_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_show: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		wgm_log_err("Error: wgm_iface_cmd_rebalance: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
-	wgm_iface_dump_json(&iface);
-	ret = 0;
+	if (out_args & IFACE_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
+	ret = wgm_iface_set_shards(&iface, arg.nr_shards, ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_iface_cmd_rebalance: Failed to save interface data: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	if (!ctx->plan)
+		wgm_iface_dump_json(&iface);
+
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_iface_free(&iface);
 	wgm_iface_free_arg(&arg);
 	return ret;
@@ -1077,15 +3053,16 @@ int wgm_iface_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 	static const uint64_t allowed_args = IFACE_ARG_HELP;
 
 	struct wgm_iface_array ifaces;
+	struct wgm_str_array names;
 	struct wgm_iface_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
-	struct dirent *ent;
-	char *dir_path;
-	DIR *dir;
+	int lock_fd;
+	size_t i;
 	int ret;
 
 	memset(&ifaces, 0, sizeof(ifaces));
+	memset(&names, 0, sizeof(names));
 	memset(&iface, 0, sizeof(iface));
 	memset(&arg, 0, sizeof(arg));
 
@@ -1093,49 +3070,21 @@ int wgm_iface_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		return ret;
 
-	ret = wgm_asprintf(&dir_path, "%s/json", ctx->data_dir);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_cmd_list: Failed to allocate memory\n");
-		wgm_iface_free_arg(&arg);
-		return -ENOMEM;
-	}
-
-	dir = opendir(dir_path);
-	free(dir_path);
-	if (!dir) {
-		ret = -errno;
-		wgm_log_err("Error: wgm_iface_cmd_list: Failed to open directory '%s': %s\n", ctx->data_dir, strerror(-ret));
+	ret = wgm_iface_list_names(ctx, &names);
+	if (ret)
 		return ret;
-	}
-
-	while (1) {
-		size_t len;
-		char *name;
 
-		ent = readdir(dir);
-		if (!ent)
+	for (i = 0; i < names.nr; i++) {
+		lock_fd = wgm_iface_lock(ctx, names.arr[i], false);
+		if (lock_fd < 0) {
+			ret = lock_fd;
 			break;
+		}
 
-		if (ent->d_type != DT_REG)
-			continue;
-
-		name = ent->d_name;
-
-		/*
-		 * Ensure the file ends with '.json'.
-		 */
-		len = strlen(name);
-		if (len < 5 || strcmp(name + len - 5, ".json"))
-			continue;
-
-		/*
-		 * Remove the '.json' extension.
-		 */
-		name[len - 5] = '\0';
-
-		ret = wgm_iface_load(&iface, ctx, name);
+		ret = wgm_iface_load(&iface, ctx, names.arr[i]);
+		wgm_iface_unlock(lock_fd);
 		if (ret) {
-			wgm_log_err("Error: wgm_iface_cmd_list: Failed to load interface '%s': %s\n", ent->d_name, strerror(-ret));
+			wgm_log_err("Error: wgm_iface_cmd_list: Failed to load interface '%s': %s\n", names.arr[i], strerror(-ret));
 			break;
 		}
 
@@ -1147,11 +3096,10 @@ int wgm_iface_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 		}
 	}
 
-	closedir(dir);
-
 	if (!ret)
 		wgm_iface_array_dump_json(&ifaces);
 
+	wgm_str_array_free(&names);
 	wgm_iface_array_free(&ifaces);
 	return ret;
 }
@@ -1180,33 +3128,15 @@ int wgm_iface_array_add(struct wgm_iface_array *ifaces, const struct wgm_iface *
 	return 0;
 }
 
-int wgm_iface_array_to_json(json_object **jobj, const struct wgm_iface_array *ifaces)
+int wgm_iface_array_write_json(struct wgm_jwriter *w, const struct wgm_iface_array *ifaces)
 {
-	json_object *jarr;
 	size_t i;
-	int ret;
-
-	jarr = json_object_new_array();
-	if (!jarr) {
-		wgm_log_err("Error: wgm_iface_array_to_json: Failed to create JSON array\n");
-		return -ENOMEM;
-	}
 
-	for (i = 0; i < ifaces->nr; i++) {
-		json_object *jiface;
-
-		ret = wgm_iface_to_json(&jiface, &ifaces->ifaces[i]);
-		if (ret) {
-			wgm_log_err("Error: wgm_iface_array_to_json: Failed to convert interface data to JSON\n");
-			json_object_put(jarr);
-			return ret;
-		}
-
-		json_object_array_add(jarr, jiface);
-	}
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < ifaces->nr; i++)
+		wgm_iface_write_json(w, &ifaces->ifaces[i]);
 
-	*jobj = jarr;
-	return 0;
+	return wgm_jw_arr_end(w);
 }
 
 int wgm_iface_copy(struct wgm_iface *dst, const struct wgm_iface *src)
@@ -1218,6 +3148,12 @@ int wgm_iface_copy(struct wgm_iface *dst, const struct wgm_iface *src)
 	dst->listen_port = src->listen_port;
 	dst->mtu = src->mtu;
 	memcpy(dst->private_key, src->private_key, sizeof(dst->private_key));
+	dst->version = src->version;
+	dst->nr_shards = src->nr_shards;
+	dst->flowtable = src->flowtable;
+	dst->filter_forward = src->filter_forward;
+	dst->shard_track = src->shard_track;
+	memcpy(dst->shard_dirty, src->shard_dirty, sizeof(dst->shard_dirty));
 
 	ret = wgm_str_array_copy(&dst->addresses, &src->addresses);
 	if (ret) {
@@ -1255,17 +3191,7 @@ void wgm_iface_move(struct wgm_iface *dst, struct wgm_iface *src)
 
 void wgm_iface_array_dump_json(const struct wgm_iface_array *ifaces)
 {
-	json_object *jobj;
-	int ret;
-
-	ret = wgm_iface_array_to_json(&jobj, ifaces);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_array_dump_json: Failed to convert interface array to JSON\n");
-		return;
-	}
-
-	printf("%s\n", json_object_to_json_string_ext(jobj, WGM_JSON_FLAGS));
-	json_object_put(jobj);
+	wgm_jw_dump(write_iface_array, ifaces, "interface array");
 }
 
 void wgm_iface_array_free(struct wgm_iface_array *ifaces)
@@ -1281,15 +3207,5 @@ void wgm_iface_array_free(struct wgm_iface_array *ifaces)
 
 void wgm_iface_peer_array_dump_json(const struct wgm_peer_array *peers)
 {
-	json_object *jobj;
-	int ret;
-
-	ret = wgm_peer_array_to_json(&jobj, peers);
-	if (ret) {
-		wgm_log_err("Error: wgm_iface_peer_array_dump_json: Failed to convert peer array to JSON\n");
-		return;
-	}
-
-	printf("%s\n", json_object_to_json_string_ext(jobj, WGM_JSON_FLAGS));
-	json_object_put(jobj);
+	wgm_jw_dump(write_peer_array, peers, "peer array");
 }
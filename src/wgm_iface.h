@@ -5,21 +5,51 @@
 #include "helpers.h"
 
 struct wgm_peer;
+struct wgm_jwriter;
+struct wgm_pool_job;
 
 struct wgm_peer_array {
 	struct wgm_peer	*peers;
 	size_t		nr;
 };
 
+/*
+ * Peers of a sharded interface (nr_shards > 0) are spread over
+ * nr_shards files by public-key hash. When @shard_track is set, only
+ * shards marked in @shard_dirty are rewritten on save.
+ */
+#define WGM_MAX_SHARDS 1024
+
 struct wgm_iface {
 	char			ifname[IFNAMSIZ];
 	uint16_t		listen_port;
 	uint16_t		mtu;
 	char			private_key[128];
 
+	/*
+	 * Bumped by every save; see --if-version.
+	 */
+	uint64_t		version;
+
 	struct wgm_str_array	addresses;
 	struct wgm_str_array	allowed_ips;
 	struct wgm_peer_array	peers;
+
+	/*
+	 * Offload established forwarded flows to an nftables flowtable,
+	 * see wgm_conf_write_flowtable().
+	 */
+	bool			flowtable;
+
+	/*
+	 * Hook the filter chain into FORWARD, where its ACCEPT rules take
+	 * precedence over the FORWARD policy; see wgm_conf_write_iptables().
+	 */
+	bool			filter_forward;
+
+	uint32_t		nr_shards;
+	bool			shard_track;
+	uint64_t		shard_dirty[WGM_MAX_SHARDS / 64];
 };
 
 struct wgm_iface_array {
@@ -28,31 +58,50 @@ struct wgm_iface_array {
 };
 
 int wgm_iface_cmd_up(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_iface_cmd_reload(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_down(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_show(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_iface_cmd_rebalance(int argc, char *argv[], struct wgm_ctx *ctx);
 int wgm_iface_load(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname);
-int wgm_iface_save(const struct wgm_iface *iface, struct wgm_ctx *ctx);
+int wgm_iface_load_meta(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname);
+int wgm_iface_list_names(struct wgm_ctx *ctx, struct wgm_str_array *names);
+int wgm_iface_order_jobs(struct wgm_pool_job *jobs, size_t nr,
+			 const struct wgm_str_array *binds, bool reverse);
+int wgm_iface_load_json_c(struct wgm_iface *iface, struct wgm_ctx *ctx, const char *devname);
+int wgm_iface_save(struct wgm_iface *iface, struct wgm_ctx *ctx);
+int wgm_iface_save_peer(struct wgm_iface *iface, const struct wgm_peer *peer,
+			struct wgm_ctx *ctx);
+int wgm_iface_load_peer(struct wgm_ctx *ctx, const char *devname, const char *pubkey,
+			struct wgm_peer *peer);
+int wgm_iface_lock(struct wgm_ctx *ctx, const char *devname, bool exclusive);
+void wgm_iface_unlock(int fd);
+uint64_t wgm_iface_store_bytes(const struct wgm_iface *iface, struct wgm_ctx *ctx);
 int wgm_iface_copy(struct wgm_iface *dst, const struct wgm_iface *src);
 void wgm_iface_move(struct wgm_iface *dst, struct wgm_iface *src);
 
 int wgm_iface_add_peer(struct wgm_iface *iface, const struct wgm_peer *peer, bool force_update);
 int wgm_iface_del_peer(struct wgm_iface *iface, size_t idx);
 int wgm_iface_del_peer_by_pubkey(struct wgm_iface *iface, const char *pubkey);
+void wgm_iface_mark_peer_dirty(struct wgm_iface *iface, const char *pubkey);
 int wgm_iface_get_peer_by_pubkey(const struct wgm_iface *iface, const char *pubkey, struct wgm_peer **peer);
 
 void wgm_iface_free(struct wgm_iface *iface);
 void wgm_iface_dump_json(const struct wgm_iface *iface);
+int wgm_iface_write_json(struct wgm_jwriter *w, const struct wgm_iface *iface);
 
 void wgm_iface_array_free(struct wgm_iface_array *ifaces);
 int wgm_iface_array_add(struct wgm_iface_array *ifaces, const struct wgm_iface *iface);
-int wgm_iface_array_to_json(json_object **jobj, const struct wgm_iface_array *ifaces);
+int wgm_iface_array_write_json(struct wgm_jwriter *w, const struct wgm_iface_array *ifaces);
 void wgm_iface_array_dump_json(const struct wgm_iface_array *ifaces);
 
 int wgm_iface_opt_get_dev(char *ifname, size_t iflen, const char *dev);
+int wgm_iface_opt_get_version(uint64_t *version, const char *str);
+int wgm_iface_check_version(const struct wgm_iface *iface, uint64_t version);
+int wgm_iface_set_version(struct wgm_ctx *ctx, const char *devname, uint64_t version);
 void wgm_iface_peer_array_dump_json(const struct wgm_peer_array *peers);
 
 #endif /* #ifndef WGM__WG_IFACE_H */
@@ -0,0 +1,488 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm_index.h"
+#include "wgm_iface.h"
+#include "wgm_peer.h"
+#include "wgm_json.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define WGM_INDEX_MAGIC		"WGMIDX1"
+#define WGM_INDEX_MAX_RECORD	(16u * 1024u * 1024u)
+
+struct wgm_index_hdr {
+	char		magic[8];
+	uint64_t	store_size;
+	uint64_t	store_ino;
+	int64_t		store_mtime_sec;
+	int64_t		store_mtime_nsec;
+	uint32_t	nr_slots;
+	uint32_t	nr_peers;
+};
+
+/*
+ * A zero hash marks an empty slot. @cap is the number of bytes the
+ * record may occupy when rewritten in place; a shorter record is
+ * padded with whitespace.
+ */
+struct wgm_index_slot {
+	uint64_t	hash;
+	uint64_t	off;
+	uint32_t	len;
+	uint32_t	cap;
+};
+
+static char *get_index_path(const char *store_path)
+{
+	size_t len = strlen(store_path);
+	char *ret;
+
+	if (len > 5 && !strcmp(store_path + len - 5, ".json"))
+		len -= 5;
+
+	if (wgm_asprintf(&ret, "%.*s.idx", (int)len, store_path))
+		return NULL;
+
+	return ret;
+}
+
+static void hdr_set_store(struct wgm_index_hdr *hdr, const struct stat *st)
+{
+	hdr->store_size = (uint64_t)st->st_size;
+	hdr->store_ino = (uint64_t)st->st_ino;
+	hdr->store_mtime_sec = (int64_t)st->st_mtim.tv_sec;
+	hdr->store_mtime_nsec = (int64_t)st->st_mtim.tv_nsec;
+}
+
+static bool hdr_matches_store(const struct wgm_index_hdr *hdr, const struct stat *st)
+{
+	return hdr->store_size == (uint64_t)st->st_size &&
+	       hdr->store_ino == (uint64_t)st->st_ino &&
+	       hdr->store_mtime_sec == (int64_t)st->st_mtim.tv_sec &&
+	       hdr->store_mtime_nsec == (int64_t)st->st_mtim.tv_nsec;
+}
+
+static off_t slot_pos(uint32_t slot)
+{
+	return (off_t)sizeof(struct wgm_index_hdr) +
+	       (off_t)slot * (off_t)sizeof(struct wgm_index_slot);
+}
+
+static int pread_full(int fd, void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	ret = pread(fd, buf, len, off);
+	if (ret < 0)
+		return -errno;
+
+	return (size_t)ret == len ? 0 : -ESTALE;
+}
+
+static int pwrite_full(int fd, const void *buf, size_t len, off_t off)
+{
+	ssize_t ret;
+
+	ret = pwrite(fd, buf, len, off);
+	if (ret < 0)
+		return -errno;
+
+	return (size_t)ret == len ? 0 : -EIO;
+}
+
+void wgm_index_remove(const char *store_path)
+{
+	char *path = get_index_path(store_path);
+
+	if (path) {
+		unlink(path);
+		free(path);
+	}
+}
+
+int wgm_index_build(const char *store_path, int store_fd,
+		    const struct wgm_peer_array *peers,
+		    const struct wgm_index_ent *ents)
+{
+	struct wgm_index_slot *slots;
+	struct wgm_index_hdr hdr;
+	char *path, *tmp_path;
+	uint32_t nr_slots = 16;
+	struct stat st;
+	size_t i;
+	FILE *fp;
+	int ret;
+
+	if (fstat(store_fd, &st))
+		return -errno;
+
+	/*
+	 * Keep the load factor at or below one half so that probe
+	 * sequences stay short.
+	 */
+	while (nr_slots < peers->nr * 2) {
+		if (nr_slots >= (1u << 31))
+			return -E2BIG;
+		nr_slots <<= 1;
+	}
+
+	slots = calloc(nr_slots, sizeof(*slots));
+	if (!slots)
+		return -ENOMEM;
+
+	for (i = 0; i < peers->nr; i++) {
+		uint64_t h = wgm_hash_str(peers->peers[i].public_key);
+		uint32_t s = (uint32_t)h & (nr_slots - 1);
+
+		while (slots[s].hash)
+			s = (s + 1) & (nr_slots - 1);
+
+		slots[s].hash = h;
+		slots[s].off = ents[i].off;
+		slots[s].len = ents[i].len;
+		slots[s].cap = ents[i].len;
+	}
+
+	memset(&hdr, 0, sizeof(hdr));
+	memcpy(hdr.magic, WGM_INDEX_MAGIC, sizeof(hdr.magic));
+	hdr_set_store(&hdr, &st);
+	hdr.nr_slots = nr_slots;
+	hdr.nr_peers = (uint32_t)peers->nr;
+
+	ret = -ENOMEM;
+	path = get_index_path(store_path);
+	if (!path)
+		goto out_free_slots;
+
+	if (wgm_asprintf(&tmp_path, "%s.tmp", path))
+		goto out_free_path;
+
+	fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		ret = -errno;
+		goto out_free_tmp;
+	}
+
+	if (fwrite(&hdr, sizeof(hdr), 1, fp) != 1 ||
+	    fwrite(slots, sizeof(*slots), nr_slots, fp) != nr_slots)
+		ret = errno ? -errno : -EIO;
+	else
+		ret = 0;
+
+	if (fclose(fp) && !ret)
+		ret = -errno;
+
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+
+	if (ret)
+		unlink(tmp_path);
+
+out_free_tmp:
+	free(tmp_path);
+out_free_path:
+	free(path);
+out_free_slots:
+	free(slots);
+	return ret;
+}
+
+static int open_index(const char *store_path, int flags, int *idx_fd,
+		      int *store_fd, struct wgm_index_hdr *hdr)
+{
+	struct stat st;
+	char *path;
+	int ret;
+
+	path = get_index_path(store_path);
+	if (!path)
+		return -ENOMEM;
+
+	/*
+	 * Both files are about to be patched in place.
+	 */
+	if (flags & O_RDWR) {
+		ret = wgm_unshare_file(store_path, true);
+		if (!ret)
+			ret = wgm_unshare_file(path, true);
+		if (ret) {
+			free(path);
+			return ret;
+		}
+	}
+
+	*idx_fd = open(path, flags | O_CLOEXEC);
+	free(path);
+	if (*idx_fd < 0)
+		return -ESTALE;
+
+	*store_fd = open(store_path, flags | O_CLOEXEC);
+	if (*store_fd < 0) {
+		ret = -errno;
+		goto out_close_idx;
+	}
+
+	ret = pread_full(*idx_fd, hdr, sizeof(*hdr), 0);
+	if (ret)
+		goto out_close_store;
+
+	if (memcmp(hdr->magic, WGM_INDEX_MAGIC, sizeof(hdr->magic)) ||
+	    !hdr->nr_slots || (hdr->nr_slots & (hdr->nr_slots - 1))) {
+		ret = -ESTALE;
+		goto out_close_store;
+	}
+
+	if (fstat(*store_fd, &st)) {
+		ret = -errno;
+		goto out_close_store;
+	}
+
+	if (!hdr_matches_store(hdr, &st)) {
+		ret = -ESTALE;
+		goto out_close_store;
+	}
+
+	return 0;
+
+out_close_store:
+	close(*store_fd);
+out_close_idx:
+	close(*idx_fd);
+	return ret;
+}
+
+/*
+ * Re-stamp the index of @store_path after the caller changed the store
+ * without moving or resizing any record (with the interface locked).
+ */
+int wgm_index_sync_store(const char *store_path)
+{
+	struct wgm_index_hdr hdr;
+	int idx_fd, store_fd;
+	struct stat st;
+	char *path;
+	int ret;
+
+	path = get_index_path(store_path);
+	if (!path)
+		return -ENOMEM;
+
+	ret = wgm_unshare_file(path, true);
+	if (ret) {
+		free(path);
+		return ret;
+	}
+
+	idx_fd = open(path, O_RDWR | O_CLOEXEC);
+	free(path);
+	if (idx_fd < 0)
+		return -errno;
+
+	store_fd = open(store_path, O_RDONLY | O_CLOEXEC);
+	if (store_fd < 0) {
+		ret = -errno;
+		goto out_close_idx;
+	}
+
+	ret = pread_full(idx_fd, &hdr, sizeof(hdr), 0);
+	if (ret)
+		goto out_close_store;
+
+	if (memcmp(hdr.magic, WGM_INDEX_MAGIC, sizeof(hdr.magic))) {
+		ret = -ESTALE;
+		goto out_close_store;
+	}
+
+	if (fstat(store_fd, &st)) {
+		ret = -errno;
+		goto out_close_store;
+	}
+
+	hdr_set_store(&hdr, &st);
+	ret = pwrite_full(idx_fd, &hdr, sizeof(hdr), 0);
+
+out_close_store:
+	close(store_fd);
+out_close_idx:
+	close(idx_fd);
+	return ret;
+}
+
+static int read_record(int store_fd, const struct wgm_index_slot *slot,
+		       struct wgm_peer *peer)
+{
+	struct wgm_jparser p;
+	char *buf;
+	int ret;
+
+	if (!slot->len || slot->len > slot->cap || slot->cap > WGM_INDEX_MAX_RECORD)
+		return -ESTALE;
+
+	buf = malloc(slot->len);
+	if (!buf)
+		return -ENOMEM;
+
+	ret = pread_full(store_fd, buf, slot->len, (off_t)slot->off);
+	if (!ret) {
+		wgm_jp_init(&p, buf, slot->len);
+		ret = wgm_peer_from_jparser(peer, &p);
+		if (!ret)
+			ret = wgm_jp_finish(&p);
+		if (ret) {
+			wgm_peer_free(peer);
+			ret = -ESTALE;
+		}
+	}
+
+	free(buf);
+	return ret;
+}
+
+/*
+ * Look @pubkey up and parse its record into @peer. Returns -ENOENT if
+ * the (valid) index says the peer does not exist and -ESTALE if the
+ * index cannot be used, in which case the caller has to fall back to
+ * loading the whole interface.
+ */
+int wgm_index_find_peer(const char *store_path, const char *pubkey,
+			struct wgm_peer *peer, struct wgm_index_loc *loc)
+{
+	uint64_t h = wgm_hash_str(pubkey);
+	struct wgm_index_slot slot;
+	struct wgm_index_hdr hdr;
+	int idx_fd, store_fd;
+	uint32_t i, s;
+	int ret;
+
+	ret = open_index(store_path, O_RDONLY, &idx_fd, &store_fd, &hdr);
+	if (ret)
+		return ret;
+
+	ret = -ENOENT;
+	for (i = 0; i < hdr.nr_slots; i++) {
+		s = ((uint32_t)h + i) & (hdr.nr_slots - 1);
+
+		ret = pread_full(idx_fd, &slot, sizeof(slot), slot_pos(s));
+		if (ret)
+			break;
+
+		if (!slot.hash) {
+			ret = -ENOENT;
+			break;
+		}
+
+		if (slot.hash != h) {
+			ret = -ENOENT;
+			continue;
+		}
+
+		ret = read_record(store_fd, &slot, peer);
+		if (ret)
+			break;
+
+		if (!strcmp(peer->public_key, pubkey)) {
+			loc->off = slot.off;
+			loc->len = slot.len;
+			loc->cap = slot.cap;
+			loc->slot = s;
+			break;
+		}
+
+		wgm_peer_free(peer);
+		ret = -ENOENT;
+	}
+
+	close(store_fd);
+	close(idx_fd);
+	return ret;
+}
+
+/*
+ * Overwrite the record at @loc with @peer if it fits into the space
+ * the old record occupied. Returns -ENOSPC if it does not, and the
+ * caller has to rewrite the whole store instead.
+ */
+int wgm_index_rewrite_peer(const char *store_path, struct wgm_index_loc *loc,
+			   const struct wgm_peer *peer)
+{
+	struct wgm_index_slot slot;
+	struct wgm_index_hdr hdr;
+	struct wgm_jwriter w;
+	int idx_fd, store_fd;
+	size_t len;
+	struct stat st;
+	int ret;
+
+	wgm_jw_init(&w, NULL, false);
+	wgm_peer_write_json(&w, peer);
+	if (w.err) {
+		ret = w.err;
+		goto out_free;
+	}
+
+	len = w.len;
+	if (len > loc->cap) {
+		ret = -ENOSPC;
+		goto out_free;
+	}
+
+	ret = open_index(store_path, O_RDWR, &idx_fd, &store_fd, &hdr);
+	if (ret)
+		goto out_free;
+
+	ret = pread_full(idx_fd, &slot, sizeof(slot), slot_pos(loc->slot));
+	if (ret)
+		goto out_close;
+
+	if (slot.off != loc->off || slot.cap != loc->cap) {
+		ret = -ESTALE;
+		goto out_close;
+	}
+
+	/*
+	 * JSON allows whitespace after the closing brace, so the unused
+	 * tail of the old record is blanked instead of moving the rest of
+	 * the file.
+	 */
+	while (w.len < loc->cap) {
+		if (wgm_jw_raw(&w, " ", 1)) {
+			ret = w.err;
+			goto out_close;
+		}
+	}
+
+	ret = pwrite_full(store_fd, w.buf, loc->cap, (off_t)loc->off);
+	if (ret)
+		goto out_drop;
+
+	if (fstat(store_fd, &st)) {
+		ret = -errno;
+		goto out_drop;
+	}
+
+	slot.len = (uint32_t)len;
+	hdr_set_store(&hdr, &st);
+	ret = pwrite_full(idx_fd, &slot, sizeof(slot), slot_pos(loc->slot));
+	if (!ret)
+		ret = pwrite_full(idx_fd, &hdr, sizeof(hdr), 0);
+
+	if (!ret) {
+		loc->len = slot.len;
+		goto out_close;
+	}
+
+out_drop:
+	/*
+	 * The store may have been modified already; never leave an index
+	 * behind that could point into the middle of a record.
+	 */
+	wgm_index_remove(store_path);
+out_close:
+	close(store_fd);
+	close(idx_fd);
+out_free:
+	wgm_jw_free(&w);
+	return ret;
+}
@@ -0,0 +1,41 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_INDEX_H
+#define WGM__WG_INDEX_H
+
+#include "helpers.h"
+
+struct wgm_peer;
+struct wgm_peer_array;
+
+/*
+ * Sidecar index of a store file: an open-addressing hash table from
+ * public key to the (offset, length) of the peer record inside the
+ * store, so a single peer can be read or rewritten with a handful of
+ * preads instead of parsing the whole interface.
+ *
+ * The index remembers the size, mtime and inode of the store it was
+ * built for and is ignored (-ESTALE) when they no longer match.
+ */
+struct wgm_index_ent {
+	uint64_t	off;
+	uint32_t	len;
+};
+
+struct wgm_index_loc {
+	uint64_t	off;
+	uint32_t	len;
+	uint32_t	cap;
+	uint32_t	slot;
+};
+
+int wgm_index_build(const char *store_path, int store_fd,
+		    const struct wgm_peer_array *peers,
+		    const struct wgm_index_ent *ents);
+int wgm_index_find_peer(const char *store_path, const char *pubkey,
+			struct wgm_peer *peer, struct wgm_index_loc *loc);
+int wgm_index_rewrite_peer(const char *store_path, struct wgm_index_loc *loc,
+			   const struct wgm_peer *peer);
+int wgm_index_sync_store(const char *store_path);
+void wgm_index_remove(const char *store_path);
+
+#endif /* #ifndef WGM__WG_INDEX_H */
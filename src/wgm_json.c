@@ -0,0 +1,856 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm_json.h"
+
+#include <limits.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+#define WGM_JP_MAX_DEPTH 64
+
+static inline bool is_ws(char c)
+{
+	return c == ' ' || c == '\n' || c == '\t' || c == '\r';
+}
+
+#ifdef __SSE2__
+/*
+ * Both scanners below look at 16 bytes per iteration. Store files are
+ * dominated by indentation runs (pretty mode) and base64/IP strings,
+ * so this is where the parser spends most of its time.
+ */
+static const char *skip_ws_simd(const char *s, const char *end)
+{
+	const __m128i sp = _mm_set1_epi8(' ');
+	const __m128i nl = _mm_set1_epi8('\n');
+	const __m128i tb = _mm_set1_epi8('\t');
+	const __m128i cr = _mm_set1_epi8('\r');
+
+	while (end - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		__m128i m = _mm_or_si128(_mm_or_si128(_mm_cmpeq_epi8(v, sp),
+						      _mm_cmpeq_epi8(v, nl)),
+					 _mm_or_si128(_mm_cmpeq_epi8(v, tb),
+						      _mm_cmpeq_epi8(v, cr)));
+		unsigned mask = (unsigned)_mm_movemask_epi8(m) ^ 0xffffu;
+
+		if (mask)
+			return s + __builtin_ctz(mask);
+
+		s += 16;
+	}
+
+	return s;
+}
+
+static const char *scan_str_simd(const char *s, const char *end)
+{
+	const __m128i quote = _mm_set1_epi8('"');
+	const __m128i bslash = _mm_set1_epi8('\\');
+
+	while (end - s >= 16) {
+		__m128i v = _mm_loadu_si128((const __m128i *)s);
+		__m128i m = _mm_or_si128(_mm_cmpeq_epi8(v, quote),
+					 _mm_cmpeq_epi8(v, bslash));
+		unsigned mask = (unsigned)_mm_movemask_epi8(m);
+
+		if (mask)
+			return s + __builtin_ctz(mask);
+
+		s += 16;
+	}
+
+	return s;
+}
+#else
+static const char *skip_ws_simd(const char *s, const char *end)
+{
+	return s;
+}
+
+static const char *scan_str_simd(const char *s, const char *end)
+{
+	return s;
+}
+#endif
+
+static inline void skip_ws(struct wgm_jparser *p)
+{
+	const char *s = p->cur, *end = p->end;
+
+	/*
+	 * Compact files mostly have no whitespace at all between tokens,
+	 * check a single byte before going wide.
+	 */
+	if (s < end && is_ws(*s))
+		s = skip_ws_simd(s + 1, end);
+
+	while (s < end && is_ws(*s))
+		s++;
+
+	p->cur = s;
+}
+
+/*
+ * Return a pointer to the first '"' or '\\' at or after @s, or @end.
+ */
+static inline const char *scan_str(const char *s, const char *end)
+{
+	s = scan_str_simd(s, end);
+	while (s < end && *s != '"' && *s != '\\')
+		s++;
+
+	return s;
+}
+
+void wgm_jp_init(struct wgm_jparser *p, const char *buf, size_t len)
+{
+	p->start = buf;
+	p->cur = buf;
+	p->end = buf + len;
+	p->first = false;
+}
+
+size_t wgm_jp_offset(const struct wgm_jparser *p)
+{
+	return (size_t)(p->cur - p->start);
+}
+
+static int expect_char(struct wgm_jparser *p, char c)
+{
+	skip_ws(p);
+	if (p->cur >= p->end || *p->cur != c)
+		return -EINVAL;
+
+	p->cur++;
+	return 0;
+}
+
+int wgm_jp_obj_begin(struct wgm_jparser *p)
+{
+	int ret;
+
+	ret = expect_char(p, '{');
+	if (ret)
+		return ret;
+
+	p->first = true;
+	return 0;
+}
+
+int wgm_jp_arr_begin(struct wgm_jparser *p)
+{
+	int ret;
+
+	ret = expect_char(p, '[');
+	if (ret)
+		return ret;
+
+	p->first = true;
+	return 0;
+}
+
+/*
+ * Consume either the closing bracket @close (returns 0) or the comma
+ * separating two members (returns 1). The comma is not expected in
+ * front of the first member.
+ */
+static int next_member(struct wgm_jparser *p, char close)
+{
+	skip_ws(p);
+	if (p->cur >= p->end)
+		return -EINVAL;
+
+	if (*p->cur == close) {
+		p->cur++;
+		p->first = false;
+		return 0;
+	}
+
+	if (!p->first) {
+		if (*p->cur != ',')
+			return -EINVAL;
+		p->cur++;
+	}
+
+	p->first = false;
+	return 1;
+}
+
+int wgm_jp_arr_next(struct wgm_jparser *p)
+{
+	return next_member(p, ']');
+}
+
+int wgm_jp_obj_next(struct wgm_jparser *p, char *key, size_t keylen)
+{
+	int ret;
+
+	ret = next_member(p, '}');
+	if (ret <= 0)
+		return ret;
+
+	ret = wgm_jp_str(p, key, keylen);
+	if (ret < 0)
+		return ret;
+
+	ret = expect_char(p, ':');
+	if (ret)
+		return ret;
+
+	return 1;
+}
+
+static int hex4(const char *s, unsigned *out)
+{
+	unsigned v = 0;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		char c = s[i];
+
+		v <<= 4;
+		if (c >= '0' && c <= '9')
+			v |= c - '0';
+		else if (c >= 'a' && c <= 'f')
+			v |= c - 'a' + 10;
+		else if (c >= 'A' && c <= 'F')
+			v |= c - 'A' + 10;
+		else
+			return -EINVAL;
+	}
+
+	*out = v;
+	return 0;
+}
+
+static size_t utf8_encode(char out[4], unsigned cp)
+{
+	if (cp < 0x80) {
+		out[0] = cp;
+		return 1;
+	}
+
+	if (cp < 0x800) {
+		out[0] = 0xc0 | (cp >> 6);
+		out[1] = 0x80 | (cp & 0x3f);
+		return 2;
+	}
+
+	if (cp < 0x10000) {
+		out[0] = 0xe0 | (cp >> 12);
+		out[1] = 0x80 | ((cp >> 6) & 0x3f);
+		out[2] = 0x80 | (cp & 0x3f);
+		return 3;
+	}
+
+	out[0] = 0xf0 | (cp >> 18);
+	out[1] = 0x80 | ((cp >> 12) & 0x3f);
+	out[2] = 0x80 | ((cp >> 6) & 0x3f);
+	out[3] = 0x80 | (cp & 0x3f);
+	return 4;
+}
+
+static int decode_escape(struct wgm_jparser *p, char out[4], size_t *out_len)
+{
+	const char *s = p->cur;
+	unsigned cp, lo;
+
+	if (p->end - s < 2)
+		return -EINVAL;
+
+	s++;
+	*out_len = 1;
+	switch (*s) {
+	case '"':
+	case '\\':
+	case '/':
+		out[0] = *s;
+		break;
+	case 'b':
+		out[0] = '\b';
+		break;
+	case 'f':
+		out[0] = '\f';
+		break;
+	case 'n':
+		out[0] = '\n';
+		break;
+	case 'r':
+		out[0] = '\r';
+		break;
+	case 't':
+		out[0] = '\t';
+		break;
+	case 'u':
+		if (p->end - s < 5 || hex4(s + 1, &cp))
+			return -EINVAL;
+		s += 4;
+
+		if (cp >= 0xd800 && cp <= 0xdbff) {
+			if (p->end - s < 7 || s[1] != '\\' || s[2] != 'u' ||
+			    hex4(s + 3, &lo) || lo < 0xdc00 || lo > 0xdfff)
+				return -EINVAL;
+			cp = 0x10000 + ((cp - 0xd800) << 10) + (lo - 0xdc00);
+			s += 6;
+		}
+
+		*out_len = utf8_encode(out, cp);
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	p->cur = s + 1;
+	return 0;
+}
+
+/*
+ * Decode a string token into @dst (if not NULL), writing at most
+ * @len - 1 bytes plus the terminating NUL. Returns the full decoded
+ * length like snprintf(), so the caller can detect truncation.
+ */
+static ssize_t decode_str(struct wgm_jparser *p, char *dst, size_t len)
+{
+	size_t n = 0;
+	int ret;
+
+	ret = expect_char(p, '"');
+	if (ret)
+		return ret;
+
+	while (1) {
+		const char *s = p->cur, *e;
+
+		e = scan_str(s, p->end);
+		if (e >= p->end)
+			return -EINVAL;
+
+		if (dst && n + 1 < len) {
+			size_t room = len - 1 - n, run = (size_t)(e - s);
+
+			memcpy(dst + n, s, run < room ? run : room);
+		}
+
+		n += (size_t)(e - s);
+		p->cur = e;
+
+		if (*e == '"') {
+			p->cur++;
+			break;
+		} else {
+			char tmp[4];
+			size_t tlen, i;
+
+			ret = decode_escape(p, tmp, &tlen);
+			if (ret)
+				return ret;
+
+			for (i = 0; i < tlen; i++, n++) {
+				if (dst && n + 1 < len)
+					dst[n] = tmp[i];
+			}
+		}
+	}
+
+	if (dst && len)
+		dst[n < len ? n : len - 1] = '\0';
+
+	return (ssize_t)n;
+}
+
+int wgm_jp_str(struct wgm_jparser *p, char *dst, size_t len)
+{
+	ssize_t ret;
+
+	ret = decode_str(p, dst, len);
+	if (ret < 0)
+		return (int)ret;
+
+	return ret > INT_MAX ? INT_MAX : (int)ret;
+}
+
+int wgm_jp_str_dup(struct wgm_jparser *p, char **out)
+{
+	struct wgm_jparser tmp = *p;
+	ssize_t len;
+	char *str;
+
+	/*
+	 * Measure first so that the allocation is exact; the common case
+	 * (no escapes) is a single SIMD scan.
+	 */
+	len = decode_str(&tmp, NULL, 0);
+	if (len < 0)
+		return (int)len;
+
+	str = malloc((size_t)len + 1);
+	if (!str)
+		return -ENOMEM;
+
+	decode_str(p, str, (size_t)len + 1);
+	*out = str;
+	return 0;
+}
+
+int wgm_jp_str_array(struct wgm_jparser *p, struct wgm_str_array *arr)
+{
+	size_t cap = arr->nr;
+	int ret;
+
+	ret = wgm_jp_arr_begin(p);
+	if (ret)
+		return ret;
+
+	while (1) {
+		char *str;
+
+		ret = wgm_jp_arr_next(p);
+		if (ret < 0)
+			goto out_err;
+		if (!ret)
+			break;
+
+		if (arr->nr == cap) {
+			char **new_arr;
+
+			cap = cap ? cap * 2 : 4;
+			new_arr = realloc(arr->arr, cap * sizeof(*new_arr));
+			if (!new_arr) {
+				ret = -ENOMEM;
+				goto out_err;
+			}
+			arr->arr = new_arr;
+		}
+
+		ret = wgm_jp_str_dup(p, &str);
+		if (ret)
+			goto out_err;
+
+		arr->arr[arr->nr++] = str;
+	}
+
+	return 0;
+
+out_err:
+	wgm_str_array_free(arr);
+	return ret;
+}
+
+int wgm_jp_int(struct wgm_jparser *p, int64_t *val)
+{
+	const char *s, *end = p->end;
+	bool neg = false;
+	uint64_t v = 0;
+
+	skip_ws(p);
+	s = p->cur;
+	if (s < end && *s == '-') {
+		neg = true;
+		s++;
+	}
+
+	if (s >= end || *s < '0' || *s > '9')
+		return -EINVAL;
+
+	while (s < end && *s >= '0' && *s <= '9') {
+		v = v * 10 + (uint64_t)(*s - '0');
+		if (v > (uint64_t)INT64_MAX)
+			return -ERANGE;
+		s++;
+	}
+
+	/*
+	 * Only integers are expected by the callers.
+	 */
+	if (s < end && (*s == '.' || *s == 'e' || *s == 'E'))
+		return -EINVAL;
+
+	p->cur = s;
+	*val = neg ? -(int64_t)v : (int64_t)v;
+	return 0;
+}
+
+static int skip_literal(struct wgm_jparser *p, const char *lit)
+{
+	size_t len = strlen(lit);
+
+	if ((size_t)(p->end - p->cur) < len || memcmp(p->cur, lit, len))
+		return -EINVAL;
+
+	p->cur += len;
+	return 0;
+}
+
+static int skip_number(struct wgm_jparser *p)
+{
+	const char *s = p->cur;
+
+	while (s < p->end && (isdigit((unsigned char)*s) || *s == '-' ||
+			      *s == '+' || *s == '.' || *s == 'e' || *s == 'E'))
+		s++;
+
+	if (s == p->cur)
+		return -EINVAL;
+
+	p->cur = s;
+	return 0;
+}
+
+static int skip_value(struct wgm_jparser *p, unsigned depth)
+{
+	char key[1];
+	int ret;
+
+	if (depth > WGM_JP_MAX_DEPTH)
+		return -ELOOP;
+
+	skip_ws(p);
+	if (p->cur >= p->end)
+		return -EINVAL;
+
+	switch (*p->cur) {
+	case '"':
+		return (int)(decode_str(p, NULL, 0) < 0 ? -EINVAL : 0);
+	case '{':
+		ret = wgm_jp_obj_begin(p);
+		while (!ret) {
+			ret = wgm_jp_obj_next(p, key, sizeof(key));
+			if (ret <= 0)
+				break;
+			ret = skip_value(p, depth + 1);
+		}
+		return ret;
+	case '[':
+		ret = wgm_jp_arr_begin(p);
+		while (!ret) {
+			ret = wgm_jp_arr_next(p);
+			if (ret <= 0)
+				break;
+			ret = skip_value(p, depth + 1);
+		}
+		return ret;
+	case 't':
+		return skip_literal(p, "true");
+	case 'f':
+		return skip_literal(p, "false");
+	case 'n':
+		return skip_literal(p, "null");
+	default:
+		return skip_number(p);
+	}
+}
+
+int wgm_jp_skip(struct wgm_jparser *p)
+{
+	return skip_value(p, 0);
+}
+
+int wgm_jp_finish(struct wgm_jparser *p)
+{
+	skip_ws(p);
+	return p->cur == p->end ? 0 : -EINVAL;
+}
+
+#define WGM_JW_FLUSH_SIZE (64u * 1024u)
+
+void wgm_jw_init(struct wgm_jwriter *w, FILE *fp, bool pretty)
+{
+	memset(w, 0, sizeof(*w));
+	w->fp = fp;
+	w->pretty = pretty;
+	w->first = true;
+}
+
+void wgm_jw_free(struct wgm_jwriter *w)
+{
+	free(w->buf);
+	memset(w, 0, sizeof(*w));
+}
+
+int wgm_jw_flush(struct wgm_jwriter *w)
+{
+	if (w->err)
+		return w->err;
+
+	if (!w->fp || !w->len)
+		return 0;
+
+	if (fwrite(w->buf, 1, w->len, w->fp) != w->len) {
+		w->err = errno ? -errno : -EIO;
+		return w->err;
+	}
+
+	w->flushed += w->len;
+	w->len = 0;
+	return 0;
+}
+
+static int jw_reserve(struct wgm_jwriter *w, size_t n)
+{
+	size_t new_cap;
+	char *new_buf;
+
+	if (w->err)
+		return w->err;
+
+	if (w->len + n <= w->cap)
+		return 0;
+
+	if (w->fp && w->len >= WGM_JW_FLUSH_SIZE) {
+		if (wgm_jw_flush(w))
+			return w->err;
+		if (n <= w->cap)
+			return 0;
+	}
+
+	new_cap = w->cap ? w->cap : 4096;
+	while (new_cap < w->len + n)
+		new_cap *= 2;
+
+	new_buf = realloc(w->buf, new_cap);
+	if (!new_buf) {
+		w->err = -ENOMEM;
+		return w->err;
+	}
+
+	w->buf = new_buf;
+	w->cap = new_cap;
+	return 0;
+}
+
+int wgm_jw_raw(struct wgm_jwriter *w, const char *data, size_t len)
+{
+	if (jw_reserve(w, len))
+		return w->err;
+
+	memcpy(w->buf + w->len, data, len);
+	w->len += len;
+	return 0;
+}
+
+static int jw_indent(struct wgm_jwriter *w, unsigned depth)
+{
+	if (jw_reserve(w, depth * 2))
+		return w->err;
+
+	memset(w->buf + w->len, ' ', depth * 2);
+	w->len += depth * 2;
+	return 0;
+}
+
+/*
+ * Emit whatever has to precede a new member of the current container:
+ * the separating comma and, in pretty mode, the newline and indentation.
+ */
+static int jw_prefix(struct wgm_jwriter *w)
+{
+	if (w->after_key) {
+		w->after_key = false;
+		return w->err;
+	}
+
+	if (!w->depth) {
+		w->first = false;
+		return w->err;
+	}
+
+	if (!w->first) {
+		wgm_jw_raw(w, ",", 1);
+		if (w->pretty)
+			wgm_jw_raw(w, "\n", 1);
+	}
+
+	w->first = false;
+	if (w->pretty)
+		jw_indent(w, w->depth);
+
+	return w->err;
+}
+
+static int jw_open(struct wgm_jwriter *w, char c)
+{
+	if (jw_prefix(w))
+		return w->err;
+
+	wgm_jw_raw(w, &c, 1);
+	if (w->pretty)
+		wgm_jw_raw(w, "\n", 1);
+
+	w->depth++;
+	w->first = true;
+	return w->err;
+}
+
+static int jw_close(struct wgm_jwriter *w, char c)
+{
+	w->depth--;
+	if (w->pretty) {
+		if (!w->first)
+			wgm_jw_raw(w, "\n", 1);
+		jw_indent(w, w->depth);
+	}
+
+	w->first = false;
+	return wgm_jw_raw(w, &c, 1);
+}
+
+int wgm_jw_obj_begin(struct wgm_jwriter *w)
+{
+	return jw_open(w, '{');
+}
+
+int wgm_jw_obj_end(struct wgm_jwriter *w)
+{
+	return jw_close(w, '}');
+}
+
+int wgm_jw_arr_begin(struct wgm_jwriter *w)
+{
+	return jw_open(w, '[');
+}
+
+int wgm_jw_arr_end(struct wgm_jwriter *w)
+{
+	return jw_close(w, ']');
+}
+
+static int jw_escape(struct wgm_jwriter *w, const char *str)
+{
+	static const char hex[] = "0123456789abcdef";
+	const char *s = str;
+
+	wgm_jw_raw(w, "\"", 1);
+	while (*s) {
+		const char *run = s;
+		unsigned char c;
+		char esc[6];
+		size_t elen;
+
+		while (*s && (unsigned char)*s >= 0x20 && *s != '"' && *s != '\\')
+			s++;
+
+		if (s != run)
+			wgm_jw_raw(w, run, (size_t)(s - run));
+
+		c = (unsigned char)*s;
+		if (!c)
+			break;
+
+		esc[0] = '\\';
+		elen = 2;
+		switch (c) {
+		case '"':  esc[1] = '"'; break;
+		case '\\': esc[1] = '\\'; break;
+		case '\b': esc[1] = 'b'; break;
+		case '\f': esc[1] = 'f'; break;
+		case '\n': esc[1] = 'n'; break;
+		case '\r': esc[1] = 'r'; break;
+		case '\t': esc[1] = 't'; break;
+		default:
+			esc[1] = 'u';
+			esc[2] = '0';
+			esc[3] = '0';
+			esc[4] = hex[c >> 4];
+			esc[5] = hex[c & 0xf];
+			elen = 6;
+			break;
+		}
+
+		wgm_jw_raw(w, esc, elen);
+		s++;
+	}
+
+	return wgm_jw_raw(w, "\"", 1);
+}
+
+int wgm_jw_key(struct wgm_jwriter *w, const char *key)
+{
+	if (jw_prefix(w))
+		return w->err;
+
+	jw_escape(w, key);
+	if (w->pretty)
+		wgm_jw_raw(w, ": ", 2);
+	else
+		wgm_jw_raw(w, ":", 1);
+
+	w->after_key = true;
+	return w->err;
+}
+
+int wgm_jw_str(struct wgm_jwriter *w, const char *str)
+{
+	if (jw_prefix(w))
+		return w->err;
+
+	return jw_escape(w, str);
+}
+
+int wgm_jw_int(struct wgm_jwriter *w, int64_t val)
+{
+	char tmp[24];
+	int len;
+
+	if (jw_prefix(w))
+		return w->err;
+
+	len = snprintf(tmp, sizeof(tmp), "%lld", (long long)val);
+	return wgm_jw_raw(w, tmp, (size_t)len);
+}
+
+int wgm_jw_str_array(struct wgm_jwriter *w, const struct wgm_str_array *arr)
+{
+	size_t i;
+
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < arr->nr; i++)
+		wgm_jw_str(w, arr->arr[i]);
+
+	return wgm_jw_arr_end(w);
+}
+
+size_t wgm_jw_offset(const struct wgm_jwriter *w)
+{
+	return w->flushed + w->len;
+}
+
+/*
+ * Hand the NUL-terminated buffer over to the caller (buffer mode only).
+ */
+char *wgm_jw_detach(struct wgm_jwriter *w)
+{
+	char *ret;
+
+	if (w->err || jw_reserve(w, 1)) {
+		wgm_jw_free(w);
+		return NULL;
+	}
+
+	w->buf[w->len] = '\0';
+	ret = w->buf;
+	memset(w, 0, sizeof(*w));
+	return ret;
+}
+
+/*
+ * Pretty print a value to stdout. @write is one of the wgm_*_write_json()
+ * wrappers and @data its argument; @what names the value in errors.
+ */
+void wgm_jw_dump(int (*write)(struct wgm_jwriter *, const void *),
+		 const void *data, const char *what)
+{
+	struct wgm_jwriter w;
+	int ret;
+
+	wgm_jw_init(&w, stdout, true);
+	write(&w, data);
+	wgm_jw_raw(&w, "\n", 1);
+	ret = wgm_jw_flush(&w);
+	if (ret)
+		wgm_log_err("Error: Failed to write %s JSON: %s\n", what, strerror(-ret));
+
+	wgm_jw_free(&w);
+}
@@ -0,0 +1,70 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_JSON_H
+#define WGM__WG_JSON_H
+
+#include "helpers.h"
+
+/*
+ * Pull parser that walks a JSON buffer in place (typically an mmap of
+ * the store file). Callers drive it with the schema they expect, and
+ * string values are decoded straight into the destination struct, so
+ * no intermediate DOM is ever built.
+ */
+struct wgm_jparser {
+	const char	*start;
+	const char	*cur;
+	const char	*end;
+	bool		first;
+};
+
+void wgm_jp_init(struct wgm_jparser *p, const char *buf, size_t len);
+int wgm_jp_obj_begin(struct wgm_jparser *p);
+int wgm_jp_obj_next(struct wgm_jparser *p, char *key, size_t keylen);
+int wgm_jp_arr_begin(struct wgm_jparser *p);
+int wgm_jp_arr_next(struct wgm_jparser *p);
+int wgm_jp_str(struct wgm_jparser *p, char *dst, size_t len);
+int wgm_jp_str_dup(struct wgm_jparser *p, char **out);
+int wgm_jp_str_array(struct wgm_jparser *p, struct wgm_str_array *arr);
+int wgm_jp_int(struct wgm_jparser *p, int64_t *val);
+int wgm_jp_skip(struct wgm_jparser *p);
+int wgm_jp_finish(struct wgm_jparser *p);
+size_t wgm_jp_offset(const struct wgm_jparser *p);
+
+/*
+ * Streaming writer. Output is accumulated in a growable buffer and, when
+ * @fp is set, flushed to it whenever the buffer gets large, so a whole
+ * interface is serialized in a single pass without a DOM. The pretty
+ * mode matches the json-c output wgm used to print; the compact mode
+ * has no whitespace at all and is what the store files use.
+ */
+struct wgm_jwriter {
+	char		*buf;
+	size_t		len;
+	size_t		cap;
+	size_t		flushed;
+	FILE		*fp;
+	unsigned	depth;
+	bool		pretty;
+	bool		first;
+	bool		after_key;
+	int		err;
+};
+
+void wgm_jw_init(struct wgm_jwriter *w, FILE *fp, bool pretty);
+void wgm_jw_free(struct wgm_jwriter *w);
+int wgm_jw_obj_begin(struct wgm_jwriter *w);
+int wgm_jw_obj_end(struct wgm_jwriter *w);
+int wgm_jw_arr_begin(struct wgm_jwriter *w);
+int wgm_jw_arr_end(struct wgm_jwriter *w);
+int wgm_jw_key(struct wgm_jwriter *w, const char *key);
+int wgm_jw_str(struct wgm_jwriter *w, const char *str);
+int wgm_jw_int(struct wgm_jwriter *w, int64_t val);
+int wgm_jw_str_array(struct wgm_jwriter *w, const struct wgm_str_array *arr);
+int wgm_jw_raw(struct wgm_jwriter *w, const char *data, size_t len);
+int wgm_jw_flush(struct wgm_jwriter *w);
+size_t wgm_jw_offset(const struct wgm_jwriter *w);
+char *wgm_jw_detach(struct wgm_jwriter *w);
+void wgm_jw_dump(int (*write)(struct wgm_jwriter *, const void *),
+		 const void *data, const char *what);
+
+#endif /* #ifndef WGM__WG_JSON_H */
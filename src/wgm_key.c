@@ -0,0 +1,894 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_key.h"
+#include "wgm_json.h"
+#include "wgm_pool.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <sys/random.h>
+
+/*
+ * X25519 public keys are the u-coordinate of a * B, B the base point
+ * u = 9. Only the base point is ever multiplied, so instead of the
+ * Montgomery ladder this uses the birationally equivalent twisted
+ * Edwards curve (Ed25519) and a fixed-base comb: a precomputed table of
+ * j * 256^i * B turns the product into 64 table lookups and additions.
+ * The Edwards y then maps back with u = (1 + y) / (1 - y).
+ *
+ * Field elements are 5 limbs of 51 bits. Nothing branches on or
+ * indexes memory with secret data: table entries are selected with
+ * masks.
+ */
+struct fe {
+	uint64_t	v[5];
+};
+
+/*
+ * Extended (X:Y:Z:T), completed and projective Edwards points, and
+ * table entries (y + x, y - x, 2dxy) of affine ones.
+ */
+struct ge_p3 {
+	struct fe	X, Y, Z, T;
+};
+
+struct ge_p1p1 {
+	struct fe	X, Y, Z, T;
+};
+
+struct ge_p2 {
+	struct fe	X, Y, Z;
+};
+
+struct ge_cached {
+	struct fe	YplusX, YminusX, Z, T2d;
+};
+
+struct ge_precomp {
+	struct fe	yplusx, yminusx, xy2d;
+};
+
+#define FE_MASK		((1ull << 51) - 1)
+
+/*
+ * 2d, and the affine coordinates of B, little endian.
+ */
+static const uint8_t ed_d2[WGM_KEY_LEN] = {
+	0x59, 0xf1, 0xb2, 0x26, 0x94, 0x9b, 0xd6, 0xeb, 0x56, 0xb1, 0x83, 0x82, 0x9a, 0x14, 0xe0, 0x00,
+	0x30, 0xd1, 0xf3, 0xee, 0xf2, 0x80, 0x8e, 0x19, 0xe7, 0xfc, 0xdf, 0x56, 0xdc, 0xd9, 0x06, 0x24,
+};
+
+static const uint8_t ed_bx[WGM_KEY_LEN] = {
+	0x1a, 0xd5, 0x25, 0x8f, 0x60, 0x2d, 0x56, 0xc9, 0xb2, 0xa7, 0x25, 0x95, 0x60, 0xc7, 0x2c, 0x69,
+	0x5c, 0xdc, 0xd6, 0xfd, 0x31, 0xe2, 0xa4, 0xc0, 0xfe, 0x53, 0x6e, 0xcd, 0xd3, 0x36, 0x69, 0x21,
+};
+
+static const uint8_t ed_by[WGM_KEY_LEN] = {
+	0x58, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+	0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66, 0x66,
+};
+
+static struct ge_precomp base_table[32][8];
+static struct fe fe_d2;
+static pthread_once_t base_table_once = PTHREAD_ONCE_INIT;
+
+static uint64_t load64(const uint8_t *p)
+{
+	uint64_t v = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		v = (v << 8) | p[i];
+
+	return v;
+}
+
+static void store64(uint8_t *p, uint64_t v)
+{
+	int i;
+
+	for (i = 0; i < 8; i++, v >>= 8)
+		p[i] = v;
+}
+
+static void fe_0(struct fe *h)
+{
+	memset(h, 0, sizeof(*h));
+}
+
+static void fe_1(struct fe *h)
+{
+	fe_0(h);
+	h->v[0] = 1;
+}
+
+static void fe_carry(struct fe *h)
+{
+	uint64_t c;
+	int i;
+
+	for (i = 0; i < 4; i++) {
+		c = h->v[i] >> 51;
+		h->v[i] &= FE_MASK;
+		h->v[i + 1] += c;
+	}
+
+	c = h->v[4] >> 51;
+	h->v[4] &= FE_MASK;
+	h->v[0] += 19 * c;
+}
+
+static void fe_add(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		h->v[i] = f->v[i] + g->v[i];
+	fe_carry(h);
+}
+
+/*
+ * f + 4p - g, so that no limb goes negative.
+ */
+static void fe_sub(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	h->v[0] = f->v[0] + 0x1fffffffffffb4ull - g->v[0];
+	h->v[1] = f->v[1] + 0x1ffffffffffffcull - g->v[1];
+	h->v[2] = f->v[2] + 0x1ffffffffffffcull - g->v[2];
+	h->v[3] = f->v[3] + 0x1ffffffffffffcull - g->v[3];
+	h->v[4] = f->v[4] + 0x1ffffffffffffcull - g->v[4];
+	fe_carry(h);
+}
+
+/*
+ * Without the carry, for the additions whose results only feed a
+ * multiplication: inputs below 2^52 give limbs below 2^53, which
+ * fe_mul() takes.
+ */
+static void fe_add_nc(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	int i;
+
+	for (i = 0; i < 5; i++)
+		h->v[i] = f->v[i] + g->v[i];
+}
+
+/*
+ * f + 2p - g, for g below 2^52.
+ */
+static void fe_sub_nc(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	h->v[0] = f->v[0] + 0xfffffffffffdaull - g->v[0];
+	h->v[1] = f->v[1] + 0xffffffffffffeull - g->v[1];
+	h->v[2] = f->v[2] + 0xffffffffffffeull - g->v[2];
+	h->v[3] = f->v[3] + 0xffffffffffffeull - g->v[3];
+	h->v[4] = f->v[4] + 0xffffffffffffeull - g->v[4];
+}
+
+static void fe_neg(struct fe *h, const struct fe *f)
+{
+	struct fe zero;
+
+	fe_0(&zero);
+	fe_sub(h, &zero, f);
+}
+
+static void fe_mul(struct fe *h, const struct fe *f, const struct fe *g)
+{
+	const uint64_t *a = f->v, *b = g->v;
+	uint64_t b1 = 19 * b[1], b2 = 19 * b[2], b3 = 19 * b[3], b4 = 19 * b[4];
+	unsigned __int128 r0, r1, r2, r3, r4;
+	uint64_t c;
+
+	r0 = (unsigned __int128)a[0] * b[0] + (unsigned __int128)a[1] * b4 +
+	     (unsigned __int128)a[2] * b3 + (unsigned __int128)a[3] * b2 +
+	     (unsigned __int128)a[4] * b1;
+	r1 = (unsigned __int128)a[0] * b[1] + (unsigned __int128)a[1] * b[0] +
+	     (unsigned __int128)a[2] * b4 + (unsigned __int128)a[3] * b3 +
+	     (unsigned __int128)a[4] * b2;
+	r2 = (unsigned __int128)a[0] * b[2] + (unsigned __int128)a[1] * b[1] +
+	     (unsigned __int128)a[2] * b[0] + (unsigned __int128)a[3] * b4 +
+	     (unsigned __int128)a[4] * b3;
+	r3 = (unsigned __int128)a[0] * b[3] + (unsigned __int128)a[1] * b[2] +
+	     (unsigned __int128)a[2] * b[1] + (unsigned __int128)a[3] * b[0] +
+	     (unsigned __int128)a[4] * b4;
+	r4 = (unsigned __int128)a[0] * b[4] + (unsigned __int128)a[1] * b[3] +
+	     (unsigned __int128)a[2] * b[2] + (unsigned __int128)a[3] * b[1] +
+	     (unsigned __int128)a[4] * b[0];
+
+	r1 += (uint64_t)(r0 >> 51);
+	r2 += (uint64_t)(r1 >> 51);
+	r3 += (uint64_t)(r2 >> 51);
+	r4 += (uint64_t)(r3 >> 51);
+	c = r4 >> 51;
+
+	h->v[0] = ((uint64_t)r0 & FE_MASK) + 19 * c;
+	h->v[1] = (uint64_t)r1 & FE_MASK;
+	h->v[2] = (uint64_t)r2 & FE_MASK;
+	h->v[3] = (uint64_t)r3 & FE_MASK;
+	h->v[4] = (uint64_t)r4 & FE_MASK;
+	h->v[1] += h->v[0] >> 51;
+	h->v[0] &= FE_MASK;
+}
+
+static void fe_sq(struct fe *h, const struct fe *f)
+{
+	fe_mul(h, f, f);
+}
+
+static void fe_sqn(struct fe *h, const struct fe *f, int n)
+{
+	fe_sq(h, f);
+	while (--n)
+		fe_sq(h, h);
+}
+
+/*
+ * z^(p - 2).
+ */
+static void fe_invert(struct fe *out, const struct fe *z)
+{
+	struct fe t0, t1, t2, t3;
+
+	fe_sq(&t0, z);
+	fe_sqn(&t1, &t0, 2);
+	fe_mul(&t1, z, &t1);
+	fe_mul(&t0, &t0, &t1);
+	fe_sq(&t2, &t0);
+	fe_mul(&t1, &t1, &t2);
+	fe_sqn(&t2, &t1, 5);
+	fe_mul(&t1, &t2, &t1);
+	fe_sqn(&t2, &t1, 10);
+	fe_mul(&t2, &t2, &t1);
+	fe_sqn(&t3, &t2, 20);
+	fe_mul(&t2, &t3, &t2);
+	fe_sqn(&t2, &t2, 10);
+	fe_mul(&t1, &t2, &t1);
+	fe_sqn(&t2, &t1, 50);
+	fe_mul(&t2, &t2, &t1);
+	fe_sqn(&t3, &t2, 100);
+	fe_mul(&t2, &t3, &t2);
+	fe_sqn(&t2, &t2, 50);
+	fe_mul(&t1, &t2, &t1);
+	fe_sqn(&t1, &t1, 5);
+	fe_mul(out, &t1, &t0);
+}
+
+static void fe_frombytes(struct fe *h, const uint8_t s[WGM_KEY_LEN])
+{
+	h->v[0] = load64(s) & FE_MASK;
+	h->v[1] = (load64(s + 6) >> 3) & FE_MASK;
+	h->v[2] = (load64(s + 12) >> 6) & FE_MASK;
+	h->v[3] = (load64(s + 19) >> 1) & FE_MASK;
+	h->v[4] = (load64(s + 24) >> 12) & FE_MASK;
+}
+
+static void fe_tobytes(uint8_t s[WGM_KEY_LEN], const struct fe *f)
+{
+	struct fe h = *f;
+	uint64_t q;
+	int i;
+
+	fe_carry(&h);
+	fe_carry(&h);
+
+	/*
+	 * q = 1 if h >= p: subtract p by adding 19 and dropping 2^255.
+	 */
+	q = (h.v[0] + 19) >> 51;
+	for (i = 1; i < 5; i++)
+		q = (h.v[i] + q) >> 51;
+
+	h.v[0] += 19 * q;
+	for (i = 0; i < 4; i++) {
+		h.v[i + 1] += h.v[i] >> 51;
+		h.v[i] &= FE_MASK;
+	}
+	h.v[4] &= FE_MASK;
+
+	store64(s, h.v[0] | h.v[1] << 51);
+	store64(s + 8, h.v[1] >> 13 | h.v[2] << 38);
+	store64(s + 16, h.v[2] >> 26 | h.v[3] << 25);
+	store64(s + 24, h.v[3] >> 39 | h.v[4] << 12);
+}
+
+static void fe_cmov(struct fe *f, const struct fe *g, uint64_t b)
+{
+	uint64_t mask = -b;
+	int i;
+
+	for (i = 0; i < 5; i++)
+		f->v[i] ^= mask & (f->v[i] ^ g->v[i]);
+}
+
+static void ge_p3_0(struct ge_p3 *h)
+{
+	fe_0(&h->X);
+	fe_1(&h->Y);
+	fe_1(&h->Z);
+	fe_0(&h->T);
+}
+
+static void ge_precomp_0(struct ge_precomp *h)
+{
+	fe_1(&h->yplusx);
+	fe_1(&h->yminusx);
+	fe_0(&h->xy2d);
+}
+
+static void ge_p1p1_to_p2(struct ge_p2 *r, const struct ge_p1p1 *p)
+{
+	fe_mul(&r->X, &p->X, &p->T);
+	fe_mul(&r->Y, &p->Y, &p->Z);
+	fe_mul(&r->Z, &p->Z, &p->T);
+}
+
+static void ge_p1p1_to_p3(struct ge_p3 *r, const struct ge_p1p1 *p)
+{
+	fe_mul(&r->X, &p->X, &p->T);
+	fe_mul(&r->Y, &p->Y, &p->Z);
+	fe_mul(&r->Z, &p->Z, &p->T);
+	fe_mul(&r->T, &p->X, &p->Y);
+}
+
+static void ge_p3_to_cached(struct ge_cached *r, const struct ge_p3 *p)
+{
+	fe_add(&r->YplusX, &p->Y, &p->X);
+	fe_sub(&r->YminusX, &p->Y, &p->X);
+	r->Z = p->Z;
+	fe_mul(&r->T2d, &p->T, &fe_d2);
+}
+
+static void ge_p2_dbl(struct ge_p1p1 *r, const struct ge_p2 *p)
+{
+	struct fe t0;
+
+	fe_sq(&r->X, &p->X);
+	fe_sq(&r->Z, &p->Y);
+	fe_sq(&r->T, &p->Z);
+	fe_add(&r->T, &r->T, &r->T);
+	fe_add(&r->Y, &p->X, &p->Y);
+	fe_sq(&t0, &r->Y);
+	fe_add(&r->Y, &r->Z, &r->X);
+	fe_sub(&r->Z, &r->Z, &r->X);
+	fe_sub(&r->X, &t0, &r->Y);
+	fe_sub(&r->T, &r->T, &r->Z);
+}
+
+static void ge_p3_dbl(struct ge_p1p1 *r, const struct ge_p3 *p)
+{
+	struct ge_p2 q = { p->X, p->Y, p->Z };
+
+	ge_p2_dbl(r, &q);
+}
+
+static void ge_add(struct ge_p1p1 *r, const struct ge_p3 *p, const struct ge_cached *q)
+{
+	struct fe t0;
+
+	fe_add(&r->X, &p->Y, &p->X);
+	fe_sub(&r->Y, &p->Y, &p->X);
+	fe_mul(&r->Z, &r->X, &q->YplusX);
+	fe_mul(&r->Y, &r->Y, &q->YminusX);
+	fe_mul(&r->T, &q->T2d, &p->T);
+	fe_mul(&r->X, &p->Z, &q->Z);
+	fe_add(&t0, &r->X, &r->X);
+	fe_sub(&r->X, &r->Z, &r->Y);
+	fe_add(&r->Y, &r->Z, &r->Y);
+	fe_add(&r->Z, &t0, &r->T);
+	fe_sub(&r->T, &t0, &r->T);
+}
+
+static void ge_madd(struct ge_p1p1 *r, const struct ge_p3 *p, const struct ge_precomp *q)
+{
+	struct fe t0;
+
+	fe_add_nc(&r->X, &p->Y, &p->X);
+	fe_sub_nc(&r->Y, &p->Y, &p->X);
+	fe_mul(&r->Z, &r->X, &q->yplusx);
+	fe_mul(&r->Y, &r->Y, &q->yminusx);
+	fe_mul(&r->T, &q->xy2d, &p->T);
+	fe_add_nc(&t0, &p->Z, &p->Z);
+	fe_sub_nc(&r->X, &r->Z, &r->Y);
+	fe_add_nc(&r->Y, &r->Z, &r->Y);
+	fe_add(&r->Z, &t0, &r->T);
+	fe_sub(&r->T, &t0, &r->T);
+}
+
+static void ge_to_precomp(struct ge_precomp *r, const struct ge_p3 *p)
+{
+	struct fe zi, x, y;
+
+	fe_invert(&zi, &p->Z);
+	fe_mul(&x, &p->X, &zi);
+	fe_mul(&y, &p->Y, &zi);
+	fe_add(&r->yplusx, &y, &x);
+	fe_sub(&r->yminusx, &y, &x);
+	fe_mul(&r->xy2d, &x, &y);
+	fe_mul(&r->xy2d, &r->xy2d, &fe_d2);
+}
+
+/*
+ * base_table[i][j] = (j + 1) * 256^i * B. Built once, on first use,
+ * from B alone (about a millisecond).
+ */
+static void base_table_init(void)
+{
+	struct ge_p3 p, q;
+	struct ge_cached pc;
+	struct ge_p1p1 t;
+	int i, j;
+
+	fe_frombytes(&fe_d2, ed_d2);
+	fe_frombytes(&p.X, ed_bx);
+	fe_frombytes(&p.Y, ed_by);
+	fe_1(&p.Z);
+	fe_mul(&p.T, &p.X, &p.Y);
+
+	for (i = 0; i < 32; i++) {
+		ge_p3_to_cached(&pc, &p);
+		q = p;
+		ge_to_precomp(&base_table[i][0], &q);
+		for (j = 1; j < 8; j++) {
+			ge_add(&t, &q, &pc);
+			ge_p1p1_to_p3(&q, &t);
+			ge_to_precomp(&base_table[i][j], &q);
+		}
+
+		for (j = 0; j < 8; j++) {
+			ge_p3_dbl(&t, &p);
+			ge_p1p1_to_p3(&p, &t);
+		}
+	}
+}
+
+static uint64_t ct_eq(uint8_t a, uint8_t b)
+{
+	return ((uint64_t)(a ^ b) - 1) >> 63;
+}
+
+/*
+ * t = b * 256^pos * B, b in [-8, 8], reading every entry of the row.
+ */
+static void ge_select(struct ge_precomp *t, int pos, int8_t b)
+{
+	uint64_t neg = (uint8_t)b >> 7;
+	uint8_t babs = b - (((-neg) & b) << 1);
+	struct ge_precomp minus;
+	int j;
+
+	ge_precomp_0(t);
+	for (j = 0; j < 8; j++) {
+		const struct ge_precomp *e = &base_table[pos][j];
+
+		fe_cmov(&t->yplusx, &e->yplusx, ct_eq(babs, j + 1));
+		fe_cmov(&t->yminusx, &e->yminusx, ct_eq(babs, j + 1));
+		fe_cmov(&t->xy2d, &e->xy2d, ct_eq(babs, j + 1));
+	}
+
+	minus.yplusx = t->yminusx;
+	minus.yminusx = t->yplusx;
+	fe_neg(&minus.xy2d, &t->xy2d);
+	fe_cmov(&t->yplusx, &minus.yplusx, neg);
+	fe_cmov(&t->yminusx, &minus.yminusx, neg);
+	fe_cmov(&t->xy2d, &minus.xy2d, neg);
+}
+
+/*
+ * h = a * B for a clamped scalar (a[31] <= 127), in signed base 16.
+ */
+static void ge_scalarmult_base(struct ge_p3 *h, const uint8_t a[WGM_KEY_LEN])
+{
+	struct ge_precomp t;
+	struct ge_p1p1 r;
+	struct ge_p2 s;
+	int8_t e[64], carry = 0;
+	int i;
+
+	for (i = 0; i < 32; i++) {
+		e[2 * i] = a[i] & 15;
+		e[2 * i + 1] = a[i] >> 4;
+	}
+
+	for (i = 0; i < 63; i++) {
+		e[i] += carry;
+		carry = (e[i] + 8) >> 4;
+		e[i] -= carry << 4;
+	}
+	e[63] += carry;
+
+	ge_p3_0(h);
+	for (i = 1; i < 64; i += 2) {
+		ge_select(&t, i / 2, e[i]);
+		ge_madd(&r, h, &t);
+		ge_p1p1_to_p3(h, &r);
+	}
+
+	ge_p3_dbl(&r, h);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p2(&s, &r);
+	ge_p2_dbl(&r, &s);
+	ge_p1p1_to_p3(h, &r);
+
+	for (i = 0; i < 64; i += 2) {
+		ge_select(&t, i / 2, e[i]);
+		ge_madd(&r, h, &t);
+		ge_p1p1_to_p3(h, &r);
+	}
+
+	memset(e, 0, sizeof(e));
+}
+
+static void clamp(uint8_t k[WGM_KEY_LEN])
+{
+	k[0] &= 248;
+	k[31] &= 127;
+	k[31] |= 64;
+}
+
+/*
+ * u = (Z + Y) / (Z - Y) for the keys @priv, with one inversion for the
+ * whole batch (Montgomery's trick).
+ */
+#define WGM_KEY_BATCH	256
+
+static void public_batch(uint8_t (*pub)[WGM_KEY_LEN], const uint8_t (*priv)[WGM_KEY_LEN],
+			 size_t nr)
+{
+	struct fe num[WGM_KEY_BATCH], acc[WGM_KEY_BATCH], inv, t;
+	uint8_t k[WGM_KEY_LEN];
+	struct ge_p3 p;
+	size_t i;
+
+	pthread_once(&base_table_once, base_table_init);
+	for (i = 0; i < nr; i++) {
+		memcpy(k, priv[i], sizeof(k));
+		clamp(k);
+		ge_scalarmult_base(&p, k);
+		fe_add(&num[i], &p.Z, &p.Y);
+		fe_sub(&t, &p.Z, &p.Y);
+		if (i)
+			fe_mul(&acc[i], &acc[i - 1], &t);
+		else
+			acc[i] = t;
+
+		/*
+		 * Keep Z - Y for the way back in @pub's slot.
+		 */
+		fe_tobytes(pub[i], &t);
+	}
+
+	fe_invert(&inv, &acc[nr - 1]);
+	for (i = nr; i-- > 0;) {
+		if (i) {
+			fe_mul(&t, &inv, &acc[i - 1]);
+			fe_frombytes(&acc[i], pub[i]);
+			fe_mul(&inv, &inv, &acc[i]);
+		} else {
+			t = inv;
+		}
+
+		fe_mul(&t, &t, &num[i]);
+		fe_tobytes(pub[i], &t);
+	}
+
+	memset(k, 0, sizeof(k));
+}
+
+void wgm_key_public_many(uint8_t (*pub)[WGM_KEY_LEN], const uint8_t (*priv)[WGM_KEY_LEN],
+			 size_t nr)
+{
+	size_t i, n;
+
+	for (i = 0; i < nr; i += n) {
+		n = nr - i < WGM_KEY_BATCH ? nr - i : WGM_KEY_BATCH;
+		public_batch(pub + i, priv + i, n);
+	}
+}
+
+void wgm_key_public(uint8_t pub[WGM_KEY_LEN], const uint8_t priv[WGM_KEY_LEN])
+{
+	wgm_key_public_many((uint8_t (*)[WGM_KEY_LEN])pub,
+			    (const uint8_t (*)[WGM_KEY_LEN])priv, 1);
+}
+
+static int fill_random(void *buf, size_t len)
+{
+	uint8_t *p = buf;
+	ssize_t n;
+
+	while (len) {
+		n = getrandom(p, len, 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			return -errno;
+		}
+
+		p += n;
+		len -= n;
+	}
+
+	return 0;
+}
+
+int wgm_key_generate(uint8_t priv[WGM_KEY_LEN])
+{
+	int ret;
+
+	ret = fill_random(priv, WGM_KEY_LEN);
+	if (ret) {
+		wgm_log_err("Error: wgm_key_generate: getrandom failed: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	clamp(priv);
+	return 0;
+}
+
+/*
+ * Public key, in base64, of the base64 private key @priv.
+ */
+int wgm_key_public_base64(char pub[WGM_KEY_B64_LEN + 1], const char *priv)
+{
+	uint8_t k[WGM_KEY_LEN], p[WGM_KEY_LEN];
+
+	if (wgm_key_from_base64(k, priv))
+		return -EINVAL;
+
+	wgm_key_public(p, k);
+	wgm_key_to_base64(pub, p);
+	memset(k, 0, sizeof(k));
+	return 0;
+}
+
+static const struct wgm_opt keygen_options[] = {
+	#define KEYGEN_ARG_COUNT	(1ull << 0)
+	{ KEYGEN_ARG_COUNT,	"count",	required_argument,	NULL,	'c' },
+
+	#define KEYGEN_ARG_HELP		(1ull << 1)
+	{ KEYGEN_ARG_HELP,	"help",		no_argument,		NULL,	'h' },
+};
+
+static int wgm_keygen_getopt(int argc, char *argv[], unsigned long *count)
+{
+	struct option *long_opt;
+	char *short_opt;
+	char *endptr;
+	int c, ret;
+
+	ret = wgm_create_getopt_long_args(&long_opt, &short_opt, keygen_options,
+					  ARRAY_SIZE(keygen_options));
+	if (ret)
+		return ret;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_opt, long_opt, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'c':
+			*count = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !*count || *count > 100000000) {
+				wgm_log_err("Error: Invalid key count (1-100000000)\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			break;
+		case 'h':
+			show_usage_keygen(NULL);
+			ret = -1;
+			goto out;
+		default:
+			wgm_log_err("Error: Invalid option '%c'\n", c);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (optind < argc) {
+		wgm_log_err("Error: Unexpected argument '%s'\n\n", argv[optind]);
+		show_usage_keygen(NULL);
+		ret = -EINVAL;
+	}
+
+out:
+	wgm_free_getopt_long_args(long_opt, short_opt);
+	return ret;
+}
+
+struct wgm_keygen {
+	pthread_mutex_t		lock;
+	unsigned long		next;
+	unsigned long		count;
+	int			ret;
+};
+
+/*
+ * Each thread claims WGM_KEY_BATCH keys at a time, derives them and
+ * writes the batch with a single fputs(), which stdio keeps whole.
+ */
+static void *wgm_keygen_fn(void *data)
+{
+	uint8_t (*priv)[WGM_KEY_LEN], (*pub)[WGM_KEY_LEN];
+	struct wgm_keygen *kg = data;
+	char b64[WGM_KEY_B64_LEN + 1];
+	struct wgm_jwriter w;
+	unsigned long j, n;
+	char *buf;
+	int ret = 0;
+
+	priv = malloc(WGM_KEY_BATCH * sizeof(*priv));
+	pub = malloc(WGM_KEY_BATCH * sizeof(*pub));
+	if (!priv || !pub) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	while (1) {
+		pthread_mutex_lock(&kg->lock);
+		if (kg->ret)
+			n = 0;
+		else
+			n = kg->count - kg->next < WGM_KEY_BATCH ? kg->count - kg->next : WGM_KEY_BATCH;
+		kg->next += n;
+		pthread_mutex_unlock(&kg->lock);
+		if (!n)
+			break;
+
+		ret = fill_random(priv, n * sizeof(*priv));
+		if (ret)
+			break;
+
+		for (j = 0; j < n; j++)
+			clamp(priv[j]);
+
+		wgm_key_public_many(pub, (const uint8_t (*)[WGM_KEY_LEN])priv, n);
+
+		wgm_jw_init(&w, NULL, false);
+		for (j = 0; j < n; j++) {
+			wgm_jw_obj_begin(&w);
+			wgm_jw_key(&w, "private_key");
+			wgm_key_to_base64(b64, priv[j]);
+			wgm_jw_str(&w, b64);
+			wgm_jw_key(&w, "public_key");
+			wgm_key_to_base64(b64, pub[j]);
+			wgm_jw_str(&w, b64);
+			wgm_jw_obj_end(&w);
+			wgm_jw_raw(&w, "\n", 1);
+		}
+
+		buf = wgm_jw_detach(&w);
+		if (!buf) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (fputs(buf, stdout) == EOF)
+			ret = -EIO;
+
+		memset(buf, 0, strlen(buf));
+		free(buf);
+		if (ret)
+			break;
+	}
+
+out:
+	if (priv)
+		memset(priv, 0, WGM_KEY_BATCH * sizeof(*priv));
+	memset(b64, 0, sizeof(b64));
+	free(priv);
+	free(pub);
+
+	if (ret) {
+		pthread_mutex_lock(&kg->lock);
+		if (!kg->ret)
+			kg->ret = ret;
+		pthread_mutex_unlock(&kg->lock);
+	}
+	return NULL;
+}
+
+/*
+ * wgm keygen [--count N]: one {"private_key", "public_key"} object per
+ * line. Batches are spread over every CPU.
+ */
+int wgm_cmd_keygen(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_keygen kg = {
+		.lock = PTHREAD_MUTEX_INITIALIZER,
+		.count = 1,
+	};
+	unsigned long nr_batches;
+	unsigned int nr_threads, i;
+	pthread_t threads[64];
+	bool started[64] = { false };
+	int ret;
+
+	ret = wgm_keygen_getopt(argc, argv, &kg.count);
+	if (ret)
+		return ret;
+
+	nr_batches = (kg.count + WGM_KEY_BATCH - 1) / WGM_KEY_BATCH;
+	nr_threads = wgm_pool_default_workers();
+	if (nr_threads > ARRAY_SIZE(threads))
+		nr_threads = ARRAY_SIZE(threads);
+	if (nr_threads > nr_batches)
+		nr_threads = nr_batches;
+
+	/*
+	 * The calling thread is one of the workers, and takes over the
+	 * share of any thread that cannot be created.
+	 */
+	for (i = 1; i < nr_threads; i++) {
+		if (!pthread_create(&threads[i], NULL, wgm_keygen_fn, &kg))
+			started[i] = true;
+	}
+
+	wgm_keygen_fn(&kg);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	ret = kg.ret;
+	if (!ret && fflush(stdout))
+		ret = -EIO;
+
+	if (ret == -ENOMEM)
+		wgm_log_err("Error: wgm_cmd_keygen: Failed to allocate memory\n");
+	else if (ret == -EIO)
+		wgm_log_err("Error: wgm_cmd_keygen: Failed to write keys\n");
+	else if (ret)
+		wgm_log_err("Error: wgm_cmd_keygen: getrandom failed: %s\n", strerror(-ret));
+
+	pthread_mutex_destroy(&kg.lock);
+	return ret;
+}
+
+/*
+ * wgm pubkey: like `wg pubkey`, for one private key per line of stdin.
+ */
+int wgm_cmd_pubkey(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	char *line = NULL, *key, pub[WGM_KEY_B64_LEN + 1];
+	size_t len = 0, lineno = 0;
+	ssize_t n;
+	int ret = 0;
+
+	if (argc > 1) {
+		if (strcmp(argv[1], "-h") && strcmp(argv[1], "--help"))
+			wgm_log_err("Error: Unexpected argument '%s'\n\n", argv[1]);
+		show_usage_keygen(NULL);
+		return -EINVAL;
+	}
+
+	while ((n = getline(&line, &len, stdin)) > 0) {
+		lineno++;
+		while (n && isspace((unsigned char)line[n - 1]))
+			line[--n] = '\0';
+
+		key = line;
+		while (isspace((unsigned char)*key))
+			key++;
+
+		if (wgm_key_public_base64(pub, key)) {
+			wgm_log_err("Error: Invalid private key on line %zu\n", lineno);
+			ret = -EINVAL;
+			break;
+		}
+
+		puts(pub);
+	}
+
+	if (line)
+		memset(line, 0, len);
+	free(line);
+	return ret;
+}
@@ -0,0 +1,20 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_KEY_H
+#define WGM__WG_KEY_H
+
+#include "helpers.h"
+
+/*
+ * WireGuard (X25519) key pairs, generated in process instead of with
+ * `wg genkey | wg pubkey`. The private key is clamped, as wg does.
+ */
+int wgm_key_generate(uint8_t priv[WGM_KEY_LEN]);
+void wgm_key_public(uint8_t pub[WGM_KEY_LEN], const uint8_t priv[WGM_KEY_LEN]);
+void wgm_key_public_many(uint8_t (*pub)[WGM_KEY_LEN], const uint8_t (*priv)[WGM_KEY_LEN],
+			 size_t nr);
+int wgm_key_public_base64(char pub[WGM_KEY_B64_LEN + 1], const char *priv);
+
+int wgm_cmd_keygen(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_cmd_pubkey(int argc, char *argv[], struct wgm_ctx *ctx);
+
+#endif /* #ifndef WGM__WG_KEY_H */
@@ -0,0 +1,561 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_metrics.h"
+#include "wgm_iface.h"
+#include "wgm_peer.h"
+
+#include <stdarg.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+
+struct wgm_metrics_family {
+	const char	*name;
+	const char	*type;
+	const char	*help;
+};
+
+/*
+ * Every series written belongs to one of these; the .prom file is
+ * rendered family by family in this order.
+ */
+static const struct wgm_metrics_family families[] = {
+	{ "wgm_command_total", "counter",
+	  "Commands run, by command and result." },
+	{ "wgm_command_duration_seconds", "histogram",
+	  "Wall-clock duration of commands." },
+	{ "wgm_iface_peers", "gauge",
+	  "Peers of the interface." },
+	{ "wgm_iface_allowed_ips", "gauge",
+	  "Allowed IPs over all peers of the interface." },
+	{ "wgm_iface_fwmarks", "gauge",
+	  "Distinct fwmarks (bind IP and device pairs) of the interface." },
+	{ "wgm_iface_store_bytes", "gauge",
+	  "Size of the interface store files." },
+	{ "wgm_iface_conf_bytes", "gauge",
+	  "Size of the rendered wg-quick configuration." },
+	{ "wgm_iface_last_apply_duration_seconds", "gauge",
+	  "Duration of the last wg-quick apply." },
+	{ "wgm_iface_last_apply_success", "gauge",
+	  "Whether the last wg-quick apply succeeded." },
+	{ "wgm_iface_last_apply_timestamp_seconds", "gauge",
+	  "Unix time of the last wg-quick apply." },
+};
+
+static const double duration_buckets[] = {
+	0.005, 0.01, 0.025, 0.05, 0.1, 0.25, 0.5, 1, 2.5, 5, 10, 30,
+};
+
+struct wgm_metrics_series {
+	char	*key;
+	double	val;
+};
+
+struct wgm_metrics_series_array {
+	struct wgm_metrics_series	*arr;
+	size_t				nr;
+	size_t				cap;
+};
+
+struct wgm_metrics *wgm_metrics_create(const char *path)
+{
+	struct wgm_metrics *m;
+
+	m = calloc(1, sizeof(*m));
+	if (!m)
+		goto out_err;
+
+	m->path = strdup(path);
+	if (!m->path) {
+		free(m);
+		goto out_err;
+	}
+
+	m->start_ns = wgm_now_ns();
+	return m;
+
+out_err:
+	wgm_log_err("Error: wgm_metrics_create: failed to allocate memory\n");
+	return NULL;
+}
+
+void wgm_metrics_destroy(struct wgm_metrics *m)
+{
+	if (!m)
+		return;
+
+	free(m->ifaces);
+	free(m->path);
+	free(m);
+}
+
+static struct wgm_metrics_iface *wgm_metrics_get_iface(struct wgm_metrics *m,
+						       const char *ifname)
+{
+	struct wgm_metrics_iface *tmp;
+	size_t i;
+
+	for (i = 0; i < m->nr_ifaces; i++) {
+		if (!strcmp(m->ifaces[i].ifname, ifname))
+			return &m->ifaces[i];
+	}
+
+	tmp = realloc(m->ifaces, (m->nr_ifaces + 1) * sizeof(*tmp));
+	if (!tmp)
+		return NULL;
+
+	m->ifaces = tmp;
+	tmp = &m->ifaces[m->nr_ifaces++];
+	memset(tmp, 0, sizeof(*tmp));
+	strncpyl(tmp->ifname, ifname, sizeof(tmp->ifname));
+	return tmp;
+}
+
+static int cmp_u64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+
+	return (x > y) - (x < y);
+}
+
+/*
+ * A fwmark is allocated per (bind IP, bind device) pair of the peers
+ * that have allowed IPs; count the distinct pairs by hash.
+ */
+static uint64_t count_fwmarks(const struct wgm_iface *iface)
+{
+	const struct wgm_peer *peer;
+	uint64_t *hashes, ret = 0;
+	size_t i, n = 0;
+
+	hashes = malloc((iface->peers.nr + 1) * sizeof(*hashes));
+	if (!hashes)
+		return 0;
+
+	for (i = 0; i < iface->peers.nr; i++) {
+		peer = &iface->peers.peers[i];
+		if (!peer->bind_ip[0] || !peer->allowed_ips.nr)
+			continue;
+
+		hashes[n++] = wgm_hash_str(peer->bind_ip) * 1099511628211ull ^
+			      wgm_hash_str(peer->bind_dev);
+	}
+
+	qsort(hashes, n, sizeof(*hashes), cmp_u64);
+	for (i = 0; i < n; i++) {
+		if (!i || hashes[i] != hashes[i - 1])
+			ret++;
+	}
+
+	free(hashes);
+	return ret;
+}
+
+void wgm_metrics_iface_state(struct wgm_ctx *ctx, const struct wgm_iface *iface,
+			     const char *conf_path)
+{
+	struct wgm_metrics_iface *mi;
+	struct stat st;
+	size_t i;
+
+	if (!ctx->metrics)
+		return;
+
+	mi = wgm_metrics_get_iface(ctx->metrics, iface->ifname);
+	if (!mi)
+		return;
+
+	mi->has_state = true;
+	mi->peers = iface->peers.nr;
+	mi->allowed_ips = 0;
+	for (i = 0; i < iface->peers.nr; i++)
+		mi->allowed_ips += iface->peers.peers[i].allowed_ips.nr;
+
+	mi->fwmarks = count_fwmarks(iface);
+	mi->store_bytes = wgm_iface_store_bytes(iface, ctx);
+	mi->conf_bytes = stat(conf_path, &st) ? 0 : st.st_size;
+}
+
+void wgm_metrics_iface_apply(struct wgm_ctx *ctx, const char *ifname, uint64_t ns,
+			     bool ok)
+{
+	struct wgm_metrics_iface *mi;
+
+	if (!ctx->metrics)
+		return;
+
+	mi = wgm_metrics_get_iface(ctx->metrics, ifname);
+	if (!mi)
+		return;
+
+	mi->has_apply = true;
+	mi->apply_ok = ok;
+	mi->apply_ns = ns;
+	mi->apply_time = time(NULL);
+}
+
+void wgm_metrics_iface_del(struct wgm_ctx *ctx, const char *ifname)
+{
+	struct wgm_metrics_iface *mi;
+
+	if (!ctx->metrics)
+		return;
+
+	mi = wgm_metrics_get_iface(ctx->metrics, ifname);
+	if (!mi)
+		return;
+
+	memset(mi, 0, sizeof(*mi));
+	strncpyl(mi->ifname, ifname, sizeof(mi->ifname));
+	mi->deleted = true;
+}
+
+static void series_array_free(struct wgm_metrics_series_array *s)
+{
+	size_t i;
+
+	for (i = 0; i < s->nr; i++)
+		free(s->arr[i].key);
+
+	free(s->arr);
+}
+
+static struct wgm_metrics_series *series_append(struct wgm_metrics_series_array *s,
+						const char *key)
+{
+	struct wgm_metrics_series *tmp;
+
+	if (s->nr == s->cap) {
+		size_t cap = s->cap ? s->cap * 2 : 64;
+
+		tmp = realloc(s->arr, cap * sizeof(*tmp));
+		if (!tmp)
+			return NULL;
+
+		s->arr = tmp;
+		s->cap = cap;
+	}
+
+	tmp = &s->arr[s->nr];
+	tmp->key = strdup(key);
+	if (!tmp->key)
+		return NULL;
+
+	tmp->val = 0;
+	s->nr++;
+	return tmp;
+}
+
+static struct wgm_metrics_series *series_get(struct wgm_metrics_series_array *s,
+					     const char *key)
+{
+	size_t i;
+
+	for (i = 0; i < s->nr; i++) {
+		if (!strcmp(s->arr[i].key, key))
+			return &s->arr[i];
+	}
+
+	return series_append(s, key);
+}
+
+static int series_addf(struct wgm_metrics_series_array *s, double val, bool set,
+		       const char *fmt, ...)
+	__attribute__((format(printf, 4, 5)));
+
+static int series_addf(struct wgm_metrics_series_array *s, double val, bool set,
+		       const char *fmt, ...)
+{
+	struct wgm_metrics_series *ser;
+	char key[512];
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(key, sizeof(key), fmt, ap);
+	va_end(ap);
+
+	ser = series_get(s, key);
+	if (!ser)
+		return -ENOMEM;
+
+	if (set)
+		ser->val = val;
+	else
+		ser->val += val;
+
+	return 0;
+}
+
+/*
+ * Drop every series carrying exactly the label set @labels.
+ */
+static void series_del_labels(struct wgm_metrics_series_array *s, const char *labels)
+{
+	size_t i, j;
+
+	for (i = 0, j = 0; i < s->nr; i++) {
+		if (strstr(s->arr[i].key, labels)) {
+			free(s->arr[i].key);
+			continue;
+		}
+
+		s->arr[j++] = s->arr[i];
+	}
+
+	s->nr = j;
+}
+
+static int series_load(struct wgm_metrics_series_array *s, const char *path)
+{
+	struct wgm_metrics_series *ser;
+	size_t len = 0;
+	char *line = NULL, *sp;
+	ssize_t n;
+	FILE *fp;
+	int ret = 0;
+
+	fp = fopen(path, "rb");
+	if (!fp)
+		return errno == ENOENT ? 0 : -errno;
+
+	while ((n = getline(&line, &len, fp)) > 0) {
+		if (line[n - 1] == '\n')
+			line[--n] = '\0';
+
+		if (!n || line[0] == '#')
+			continue;
+
+		sp = strrchr(line, ' ');
+		if (!sp)
+			continue;
+
+		/*
+		 * The file is only ever written by series_store(), so its
+		 * series are unique and need no lookup here.
+		 */
+		*sp = '\0';
+		ser = series_append(s, line);
+		if (!ser) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ser->val = strtod(sp + 1, NULL);
+	}
+
+	free(line);
+	fclose(fp);
+	return ret;
+}
+
+static bool series_in_family(const char *key, const struct wgm_metrics_family *f)
+{
+	size_t n = strlen(f->name);
+	const char *rest = key + n;
+
+	if (strncmp(key, f->name, n))
+		return false;
+
+	if (*rest == '{' || *rest == '\0')
+		return true;
+
+	if (strcmp(f->type, "histogram"))
+		return false;
+
+	return !strncmp(rest, "_bucket{", 8) || !strncmp(rest, "_sum{", 5) ||
+	       !strncmp(rest, "_count{", 7);
+}
+
+static void fprint_value(FILE *fp, double val)
+{
+	if (val >= -9e15 && val <= 9e15 && val == (double)(int64_t)val)
+		fprintf(fp, "%lld\n", (long long)val);
+	else
+		fprintf(fp, "%.9g\n", val);
+}
+
+static int series_store(const struct wgm_metrics_series_array *s, const char *path)
+{
+	const struct wgm_metrics_family *f;
+	char *tmp_path;
+	size_t i, j;
+	FILE *fp;
+	int ret;
+
+	ret = wgm_asprintf(&tmp_path, "%s.tmp", path);
+	if (ret)
+		return ret;
+
+	fp = fopen(tmp_path, "wb");
+	if (!fp) {
+		ret = -errno;
+		goto out;
+	}
+
+	for (i = 0; i < ARRAY_SIZE(families); i++) {
+		f = &families[i];
+		fprintf(fp, "# HELP %s %s\n", f->name, f->help);
+		fprintf(fp, "# TYPE %s %s\n", f->name, f->type);
+		for (j = 0; j < s->nr; j++) {
+			if (!series_in_family(s->arr[j].key, f))
+				continue;
+
+			fprintf(fp, "%s ", s->arr[j].key);
+			fprint_value(fp, s->arr[j].val);
+		}
+	}
+
+	ret = fflush(fp) ? -errno : 0;
+	if (fclose(fp) && !ret)
+		ret = -errno;
+
+	if (!ret && rename(tmp_path, path))
+		ret = -errno;
+
+	if (ret)
+		unlink(tmp_path);
+out:
+	free(tmp_path);
+	return ret;
+}
+
+static void escape_label(char *dst, size_t len, const char *src)
+{
+	size_t i = 0;
+
+	for (; *src && i + 2 < len; src++) {
+		if (*src == '\\' || *src == '"') {
+			dst[i++] = '\\';
+			dst[i++] = *src;
+		} else if (*src == '\n') {
+			dst[i++] = '\\';
+			dst[i++] = 'n';
+		} else {
+			dst[i++] = *src;
+		}
+	}
+
+	dst[i] = '\0';
+}
+
+static int record_command(struct wgm_metrics_series_array *s, struct wgm_ctx *ctx,
+			  int result, double sec)
+{
+	static const char dur[] = "wgm_command_duration_seconds";
+	char cmd[64];
+	size_t i;
+	int ret;
+
+	if (ctx->cmd_name)
+		snprintf(cmd, sizeof(cmd), "%s %s", ctx->cmd_group, ctx->cmd_name);
+	else
+		snprintf(cmd, sizeof(cmd), "%s", ctx->cmd_group);
+	ret = series_addf(s, 1, false, "wgm_command_total{command=\"%s\",result=\"%s\"}",
+			  cmd, result ? "error" : "ok");
+
+	/*
+	 * All buckets are touched so a new command gets the full set, in
+	 * order, the first time it is seen.
+	 */
+	for (i = 0; !ret && i < ARRAY_SIZE(duration_buckets); i++) {
+		ret = series_addf(s, sec <= duration_buckets[i], false,
+				  "%s_bucket{command=\"%s\",le=\"%g\"}", dur, cmd,
+				  duration_buckets[i]);
+	}
+
+	if (!ret)
+		ret = series_addf(s, 1, false, "%s_bucket{command=\"%s\",le=\"+Inf\"}", dur, cmd);
+	if (!ret)
+		ret = series_addf(s, sec, false, "%s_sum{command=\"%s\"}", dur, cmd);
+	if (!ret)
+		ret = series_addf(s, 1, false, "%s_count{command=\"%s\"}", dur, cmd);
+
+	return ret;
+}
+
+static int record_iface(struct wgm_metrics_series_array *s,
+			const struct wgm_metrics_iface *mi)
+{
+	char dev[IFNAMSIZ * 2 + 1], labels[sizeof(dev) + 16];
+	int ret = 0;
+
+	escape_label(dev, sizeof(dev), mi->ifname);
+	snprintf(labels, sizeof(labels), "{dev=\"%s\"}", dev);
+
+	if (mi->deleted)
+		series_del_labels(s, labels);
+
+	if (mi->has_state) {
+		ret |= series_addf(s, mi->peers, true, "wgm_iface_peers%s", labels);
+		ret |= series_addf(s, mi->allowed_ips, true, "wgm_iface_allowed_ips%s", labels);
+		ret |= series_addf(s, mi->fwmarks, true, "wgm_iface_fwmarks%s", labels);
+		ret |= series_addf(s, mi->store_bytes, true, "wgm_iface_store_bytes%s", labels);
+		ret |= series_addf(s, mi->conf_bytes, true, "wgm_iface_conf_bytes%s", labels);
+	}
+
+	if (mi->has_apply) {
+		ret |= series_addf(s, mi->apply_ns / 1e9, true, "wgm_iface_last_apply_duration_seconds%s", labels);
+		ret |= series_addf(s, mi->apply_ok, true, "wgm_iface_last_apply_success%s", labels);
+		ret |= series_addf(s, mi->apply_time, true, "wgm_iface_last_apply_timestamp_seconds%s", labels);
+	}
+
+	return ret ? -ENOMEM : 0;
+}
+
+/*
+ * Merge what this command recorded into the metrics file. Failures are
+ * logged but never change the result of the command.
+ */
+int wgm_metrics_flush(struct wgm_ctx *ctx, int result)
+{
+	struct wgm_metrics *m = ctx->metrics;
+	struct wgm_metrics_series_array s;
+	char *lock_path;
+	double sec;
+	size_t i;
+	int fd, ret;
+
+	if (!m)
+		return 0;
+
+	sec = (wgm_now_ns() - m->start_ns) / 1e9;
+	memset(&s, 0, sizeof(s));
+
+	ret = wgm_asprintf(&lock_path, "%s/metrics.lock", ctx->data_dir);
+	if (ret)
+		return ret;
+
+	fd = open(lock_path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	free(lock_path);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		ret = -errno;
+		wgm_log_err("Error: wgm_metrics_flush: Failed to lock the metrics file: %s\n", strerror(-ret));
+		if (fd >= 0)
+			close(fd);
+		return ret;
+	}
+
+	ret = series_load(&s, m->path);
+	if (ret) {
+		wgm_log_err("Error: wgm_metrics_flush: Failed to read '%s': %s\n", m->path, strerror(-ret));
+		goto out;
+	}
+
+	if (ctx->cmd_group)
+		ret = record_command(&s, ctx, result, sec);
+
+	for (i = 0; !ret && i < m->nr_ifaces; i++)
+		ret = record_iface(&s, &m->ifaces[i]);
+
+	if (!ret)
+		ret = series_store(&s, m->path);
+
+	if (ret)
+		wgm_log_err("Error: wgm_metrics_flush: Failed to write '%s': %s\n", m->path, strerror(-ret));
+out:
+	series_array_free(&s);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_METRICS_H
+#define WGM__WG_METRICS_H
+
+#include "helpers.h"
+
+#include <time.h>
+
+struct wgm_iface;
+
+/*
+ * Prometheus textfile metrics (WGM_METRICS_FILE). A command only
+ * records what it already has in memory: its own result and duration,
+ * and the interfaces it saved, applied or deleted. On exit that is
+ * merged into the .prom file under a lock and the file is replaced
+ * atomically; the file itself holds the running counters, so nothing
+ * in the data directory is ever rescanned.
+ */
+struct wgm_metrics_iface {
+	char		ifname[IFNAMSIZ];
+	bool		deleted;
+
+	bool		has_state;
+	uint64_t	peers;
+	uint64_t	allowed_ips;
+	uint64_t	fwmarks;
+	uint64_t	store_bytes;
+	uint64_t	conf_bytes;
+
+	bool		has_apply;
+	bool		apply_ok;
+	uint64_t	apply_ns;
+	time_t		apply_time;
+};
+
+struct wgm_metrics {
+	char				*path;
+	uint64_t			start_ns;
+	struct wgm_metrics_iface	*ifaces;
+	size_t				nr_ifaces;
+};
+
+struct wgm_metrics *wgm_metrics_create(const char *path);
+void wgm_metrics_destroy(struct wgm_metrics *m);
+void wgm_metrics_iface_state(struct wgm_ctx *ctx, const struct wgm_iface *iface,
+			     const char *conf_path);
+void wgm_metrics_iface_apply(struct wgm_ctx *ctx, const char *ifname, uint64_t ns,
+			     bool ok);
+void wgm_metrics_iface_del(struct wgm_ctx *ctx, const char *ifname);
+int wgm_metrics_flush(struct wgm_ctx *ctx, int result);
+
+#endif /* #ifndef WGM__WG_METRICS_H */
@@ -0,0 +1,885 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_nl.h"
+#include "wgm_iface.h"
+#include "wgm_peer.h"
+#include "wgm_trace.h"
+
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+#include <linux/genetlink.h>
+#include <linux/wireguard.h>
+
+/*
+ * Attribute lengths are 16 bits, so the peers of a large interface are
+ * spread over several WG_CMD_SET_DEVICE messages of at most this size,
+ * as wg(8) does. Messages are queued and sent WGM_NL_BATCH bytes at a
+ * time, which keeps both the request and its acks well within the
+ * socket buffers.
+ */
+#define WGM_NL_MSG_MAX		(32u << 10)
+#define WGM_NL_BATCH		(128u << 10)
+#define WGM_NL_SOCK_BUF		(1u << 20)
+
+struct wgm_nl {
+	int		fd;
+
+	/*
+	 * Sequence number of the next message, and of the first one not
+	 * sent yet.
+	 */
+	uint32_t	seq;
+	uint32_t	batch_seq;
+
+	/*
+	 * Queued messages; @msg is the offset of the one being built.
+	 */
+	char		*buf;
+	size_t		len;
+	size_t		alloc;
+	size_t		msg;
+	bool		oom;
+
+	/*
+	 * Error (positive errno) acked by the kernel that is not a
+	 * failure, e.g. EEXIST for a route.
+	 */
+	int		ignore_err;
+
+	/*
+	 * Called for every reply that is not an ack.
+	 */
+	int		(*cb)(const struct nlmsghdr *nlh, void *data);
+	void		*cb_data;
+};
+
+struct wgm_nl_link {
+	int	index;
+	char	kind[32];
+};
+
+struct wgm_nl_prefix {
+	int	family;
+	uint8_t	addr[16];
+	uint8_t	len;
+};
+
+union wgm_nl_sockaddr {
+	struct sockaddr		sa;
+	struct sockaddr_in	sin;
+	struct sockaddr_in6	sin6;
+};
+
+static int wgm_nl_open(struct wgm_nl *nl, int proto)
+{
+	int one = 1, size = WGM_NL_SOCK_BUF;
+
+	memset(nl, 0, sizeof(*nl));
+	nl->seq = nl->batch_seq = 1;
+	nl->fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, proto);
+	if (nl->fd < 0)
+		return -errno;
+
+	/*
+	 * Best effort: the defaults are enough for WGM_NL_BATCH.
+	 */
+	setsockopt(nl->fd, SOL_SOCKET, SO_SNDBUF, &size, sizeof(size));
+	setsockopt(nl->fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+	setsockopt(nl->fd, SOL_NETLINK, NETLINK_CAP_ACK, &one, sizeof(one));
+	return 0;
+}
+
+static void wgm_nl_close(struct wgm_nl *nl)
+{
+	if (nl->fd >= 0)
+		close(nl->fd);
+	free(nl->buf);
+	nl->fd = -1;
+	nl->buf = NULL;
+}
+
+static void *nl_reserve(struct wgm_nl *nl, size_t len)
+{
+	size_t need = nl->len + NLMSG_ALIGN(len);
+	void *p;
+
+	if (nl->oom)
+		return NULL;
+
+	if (need > nl->alloc) {
+		size_t alloc = nl->alloc ? nl->alloc : 4096;
+
+		while (alloc < need)
+			alloc *= 2;
+
+		p = realloc(nl->buf, alloc);
+		if (!p) {
+			nl->oom = true;
+			return NULL;
+		}
+
+		nl->buf = p;
+		nl->alloc = alloc;
+	}
+
+	p = nl->buf + nl->len;
+	memset(p, 0, NLMSG_ALIGN(len));
+	nl->len = need;
+	return p;
+}
+
+/*
+ * Start a message and return its family header (@hdr_len bytes, zeroed),
+ * valid until the next nl_put().
+ */
+static void *nl_msg_begin(struct wgm_nl *nl, uint16_t type, uint16_t flags, size_t hdr_len)
+{
+	struct nlmsghdr *nlh;
+
+	nl->msg = nl->len;
+	nlh = nl_reserve(nl, NLMSG_HDRLEN + hdr_len);
+	if (!nlh)
+		return NULL;
+
+	nlh->nlmsg_type = type;
+	nlh->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK | flags;
+	nlh->nlmsg_seq = nl->seq++;
+	return (char *)nlh + NLMSG_HDRLEN;
+}
+
+static void nl_msg_end(struct wgm_nl *nl)
+{
+	if (!nl->oom)
+		((struct nlmsghdr *)(nl->buf + nl->msg))->nlmsg_len = nl->len - nl->msg;
+}
+
+static void nl_put(struct wgm_nl *nl, uint16_t type, const void *data, size_t len)
+{
+	struct nlattr *nla = nl_reserve(nl, NLA_HDRLEN + len);
+
+	if (!nla)
+		return;
+
+	nla->nla_type = type;
+	nla->nla_len = NLA_HDRLEN + len;
+	if (len)
+		memcpy((char *)nla + NLA_HDRLEN, data, len);
+}
+
+static void nl_put_u8(struct wgm_nl *nl, uint16_t type, uint8_t val)
+{
+	nl_put(nl, type, &val, sizeof(val));
+}
+
+static void nl_put_u16(struct wgm_nl *nl, uint16_t type, uint16_t val)
+{
+	nl_put(nl, type, &val, sizeof(val));
+}
+
+static void nl_put_u32(struct wgm_nl *nl, uint16_t type, uint32_t val)
+{
+	nl_put(nl, type, &val, sizeof(val));
+}
+
+static void nl_put_str(struct wgm_nl *nl, uint16_t type, const char *str)
+{
+	nl_put(nl, type, str, strlen(str) + 1);
+}
+
+static size_t nl_nest_begin(struct wgm_nl *nl, uint16_t type)
+{
+	size_t off = nl->len;
+
+	nl_put(nl, type | NLA_F_NESTED, NULL, 0);
+	return off;
+}
+
+static void nl_nest_end(struct wgm_nl *nl, size_t off)
+{
+	if (!nl->oom)
+		((struct nlattr *)(nl->buf + off))->nla_len = nl->len - off;
+}
+
+/*
+ * Send the queued messages and wait for all their acks. Returns the
+ * first error, after every ack has been read.
+ */
+static int nl_flush(struct wgm_nl *nl)
+{
+	uint32_t pending = nl->seq - nl->batch_seq;
+	char rbuf[32768] __attribute__((aligned(NLMSG_ALIGNTO)));
+	const struct nlmsghdr *nlh;
+	int ret = 0, n;
+
+	if (nl->oom)
+		return -ENOMEM;
+
+	if (!nl->len)
+		return 0;
+
+	if (send(nl->fd, nl->buf, nl->len, 0) < 0) {
+		ret = -errno;
+		pending = 0;
+	}
+
+	while (pending) {
+		n = recv(nl->fd, rbuf, sizeof(rbuf), 0);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			if (!ret)
+				ret = -errno;
+			break;
+		}
+
+		for (nlh = (void *)rbuf; NLMSG_OK(nlh, n); nlh = NLMSG_NEXT(nlh, n)) {
+			if (nlh->nlmsg_seq - nl->batch_seq >= nl->seq - nl->batch_seq)
+				continue;
+
+			if (nlh->nlmsg_type == NLMSG_ERROR) {
+				const struct nlmsgerr *e = NLMSG_DATA(nlh);
+
+				if (e->error && -e->error != nl->ignore_err && !ret)
+					ret = e->error;
+				pending--;
+			} else if (nl->cb && !ret) {
+				ret = nl->cb(nlh, nl->cb_data);
+			}
+		}
+	}
+
+	nl->len = 0;
+	nl->batch_seq = nl->seq;
+	return ret;
+}
+
+static int nl_maybe_flush(struct wgm_nl *nl)
+{
+	return nl->len >= WGM_NL_BATCH ? nl_flush(nl) : 0;
+}
+
+static int link_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct ifinfomsg *ifi = NLMSG_DATA(nlh);
+	struct wgm_nl_link *link = data;
+	const struct rtattr *rta, *info;
+	int len, ilen;
+
+	if (nlh->nlmsg_type != RTM_NEWLINK)
+		return 0;
+
+	link->index = ifi->ifi_index;
+	len = IFLA_PAYLOAD(nlh);
+	for (rta = IFLA_RTA(ifi); RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if ((rta->rta_type & NLA_TYPE_MASK) != IFLA_LINKINFO)
+			continue;
+
+		ilen = RTA_PAYLOAD(rta);
+		for (info = RTA_DATA(rta); RTA_OK(info, ilen); info = RTA_NEXT(info, ilen)) {
+			size_t n = RTA_PAYLOAD(info);
+
+			if ((info->rta_type & NLA_TYPE_MASK) != IFLA_INFO_KIND)
+				continue;
+
+			if (n >= sizeof(link->kind))
+				n = sizeof(link->kind) - 1;
+			memcpy(link->kind, RTA_DATA(info), n);
+			link->kind[n] = '\0';
+		}
+	}
+
+	return 0;
+}
+
+static int nl_get_link(struct wgm_nl *rt, const char *ifname, struct wgm_nl_link *link)
+{
+	int ret;
+
+	memset(link, 0, sizeof(*link));
+	if (!nl_msg_begin(rt, RTM_GETLINK, 0, sizeof(struct ifinfomsg)))
+		return -ENOMEM;
+
+	nl_put_str(rt, IFLA_IFNAME, ifname);
+	nl_msg_end(rt);
+
+	rt->cb = link_cb;
+	rt->cb_data = link;
+	ret = nl_flush(rt);
+	rt->cb = NULL;
+	if (!ret && !link->index)
+		ret = -ENODEV;
+
+	return ret;
+}
+
+static int family_cb(const struct nlmsghdr *nlh, void *data)
+{
+	const struct rtattr *rta;
+	uint16_t *id = data;
+	int len;
+
+	if (nlh->nlmsg_type != GENL_ID_CTRL)
+		return 0;
+
+	len = nlh->nlmsg_len - NLMSG_LENGTH(GENL_HDRLEN);
+	rta = (const void *)((const char *)NLMSG_DATA(nlh) + GENL_HDRLEN);
+	for (; RTA_OK(rta, len); rta = RTA_NEXT(rta, len)) {
+		if (rta->rta_type == CTRL_ATTR_FAMILY_ID && RTA_PAYLOAD(rta) >= sizeof(*id))
+			memcpy(id, RTA_DATA(rta), sizeof(*id));
+	}
+
+	return 0;
+}
+
+static int nl_get_family(struct wgm_nl *gn, const char *name, uint16_t *id)
+{
+	struct genlmsghdr *g;
+	int ret;
+
+	*id = 0;
+	g = nl_msg_begin(gn, GENL_ID_CTRL, 0, GENL_HDRLEN);
+	if (!g)
+		return -ENOMEM;
+
+	g->cmd = CTRL_CMD_GETFAMILY;
+	g->version = 1;
+	nl_put_str(gn, CTRL_ATTR_FAMILY_NAME, name);
+	nl_msg_end(gn);
+
+	gn->cb = family_cb;
+	gn->cb_data = id;
+	ret = nl_flush(gn);
+	gn->cb = NULL;
+	if (!ret && !*id)
+		ret = -ENOENT;
+
+	return ret;
+}
+
+static int parse_prefix(struct wgm_nl_prefix *p, const char *str)
+{
+	char buf[INET6_ADDRSTRLEN + 8], *slash, *end;
+	unsigned long len;
+	int max;
+
+	if (strlen(str) >= sizeof(buf))
+		return -EINVAL;
+
+	strcpy(buf, str);
+	slash = strchr(buf, '/');
+	if (slash)
+		*slash++ = '\0';
+
+	memset(p, 0, sizeof(*p));
+	if (inet_pton(AF_INET, buf, p->addr) == 1) {
+		p->family = AF_INET;
+		max = 32;
+	} else if (inet_pton(AF_INET6, buf, p->addr) == 1) {
+		p->family = AF_INET6;
+		max = 128;
+	} else {
+		return -EINVAL;
+	}
+
+	p->len = max;
+	if (slash) {
+		len = strtoul(slash, &end, 10);
+		if (!*slash || *end || len > (unsigned long)max)
+			return -EINVAL;
+
+		p->len = len;
+	}
+
+	return 0;
+}
+
+static size_t prefix_addr_len(const struct wgm_nl_prefix *p)
+{
+	return p->family == AF_INET ? 4 : 16;
+}
+
+/*
+ * Clear the host bits; route destinations must not have any.
+ */
+static void prefix_mask(struct wgm_nl_prefix *p)
+{
+	size_t i, n = prefix_addr_len(p);
+
+	for (i = 0; i < n; i++) {
+		if (i * 8 >= p->len)
+			p->addr[i] = 0;
+		else if (i * 8 + 8 > p->len)
+			p->addr[i] &= 0xff << (8 - (p->len - i * 8));
+	}
+}
+
+static bool prefix_covers(const struct wgm_nl_prefix *net, const struct wgm_nl_prefix *p)
+{
+	struct wgm_nl_prefix a = *net, b = *p;
+
+	if (net->family != p->family || net->len > p->len)
+		return false;
+
+	b.len = a.len;
+	prefix_mask(&a);
+	prefix_mask(&b);
+	return !memcmp(a.addr, b.addr, prefix_addr_len(&a));
+}
+
+/*
+ * Only numeric endpoints; a host name would need the resolver, which
+ * is left to wg-quick (and keeps getaddrinfo() out of the static
+ * binary).
+ */
+static int parse_endpoint(union wgm_nl_sockaddr *sa, socklen_t *salen, const char *str)
+{
+	char buf[128], *host = buf, *port, *end;
+	unsigned long p;
+
+	if (strlen(str) >= sizeof(buf))
+		return -EINVAL;
+
+	strcpy(buf, str);
+	if (*host == '[') {
+		host++;
+		port = strchr(host, ']');
+		if (!port || port[1] != ':')
+			return -EINVAL;
+
+		*port = '\0';
+		port += 2;
+	} else {
+		port = strrchr(host, ':');
+		if (!port)
+			return -EINVAL;
+
+		*port++ = '\0';
+	}
+
+	p = strtoul(port, &end, 10);
+	if (!*port || *end || !p || p > 65535)
+		return -EINVAL;
+
+	memset(sa, 0, sizeof(*sa));
+	if (inet_pton(AF_INET, host, &sa->sin.sin_addr) == 1) {
+		sa->sin.sin_family = AF_INET;
+		sa->sin.sin_port = htons(p);
+		*salen = sizeof(sa->sin);
+	} else if (inet_pton(AF_INET6, host, &sa->sin6.sin6_addr) == 1) {
+		sa->sin6.sin6_family = AF_INET6;
+		sa->sin6.sin6_port = htons(p);
+		*salen = sizeof(sa->sin6);
+	} else {
+		return -EOPNOTSUPP;
+	}
+
+	return 0;
+}
+
+/*
+ * Everything is parsed once before the link is created, so a bad or
+ * unsupported configuration changes nothing.
+ */
+static int wgm_nl_check(const struct wgm_iface *iface)
+{
+	union wgm_nl_sockaddr sa;
+	struct wgm_nl_prefix p;
+	uint8_t key[WGM_KEY_LEN];
+	socklen_t salen;
+	size_t i, j;
+	int ret;
+
+	if (wgm_key_from_base64(key, iface->private_key)) {
+		wgm_log_err("Error: wgm_nl_up: Invalid private key of '%s'\n", iface->ifname);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < iface->addresses.nr; i++) {
+		if (parse_prefix(&p, iface->addresses.arr[i])) {
+			wgm_log_err("Error: wgm_nl_up: Invalid address '%s'\n", iface->addresses.arr[i]);
+			return -EINVAL;
+		}
+	}
+
+	for (i = 0; i < iface->peers.nr; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+
+		if (wgm_key_from_base64(key, peer->public_key)) {
+			wgm_log_err("Error: wgm_nl_up: Invalid public key '%s'\n", peer->public_key);
+			return -EINVAL;
+		}
+
+		if (peer->endpoint[0]) {
+			ret = parse_endpoint(&sa, &salen, peer->endpoint);
+			if (ret == -EINVAL)
+				wgm_log_err("Error: wgm_nl_up: Invalid endpoint '%s'\n", peer->endpoint);
+			if (ret)
+				return ret;
+		}
+
+		for (j = 0; j < peer->allowed_ips.nr; j++) {
+			if (parse_prefix(&p, peer->allowed_ips.arr[j])) {
+				wgm_log_err("Error: wgm_nl_up: Invalid allowed IP '%s'\n", peer->allowed_ips.arr[j]);
+				return -EINVAL;
+			}
+
+			/*
+			 * A default route needs wg-quick's policy routing.
+			 */
+			if (!p.len)
+				return -EOPNOTSUPP;
+		}
+	}
+
+	return 0;
+}
+
+static int nl_link_create(struct wgm_nl *rt, const char *ifname)
+{
+	size_t info;
+
+	if (!nl_msg_begin(rt, RTM_NEWLINK, NLM_F_CREATE | NLM_F_EXCL, sizeof(struct ifinfomsg)))
+		return -ENOMEM;
+
+	nl_put_str(rt, IFLA_IFNAME, ifname);
+	info = nl_nest_begin(rt, IFLA_LINKINFO);
+	nl_put_str(rt, IFLA_INFO_KIND, WG_GENL_NAME);
+	nl_nest_end(rt, info);
+	nl_msg_end(rt);
+	return nl_flush(rt);
+}
+
+static int nl_link_del(struct wgm_nl *rt, int index)
+{
+	struct ifinfomsg *ifi;
+
+	ifi = nl_msg_begin(rt, RTM_DELLINK, 0, sizeof(*ifi));
+	if (!ifi)
+		return -ENOMEM;
+
+	ifi->ifi_index = index;
+	nl_msg_end(rt);
+	return nl_flush(rt);
+}
+
+static int nl_link_set_up(struct wgm_nl *rt, int index, uint16_t mtu)
+{
+	struct ifinfomsg *ifi;
+
+	ifi = nl_msg_begin(rt, RTM_NEWLINK, 0, sizeof(*ifi));
+	if (!ifi)
+		return -ENOMEM;
+
+	ifi->ifi_index = index;
+	ifi->ifi_flags = IFF_UP;
+	ifi->ifi_change = IFF_UP;
+	if (mtu)
+		nl_put_u32(rt, IFLA_MTU, mtu);
+	nl_msg_end(rt);
+	return nl_flush(rt);
+}
+
+static int nl_addr_add(struct wgm_nl *rt, int index, const struct wgm_str_array *addrs)
+{
+	struct wgm_nl_prefix p;
+	struct ifaddrmsg *ifa;
+	size_t i;
+
+	for (i = 0; i < addrs->nr; i++) {
+		parse_prefix(&p, addrs->arr[i]);
+		ifa = nl_msg_begin(rt, RTM_NEWADDR, NLM_F_CREATE | NLM_F_EXCL, sizeof(*ifa));
+		if (!ifa)
+			return -ENOMEM;
+
+		ifa->ifa_family = p.family;
+		ifa->ifa_prefixlen = p.len;
+		ifa->ifa_index = index;
+		nl_put(rt, IFA_LOCAL, p.addr, prefix_addr_len(&p));
+		nl_put(rt, IFA_ADDRESS, p.addr, prefix_addr_len(&p));
+		nl_msg_end(rt);
+	}
+
+	return nl_flush(rt);
+}
+
+/*
+ * Route every allowed IP through the interface, as wg-quick does, except
+ * those already covered by the prefix route of one of its addresses.
+ */
+static int nl_route_add(struct wgm_nl *rt, int index, const struct wgm_iface *iface)
+{
+	struct wgm_nl_prefix *nets, p;
+	size_t i, j, k, nr_nets = iface->addresses.nr;
+	struct rtmsg *rtm;
+	int ret = 0;
+
+	nets = calloc(nr_nets ? nr_nets : 1, sizeof(*nets));
+	if (!nets)
+		return -ENOMEM;
+
+	for (i = 0; i < nr_nets; i++)
+		parse_prefix(&nets[i], iface->addresses.arr[i]);
+
+	rt->ignore_err = EEXIST;
+	for (i = 0; !ret && i < iface->peers.nr; i++) {
+		const struct wgm_peer *peer = &iface->peers.peers[i];
+
+		for (j = 0; !ret && j < peer->allowed_ips.nr; j++) {
+			parse_prefix(&p, peer->allowed_ips.arr[j]);
+			for (k = 0; k < nr_nets; k++) {
+				if (prefix_covers(&nets[k], &p))
+					break;
+			}
+
+			if (k < nr_nets)
+				continue;
+
+			prefix_mask(&p);
+			rtm = nl_msg_begin(rt, RTM_NEWROUTE, NLM_F_CREATE | NLM_F_EXCL, sizeof(*rtm));
+			if (!rtm) {
+				ret = -ENOMEM;
+				break;
+			}
+
+			rtm->rtm_family = p.family;
+			rtm->rtm_dst_len = p.len;
+			rtm->rtm_table = RT_TABLE_MAIN;
+			rtm->rtm_protocol = RTPROT_BOOT;
+			rtm->rtm_scope = RT_SCOPE_LINK;
+			rtm->rtm_type = RTN_UNICAST;
+			nl_put(rt, RTA_DST, p.addr, prefix_addr_len(&p));
+			nl_put_u32(rt, RTA_OIF, index);
+			nl_msg_end(rt);
+			ret = nl_maybe_flush(rt);
+		}
+	}
+
+	if (!ret)
+		ret = nl_flush(rt);
+	rt->ignore_err = 0;
+	free(nets);
+	return ret;
+}
+
+static int wg_msg_begin(struct wgm_nl *gn, uint16_t family, const struct wgm_iface *iface,
+			bool first, size_t *peers)
+{
+	struct genlmsghdr *g;
+	uint8_t key[WGM_KEY_LEN];
+
+	g = nl_msg_begin(gn, family, 0, GENL_HDRLEN);
+	if (!g)
+		return -ENOMEM;
+
+	g->cmd = WG_CMD_SET_DEVICE;
+	g->version = WG_GENL_VERSION;
+	nl_put_str(gn, WGDEVICE_A_IFNAME, iface->ifname);
+	if (first) {
+		wgm_key_from_base64(key, iface->private_key);
+		nl_put(gn, WGDEVICE_A_PRIVATE_KEY, key, sizeof(key));
+		nl_put_u16(gn, WGDEVICE_A_LISTEN_PORT, iface->listen_port);
+		nl_put_u32(gn, WGDEVICE_A_FLAGS, WGDEVICE_F_REPLACE_PEERS);
+		memset(key, 0, sizeof(key));
+	}
+
+	*peers = nl_nest_begin(gn, WGDEVICE_A_PEERS);
+	return 0;
+}
+
+static void wg_put_peer(struct wgm_nl *gn, const struct wgm_peer *peer)
+{
+	union wgm_nl_sockaddr sa;
+	struct wgm_nl_prefix p;
+	uint8_t key[WGM_KEY_LEN];
+	size_t nest, ips, ip, i;
+	socklen_t salen;
+
+	wgm_key_from_base64(key, peer->public_key);
+	nest = nl_nest_begin(gn, 0);
+	nl_put(gn, WGPEER_A_PUBLIC_KEY, key, sizeof(key));
+	nl_put_u32(gn, WGPEER_A_FLAGS, WGPEER_F_REPLACE_ALLOWEDIPS);
+	if (peer->endpoint[0] && !parse_endpoint(&sa, &salen, peer->endpoint))
+		nl_put(gn, WGPEER_A_ENDPOINT, &sa, salen);
+
+	ips = nl_nest_begin(gn, WGPEER_A_ALLOWEDIPS);
+	for (i = 0; i < peer->allowed_ips.nr; i++) {
+		parse_prefix(&p, peer->allowed_ips.arr[i]);
+		ip = nl_nest_begin(gn, 0);
+		nl_put_u16(gn, WGALLOWEDIP_A_FAMILY, p.family);
+		nl_put(gn, WGALLOWEDIP_A_IPADDR, p.addr, prefix_addr_len(&p));
+		nl_put_u8(gn, WGALLOWEDIP_A_CIDR_MASK, p.len);
+		nl_nest_end(gn, ip);
+	}
+	nl_nest_end(gn, ips);
+	nl_nest_end(gn, nest);
+}
+
+/*
+ * Set the private key, listen port and the whole peer list, replacing
+ * whatever the device had, in as few messages as fit.
+ */
+static int wg_set_device(struct wgm_nl *gn, uint16_t family, const struct wgm_iface *iface)
+{
+	size_t i, peers, mark;
+	int ret;
+
+	ret = wg_msg_begin(gn, family, iface, true, &peers);
+	i = 0;
+	while (!ret && i < iface->peers.nr) {
+		mark = gn->len;
+		wg_put_peer(gn, &iface->peers.peers[i]);
+		if (gn->oom)
+			return -ENOMEM;
+
+		if (gn->len - gn->msg <= WGM_NL_MSG_MAX) {
+			i++;
+			continue;
+		}
+
+		if (mark == peers + NLA_HDRLEN) {
+			wgm_log_err("Error: wgm_nl_up: Peer '%s' has too many allowed IPs\n", iface->peers.peers[i].public_key);
+			return -E2BIG;
+		}
+
+		gn->len = mark;
+		nl_nest_end(gn, peers);
+		nl_msg_end(gn);
+		ret = nl_maybe_flush(gn);
+		if (!ret)
+			ret = wg_msg_begin(gn, family, iface, false, &peers);
+	}
+
+	if (ret)
+		return ret;
+
+	nl_nest_end(gn, peers);
+	nl_msg_end(gn);
+	return nl_flush(gn);
+}
+
+int wgm_nl_up(const struct wgm_iface *iface, struct wgm_ctx *ctx)
+{
+	struct wgm_nl rt, gn = { .fd = -1 };
+	struct wgm_nl_link link;
+	uint16_t family;
+	int ret;
+
+	ret = wgm_nl_check(iface);
+	if (ret)
+		return ret;
+
+	ret = wgm_nl_open(&rt, NETLINK_ROUTE);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_up: Failed to open rtnetlink socket: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	wgm_trace_begin(ctx, "nl_link");
+	ret = nl_link_create(&rt, iface->ifname);
+	if (!ret)
+		ret = nl_get_link(&rt, iface->ifname, &link);
+	wgm_trace_end(ctx);
+	if (ret == -EOPNOTSUPP)
+		goto out;
+
+	if (ret == -EEXIST) {
+		wgm_log_err("Error: wgm_nl_up: '%s' already exists\n", iface->ifname);
+		goto out;
+	}
+
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_up: Failed to create '%s': %s\n", iface->ifname, strerror(-ret));
+		goto out;
+	}
+
+	/*
+	 * Creating the link loaded the module, so the family exists now.
+	 */
+	wgm_trace_begin(ctx, "nl_wg");
+	ret = wgm_nl_open(&gn, NETLINK_GENERIC);
+	if (!ret)
+		ret = nl_get_family(&gn, WG_GENL_NAME, &family);
+	if (!ret)
+		ret = wg_set_device(&gn, family, iface);
+	wgm_trace_end(ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_up: Failed to configure '%s': %s\n", iface->ifname, strerror(-ret));
+		goto out_del;
+	}
+
+	wgm_trace_begin(ctx, "nl_addr");
+	ret = nl_addr_add(&rt, link.index, &iface->addresses);
+	if (!ret)
+		ret = nl_link_set_up(&rt, link.index, iface->mtu);
+	wgm_trace_end(ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_up: Failed to set the addresses of '%s': %s\n", iface->ifname, strerror(-ret));
+		goto out_del;
+	}
+
+	wgm_trace_begin(ctx, "nl_route");
+	ret = nl_route_add(&rt, link.index, iface);
+	wgm_trace_end(ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_up: Failed to add the routes of '%s': %s\n", iface->ifname, strerror(-ret));
+		goto out_del;
+	}
+
+	goto out;
+
+out_del:
+	/*
+	 * Like wg-quick, do not leave a half configured interface behind.
+	 * A -EOPNOTSUPP from here on is a failure, not a reason to retry
+	 * with wg-quick.
+	 */
+	nl_link_del(&rt, link.index);
+	if (ret == -EOPNOTSUPP)
+		ret = -EIO;
+out:
+	wgm_nl_close(&gn);
+	wgm_nl_close(&rt);
+	return ret;
+}
+
+int wgm_nl_down(const char *ifname, struct wgm_ctx *ctx)
+{
+	struct wgm_nl_link link;
+	struct wgm_nl rt;
+	int ret;
+
+	ret = wgm_nl_open(&rt, NETLINK_ROUTE);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_down: Failed to open rtnetlink socket: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	wgm_trace_begin(ctx, "nl_link");
+	ret = nl_get_link(&rt, ifname, &link);
+	if (ret) {
+		wgm_log_err("Error: wgm_nl_down: '%s' is not running\n", ifname);
+		goto out;
+	}
+
+	/*
+	 * Leave anything that is not a WireGuard link to wg-quick, which
+	 * refuses it.
+	 */
+	if (strcmp(link.kind, WG_GENL_NAME)) {
+		ret = -EOPNOTSUPP;
+		goto out;
+	}
+
+	ret = nl_link_del(&rt, link.index);
+	if (ret)
+		wgm_log_err("Error: wgm_nl_down: Failed to delete '%s': %s\n", ifname, strerror(-ret));
+out:
+	wgm_trace_end(ctx);
+	wgm_nl_close(&rt);
+	return ret;
+}
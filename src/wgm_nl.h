@@ -0,0 +1,25 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_NL_H
+#define WGM__WG_NL_H
+
+#include "helpers.h"
+
+struct wgm_iface;
+
+/*
+ * Bring a WireGuard interface up and down over netlink, without
+ * wg-quick: the link, its addresses, MTU and routes through rtnetlink,
+ * the private key, listen port and peers through the WireGuard generic
+ * netlink family. Requests are batched, many per sendmsg().
+ *
+ * The firewall hooks are not run here; see wgm_conf_up().
+ *
+ * -EOPNOTSUPP means the interface cannot be brought up natively (no
+ * WireGuard support in the kernel, a default route or an endpoint
+ * given by host name) and nothing was changed; wg-quick may still be
+ * able to do it.
+ */
+int wgm_nl_up(const struct wgm_iface *iface, struct wgm_ctx *ctx);
+int wgm_nl_down(const char *ifname, struct wgm_ctx *ctx);
+
+#endif /* #ifndef WGM__WG_NL_H */
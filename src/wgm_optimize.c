@@ -0,0 +1,293 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_optimize.h"
+#include "wgm_iface.h"
+#include "wgm_conf.h"
+#include "wgm_cidr.h"
+#include "wgm_exec.h"
+
+#include <getopt.h>
+
+/*
+ * wgm optimize puts the hottest sources of a running interface first
+ * in its firewall chains:
+ *
+ *  1. The packet counters of the ACCEPT rules of its filter chain,
+ *     which every forwarded packet walks once hooked into FORWARD
+ *     (--filter-forward on), are read with
+ *     `iptables -L -v -x -n`.
+ *  2. The packets of a rule are shared out evenly among the allowed
+ *     IPs it matches; the sum for a peer is saved as its "hits", the
+ *     ordering hint of the renderer, see wgm_cidr_order().
+ *  3. The configuration is rendered again and applied. As only the
+ *     order of the rules changes, the chains are refilled in one
+ *     iptables-restore commit per table, see wgm_conf_script_reorder().
+ *
+ * The counters start over with the new rules, so running it again
+ * ranks the traffic since the last run.
+ */
+struct wgm_optimize_arg {
+	char		ifname[IFNAMSIZ];
+};
+
+static const struct wgm_opt options[] = {
+	#define OPTIMIZE_ARG_DEV	(1ull << 0)
+	{ OPTIMIZE_ARG_DEV,	"dev",		required_argument,	NULL,	'd' },
+
+	#define OPTIMIZE_ARG_HELP	(1ull << 1)
+	{ OPTIMIZE_ARG_HELP,	"help",		no_argument,		NULL,	'h' },
+};
+
+static int wgm_optimize_getopt(int argc, char *argv[], struct wgm_optimize_arg *arg)
+{
+	struct option *long_opt;
+	uint64_t out_args = 0;
+	char *short_opt;
+	int c, ret;
+
+	ret = wgm_create_getopt_long_args(&long_opt, &short_opt, options,
+					  ARRAY_SIZE(options));
+	if (ret)
+		return ret;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_opt, long_opt, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'd':
+			if (wgm_iface_opt_get_dev(arg->ifname, sizeof(arg->ifname), optarg)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			out_args |= OPTIMIZE_ARG_DEV;
+			break;
+		case 'h':
+			show_usage_optimize(NULL);
+			ret = -1;
+			goto out;
+		default:
+			wgm_log_err("Error: Invalid option '%c'\n", c);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (!(out_args & OPTIMIZE_ARG_DEV)) {
+		wgm_log_err("Error: Option '--dev' is required\n\n");
+		show_usage_optimize(NULL);
+		ret = -EINVAL;
+	}
+
+out:
+	wgm_free_getopt_long_args(long_opt, short_opt);
+	return ret;
+}
+
+/*
+ * Parse `iptables -L <chain> -v -x -n` into the prefixes of its ACCEPT
+ * rules, with their packet count as the action:
+ *
+ *   Chain wgm_wg0 (1 references)
+ *       pkts      bytes target     prot opt in     out     source               destination
+ *       1234   567890 ACCEPT     all  --  *      *       10.0.1.0/24          0.0.0.0/0
+ *
+ * The source is the first address after the target, whatever columns
+ * this version of iptables prints in between.
+ */
+static int wgm_optimize_parse_counters(struct wgm_cidr_array *rules, char *out)
+{
+	char *line, *save, *tok, *tsave, *end;
+	unsigned long long pkts;
+	uint32_t addr;
+	uint8_t len;
+	int ret;
+
+	for (line = strtok_r(out, "\n", &save); line; line = strtok_r(NULL, "\n", &save)) {
+		tok = strtok_r(line, " \t", &tsave);
+		if (!tok)
+			continue;
+
+		pkts = strtoull(tok, &end, 10);
+		if (*end)
+			continue;
+
+		tok = strtok_r(NULL, " \t", &tsave);
+		tok = tok ? strtok_r(NULL, " \t", &tsave) : NULL;
+		if (!tok || strcmp(tok, "ACCEPT"))
+			continue;
+
+		while ((tok = strtok_r(NULL, " \t", &tsave))) {
+			if (!wgm_cidr_parse(tok, &addr, &len))
+				break;
+		}
+
+		if (!tok || pkts > INT64_MAX)
+			continue;
+
+		ret = wgm_cidr_array_add(rules, addr, len, (int64_t)pkts);
+		if (ret)
+			return ret;
+	}
+
+	return 0;
+}
+
+static int wgm_optimize_read_counters(struct wgm_ctx *ctx, const char *ifname,
+				      struct wgm_cidr_array *rules)
+{
+	char chain[IFNAMSIZ + 4];
+	const char *argv[] = { "iptables", "-w", "-t", "filter", "-L", chain, "-v", "-x", "-n", NULL };
+	struct wgm_exec_cmd cmd = {
+		.argv = argv,
+		.name = "iptables",
+	};
+	int ret;
+
+	snprintf(chain, sizeof(chain), "wgm_%s", ifname);
+	ret = wgm_exec_run(ctx, &cmd);
+	if (ret) {
+		if (cmd.err_len)
+			fwrite(cmd.err, 1, cmd.err_len, stderr);
+		wgm_log_err("Error: wgm_optimize: Failed to read the counters of chain '%s'\n", chain);
+		wgm_exec_cmd_free(&cmd);
+		return ret < 0 ? ret : -EIO;
+	}
+
+	ret = cmd.out ? wgm_optimize_parse_counters(rules, cmd.out) : 0;
+	wgm_exec_cmd_free(&cmd);
+	if (ret)
+		return ret;
+
+	wgm_cidr_sort(rules);
+	return 0;
+}
+
+/*
+ * Share the packets of every rule out among the allowed IPs it is the
+ * longest match of, and set the hits of the peers from them. Returns
+ * the number of packets given to peers.
+ */
+static uint64_t wgm_optimize_rank_peers(struct wgm_iface *iface,
+					const struct wgm_cidr_array *rules,
+					uint32_t *nr_srcs)
+{
+	uint64_t total = 0;
+	size_t i, j;
+	uint32_t addr;
+	uint8_t len;
+	ssize_t k;
+	int pass;
+
+	for (pass = 0; pass < 2; pass++) {
+		for (i = 0; i < iface->peers.nr; i++) {
+			struct wgm_peer *peer = &iface->peers.peers[i];
+
+			if (pass)
+				peer->hits = 0;
+
+			for (j = 0; j < peer->allowed_ips.nr; j++) {
+				if (wgm_cidr_parse(peer->allowed_ips.arr[j], &addr, &len))
+					continue;
+
+				k = wgm_cidr_lookup(rules, addr, len);
+				if (k < 0)
+					continue;
+
+				if (!pass) {
+					nr_srcs[k]++;
+				} else {
+					peer->hits += (uint64_t)rules->arr[k].action / nr_srcs[k];
+					total += (uint64_t)rules->arr[k].action / nr_srcs[k];
+				}
+			}
+		}
+	}
+
+	return total;
+}
+
+int wgm_cmd_optimize(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_cidr_array rules = { NULL, 0, 0 };
+	struct wgm_optimize_arg arg;
+	struct wgm_iface iface;
+	uint32_t *nr_srcs = NULL;
+	uint64_t total;
+	char *sys_path;
+	int lock_fd, ret;
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&iface, 0, sizeof(iface));
+	ret = wgm_optimize_getopt(argc, argv, &arg);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&sys_path, "/sys/class/net/%s", arg.ifname);
+	if (ret)
+		return ret;
+
+	if (!wgm_file_exists(sys_path)) {
+		wgm_log_err("Error: Interface '%s' is not running\n", arg.ifname);
+		free(sys_path);
+		return -ENODEV;
+	}
+	free(sys_path);
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load(&iface, ctx, arg.ifname);
+	if (ret) {
+		wgm_log_err("Error: wgm_optimize: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+		goto out;
+	}
+
+	if (!iface.filter_forward) {
+		wgm_log_err("Error: wgm_optimize: The filter chain of '%s' is not hooked and counts nothing, see --filter-forward\n", arg.ifname);
+		ret = -EINVAL;
+		goto out;
+	}
+
+	ret = wgm_optimize_read_counters(ctx, arg.ifname, &rules);
+	if (ret)
+		goto out;
+
+	nr_srcs = calloc(rules.nr + 1, sizeof(*nr_srcs));
+	if (!nr_srcs) {
+		wgm_log_err("Error: wgm_optimize: Failed to allocate memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	total = wgm_optimize_rank_peers(&iface, &rules, nr_srcs);
+	if (!total) {
+		printf("No packets counted on '%s' since its rules were applied, keeping their order\n", arg.ifname);
+		goto out;
+	}
+
+	printf("Ranked the peers of '%s' by %llu packets over %zu rules\n", arg.ifname,
+	       (unsigned long long)total, rules.nr);
+
+	/*
+	 * Every peer may have changed, so every shard is written.
+	 */
+	iface.shard_track = false;
+	ret = wgm_iface_save(&iface, ctx);
+	if (ret) {
+		wgm_log_err("Error: wgm_optimize: Failed to save interface data: %s\n", strerror(-ret));
+		goto out;
+	}
+
+	ret = wgm_conf_restart_if_changed(&iface, ctx);
+
+out:
+	wgm_iface_unlock(lock_fd);
+	wgm_iface_free(&iface);
+	wgm_cidr_array_free(&rules);
+	free(nr_srcs);
+	return ret;
+}
@@ -0,0 +1,9 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_OPTIMIZE_H
+#define WGM__WG_OPTIMIZE_H
+
+#include "wgm.h"
+
+int wgm_cmd_optimize(int argc, char *argv[], struct wgm_ctx *ctx);
+
+#endif /* #ifndef WGM__WG_OPTIMIZE_H */
@@ -3,6 +3,9 @@
 #include "wgm.h"
 #include "wgm_peer.h"
 #include "wgm_iface.h"
+#include "wgm_conf.h"
+#include "wgm_json.h"
+#include "wgm_key.h"
 
 struct wgm_peer_arg {
 	char			ifname[IFNAMSIZ];
@@ -12,6 +15,8 @@ struct wgm_peer_arg {
 	char			bind_dev[IFNAMSIZ];
 	struct wgm_str_array	allowed_ips;
 	bool			force;
+	uint64_t		if_version;
+	uint8_t			private_key[WGM_KEY_LEN];
 };
 
 static const struct wgm_opt options[] = {
@@ -39,6 +44,15 @@ static const struct wgm_opt options[] = {
 	#define PEER_ARG_BIND_DEV	(1ull << 7ull)
 	{ PEER_ARG_BIND_DEV,	"bind-dev",	required_argument,	NULL,	'g' },
 
+	#define PEER_ARG_IF_VERSION	(1ull << 8ull)
+	{ PEER_ARG_IF_VERSION,	"if-version",	required_argument,	NULL,	'V' },
+
+	#define PEER_ARG_GENERATE_KEY	(1ull << 9ull)
+	{ PEER_ARG_GENERATE_KEY, "generate-key", no_argument,		NULL,	'G' },
+
+	#define PEER_ARG_PLAN		(1ull << 10ull)
+	{ PEER_ARG_PLAN,	"plan",		no_argument,		NULL,	'P' },
+
 	{ 0, NULL, 0, NULL, 0 }
 };
 
@@ -52,24 +66,41 @@ static int wgm_peer_opt_get_dev(char *ifname, size_t iflen, const char *dev)
 	return wgm_iface_opt_get_dev(ifname, iflen, dev);
 }
 
-static int wgm_peer_opt_get_public_key(char *private_key, size_t keylen,
+/*
+ * Only a length check here: show, update and del must still find the
+ * peers of stores written before keys were checked. A new peer's key
+ * is checked by wgm_peer_check_public_key().
+ */
+static int wgm_peer_opt_get_public_key(char *public_key, size_t keylen,
 				       const char *key)
 {
 	size_t i;
 
 	i = strlen(key);
 	if (i >= keylen) {
-		wgm_log_err("Error: Private key is too long, max %zu characters\n",
+		wgm_log_err("Error: Public key is too long, max %zu characters\n",
 			    keylen - 1);
 		return -EINVAL;
 	}
 
 	if (!i) {
-		wgm_log_err("Error: Private key cannot be empty\n");
+		wgm_log_err("Error: Public key cannot be empty\n");
+		return -EINVAL;
+	}
+
+	strncpyl(public_key, key, keylen);
+	return 0;
+}
+
+static int wgm_peer_check_public_key(const char *key)
+{
+	uint8_t raw[WGM_KEY_LEN];
+
+	if (wgm_key_from_base64(raw, key)) {
+		wgm_log_err("Error: Invalid public key '%s': must be a 32-byte base64 key\n", key);
 		return -EINVAL;
 	}
 
-	strncpyl(private_key, key, keylen);
 	return 0;
 }
 
@@ -179,6 +210,17 @@ static int wgm_peer_getopt(int argc, char *argv[], struct wgm_peer_arg *arg,
 				return -EINVAL;
 			out_args |= PEER_ARG_BIND_DEV;
 			break;
+		case 'V':
+			if (wgm_iface_opt_get_version(&arg->if_version, optarg))
+				return -EINVAL;
+			out_args |= PEER_ARG_IF_VERSION;
+			break;
+		case 'G':
+			out_args |= PEER_ARG_GENERATE_KEY;
+			break;
+		case 'P':
+			out_args |= PEER_ARG_PLAN;
+			break;
 		case '?':
 			ret = -EINVAL;
 			goto out;
@@ -222,6 +264,51 @@ out:
 	return ret;
 }
 
+/*
+ * --generate-key stands in for --public-key: a fresh key pair is made
+ * here and only the public half is stored.
+ */
+static int wgm_peer_generate_key(struct wgm_peer_arg *arg, uint64_t *out_args)
+{
+	uint8_t pub[WGM_KEY_LEN];
+	int ret;
+
+	if (*out_args & PEER_ARG_PUBLIC_KEY) {
+		wgm_log_err("Error: Options '--public-key' and '--generate-key' cannot be used together\n\n");
+		wgm_peer_show_usage();
+		return -EINVAL;
+	}
+
+	ret = wgm_key_generate(arg->private_key);
+	if (ret) {
+		wgm_log_err("Error: Failed to generate a key pair: %s\n", strerror(-ret));
+		return ret;
+	}
+
+	wgm_key_public(pub, arg->private_key);
+	wgm_key_to_base64(arg->public_key, pub);
+	*out_args |= PEER_ARG_PUBLIC_KEY;
+	return 0;
+}
+
+static int write_key_pair(struct wgm_jwriter *w, const void *data)
+{
+	const struct wgm_peer_arg *arg = data;
+	char b64[WGM_KEY_B64_LEN + 1];
+
+	wgm_key_to_base64(b64, arg->private_key);
+	wgm_jw_obj_begin(w);
+	wgm_jw_key(w, "dev");
+	wgm_jw_str(w, arg->ifname);
+	wgm_jw_key(w, "public_key");
+	wgm_jw_str(w, arg->public_key);
+	wgm_jw_key(w, "private_key");
+	wgm_jw_str(w, b64);
+	wgm_jw_obj_end(w);
+	memset(b64, 0, sizeof(b64));
+	return 0;
+}
+
 static void wgm_peer_arg_free(struct wgm_peer_arg *arg)
 {
 	wgm_str_array_free(&arg->allowed_ips);
@@ -247,16 +334,19 @@ static void apply_wgm_arg(struct wgm_peer *peer, struct wgm_peer_arg *arg,
 
 int wgm_peer_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 {
-	static const uint64_t required_args = PEER_ARG_DEV | PEER_ARG_PUBLIC_KEY |
-					      PEER_ARG_ALLOWED_IPS;
-	static const uint64_t allowed_args = required_args | PEER_ARG_ENDPOINT |
-					     PEER_ARG_BIND_IP | PEER_ARG_FORCE |
-					     PEER_ARG_HELP | PEER_ARG_BIND_DEV;
-
+	static const uint64_t required_args = PEER_ARG_DEV | PEER_ARG_ALLOWED_IPS;
+	static const uint64_t allowed_args = required_args | PEER_ARG_PUBLIC_KEY |
+					     PEER_ARG_ENDPOINT | PEER_ARG_BIND_IP |
+					     PEER_ARG_FORCE | PEER_ARG_HELP |
+					     PEER_ARG_BIND_DEV | PEER_ARG_IF_VERSION |
+					     PEER_ARG_GENERATE_KEY | PEER_ARG_PLAN;
+
+	struct wgm_plan plan = { 0 };
 	struct wgm_peer_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
 	struct wgm_peer peer;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -267,12 +357,42 @@ int wgm_peer_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		goto out;
 
+	if (out_args & PEER_ARG_GENERATE_KEY) {
+		ret = wgm_peer_generate_key(&arg, &out_args);
+		if (ret)
+			goto out;
+	} else if (!(out_args & PEER_ARG_PUBLIC_KEY)) {
+		wgm_log_err("Error: Option '--public-key' or '--generate-key' is required\n\n");
+		wgm_peer_show_usage();
+		ret = -EINVAL;
+		goto out;
+	} else {
+		ret = wgm_peer_check_public_key(arg.public_key);
+		if (ret)
+			goto out;
+	}
+
+	if (out_args & PEER_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
 		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
+	if (out_args & PEER_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
 	apply_wgm_arg(&peer, &arg, out_args);
 	ret = wgm_iface_add_peer(&iface, &peer, arg.force);
 	if (ret) {
@@ -286,8 +406,20 @@ int wgm_peer_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx)
 		goto out;
 	}
 
-	wgm_iface_dump_json(&iface);
+	if (ctx->plan)
+		goto out;
+
+	/*
+	 * The private key is not kept anywhere, so this is the only time
+	 * it is shown.
+	 */
+	if (out_args & PEER_ARG_GENERATE_KEY)
+		wgm_jw_dump(write_key_pair, &arg, "key pair");
+	else
+		wgm_iface_dump_json(&iface);
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_peer_arg_free(&arg);
 	wgm_iface_free(&iface);
 	wgm_peer_free(&peer);
@@ -297,12 +429,15 @@ out:
 int wgm_peer_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 {
 	static const uint64_t required_args = PEER_ARG_DEV | PEER_ARG_PUBLIC_KEY;
-	static const uint64_t allowed_args = required_args | PEER_ARG_FORCE | PEER_ARG_HELP;
+	static const uint64_t allowed_args = required_args | PEER_ARG_FORCE | PEER_ARG_HELP |
+					     PEER_ARG_IF_VERSION | PEER_ARG_PLAN;
 
+	struct wgm_plan plan = { 0 };
 	struct wgm_peer_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
 	struct wgm_peer peer;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -313,12 +448,27 @@ int wgm_peer_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		goto out;
 
+	if (out_args & PEER_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
 		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
+	if (out_args & PEER_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
 	apply_wgm_arg(&peer, &arg, out_args);
 	ret = wgm_iface_del_peer_by_pubkey(&iface, peer.public_key);
 	if (ret) {
@@ -332,28 +482,26 @@ int wgm_peer_cmd_del(int argc, char *argv[], struct wgm_ctx *ctx)
 		goto out;
 	}
 
-	wgm_iface_dump_json(&iface);
+	if (!ctx->plan)
+		wgm_iface_dump_json(&iface);
 	ret = 0;
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_peer_arg_free(&arg);
 	wgm_iface_free(&iface);
 	wgm_peer_free(&peer);
 	return ret;
 }
 
-static void wgm_peer_dump_json(const struct wgm_peer *peer)
+static int write_peer(struct wgm_jwriter *w, const void *data)
 {
-	json_object *jpeer;
-	int ret;
-
-	ret = wgm_peer_to_json(&jpeer, peer);
-	if (ret) {
-		wgm_log_err("Error: Failed to convert peer to JSON: %s\n", strerror(-ret));
-		return;
-	}
+	return wgm_peer_write_json(w, data);
+}
 
-	printf("%s\n", json_object_to_json_string_ext(jpeer, WGM_JSON_FLAGS));
-	json_object_put(jpeer);
+static void wgm_peer_dump_json(const struct wgm_peer *peer)
+{
+	wgm_jw_dump(write_peer, peer, "peer");
 }
 
 int wgm_peer_cmd_show(int argc, char *argv[], struct wgm_ctx *ctx)
@@ -361,37 +509,38 @@ int wgm_peer_cmd_show(int argc, char *argv[], struct wgm_ctx *ctx)
 	static const uint64_t required_args = PEER_ARG_DEV | PEER_ARG_PUBLIC_KEY;
 	static const uint64_t allowed_args = required_args | PEER_ARG_HELP;
 
-	struct wgm_peer *peer_p;
 	struct wgm_peer_arg arg;
-	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	struct wgm_peer peer;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
-	memset(&iface, 0, sizeof(iface));
+	memset(&peer, 0, sizeof(peer));
 
 	ret = wgm_peer_getopt(argc, argv, &arg, allowed_args, required_args, &out_args);
 	if (ret)
 		goto out;
 
-	ret = wgm_iface_load(&iface, ctx, arg.ifname);
-	if (ret) {
-		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, false);
+	if (lock_fd < 0) {
+		ret = lock_fd;
 		goto out;
 	}
 
-	ret = wgm_iface_get_peer_by_pubkey(&iface, arg.public_key, &peer_p);
+	ret = wgm_iface_load_peer(ctx, arg.ifname, arg.public_key, &peer);
 	if (ret) {
 		wgm_log_err("Error: Failed to get peer from interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
-	wgm_peer_dump_json(peer_p);
+	wgm_peer_dump_json(&peer);
 	ret = 0;
 
 out:
+	wgm_iface_unlock(lock_fd);
 	wgm_peer_arg_free(&arg);
-	wgm_iface_free(&iface);
+	wgm_peer_free(&peer);
 	return ret;
 }
 
@@ -400,12 +549,15 @@ int wgm_peer_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx)
 	const uint64_t required_args = PEER_ARG_DEV | PEER_ARG_PUBLIC_KEY;
 	const uint64_t allowed_args = required_args | PEER_ARG_ENDPOINT |
 				      PEER_ARG_BIND_IP | PEER_ARG_ALLOWED_IPS |
-				      PEER_ARG_FORCE | PEER_ARG_HELP;
+				      PEER_ARG_FORCE | PEER_ARG_HELP |
+				      PEER_ARG_IF_VERSION | PEER_ARG_PLAN;
 
+	struct wgm_plan plan = { 0 };
 	struct wgm_peer *peer_p;
 	struct wgm_peer_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -415,12 +567,27 @@ int wgm_peer_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		goto out;
 
+	if (out_args & PEER_ARG_PLAN)
+		ctx->plan = &plan;
+
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, true);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
 		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
+	if (out_args & PEER_ARG_IF_VERSION) {
+		ret = wgm_iface_check_version(&iface, arg.if_version);
+		if (ret)
+			goto out;
+	}
+
 	ret = wgm_iface_get_peer_by_pubkey(&iface, arg.public_key, &peer_p);
 	if (ret) {
 		wgm_log_err("Error: Failed to get peer from interface '%s': %s\n", arg.ifname, strerror(-ret));
@@ -428,16 +595,20 @@ int wgm_peer_cmd_update(int argc, char *argv[], struct wgm_ctx *ctx)
 	}
 
 	apply_wgm_arg(peer_p, &arg, out_args);
-	ret = wgm_iface_save(&iface, ctx);
+	wgm_iface_mark_peer_dirty(&iface, peer_p->public_key);
+	ret = wgm_iface_save_peer(&iface, peer_p, ctx);
 	if (ret) {
 		wgm_log_err("Error: Failed to save interface '%s': %s\n", arg.ifname, strerror(-ret));
 		goto out;
 	}
 
-	wgm_iface_dump_json(&iface);
+	if (!ctx->plan)
+		wgm_iface_dump_json(&iface);
 	ret = 0;
 
 out:
+	ctx->plan = NULL;
+	wgm_iface_unlock(lock_fd);
 	wgm_peer_arg_free(&arg);
 	wgm_iface_free(&iface);
 	return ret;
@@ -451,6 +622,7 @@ int wgm_peer_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 	struct wgm_peer_arg arg;
 	struct wgm_iface iface;
 	uint64_t out_args = 0;
+	int lock_fd = -1;
 	int ret;
 
 	memset(&arg, 0, sizeof(arg));
@@ -460,6 +632,12 @@ int wgm_peer_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 	if (ret)
 		goto out;
 
+	lock_fd = wgm_iface_lock(ctx, arg.ifname, false);
+	if (lock_fd < 0) {
+		ret = lock_fd;
+		goto out;
+	}
+
 	ret = wgm_iface_load(&iface, ctx, arg.ifname);
 	if (ret) {
 		wgm_log_err("Error: Failed to load interface '%s': %s\n", arg.ifname, strerror(-ret));
@@ -470,6 +648,7 @@ int wgm_peer_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
 	ret = 0;
 
 out:
+	wgm_iface_unlock(lock_fd);
 	wgm_peer_arg_free(&arg);
 	wgm_iface_free(&iface);
 	return ret;
@@ -480,6 +659,7 @@ int wgm_peer_copy(struct wgm_peer *dst, const struct wgm_peer *src)
 	memcpy(dst->public_key, src->public_key, sizeof(dst->public_key));
 	memcpy(dst->bind_ip, src->bind_ip, sizeof(dst->bind_ip));
 	memcpy(dst->bind_dev, src->bind_dev, sizeof(dst->bind_dev));
+	dst->hits = src->hits;
 	return wgm_str_array_copy(&dst->allowed_ips, &src->allowed_ips);
 }
 
@@ -488,6 +668,7 @@ void wgm_peer_move(struct wgm_peer *dst, struct wgm_peer *src)
 	memcpy(dst->public_key, src->public_key, sizeof(dst->public_key));
 	memcpy(dst->bind_ip, src->bind_ip, sizeof(dst->bind_ip));
 	memcpy(dst->bind_dev, src->bind_dev, sizeof(dst->bind_dev));
+	dst->hits = src->hits;
 	wgm_str_array_move(&dst->allowed_ips, &src->allowed_ips);
 	memset(src, 0, sizeof(*src));
 }
@@ -498,49 +679,27 @@ void wgm_peer_free(struct wgm_peer *peer)
 	memset(peer, 0, sizeof(*peer));
 }
 
-int wgm_peer_to_json(json_object **jobj, const struct wgm_peer *peer)
+int wgm_peer_write_json(struct wgm_jwriter *w, const struct wgm_peer *peer)
 {
-	json_object *jpeer, *jallowed_ips;
-	int ret;
-
-	jpeer = json_object_new_object();
-	if (!jpeer)
-		return -ENOMEM;
-
-	ret = json_object_object_add(jpeer, "public_key",
-				     json_object_new_string(peer->public_key));
-	if (ret)
-		goto out;
-
-	ret = json_object_object_add(jpeer, "bind_ip",
-				     json_object_new_string(peer->bind_ip));
-	if (ret)
-		goto out;
-
-	ret = json_object_object_add(jpeer, "bind_dev",
-				     json_object_new_string(peer->bind_dev));
-	if (ret)
-		goto out;
-
-	ret = wgm_str_array_to_json(&jallowed_ips, &peer->allowed_ips);
-	if (ret)
-		goto out;
-
-	ret = json_object_object_add(jpeer, "allowed_ips", jallowed_ips);
-	if (ret)
-		goto out;
-
-	*jobj = jpeer;
-	return 0;
-
-out:
-	json_object_put(jpeer);
-	return ret;
+	wgm_jw_obj_begin(w);
+	wgm_jw_key(w, "public_key");
+	wgm_jw_str(w, peer->public_key);
+	wgm_jw_key(w, "bind_ip");
+	wgm_jw_str(w, peer->bind_ip);
+	wgm_jw_key(w, "bind_dev");
+	wgm_jw_str(w, peer->bind_dev);
+	wgm_jw_key(w, "allowed_ips");
+	wgm_jw_str_array(w, &peer->allowed_ips);
+	if (peer->hits) {
+		wgm_jw_key(w, "hits");
+		wgm_jw_int(w, (int64_t)peer->hits);
+	}
+	return wgm_jw_obj_end(w);
 }
 
 int wgm_peer_from_json(struct wgm_peer *peer, const json_object *jobj)
 {
-	json_object *tmp;
+	json_object *tmp, *hits;
 	int ret;
 
 	ret = json_object_object_get_ex(jobj, "public_key", &tmp);
@@ -565,6 +724,76 @@ int wgm_peer_from_json(struct wgm_peer *peer, const json_object *jobj)
 	if (!ret)
 		return -EINVAL;
 
+	peer->hits = 0;
+	if (json_object_object_get_ex(jobj, "hits", &hits))
+		peer->hits = (uint64_t)json_object_get_int64(hits);
+
 	memset(&peer->allowed_ips, 0, sizeof(peer->allowed_ips));
 	return wgm_str_array_from_json(&peer->allowed_ips, tmp);
 }
+
+int wgm_peer_from_jparser(struct wgm_peer *peer, struct wgm_jparser *p)
+{
+	enum {
+		SEEN_PUBLIC_KEY	= (1u << 0),
+		SEEN_BIND_IP	= (1u << 1),
+		SEEN_BIND_DEV	= (1u << 2),
+		SEEN_ALLOWED_IP	= (1u << 3),
+		SEEN_ALL	= (1u << 4) - 1,
+	};
+	unsigned seen = 0;
+	char key[32];
+	int64_t hits;
+	int ret;
+
+	memset(peer, 0, sizeof(*peer));
+	ret = wgm_jp_obj_begin(p);
+	if (ret)
+		return ret;
+
+	while (1) {
+		ret = wgm_jp_obj_next(p, key, sizeof(key));
+		if (ret < 0)
+			goto out_err;
+		if (!ret)
+			break;
+
+		/*
+		 * Oversized values are truncated, like strncpyl() does
+		 * on the json-c path.
+		 */
+		if (!strcmp(key, "public_key")) {
+			ret = wgm_jp_str(p, peer->public_key, sizeof(peer->public_key));
+			seen |= SEEN_PUBLIC_KEY;
+		} else if (!strcmp(key, "bind_ip")) {
+			ret = wgm_jp_str(p, peer->bind_ip, sizeof(peer->bind_ip));
+			seen |= SEEN_BIND_IP;
+		} else if (!strcmp(key, "bind_dev")) {
+			ret = wgm_jp_str(p, peer->bind_dev, sizeof(peer->bind_dev));
+			seen |= SEEN_BIND_DEV;
+		} else if (!strcmp(key, "allowed_ips")) {
+			wgm_str_array_free(&peer->allowed_ips);
+			ret = wgm_jp_str_array(p, &peer->allowed_ips);
+			seen |= SEEN_ALLOWED_IP;
+		} else if (!strcmp(key, "hits")) {
+			ret = wgm_jp_int(p, &hits);
+			peer->hits = hits > 0 ? (uint64_t)hits : 0;
+		} else {
+			ret = wgm_jp_skip(p);
+		}
+
+		if (ret < 0)
+			goto out_err;
+	}
+
+	if (seen != SEEN_ALL) {
+		ret = -EINVAL;
+		goto out_err;
+	}
+
+	return 0;
+
+out_err:
+	wgm_peer_free(peer);
+	return ret;
+}
@@ -4,12 +4,21 @@
 
 #include "helpers.h"
 
+struct wgm_jparser;
+struct wgm_jwriter;
+
 struct wgm_peer {
 	char			public_key[256];
 	char			endpoint[128];
 	char			bind_ip[16];
 	char			bind_dev[IFNAMSIZ];
 	struct wgm_str_array	allowed_ips;
+
+	/*
+	 * Packets counted by the peer's firewall rules at the last
+	 * `wgm optimize`; hot peers have their rules matched first.
+	 */
+	uint64_t		hits;
 };
 
 int wgm_peer_cmd_add(int argc, char *argv[], struct wgm_ctx *ctx);
@@ -21,7 +30,8 @@ int wgm_peer_copy(struct wgm_peer *dst, const struct wgm_peer *src);
 void wgm_peer_move(struct wgm_peer *dst, struct wgm_peer *src);
 void wgm_peer_free(struct wgm_peer *peer);
 
-int wgm_peer_to_json(json_object **jobj, const struct wgm_peer *peer);
+int wgm_peer_write_json(struct wgm_jwriter *w, const struct wgm_peer *peer);
 int wgm_peer_from_json(struct wgm_peer *peer, const json_object *jobj);
+int wgm_peer_from_jparser(struct wgm_peer *peer, struct wgm_jparser *p);
 
 #endif /* #ifndef WGM__WG_PEER_H */
@@ -0,0 +1,329 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_pool.h"
+#include "wgm_trace.h"
+#include "wgm_metrics.h"
+
+#include <limits.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/wait.h>
+
+#define WGM_POOL_NO_RESULT	INT_MIN
+
+struct wgm_pool_slot {
+	pid_t	pid;
+	FILE	*out;
+	FILE	*err;
+	bool	started;
+	bool	done;
+};
+
+unsigned int wgm_pool_default_workers(void)
+{
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+
+	if (n < 1)
+		return 1;
+
+	return n > 64 ? 64 : n;
+}
+
+/*
+ * Make @job wait for the job at index @dep.
+ */
+int wgm_pool_job_after(struct wgm_pool_job *job, size_t dep)
+{
+	size_t *after;
+
+	after = realloc(job->after, (job->nr_after + 1) * sizeof(*after));
+	if (!after)
+		return -ENOMEM;
+
+	after[job->nr_after++] = dep;
+	job->after = after;
+	return 0;
+}
+
+void wgm_pool_free_jobs(struct wgm_pool_job *jobs, size_t nr)
+{
+	size_t i;
+
+	if (!jobs)
+		return;
+
+	for (i = 0; i < nr; i++)
+		free(jobs[i].after);
+
+	free(jobs);
+}
+
+static bool job_ready(const struct wgm_pool_job *job, const struct wgm_pool_slot *slots)
+{
+	size_t i;
+
+	for (i = 0; i < job->nr_after; i++) {
+		if (!slots[job->after[i]].done)
+			return false;
+	}
+
+	return true;
+}
+
+static void copy_stream(FILE *src, FILE *dst, bool strip_nl)
+{
+	char buf[4096];
+	size_t n, held = 0;
+
+	if (!src)
+		return;
+
+	rewind(src);
+	while ((n = fread(buf, 1, sizeof(buf), src)) > 0) {
+		/*
+		 * Hold back one trailing newline; it is only written if
+		 * more data follows.
+		 */
+		if (held)
+			fputc('\n', dst);
+
+		held = strip_nl && buf[n - 1] == '\n';
+		fwrite(buf, 1, n - held, dst);
+	}
+}
+
+static bool stream_empty(FILE *fp)
+{
+	return !fp || ftell(fp) <= 0;
+}
+
+static __attribute__((noreturn))
+void wgm_pool_child(struct wgm_ctx *ctx, const struct wgm_pool_job *job,
+		    struct wgm_pool_slot *slot, wgm_pool_fn_t fn, void *data,
+		    int *result)
+{
+	int ret;
+
+	if (dup2(fileno(slot->out), STDOUT_FILENO) < 0 ||
+	    dup2(fileno(slot->err), STDERR_FILENO) < 0)
+		_exit(1);
+
+	/*
+	 * Time only this job; the command itself is counted once, by
+	 * the parent, so only the interface metrics are flushed here.
+	 */
+	if (ctx->trace) {
+		enum wgm_trace_fmt fmt = ctx->trace->fmt;
+
+		wgm_trace_destroy(ctx->trace);
+		ctx->trace = wgm_trace_create(fmt);
+	}
+
+	ret = fn(ctx, job, data);
+	if (ctx->trace)
+		wgm_trace_dump(ctx->trace);
+
+	ctx->cmd_group = NULL;
+	wgm_metrics_flush(ctx, ret);
+
+	*result = ret;
+	fflush(stdout);
+	fflush(stderr);
+	_exit(0);
+}
+
+static int wgm_pool_start(struct wgm_ctx *ctx, struct wgm_pool_job *job,
+			  struct wgm_pool_slot *slot, wgm_pool_fn_t fn, void *data,
+			  int *result)
+{
+	slot->started = true;
+	slot->out = tmpfile();
+	slot->err = tmpfile();
+	if (!slot->out || !slot->err)
+		return -errno;
+
+	*result = WGM_POOL_NO_RESULT;
+	fflush(stdout);
+	fflush(stderr);
+
+	job->start_ns = wgm_now_ns();
+	slot->pid = fork();
+	if (slot->pid < 0)
+		return -errno;
+
+	if (!slot->pid)
+		wgm_pool_child(ctx, job, slot, fn, data, result);
+
+	return 0;
+}
+
+static void wgm_pool_emit(const struct wgm_pool_job *job, struct wgm_pool_slot *slot,
+			  unsigned int flags, bool *first)
+{
+	if (flags & WGM_POOL_JSON_ARRAY) {
+		if (!stream_empty(slot->out)) {
+			if (!*first)
+				fputs(",\n", stdout);
+			copy_stream(slot->out, stdout, true);
+			*first = false;
+		}
+	} else {
+		copy_stream(slot->out, stdout, false);
+	}
+
+	fflush(stdout);
+	copy_stream(slot->err, stderr, false);
+	if (flags & WGM_POOL_SUMMARY) {
+		if (!job->ret)
+			fprintf(stderr, "%s: ok\n", job->name);
+		else if (job->ret < 0)
+			fprintf(stderr, "%s: failed: %s\n", job->name, strerror(-job->ret));
+		else
+			fprintf(stderr, "%s: failed: exit status %d\n", job->name, job->ret);
+	}
+
+	if (slot->out)
+		fclose(slot->out);
+	if (slot->err)
+		fclose(slot->err);
+	slot->out = slot->err = NULL;
+}
+
+/*
+ * Run @fn for every job, at most @nr_workers at a time. The result of
+ * each job is stored in its @ret; the return value is the result of
+ * the first job that failed, in job order, or 0.
+ */
+int wgm_pool_run(struct wgm_ctx *ctx, struct wgm_pool_job *jobs, size_t nr,
+		 unsigned int nr_workers, unsigned int flags, wgm_pool_fn_t fn,
+		 void *data)
+{
+	struct wgm_pool_slot *slots;
+	size_t i, nr_done = 0, next_emit = 0;
+	unsigned int running = 0;
+	bool first = true;
+	int *results;
+	int status, ret;
+	pid_t pid;
+
+	if (!nr)
+		return 0;
+
+	slots = calloc(nr, sizeof(*slots));
+	results = mmap(NULL, nr * sizeof(*results), PROT_READ | PROT_WRITE,
+		       MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (!slots || results == MAP_FAILED) {
+		wgm_log_err("Error: wgm_pool_run: Failed to allocate memory\n");
+		free(slots);
+		if (results != MAP_FAILED)
+			munmap(results, nr * sizeof(*results));
+		return -ENOMEM;
+	}
+
+	if (!nr_workers)
+		nr_workers = 1;
+
+	if (flags & WGM_POOL_JSON_ARRAY)
+		fputs("[\n", stdout);
+
+	while (nr_done < nr) {
+		for (i = 0; i < nr && running < nr_workers; i++) {
+			if (slots[i].started || !job_ready(&jobs[i], slots))
+				continue;
+
+			ret = wgm_pool_start(ctx, &jobs[i], &slots[i], fn, data, &results[i]);
+			if (ret) {
+				wgm_log_err("Error: wgm_pool_run: Failed to start job '%s': %s\n", jobs[i].name, strerror(-ret));
+				jobs[i].ret = ret;
+				slots[i].done = true;
+				nr_done++;
+				continue;
+			}
+
+			running++;
+		}
+
+		while (running) {
+			pid = waitpid(-1, &status, 0);
+			if (pid < 0 && errno == EINTR)
+				continue;
+
+			if (pid < 0) {
+				ret = -errno;
+				wgm_log_err("Error: wgm_pool_run: waitpid failed: %s\n", strerror(-ret));
+				running = 0;
+				break;
+			}
+
+			for (i = 0; i < nr; i++) {
+				if (slots[i].started && !slots[i].done && slots[i].pid == pid)
+					break;
+			}
+
+			if (i == nr)
+				continue;
+
+			/*
+			 * A worker that died before storing its result
+			 * (crash, signal) counts as failed.
+			 */
+			jobs[i].end_ns = wgm_now_ns();
+			jobs[i].ret = results[i];
+			if (jobs[i].ret == WGM_POOL_NO_RESULT)
+				jobs[i].ret = -ECHILD;
+
+			slots[i].done = true;
+			nr_done++;
+			running--;
+			break;
+		}
+
+		while (next_emit < nr && slots[next_emit].done) {
+			wgm_pool_emit(&jobs[next_emit], &slots[next_emit], flags, &first);
+			next_emit++;
+		}
+
+		/*
+		 * Nothing running and nothing could start: only possible
+		 * with a cycle in @after, or if waitpid() failed.
+		 */
+		if (!running && nr_done < nr) {
+			for (i = 0; i < nr; i++) {
+				if (!slots[i].started && job_ready(&jobs[i], slots))
+					break;
+			}
+
+			if (i == nr) {
+				for (i = 0; i < nr; i++) {
+					if (!slots[i].done) {
+						jobs[i].ret = -EDEADLK;
+						slots[i].done = true;
+						nr_done++;
+					}
+				}
+
+				while (next_emit < nr && slots[next_emit].done) {
+					wgm_pool_emit(&jobs[next_emit], &slots[next_emit], flags, &first);
+					next_emit++;
+				}
+			}
+		}
+	}
+
+	if (flags & WGM_POOL_JSON_ARRAY)
+		fputs(first ? "]\n" : "\n]\n", stdout);
+	fflush(stdout);
+
+	ret = 0;
+	for (i = 0; i < nr; i++) {
+		if (jobs[i].ret) {
+			ret = jobs[i].ret;
+			break;
+		}
+	}
+
+	munmap(results, nr * sizeof(*results));
+	free(slots);
+	return ret;
+}
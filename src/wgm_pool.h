@@ -0,0 +1,52 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_POOL_H
+#define WGM__WG_POOL_H
+
+#include "helpers.h"
+
+/*
+ * Run one job per interface on a bounded pool of worker processes.
+ * Processes rather than threads, because the per-interface commands
+ * print and use getopt's globals.
+ *
+ * A job only starts once the jobs in @after (indices, added with
+ * wgm_pool_job_after()) have finished, which orders jobs that depend on
+ * each other. The stdout and stderr of every job are captured and
+ * replayed in job order, so the output reads as if the jobs had run one
+ * after another.
+ */
+struct wgm_pool_job {
+	char		name[IFNAMSIZ];
+	size_t		*after;
+	size_t		nr_after;
+	int		ret;
+
+	/*
+	 * CLOCK_MONOTONIC time the job was started and reaped; 0 if it
+	 * never ran.
+	 */
+	uint64_t	start_ns;
+	uint64_t	end_ns;
+};
+
+/*
+ * Print the stdout of the jobs as the elements of one JSON array.
+ */
+#define WGM_POOL_JSON_ARRAY	(1u << 0)
+
+/*
+ * Print a "<name>: ok" / "<name>: failed" line per job on stderr.
+ */
+#define WGM_POOL_SUMMARY	(1u << 1)
+
+typedef int (*wgm_pool_fn_t)(struct wgm_ctx *ctx, const struct wgm_pool_job *job,
+			     void *data);
+
+unsigned int wgm_pool_default_workers(void);
+int wgm_pool_job_after(struct wgm_pool_job *job, size_t dep);
+void wgm_pool_free_jobs(struct wgm_pool_job *jobs, size_t nr);
+int wgm_pool_run(struct wgm_ctx *ctx, struct wgm_pool_job *jobs, size_t nr,
+		 unsigned int nr_workers, unsigned int flags, wgm_pool_fn_t fn,
+		 void *data);
+
+#endif /* #ifndef WGM__WG_POOL_H */
@@ -0,0 +1,409 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_restore.h"
+#include "wgm_iface.h"
+#include "wgm_peer.h"
+#include "wgm_conf.h"
+#include "wgm_pool.h"
+#include "wgm_trace.h"
+
+#include <getopt.h>
+#include <pthread.h>
+#include <unistd.h>
+
+/*
+ * wgm restore brings every stored interface up after a reboot:
+ *
+ *  1. The stores are read by a pool of threads. An interface whose
+ *     rendered configuration still matches its digest (see
+ *     wgm_conf_check_digest()) only has its metadata read; the others
+ *     are loaded completely.
+ *  2. The fwmarks of every interface that must be rendered are
+ *     resolved in one pass.
+ *  3. The interfaces are rendered as needed and brought up on the
+ *     worker pool, each after the interfaces it binds to like
+ *     `iface up --all`; interfaces that only share a bind device are
+ *     brought up concurrently.
+ */
+struct wgm_restore_arg {
+	unsigned int	jobs;
+};
+
+static const struct wgm_opt options[] = {
+	#define RESTORE_ARG_JOBS	(1ull << 0)
+	{ RESTORE_ARG_JOBS,	"jobs",		required_argument,	NULL,	'j' },
+
+	#define RESTORE_ARG_HELP	(1ull << 1)
+	{ RESTORE_ARG_HELP,	"help",		no_argument,		NULL,	'h' },
+};
+
+struct wgm_restore_ent {
+	struct wgm_iface	iface;
+	struct wgm_str_array	bind_devs;
+	bool			render;
+	int			ret;
+};
+
+struct wgm_restore {
+	struct wgm_ctx			*ctx;
+	const struct wgm_str_array	*names;
+	struct wgm_restore_ent		*ents;
+	struct wgm_pool_job		*jobs;
+	pthread_mutex_t			lock;
+	size_t				next;
+};
+
+static int wgm_restore_getopt(int argc, char *argv[], struct wgm_restore_arg *arg)
+{
+	struct option *long_opt;
+	char *short_opt;
+	char *endptr;
+	unsigned long n;
+	int c, ret;
+
+	ret = wgm_create_getopt_long_args(&long_opt, &short_opt, options,
+					  ARRAY_SIZE(options));
+	if (ret)
+		return ret;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_opt, long_opt, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'j':
+			n = strtoul(optarg, &endptr, 10);
+			if (!*optarg || *endptr || !n || n > 1024) {
+				wgm_log_err("Error: Invalid number of jobs (1-1024)\n");
+				ret = -EINVAL;
+				goto out;
+			}
+			arg->jobs = n;
+			break;
+		case 'h':
+			show_usage_restore(NULL);
+			ret = -1;
+			goto out;
+		default:
+			wgm_log_err("Error: Invalid option '%c'\n", c);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (optind < argc) {
+		wgm_log_err("Error: Unexpected argument '%s'\n\n", argv[optind]);
+		show_usage_restore(NULL);
+		ret = -EINVAL;
+	}
+
+out:
+	wgm_free_getopt_long_args(long_opt, short_opt);
+	return ret;
+}
+
+static int wgm_restore_load_one(struct wgm_ctx *ctx, const char *name,
+				struct wgm_restore_ent *ent)
+{
+	int lock_fd, ret;
+	size_t i;
+
+	lock_fd = wgm_iface_lock(ctx, name, false);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	ret = wgm_iface_load_meta(&ent->iface, ctx, name);
+	if (ret) {
+		wgm_log_err("Error: wgm_restore: Failed to load interface '%s': %s\n", name, strerror(-ret));
+		goto out;
+	}
+
+	ret = wgm_conf_check_digest(ctx, name, ent->iface.version, &ent->bind_devs);
+	if (ret != -ESTALE)
+		goto out;
+
+	wgm_iface_free(&ent->iface);
+	ret = wgm_iface_load(&ent->iface, ctx, name);
+	if (ret) {
+		wgm_log_err("Error: wgm_restore: Failed to load interface '%s': %s\n", name, strerror(-ret));
+		goto out;
+	}
+
+	ent->render = true;
+	for (i = 0; i < ent->iface.peers.nr && !ret; i++) {
+		const struct wgm_peer *peer = &ent->iface.peers.peers[i];
+		size_t j;
+
+		if (!peer->bind_ip[0] || !peer->bind_dev[0])
+			continue;
+
+		for (j = 0; j < ent->bind_devs.nr; j++) {
+			if (!strcmp(ent->bind_devs.arr[j], peer->bind_dev))
+				break;
+		}
+
+		if (j == ent->bind_devs.nr)
+			ret = wgm_str_array_add(&ent->bind_devs, peer->bind_dev);
+	}
+
+out:
+	wgm_iface_unlock(lock_fd);
+	return ret;
+}
+
+static void *wgm_restore_loader_fn(void *data)
+{
+	struct wgm_restore *r = data;
+	struct wgm_ctx ctx;
+	size_t i;
+
+	/*
+	 * Traces and metrics are not shared between threads.
+	 */
+	ctx = *r->ctx;
+	ctx.trace = NULL;
+	ctx.metrics = NULL;
+
+	while (1) {
+		pthread_mutex_lock(&r->lock);
+		i = r->next++;
+		pthread_mutex_unlock(&r->lock);
+		if (i >= r->names->nr)
+			break;
+
+		r->ents[i].ret = wgm_restore_load_one(&ctx, r->names->arr[i], &r->ents[i]);
+	}
+
+	return NULL;
+}
+
+static void wgm_restore_load(struct wgm_restore *r, unsigned int nr_threads)
+{
+	pthread_t *threads;
+	bool *started;
+	unsigned int i;
+
+	if (nr_threads > r->names->nr)
+		nr_threads = r->names->nr;
+
+	threads = calloc(nr_threads, sizeof(*threads));
+	started = calloc(nr_threads, sizeof(*started));
+	if (!threads || !started)
+		nr_threads = 1;
+
+	/*
+	 * As in wgm_iface_load_shards(), the calling thread takes part and
+	 * does the work of any thread that cannot be created.
+	 */
+	for (i = 1; i < nr_threads; i++) {
+		if (!pthread_create(&threads[i], NULL, wgm_restore_loader_fn, r))
+			started[i] = true;
+	}
+
+	wgm_restore_loader_fn(r);
+
+	for (i = 1; i < nr_threads; i++) {
+		if (started[i])
+			pthread_join(threads[i], NULL);
+	}
+
+	free(started);
+	free(threads);
+}
+
+static int wgm_restore_alloc_fwmarks(struct wgm_restore *r)
+{
+	const struct wgm_iface **ifaces;
+	size_t i, nr = 0;
+	int ret;
+
+	ifaces = calloc(r->names->nr, sizeof(*ifaces));
+	if (!ifaces) {
+		wgm_log_err("Error: wgm_restore: Failed to allocate memory\n");
+		return -ENOMEM;
+	}
+
+	for (i = 0; i < r->names->nr; i++) {
+		if (!r->ents[i].ret && r->ents[i].render)
+			ifaces[nr++] = &r->ents[i].iface;
+	}
+
+	ret = nr ? wgm_conf_alloc_fwmarks(r->ctx, ifaces, nr) : 0;
+	free(ifaces);
+	return ret;
+}
+
+static bool is_running(const char *ifname)
+{
+	char path[64];
+
+	snprintf(path, sizeof(path), "/sys/class/net/%s", ifname);
+	return wgm_file_exists(path);
+}
+
+static int wgm_restore_job(struct wgm_ctx *ctx, const struct wgm_pool_job *job, void *data)
+{
+	struct wgm_restore *r = data;
+	struct wgm_restore_ent *ent = &r->ents[job - r->jobs];
+	struct wgm_iface meta;
+	int lock_fd, ret;
+
+	if (ent->ret)
+		return ent->ret;
+
+	lock_fd = wgm_iface_lock(ctx, job->name, true);
+	if (lock_fd < 0)
+		return lock_fd;
+
+	/*
+	 * The interface may have changed since it was read; start over
+	 * from the store then.
+	 */
+	memset(&meta, 0, sizeof(meta));
+	ret = wgm_iface_load_meta(&meta, ctx, job->name);
+	if (ret) {
+		wgm_log_err("Error: wgm_restore: Failed to load interface '%s': %s\n", job->name, strerror(-ret));
+		goto out;
+	}
+
+	if (meta.version != ent->iface.version) {
+		wgm_iface_free(&ent->iface);
+		ret = wgm_iface_load(&ent->iface, ctx, job->name);
+		if (ret) {
+			wgm_log_err("Error: wgm_restore: Failed to load interface '%s': %s\n", job->name, strerror(-ret));
+			goto out;
+		}
+		ent->render = true;
+	}
+
+	if (ent->render) {
+		ret = wgm_conf_save(&ent->iface, ctx);
+		if (ret) {
+			wgm_log_err("Error: wgm_restore: Failed to save configuration: %s\n", strerror(-ret));
+			goto out;
+		}
+	}
+
+	if (is_running(job->name))
+		ret = wgm_conf_restart_if_changed(&ent->iface, ctx);
+	else
+		ret = wgm_conf_up(&ent->iface, ctx);
+
+out:
+	wgm_iface_free(&meta);
+	wgm_iface_unlock(lock_fd);
+	return ret;
+}
+
+static void wgm_restore_report(const struct wgm_restore *r, uint64_t start_ns)
+{
+	size_t i, nr_ok = 0, nr_rendered = 0;
+	uint64_t last = start_ns;
+
+	printf("%-16s %-8s %12s  %s\n", "dev", "conf", "ready_ms", "status");
+	for (i = 0; i < r->names->nr; i++) {
+		const struct wgm_pool_job *job = &r->jobs[i];
+		const struct wgm_restore_ent *ent = &r->ents[i];
+
+		if (!job->ret)
+			nr_ok++;
+		if (ent->render)
+			nr_rendered++;
+		if (job->end_ns > last)
+			last = job->end_ns;
+
+		printf("%-16s %-8s %12.3f  %s\n", job->name,
+		       ent->ret ? "-" : (ent->render ? "rendered" : "cached"),
+		       job->end_ns ? (job->end_ns - start_ns) / 1e6 : 0.0,
+		       job->ret ? "failed" : "ok");
+	}
+
+	printf("restored %zu/%zu interfaces (%zu rendered) in %.3f ms\n", nr_ok,
+	       r->names->nr, nr_rendered, (last - start_ns) / 1e6);
+}
+
+int wgm_cmd_restore(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_restore_arg arg;
+	struct wgm_str_array names;
+	struct wgm_str_array *binds = NULL;
+	struct wgm_restore r;
+	unsigned int nr_workers;
+	uint64_t start_ns;
+	size_t i;
+	int ret;
+
+	start_ns = wgm_now_ns();
+	memset(&arg, 0, sizeof(arg));
+	memset(&names, 0, sizeof(names));
+	memset(&r, 0, sizeof(r));
+
+	ret = wgm_restore_getopt(argc, argv, &arg);
+	if (ret)
+		return ret;
+
+	nr_workers = arg.jobs ? arg.jobs : wgm_pool_default_workers();
+	ret = wgm_iface_list_names(ctx, &names);
+	if (ret)
+		return ret;
+
+	if (!names.nr) {
+		printf("restored 0/0 interfaces (0 rendered) in 0.000 ms\n");
+		return 0;
+	}
+
+	r.ctx = ctx;
+	r.names = &names;
+	r.ents = calloc(names.nr, sizeof(*r.ents));
+	r.jobs = calloc(names.nr, sizeof(*r.jobs));
+	binds = calloc(names.nr, sizeof(*binds));
+	if (!r.ents || !r.jobs || !binds) {
+		wgm_log_err("Error: wgm_restore: Failed to allocate memory\n");
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	pthread_mutex_init(&r.lock, NULL);
+	wgm_trace_begin(ctx, "restore_load");
+	wgm_restore_load(&r, nr_workers);
+	wgm_trace_end(ctx);
+	pthread_mutex_destroy(&r.lock);
+
+	wgm_trace_begin(ctx, "restore_fwmarks");
+	ret = wgm_restore_alloc_fwmarks(&r);
+	wgm_trace_end(ctx);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < names.nr; i++) {
+		strncpyl(r.jobs[i].name, names.arr[i], sizeof(r.jobs[i].name));
+		binds[i] = r.ents[i].bind_devs;
+	}
+
+	ret = wgm_iface_order_jobs(r.jobs, names.nr, binds, false);
+	if (ret)
+		goto out;
+
+	wgm_trace_begin(ctx, "restore_up");
+	ret = wgm_pool_run(ctx, r.jobs, names.nr, nr_workers, 0, wgm_restore_job, &r);
+	wgm_trace_end(ctx);
+
+	wgm_restore_report(&r, start_ns);
+
+out:
+	if (r.ents) {
+		for (i = 0; i < names.nr; i++) {
+			wgm_iface_free(&r.ents[i].iface);
+			wgm_str_array_free(&r.ents[i].bind_devs);
+		}
+	}
+
+	wgm_conf_free_fwmarks(ctx);
+	free(binds);
+	wgm_pool_free_jobs(r.jobs, names.nr);
+	free(r.ents);
+	wgm_str_array_free(&names);
+	return ret;
+}
@@ -0,0 +1,932 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm.h"
+#include "wgm_snapshot.h"
+#include "wgm_iface.h"
+#include "wgm_conf.h"
+#include "wgm_json.h"
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <getopt.h>
+#include <linux/fs.h>
+#include <stdio.h>
+#include <sys/file.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * A snapshot is a copy of the state of the data directory in
+ * <data_dir>/snapshots/<name>/, laid out like the data directory:
+ *
+ *   json/         the stores (hardlinked)
+ *   wg_conf/      the rendered configurations (hardlinked)
+ *   fwmark/       the fwmark state (copied, it is tiny and flock()ed
+ *   fwmark.last   in place)
+ *
+ * Hardlinks make a snapshot cost a directory entry per file. They are
+ * safe because every writer of the data directory gives a file an inode
+ * of its own before it writes it in place (wgm_unshare_file()), so a
+ * snapshot keeps the contents its files had when it was taken.
+ *
+ * A rollback builds the same trees from the snapshot next to the live
+ * ones and swaps them in with renameat2(RENAME_EXCHANGE), then applies
+ * the interfaces whose store or configuration differs.
+ *
+ * Every interface is locked while a snapshot is taken (shared) or
+ * rolled back to (exclusive).
+ */
+struct wgm_snapshot_arg {
+	char		name[64];
+};
+
+static const struct wgm_opt options[] = {
+	#define SNAPSHOT_ARG_NAME	(1ull << 0)
+	{ SNAPSHOT_ARG_NAME,	"name",		required_argument,	NULL,	'n' },
+
+	#define SNAPSHOT_ARG_HELP	(1ull << 1)
+	{ SNAPSHOT_ARG_HELP,	"help",		no_argument,		NULL,	'h' },
+};
+
+struct wgm_snapshot_stat {
+	size_t		files;
+	size_t		linked;
+	uint64_t	bytes;
+	uint64_t	copied_bytes;
+};
+
+static const char * const linked_dirs[] = { "json", "wg_conf" };
+
+static int wgm_snapshot_opt_get_name(char *name, size_t len, const char *str)
+{
+	size_t i, n = strlen(str);
+
+	if (!n || n >= len || str[0] == '.') {
+		wgm_log_err("Error: Invalid snapshot name '%s'\n", str);
+		return -EINVAL;
+	}
+
+	for (i = 0; i < n; i++) {
+		char c = str[i];
+
+		if (!isalnum((unsigned char)c) && c != '-' && c != '_' && c != '.') {
+			wgm_log_err("Error: Invalid snapshot name '%s' (allowed: A-Z a-z 0-9 - _ .)\n", str);
+			return -EINVAL;
+		}
+	}
+
+	strncpyl(name, str, len);
+	return 0;
+}
+
+static int wgm_snapshot_getopt(int argc, char *argv[], struct wgm_snapshot_arg *arg,
+			       bool need_name)
+{
+	struct option *long_opt;
+	uint64_t out_args = 0;
+	char *short_opt;
+	int c, ret;
+
+	ret = wgm_create_getopt_long_args(&long_opt, &short_opt, options,
+					  ARRAY_SIZE(options));
+	if (ret)
+		return ret;
+
+	while (1) {
+		c = getopt_long(argc, argv, short_opt, long_opt, NULL);
+		if (c == -1)
+			break;
+
+		switch (c) {
+		case 'n':
+			if (wgm_snapshot_opt_get_name(arg->name, sizeof(arg->name), optarg)) {
+				ret = -EINVAL;
+				goto out;
+			}
+			out_args |= SNAPSHOT_ARG_NAME;
+			break;
+		case 'h':
+			show_usage_snapshot(NULL, false);
+			ret = -1;
+			goto out;
+		default:
+			wgm_log_err("Error: Invalid option '%c'\n", c);
+			ret = -EINVAL;
+			goto out;
+		}
+	}
+
+	if (need_name && !(out_args & SNAPSHOT_ARG_NAME)) {
+		wgm_log_err("Error: Option '--name' is required\n\n");
+		show_usage_snapshot(NULL, false);
+		ret = -EINVAL;
+	}
+
+out:
+	wgm_free_getopt_long_args(long_opt, short_opt);
+	return ret;
+}
+
+/*
+ * Serializes the snapshot commands against each other.
+ */
+static int wgm_snapshot_lock(struct wgm_ctx *ctx)
+{
+	char *path;
+	int fd, ret;
+
+	ret = wgm_asprintf(&path, "%s/snapshots", ctx->data_dir);
+	if (ret)
+		return ret;
+
+	ret = mkdir_recursive(path, 0700);
+	free(path);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&path, "%s/snapshots/.lock", ctx->data_dir);
+	if (ret)
+		return ret;
+
+	fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0600);
+	if (fd < 0 || flock(fd, LOCK_EX)) {
+		ret = -errno;
+		wgm_log_err("Error: wgm_snapshot_lock: Failed to lock '%s': %s\n", path, strerror(-ret));
+		if (fd >= 0)
+			close(fd);
+		free(path);
+		return ret;
+	}
+
+	free(path);
+	return fd;
+}
+
+static int cmp_str(const void *a, const void *b)
+{
+	return strcmp(*(char * const *)a, *(char * const *)b);
+}
+
+static void wgm_snapshot_unlock_all(int *fds, size_t nr)
+{
+	size_t i;
+
+	for (i = 0; i < nr; i++)
+		wgm_iface_unlock(fds[i]);
+	free(fds);
+}
+
+/*
+ * Lock the interfaces in @names, in name order so that two snapshot
+ * commands cannot deadlock. On success, *fds_p must be released with
+ * wgm_snapshot_unlock_all().
+ */
+static int wgm_snapshot_lock_all(struct wgm_ctx *ctx, struct wgm_str_array *names,
+				 bool exclusive, int **fds_p)
+{
+	size_t i;
+	int *fds;
+
+	qsort(names->arr, names->nr, sizeof(*names->arr), cmp_str);
+	fds = calloc(names->nr ? names->nr : 1, sizeof(*fds));
+	if (!fds)
+		return -ENOMEM;
+
+	for (i = 0; i < names->nr; i++) {
+		fds[i] = wgm_iface_lock(ctx, names->arr[i], exclusive);
+		if (fds[i] < 0) {
+			int ret = fds[i];
+
+			wgm_snapshot_unlock_all(fds, i);
+			return ret;
+		}
+	}
+
+	*fds_p = fds;
+	return 0;
+}
+
+static int clone_file(const char *src, const char *dst, bool hardlink,
+		      struct wgm_snapshot_stat *st)
+{
+	struct stat sb;
+	ssize_t ret;
+
+	if (lstat(src, &sb))
+		return -errno;
+
+	st->files++;
+	st->bytes += sb.st_size;
+	if (hardlink) {
+		if (!link(src, dst)) {
+			st->linked++;
+			return 0;
+		}
+
+		if (errno != EXDEV && errno != EPERM && errno != EMLINK)
+			return -errno;
+	}
+
+	/*
+	 * Reflinked where the filesystem can, see wgm_copy_file().
+	 */
+	ret = wgm_copy_file(src, dst, NULL);
+	if (ret < 0)
+		return ret;
+
+	st->copied_bytes += ret;
+	return 0;
+}
+
+/*
+ * Mirror the tree @src as @dst, which must not exist yet. A missing
+ * @src gives an empty @dst.
+ */
+static int clone_tree(const char *src, const char *dst, bool hardlink,
+		      struct wgm_snapshot_stat *st)
+{
+	struct dirent *ent;
+	char *s, *d;
+	struct stat sb;
+	DIR *dir;
+	int ret = 0;
+
+	if (mkdir(dst, 0700))
+		return -errno;
+
+	dir = opendir(src);
+	if (!dir)
+		return errno == ENOENT ? 0 : -errno;
+
+	while (!ret && (ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (wgm_asprintf(&s, "%s/%s", src, ent->d_name)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (wgm_asprintf(&d, "%s/%s", dst, ent->d_name)) {
+			free(s);
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (lstat(s, &sb))
+			ret = errno == ENOENT ? 0 : -errno;
+		else if (S_ISDIR(sb.st_mode))
+			ret = clone_tree(s, d, hardlink, st);
+		else if (S_ISREG(sb.st_mode))
+			ret = clone_file(s, d, hardlink, st);
+
+		if (ret)
+			wgm_log_err("Error: Failed to copy '%s' to '%s': %s\n", s, d, strerror(-ret));
+		free(s);
+		free(d);
+	}
+
+	closedir(dir);
+	return ret;
+}
+
+static int remove_tree(const char *path)
+{
+	struct dirent *ent;
+	struct stat sb;
+	char *p;
+	DIR *dir;
+	int ret = 0;
+
+	if (lstat(path, &sb))
+		return errno == ENOENT ? 0 : -errno;
+
+	if (!S_ISDIR(sb.st_mode))
+		return unlink(path) ? -errno : 0;
+
+	dir = opendir(path);
+	if (!dir)
+		return -errno;
+
+	while (!ret && (ent = readdir(dir))) {
+		if (!strcmp(ent->d_name, ".") || !strcmp(ent->d_name, ".."))
+			continue;
+
+		if (wgm_asprintf(&p, "%s/%s", path, ent->d_name)) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		ret = remove_tree(p);
+		free(p);
+	}
+
+	closedir(dir);
+	if (!ret && rmdir(path))
+		ret = -errno;
+	return ret;
+}
+
+/*
+ * Copy the state of the data directory @from into the new directory
+ * @to (the data directory layout on both sides).
+ */
+static int clone_state(const char *from, const char *to, struct wgm_snapshot_stat *st)
+{
+	char *s = NULL, *d = NULL;
+	size_t i;
+	int ret;
+
+	for (i = 0; i < ARRAY_SIZE(linked_dirs); i++) {
+		ret = wgm_asprintf(&s, "%s/%s", from, linked_dirs[i]);
+		if (!ret)
+			ret = wgm_asprintf(&d, "%s/%s", to, linked_dirs[i]);
+		if (!ret)
+			ret = clone_tree(s, d, true, st);
+		free(s);
+		free(d);
+		s = d = NULL;
+		if (ret)
+			return ret;
+	}
+
+	ret = wgm_asprintf(&s, "%s/fwmark", from);
+	if (!ret)
+		ret = wgm_asprintf(&d, "%s/fwmark", to);
+	if (!ret)
+		ret = clone_tree(s, d, false, st);
+	free(s);
+	free(d);
+	s = d = NULL;
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&s, "%s/fwmark.last", from);
+	if (!ret)
+		ret = wgm_asprintf(&d, "%s/fwmark.last", to);
+	if (!ret && !wgm_file_exists(s))
+		goto out;
+	if (!ret)
+		ret = clone_file(s, d, false, st);
+out:
+	free(s);
+	free(d);
+	return ret;
+}
+
+static char *wgm_snapshot_path(struct wgm_ctx *ctx, const char *name)
+{
+	char *path;
+
+	if (wgm_asprintf(&path, "%s/snapshots/%s", ctx->data_dir, name))
+		return NULL;
+
+	return path;
+}
+
+static int write_snapshot_json(struct wgm_jwriter *w, const void *data)
+{
+	const struct wgm_snapshot_stat *st = data;
+
+	wgm_jw_key(w, "files");
+	wgm_jw_int(w, st->files);
+	wgm_jw_key(w, "linked_files");
+	wgm_jw_int(w, st->linked);
+	wgm_jw_key(w, "bytes");
+	wgm_jw_int(w, st->bytes);
+	wgm_jw_key(w, "copied_bytes");
+	wgm_jw_int(w, st->copied_bytes);
+	return 0;
+}
+
+struct wgm_snapshot_created {
+	const char			*name;
+	size_t				nr_ifaces;
+	uint64_t			us;
+	struct wgm_snapshot_stat	st;
+};
+
+static int write_created_json(struct wgm_jwriter *w, const void *data)
+{
+	const struct wgm_snapshot_created *c = data;
+
+	wgm_jw_obj_begin(w);
+	wgm_jw_key(w, "name");
+	wgm_jw_str(w, c->name);
+	wgm_jw_key(w, "interfaces");
+	wgm_jw_int(w, c->nr_ifaces);
+	write_snapshot_json(w, &c->st);
+	wgm_jw_key(w, "duration_us");
+	wgm_jw_int(w, c->us);
+	wgm_jw_obj_end(w);
+	return 0;
+}
+
+int wgm_snapshot_cmd_create(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_snapshot_created c;
+	struct wgm_snapshot_arg arg;
+	struct wgm_str_array names;
+	char *path = NULL, *tmp = NULL;
+	uint64_t start = wgm_now_ns();
+	int snap_fd, *fds = NULL;
+	struct tm tm;
+	time_t now;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&names, 0, sizeof(names));
+	memset(&c, 0, sizeof(c));
+
+	ret = wgm_snapshot_getopt(argc, argv, &arg, false);
+	if (ret)
+		return ret;
+
+	if (!arg.name[0]) {
+		now = time(NULL);
+		localtime_r(&now, &tm);
+		strftime(arg.name, sizeof(arg.name), "%Y%m%d-%H%M%S", &tm);
+	}
+
+	snap_fd = wgm_snapshot_lock(ctx);
+	if (snap_fd < 0)
+		return snap_fd;
+
+	path = wgm_snapshot_path(ctx, arg.name);
+	if (!path || wgm_asprintf(&tmp, "%s/snapshots/.tmp-%s", ctx->data_dir, arg.name)) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (wgm_file_exists(path)) {
+		wgm_log_err("Error: Snapshot '%s' already exists\n", arg.name);
+		ret = -EEXIST;
+		goto out;
+	}
+
+	ret = wgm_iface_list_names(ctx, &names);
+	if (ret)
+		goto out;
+
+	ret = wgm_snapshot_lock_all(ctx, &names, false, &fds);
+	if (ret)
+		goto out;
+
+	/*
+	 * Built under a temporary name, so a snapshot is either complete
+	 * or not there at all.
+	 */
+	remove_tree(tmp);
+	ret = mkdir(tmp, 0700) ? -errno : 0;
+	if (!ret)
+		ret = clone_state(ctx->data_dir, tmp, &c.st);
+	if (!ret && rename(tmp, path))
+		ret = -errno;
+
+	wgm_snapshot_unlock_all(fds, names.nr);
+	if (ret) {
+		wgm_log_err("Error: Failed to create snapshot '%s': %s\n", arg.name, strerror(-ret));
+		remove_tree(tmp);
+		goto out;
+	}
+
+	c.name = arg.name;
+	c.nr_ifaces = names.nr;
+	c.us = (wgm_now_ns() - start) / 1000;
+	wgm_jw_dump(write_created_json, &c, "snapshot");
+
+out:
+	close(snap_fd);
+	wgm_str_array_free(&names);
+	free(path);
+	free(tmp);
+	return ret;
+}
+
+struct wgm_snapshot_ent {
+	char		*name;
+	time_t		created;
+	size_t		nr_ifaces;
+};
+
+struct wgm_snapshot_list {
+	struct wgm_snapshot_ent	*ents;
+	size_t			nr;
+};
+
+static int cmp_ent(const void *a, const void *b)
+{
+	const struct wgm_snapshot_ent *x = a, *y = b;
+
+	return strcmp(x->name, y->name);
+}
+
+static int write_list_json(struct wgm_jwriter *w, const void *data)
+{
+	const struct wgm_snapshot_list *l = data;
+	size_t i;
+
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < l->nr; i++) {
+		wgm_jw_obj_begin(w);
+		wgm_jw_key(w, "name");
+		wgm_jw_str(w, l->ents[i].name);
+		wgm_jw_key(w, "created");
+		wgm_jw_int(w, l->ents[i].created);
+		wgm_jw_key(w, "interfaces");
+		wgm_jw_int(w, l->ents[i].nr_ifaces);
+		wgm_jw_obj_end(w);
+	}
+	wgm_jw_arr_end(w);
+	return 0;
+}
+
+int wgm_snapshot_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_snapshot_list l = { NULL, 0 };
+	struct wgm_snapshot_arg arg;
+	struct wgm_str_array names;
+	struct wgm_ctx sctx;
+	struct dirent *ent;
+	struct stat sb;
+	char *path;
+	DIR *dir;
+	size_t i;
+	void *p;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	ret = wgm_snapshot_getopt(argc, argv, &arg, false);
+	if (ret)
+		return ret;
+
+	ret = wgm_asprintf(&path, "%s/snapshots", ctx->data_dir);
+	if (ret)
+		return ret;
+
+	dir = opendir(path);
+	free(path);
+	while (dir && (ent = readdir(dir))) {
+		if (ent->d_name[0] == '.')
+			continue;
+
+		path = wgm_snapshot_path(ctx, ent->d_name);
+		if (!path) {
+			ret = -ENOMEM;
+			break;
+		}
+
+		if (stat(path, &sb) || !S_ISDIR(sb.st_mode)) {
+			free(path);
+			continue;
+		}
+
+		p = realloc(l.ents, (l.nr + 1) * sizeof(*l.ents));
+		if (!p) {
+			free(path);
+			ret = -ENOMEM;
+			break;
+		}
+		l.ents = p;
+
+		/*
+		 * A snapshot has the layout of a data directory, so its
+		 * interfaces are listed the same way.
+		 */
+		memset(&names, 0, sizeof(names));
+		sctx = *ctx;
+		sctx.data_dir = path;
+		wgm_iface_list_names(&sctx, &names);
+
+		l.ents[l.nr].name = strdup(ent->d_name);
+		l.ents[l.nr].created = sb.st_mtime;
+		l.ents[l.nr].nr_ifaces = names.nr;
+		wgm_str_array_free(&names);
+		free(path);
+		if (!l.ents[l.nr].name) {
+			ret = -ENOMEM;
+			break;
+		}
+		l.nr++;
+	}
+
+	if (dir)
+		closedir(dir);
+
+	if (!ret) {
+		qsort(l.ents, l.nr, sizeof(*l.ents), cmp_ent);
+		wgm_jw_dump(write_list_json, &l, "snapshot list");
+	} else {
+		wgm_log_err("Error: wgm_snapshot_cmd_list: Failed to allocate memory\n");
+	}
+
+	for (i = 0; i < l.nr; i++)
+		free(l.ents[i].name);
+	free(l.ents);
+	return ret;
+}
+
+/*
+ * Whether the file @name under @a and @b differs: the same inode (the
+ * common case, through the hardlinks) is the same file.
+ */
+static bool file_differs(const char *a, const char *b, const char *name)
+{
+	char *pa = NULL, *pb = NULL;
+	struct stat sa, sb;
+	bool ret = true;
+	int ea, eb;
+
+	if (wgm_asprintf(&pa, "%s/%s", a, name) || wgm_asprintf(&pb, "%s/%s", b, name))
+		goto out;
+
+	ea = stat(pa, &sa);
+	eb = stat(pb, &sb);
+	if (ea && eb) {
+		ret = false;
+		goto out;
+	}
+
+	if (ea || eb)
+		goto out;
+
+	if (sa.st_dev == sb.st_dev && sa.st_ino == sb.st_ino) {
+		ret = false;
+		goto out;
+	}
+
+	ret = sa.st_size != sb.st_size || !wgm_cmp_file_md5(pa, pb);
+out:
+	free(pa);
+	free(pb);
+	return ret;
+}
+
+static bool iface_differs(const char *live, const char *snap, const char *ifname)
+{
+	char *store = NULL, *conf = NULL;
+	bool ret = true;
+
+	if (!wgm_asprintf(&store, "json/%s.json", ifname) &&
+	    !wgm_asprintf(&conf, "wg_conf/%s.conf", ifname))
+		ret = file_differs(live, snap, store) || file_differs(live, snap, conf);
+
+	free(store);
+	free(conf);
+	return ret;
+}
+
+/*
+ * Swap the tree @name of the data directory with the one built from
+ * the snapshot, then drop the old one.
+ */
+static int swap_in(struct wgm_ctx *ctx, const char *snap, const char *name, bool hardlink,
+		   struct wgm_snapshot_stat *st)
+{
+	char *live = NULL, *from = NULL, *tmp = NULL;
+	struct stat sb;
+	int ret;
+
+	ret = wgm_asprintf(&live, "%s/%s", ctx->data_dir, name);
+	if (!ret)
+		ret = wgm_asprintf(&from, "%s/%s", snap, name);
+	if (!ret)
+		ret = wgm_asprintf(&tmp, "%s/snapshots/.rollback-%s", ctx->data_dir, name);
+	if (ret)
+		goto out;
+
+	remove_tree(tmp);
+	if (lstat(from, &sb)) {
+		ret = errno == ENOENT ? 0 : -errno;
+		goto out;
+	}
+
+	if (S_ISDIR(sb.st_mode))
+		ret = clone_tree(from, tmp, hardlink, st);
+	else
+		ret = clone_file(from, tmp, hardlink, st);
+	if (ret)
+		goto out;
+
+	if (renameat2(AT_FDCWD, tmp, AT_FDCWD, live, RENAME_EXCHANGE)) {
+		if (errno != ENOENT) {
+			ret = -errno;
+			goto out;
+		}
+
+		if (rename(tmp, live)) {
+			ret = -errno;
+			goto out;
+		}
+	}
+
+out:
+	if (tmp)
+		remove_tree(tmp);
+	if (ret)
+		wgm_log_err("Error: Failed to restore '%s' from '%s': %s\n", live, from, strerror(-ret));
+	free(live);
+	free(from);
+	free(tmp);
+	return ret;
+}
+
+int wgm_snapshot_cmd_rollback(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_str_array names, snap_names, changed;
+	struct wgm_snapshot_stat st = { 0 };
+	struct wgm_snapshot_arg arg;
+	struct wgm_iface iface;
+	int snap_fd, *fds = NULL;
+	uint64_t *versions = NULL;
+	struct wgm_ctx sctx;
+	size_t i, failed = 0;
+	char *path = NULL;
+	int ret;
+
+	memset(&arg, 0, sizeof(arg));
+	memset(&names, 0, sizeof(names));
+	memset(&snap_names, 0, sizeof(snap_names));
+	memset(&changed, 0, sizeof(changed));
+
+	ret = wgm_snapshot_getopt(argc, argv, &arg, true);
+	if (ret)
+		return ret;
+
+	snap_fd = wgm_snapshot_lock(ctx);
+	if (snap_fd < 0)
+		return snap_fd;
+
+	path = wgm_snapshot_path(ctx, arg.name);
+	if (!path) {
+		ret = -ENOMEM;
+		goto out;
+	}
+
+	if (!wgm_file_exists(path)) {
+		wgm_log_err("Error: Snapshot '%s' does not exist\n", arg.name);
+		ret = -ENOENT;
+		goto out;
+	}
+
+	sctx = *ctx;
+	sctx.data_dir = path;
+	ret = wgm_iface_list_names(ctx, &names);
+	if (!ret)
+		ret = wgm_iface_list_names(&sctx, &snap_names);
+	if (ret)
+		goto out;
+
+	/*
+	 * Every interface of either side is locked: those only in the
+	 * snapshot come back, those only in the data directory go away.
+	 */
+	for (i = 0; i < snap_names.nr && !ret; i++) {
+		size_t j;
+
+		for (j = 0; j < names.nr; j++) {
+			if (!strcmp(names.arr[j], snap_names.arr[i]))
+				break;
+		}
+		if (j == names.nr)
+			ret = wgm_str_array_add(&names, snap_names.arr[i]);
+	}
+	if (ret)
+		goto out;
+
+	ret = wgm_snapshot_lock_all(ctx, &names, true, &fds);
+	if (ret)
+		goto out;
+
+	for (i = 0; i < names.nr && !ret; i++) {
+		if (iface_differs(ctx->data_dir, path, names.arr[i]))
+			ret = wgm_str_array_add(&changed, names.arr[i]);
+	}
+
+	/*
+	 * The versions of the live stores, for the restored ones to move
+	 * past: an older version coming back would let an --if-version
+	 * taken before the rollback match a different configuration.
+	 */
+	if (!ret && changed.nr) {
+		versions = calloc(changed.nr, sizeof(*versions));
+		if (!versions)
+			ret = -ENOMEM;
+	}
+
+	for (i = 0; i < changed.nr && !ret; i++) {
+		memset(&iface, 0, sizeof(iface));
+		ret = wgm_iface_load_meta(&iface, ctx, changed.arr[i]);
+		if (!ret)
+			versions[i] = iface.version;
+		else if (ret == -ENOENT)
+			ret = 0;
+		wgm_iface_free(&iface);
+	}
+
+	for (i = 0; i < ARRAY_SIZE(linked_dirs) && !ret; i++)
+		ret = swap_in(ctx, path, linked_dirs[i], true, &st);
+	if (!ret)
+		ret = swap_in(ctx, path, "fwmark", false, &st);
+	if (!ret)
+		ret = swap_in(ctx, path, "fwmark.last", false, &st);
+
+	if (ret) {
+		wgm_snapshot_unlock_all(fds, names.nr);
+		goto out;
+	}
+
+	for (i = 0; i < changed.nr; i++) {
+		const char *name = changed.arr[i];
+		int err;
+
+		memset(&iface, 0, sizeof(iface));
+		err = wgm_iface_load_meta(&iface, ctx, name);
+		if (!err) {
+			uint64_t v = versions[i] > iface.version ? versions[i] : iface.version;
+
+			err = wgm_iface_set_version(ctx, name, v + 1);
+		}
+		wgm_iface_free(&iface);
+		if (err && err != -ENOENT) {
+			wgm_log_err("Error: Failed to set the version of interface '%s': %s\n", name, strerror(-err));
+			failed++;
+		}
+	}
+
+	printf("Rolled back to snapshot '%s', %zu of %zu interfaces changed\n",
+	       arg.name, changed.nr, names.nr);
+
+	/*
+	 * Only the interfaces that differ are applied; the others are
+	 * left alone, running or not.
+	 */
+	for (i = 0; i < changed.nr; i++) {
+		const char *name = changed.arr[i];
+		int err;
+
+		memset(&iface, 0, sizeof(iface));
+		err = wgm_iface_load(&iface, ctx, name);
+		if (err == -ENOENT) {
+			printf("Interface '%s' is not in the snapshot, removed from the store\n", name);
+			continue;
+		}
+
+		if (!err)
+			err = wgm_conf_restart_if_changed(&iface, ctx);
+		if (err) {
+			wgm_log_err("Error: Failed to apply interface '%s': %s\n", name, strerror(err < 0 ? -err : EIO));
+			failed++;
+		}
+		wgm_iface_free(&iface);
+	}
+
+	wgm_snapshot_unlock_all(fds, names.nr);
+	if (failed)
+		ret = -EIO;
+
+out:
+	close(snap_fd);
+	wgm_str_array_free(&names);
+	wgm_str_array_free(&snap_names);
+	wgm_str_array_free(&changed);
+	free(versions);
+	free(path);
+	return ret;
+}
+
+int wgm_snapshot_cmd_delete(int argc, char *argv[], struct wgm_ctx *ctx)
+{
+	struct wgm_snapshot_arg arg;
+	char *path;
+	int snap_fd, ret;
+
+	memset(&arg, 0, sizeof(arg));
+	ret = wgm_snapshot_getopt(argc, argv, &arg, true);
+	if (ret)
+		return ret;
+
+	snap_fd = wgm_snapshot_lock(ctx);
+	if (snap_fd < 0)
+		return snap_fd;
+
+	path = wgm_snapshot_path(ctx, arg.name);
+	if (!path) {
+		close(snap_fd);
+		return -ENOMEM;
+	}
+
+	if (!wgm_file_exists(path)) {
+		wgm_log_err("Error: Snapshot '%s' does not exist\n", arg.name);
+		ret = -ENOENT;
+	} else {
+		ret = remove_tree(path);
+		if (ret)
+			wgm_log_err("Error: Failed to delete snapshot '%s': %s\n", arg.name, strerror(-ret));
+	}
+
+	close(snap_fd);
+	free(path);
+	return ret;
+}
@@ -0,0 +1,12 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_SNAPSHOT_H
+#define WGM__WG_SNAPSHOT_H
+
+#include "helpers.h"
+
+int wgm_snapshot_cmd_create(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_snapshot_cmd_list(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_snapshot_cmd_rollback(int argc, char *argv[], struct wgm_ctx *ctx);
+int wgm_snapshot_cmd_delete(int argc, char *argv[], struct wgm_ctx *ctx);
+
+#endif /* #ifndef WGM__WG_SNAPSHOT_H */
@@ -0,0 +1,203 @@
+// SPDX-License-Identifier: GPL-2.0-only
+
+#include "wgm_trace.h"
+#include "wgm_json.h"
+
+#define WGM_TRACE_NO_SPAN	UINT32_MAX
+
+int wgm_trace_opt_get_fmt(enum wgm_trace_fmt *fmt, const char *str)
+{
+	if (!*str || !strcmp(str, "1") || !strcmp(str, "table")) {
+		*fmt = WGM_TRACE_TABLE;
+		return 0;
+	}
+
+	if (!strcmp(str, "json")) {
+		*fmt = WGM_TRACE_JSON;
+		return 0;
+	}
+
+	wgm_log_err("Error: wgm_trace_opt_get_fmt: invalid timing format '%s' (expected 'table' or 'json')\n", str);
+	return -EINVAL;
+}
+
+struct wgm_trace *wgm_trace_create(enum wgm_trace_fmt fmt)
+{
+	struct wgm_trace *t;
+
+	t = calloc(1, sizeof(*t));
+	if (!t) {
+		wgm_log_err("Error: wgm_trace_create: failed to allocate memory\n");
+		return NULL;
+	}
+
+	t->fmt = fmt;
+	t->start_ns = wgm_now_ns();
+	return t;
+}
+
+void wgm_trace_destroy(struct wgm_trace *t)
+{
+	free(t);
+}
+
+static uint32_t wgm_trace_find_span(struct wgm_trace *t, uint32_t parent,
+				    uint32_t depth, const char *name)
+{
+	struct wgm_trace_span *s;
+	uint32_t i;
+
+	for (i = 0; i < t->nr_spans; i++) {
+		s = &t->spans[i];
+		if (s->parent == parent && s->depth == depth && !strcmp(s->name, name))
+			return i;
+	}
+
+	if (t->nr_spans >= WGM_TRACE_MAX_SPANS)
+		return WGM_TRACE_NO_SPAN;
+
+	s = &t->spans[t->nr_spans];
+	s->name = name;
+	s->parent = parent;
+	s->depth = depth;
+	s->calls = 0;
+	s->total_ns = 0;
+	return t->nr_spans++;
+}
+
+void __wgm_trace_begin(struct wgm_trace *t, const char *name)
+{
+	uint32_t d = t->depth++;
+	uint32_t parent, idx;
+
+	if (d >= WGM_TRACE_MAX_DEPTH) {
+		t->dropped++;
+		return;
+	}
+
+	parent = d ? t->stack[d - 1] : WGM_TRACE_NO_SPAN;
+	idx = wgm_trace_find_span(t, parent, d, name);
+	if (idx == WGM_TRACE_NO_SPAN)
+		t->dropped++;
+
+	t->stack[d] = idx;
+	t->stack_ns[d] = wgm_now_ns();
+}
+
+void __wgm_trace_end(struct wgm_trace *t)
+{
+	uint64_t now = wgm_now_ns();
+	struct wgm_trace_span *s;
+	uint32_t d;
+
+	if (!t->depth)
+		return;
+
+	d = --t->depth;
+	if (d >= WGM_TRACE_MAX_DEPTH || t->stack[d] == WGM_TRACE_NO_SPAN)
+		return;
+
+	s = &t->spans[t->stack[d]];
+	s->calls++;
+	s->total_ns += now - t->stack_ns[d];
+}
+
+void __wgm_trace_add(struct wgm_trace *t, const char *name, uint64_t ns)
+{
+	uint32_t d = t->depth, parent, idx;
+
+	if (d >= WGM_TRACE_MAX_DEPTH) {
+		t->dropped++;
+		return;
+	}
+
+	parent = d ? t->stack[d - 1] : WGM_TRACE_NO_SPAN;
+	idx = wgm_trace_find_span(t, parent, d, name);
+	if (idx == WGM_TRACE_NO_SPAN) {
+		t->dropped++;
+		return;
+	}
+
+	t->spans[idx].calls++;
+	t->spans[idx].total_ns += ns;
+}
+
+static void wgm_trace_print_table(const struct wgm_trace *t, uint32_t parent)
+{
+	const struct wgm_trace_span *s;
+	uint32_t i;
+
+	for (i = 0; i < t->nr_spans; i++) {
+		s = &t->spans[i];
+		if (s->parent != parent)
+			continue;
+
+		fprintf(stderr, "%*s%-*s %8llu %12.3f\n", (int)s->depth * 2, "",
+			32 - (int)s->depth * 2, s->name,
+			(unsigned long long)s->calls, s->total_ns / 1e6);
+		wgm_trace_print_table(t, i);
+	}
+}
+
+static int wgm_trace_write_spans(struct wgm_jwriter *w, const struct wgm_trace *t,
+				 uint32_t parent)
+{
+	const struct wgm_trace_span *s;
+	uint32_t i;
+
+	wgm_jw_arr_begin(w);
+	for (i = 0; i < t->nr_spans; i++) {
+		s = &t->spans[i];
+		if (s->parent != parent)
+			continue;
+
+		wgm_jw_obj_begin(w);
+		wgm_jw_key(w, "name");
+		wgm_jw_str(w, s->name);
+		wgm_jw_key(w, "calls");
+		wgm_jw_int(w, s->calls);
+		wgm_jw_key(w, "total_ns");
+		wgm_jw_int(w, s->total_ns);
+		wgm_jw_key(w, "spans");
+		wgm_trace_write_spans(w, t, i);
+		wgm_jw_obj_end(w);
+	}
+
+	return wgm_jw_arr_end(w);
+}
+
+/*
+ * Print the collected spans on stderr, so the timing never mixes with
+ * the JSON a command prints on stdout.
+ */
+void wgm_trace_dump(struct wgm_trace *t)
+{
+	uint64_t total = wgm_now_ns() - t->start_ns;
+	struct wgm_jwriter w;
+	int ret;
+
+	if (t->fmt == WGM_TRACE_TABLE) {
+		fprintf(stderr, "%-32s %8s %12s\n", "phase", "calls", "ms");
+		wgm_trace_print_table(t, WGM_TRACE_NO_SPAN);
+		fprintf(stderr, "%-32s %8s %12.3f\n", "total", "", total / 1e6);
+		if (t->dropped)
+			fprintf(stderr, "(%llu spans dropped)\n", (unsigned long long)t->dropped);
+		return;
+	}
+
+	wgm_jw_init(&w, stderr, true);
+	wgm_jw_obj_begin(&w);
+	wgm_jw_key(&w, "total_ns");
+	wgm_jw_int(&w, total);
+	wgm_jw_key(&w, "dropped");
+	wgm_jw_int(&w, t->dropped);
+	wgm_jw_key(&w, "spans");
+	wgm_trace_write_spans(&w, t, WGM_TRACE_NO_SPAN);
+	wgm_jw_obj_end(&w);
+	wgm_jw_raw(&w, "\n", 1);
+	ret = wgm_jw_flush(&w);
+	if (ret)
+		wgm_log_err("Error: Failed to write timing JSON: %s\n", strerror(-ret));
+
+	wgm_jw_free(&w);
+}
@@ -0,0 +1,79 @@
+// SPDX-License-Identifier: GPL-2.0-only
+#ifndef WGM__WG_TRACE_H
+#define WGM__WG_TRACE_H
+
+#include "helpers.h"
+
+/*
+ * Per-phase timing (--timing, WGM_TRACE). Phases are bracketed with
+ * wgm_trace_begin()/wgm_trace_end() pairs, which nest. Spans with the
+ * same name under the same parent are folded into one entry with a
+ * call count, so a phase hit once per peer (fwmark I/O) shows up as a
+ * single line.
+ *
+ * When tracing is off, ctx->trace is NULL and both calls are a single
+ * not-taken branch.
+ */
+#define WGM_TRACE_MAX_SPANS	128
+#define WGM_TRACE_MAX_DEPTH	16
+
+enum wgm_trace_fmt {
+	WGM_TRACE_TABLE,
+	WGM_TRACE_JSON,
+};
+
+struct wgm_trace_span {
+	const char	*name;
+	uint32_t	parent;
+	uint32_t	depth;
+	uint64_t	calls;
+	uint64_t	total_ns;
+};
+
+struct wgm_trace {
+	enum wgm_trace_fmt	fmt;
+	uint64_t		start_ns;
+	uint32_t		nr_spans;
+	uint32_t		depth;
+	uint64_t		dropped;
+
+	/*
+	 * Open spans: index into @spans and start time.
+	 */
+	uint32_t		stack[WGM_TRACE_MAX_DEPTH];
+	uint64_t		stack_ns[WGM_TRACE_MAX_DEPTH];
+
+	struct wgm_trace_span	spans[WGM_TRACE_MAX_SPANS];
+};
+
+int wgm_trace_opt_get_fmt(enum wgm_trace_fmt *fmt, const char *str);
+struct wgm_trace *wgm_trace_create(enum wgm_trace_fmt fmt);
+void wgm_trace_destroy(struct wgm_trace *t);
+void wgm_trace_dump(struct wgm_trace *t);
+void __wgm_trace_begin(struct wgm_trace *t, const char *name);
+void __wgm_trace_end(struct wgm_trace *t);
+void __wgm_trace_add(struct wgm_trace *t, const char *name, uint64_t ns);
+
+#define wgm_trace_begin(ctx, name)				\
+do {								\
+	if (__builtin_expect(!!(ctx)->trace, 0))		\
+		__wgm_trace_begin((ctx)->trace, (name));	\
+} while (0)
+
+#define wgm_trace_end(ctx)					\
+do {								\
+	if (__builtin_expect(!!(ctx)->trace, 0))		\
+		__wgm_trace_end((ctx)->trace);			\
+} while (0)
+
+/*
+ * Account @ns to the span @name under the innermost open one, for work
+ * timed elsewhere, e.g. commands that ran concurrently.
+ */
+#define wgm_trace_add(ctx, name, ns)				\
+do {								\
+	if (__builtin_expect(!!(ctx)->trace, 0))		\
+		__wgm_trace_add((ctx)->trace, (name), (ns));	\
+} while (0)
+
+#endif /* #ifndef WGM__WG_TRACE_H */